@@ -26,6 +26,7 @@ class CSimpleThread
         pthread_t the_thread;
         pthread_cond_t the_condition;
         pthread_mutex_t the_mutex;
+        bool stop_requested;   // set with the_condition signaled so a thread that wasn't waiting still sees it
 #endif        
 
     public:
@@ -49,7 +50,7 @@ class CSimpleThread
             }
         }
 #else        
-        CSimpleThread( void * ( * start_routine )( void * ) ) : the_thread( 0 )
+        CSimpleThread( void * ( * start_routine )( void * ) ) : the_thread( 0 ), stop_requested( false )
         {
             the_condition = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
             the_mutex = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
@@ -65,6 +66,7 @@ class CSimpleThread
                 {
                     tracer.Trace( "signaling a thread to complete\n" );
                     C_pthread_mutex_t_lock mtx_lock( the_mutex );
+                    stop_requested = true;
                     pthread_cond_signal( & the_condition );
                 }
 
@@ -76,6 +78,12 @@ class CSimpleThread
                 pthread_mutex_destroy( & the_mutex );
             }
         }
+
+        bool StopRequested()
+        {
+            C_pthread_mutex_t_lock mtx_lock( the_mutex );
+            return stop_requested;
+        }
 #endif
 
         ~CSimpleThread() { EndThread(); }
@@ -19,12 +19,22 @@
 #include <assert.h>
 #include <djltrace.hxx>
 #include <djl8086d.hxx>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <string>
+
+#if ( defined( __amd64 ) || defined( _M_AMD64 ) ) && !defined( _WIN32 )
+    #include <sys/mman.h>
+#endif
 
 using namespace std;
 
 #include "i8086.hxx"
 
-uint8_t memory[ 0x10fff0 ];
+alignas( 4096 ) uint8_t memory[ 0x10fff0 ]; // page aligned so hosts can write-protect pages to track which change
+uint8_t i8086_store_watch[ 0x100000 ];
 
 i8086 cpu;
 static CDisassemble8086 g_Disassembler;
@@ -34,12 +44,49 @@ const uint32_t stateTraceInstructions = 1;
 const uint32_t stateEndEmulation = 2;
 const uint32_t stateExitEmulateEarly = 4;
 const uint32_t stateTrapSet = 8;
+const uint32_t stateBinaryTrace = 32;
 
 void i8086::trace_instructions( bool t ) { if ( t ) g_State |= stateTraceInstructions; else g_State &= ~stateTraceInstructions; }
 void i8086::end_emulation() { g_State |= stateEndEmulation; }
 void i8086::exit_emulate_early() { g_State |= stateExitEmulateEarly; }
 static void trap_set() { g_State |= stateTrapSet; }
 
+// Instruction counters. The dispatch loops count each instruction they decode, and enter_block() counts the
+// instructions compiled code ran, so counting doesn't change how code runs. Off, it's one untaken branch each.
+
+static i8086_counters g_counters = {};
+static bool g_hasModrm[ 256 ];
+static bool g_countInstructions = false;
+
+static force_inlined void count_instruction( uint8_t b0, uint8_t b1 )
+{
+    g_counters.opcodes[ b0 ]++;
+    if ( g_hasModrm[ b0 ] )
+        g_counters.modrm[ b1 ]++;
+} //count_instruction
+
+static bool has_modrm( uint8_t b0 )
+{
+    if ( b0 < 0x40 )
+        return ( ( b0 & 7 ) <= 3 );           // add, or, adc, sbb, and, sub, xor, cmp
+
+    return ( b0 >= 0x80 && b0 <= 0x8f ) ||    // math immed, test, xchg, mov, lea, pop
+           ( b0 >= 0xc4 && b0 <= 0xc7 ) ||    // les, lds, mov immed
+           ( b0 >= 0xd0 && b0 <= 0xd3 ) ||    // shifts and rotates
+           ( b0 >= 0xd8 && b0 <= 0xdf ) ||    // esc
+           ( 0xf6 == b0 ) || ( 0xf7 == b0 ) || ( 0xfe == b0 ) || ( 0xff == b0 );
+} //has_modrm
+
+void i8086::enable_counters( bool enable )
+{
+    for ( size_t i = 0; i < 256; i++ )
+        g_hasModrm[ i ] = has_modrm( (uint8_t) i );
+
+    g_countInstructions = enable;
+} //enable_counters
+
+const i8086_counters & i8086::get_counters() { return g_counters; }
+
 bool i8086::external_interrupt( uint8_t interrupt_num )
 {
     if ( fInterrupt && !fTrap )
@@ -73,6 +120,378 @@ void i8086::trace_state()
                        render_flags(), pdisassemble, g_Disassembler.BytesConsumed() );
 } //trace_state
 
+// Binary instruction trace. Each instruction is an 'I' record: cs, ip, 6 code bytes, a mask of the registers that
+// changed since the previous record, and their new values. Memory an instruction stored to follows it as 'W' records
+// of flat address, length, and the bytes there afterward. While tracing, every byte is marked i8086_watch_trace so
+// each store reaches store_watched() or track_store_range(), which note its range. Stores of unchanged values are
+// recorded too. DOS and BIOS code in the host writes memory directly, so those writes aren't recorded. Records go
+// through a ring buffer that a writer thread drains to the file, so the emulator only waits when the disk can't keep up.
+
+const char TraceSignature[ 8 ] = { 'N', 'T', 'V', 'D', 'M', 'T', 'R', 'C' };
+const uint32_t TraceVersion = 1;
+const size_t TraceRegisters = 13;                      // ax bx cx dx si di bp sp es cs ss ds flags
+const size_t TraceRingBytes = 16 * 1024 * 1024;        // a power of 2
+
+struct TraceStore
+{
+    uint32_t flat;
+    uint32_t bytes;
+};
+
+struct TraceRing
+{
+    vector<uint8_t> buffer;
+    atomic<size_t> head;                               // bytes written by the emulator
+    atomic<size_t> tail;                               // bytes written to the file
+    atomic<bool> done;
+    FILE * fp;
+    thread writer;
+
+    TraceRing() : buffer( TraceRingBytes ), head( 0 ), tail( 0 ), done( false ), fp( 0 ) {}
+};
+
+static TraceRing * g_traceRing = 0;
+static uint16_t g_traceRegisters[ TraceRegisters ];    // as of the previous record
+static vector<TraceStore> g_traceStores;               // ranges stored to since the previous record
+
+static void trace_ring_writer( TraceRing * ring )
+{
+    size_t tail = ring->tail.load( memory_order_relaxed );
+
+    do
+    {
+        size_t head = ring->head.load( memory_order_acquire );
+        if ( head == tail )
+        {
+            if ( ring->done.load( memory_order_acquire ) && ( head == ring->head.load( memory_order_acquire ) ) )
+                break;
+
+            this_thread::sleep_for( chrono::milliseconds( 1 ) );
+            continue;
+        }
+
+        while ( tail != head )
+        {
+            size_t offset = tail & ( TraceRingBytes - 1 );
+            size_t len = get_min( head - tail, TraceRingBytes - offset );
+            fwrite( ring->buffer.data() + offset, 1, len, ring->fp );
+            tail += len;
+        }
+
+        ring->tail.store( tail, memory_order_release );
+    } while ( true );
+} //trace_ring_writer
+
+static void trace_put( const void * pv, size_t len )
+{
+    TraceRing * ring = g_traceRing;
+    const uint8_t * p = (const uint8_t *) pv;
+    size_t head = ring->head.load( memory_order_relaxed );
+
+    while ( len )
+    {
+        size_t room = TraceRingBytes - ( head - ring->tail.load( memory_order_acquire ) );
+        if ( 0 == room )
+        {
+            this_thread::yield();
+            continue;
+        }
+
+        size_t offset = head & ( TraceRingBytes - 1 );
+        size_t chunk = get_min( get_min( len, room ), TraceRingBytes - offset );
+        memcpy( ring->buffer.data() + offset, p, chunk );
+        p += chunk;
+        len -= chunk;
+        head += chunk;
+        ring->head.store( head, memory_order_release );
+    }
+} //trace_put
+
+static void trace_note_store( uint32_t flat, uint32_t bytes )
+{
+    bytes = get_min( bytes, (uint32_t) sizeof( memory ) - flat );
+
+    if ( !g_traceStores.empty() ) // string instructions and pushes usually continue the previous store
+    {
+        TraceStore & last = g_traceStores.back();
+        if ( ( flat <= last.flat + last.bytes ) && ( flat + bytes >= last.flat ) )
+        {
+            uint32_t end = get_max( last.flat + last.bytes, flat + bytes );
+            last.flat = get_min( last.flat, flat );
+            last.bytes = end - last.flat;
+            return;
+        }
+    }
+
+    TraceStore store = { flat, bytes };
+    g_traceStores.push_back( store );
+} //trace_note_store
+
+static void trace_stored_memory()
+{
+    // write records for the memory the previous instruction stored to, with its values now
+
+    for ( size_t s = 0; s < g_traceStores.size(); s++ )
+    {
+        uint32_t flat = g_traceStores[ s ].flat;
+        uint32_t left = g_traceStores[ s ].bytes;
+        while ( left )
+        {
+            uint8_t record[ 7 ] = { 'W' };
+            uint16_t len = (uint16_t) get_min( left, (uint32_t) 0xffff );
+            memcpy( record + 1, & flat, 4 );
+            memcpy( record + 5, & len, 2 );
+            trace_put( record, sizeof( record ) );
+            trace_put( memory + flat, len );
+            flat += len;
+            left -= len;
+        }
+    }
+
+    g_traceStores.clear();
+} //trace_stored_memory
+
+static void trace_watch_stores( bool watch )
+{
+    for ( uint32_t i = 0; i < sizeof( i8086_store_watch ); i++ )
+    {
+        if ( watch )
+            i8086_store_watch[ i ] |= i8086_watch_trace;
+        else
+            i8086_store_watch[ i ] &= ~i8086_watch_trace;
+    }
+} //trace_watch_stores
+
+bool i8086::trace_binary( const char * path )
+{
+    if ( g_traceRing )
+    {
+        trace_stored_memory();
+        trace_watch_stores( false );
+        g_State &= ~stateBinaryTrace;
+        g_traceRing->done.store( true, memory_order_release );
+        g_traceRing->writer.join();
+        fclose( g_traceRing->fp );
+        delete g_traceRing;
+        g_traceRing = 0;
+    }
+
+    if ( !path )
+        return true;
+
+    FILE * fp = fopen( path, "wb" );
+    if ( !fp )
+        return false;
+
+    g_traceRing = new TraceRing();
+    g_traceRing->fp = fp;
+    g_traceRing->writer = thread( trace_ring_writer, g_traceRing );
+
+    trace_put( TraceSignature, sizeof( TraceSignature ) );
+    trace_put( & TraceVersion, sizeof( TraceVersion ) );
+    memset( g_traceRegisters, 0, sizeof( g_traceRegisters ) );
+    g_traceStores.clear();
+    trace_watch_stores( true );
+    g_State |= stateBinaryTrace;
+    return true;
+} //trace_binary
+
+void i8086::trace_binary_record()
+{
+    trace_stored_memory();
+
+    materializeFlags();
+    uint16_t regs[ TraceRegisters ] = { ax, bx, cx, dx, si, di, bp, sp, es, cs, ss, ds, flags };
+
+    uint8_t record[ 1 + 4 + 6 + 2 + 2 * TraceRegisters ];
+    record[ 0 ] = 'I';
+    memcpy( record + 1, & cs, 2 );
+    memcpy( record + 3, & ip, 2 );
+    memcpy( record + 5, flat_address8( cs, ip ), 6 );
+    uint16_t mask = 0;
+    size_t len = 13;
+    for ( size_t r = 0; r < TraceRegisters; r++ )
+    {
+        if ( regs[ r ] != g_traceRegisters[ r ] )
+        {
+            mask |= ( 1 << r );
+            memcpy( record + len, & regs[ r ], 2 );
+            len += 2;
+            g_traceRegisters[ r ] = regs[ r ];
+        }
+    }
+
+    memcpy( record + 11, & mask, 2 );
+    trace_put( record, len );
+} //trace_binary_record
+
+// Reads a binary trace one record at a time, keeping the full register state.
+
+struct TraceReader
+{
+    CFile file;
+    uint16_t regs[ TraceRegisters ];
+    uint8_t kind;                                      // 'I' or 'W'
+    uint16_t cs, ip;
+    uint8_t code[ 8 ];
+    uint32_t flat;                                     // for 'W'
+    vector<uint8_t> bytes;                             // for 'W'
+
+    TraceReader( const char * path ) : file( fopen( path, "rb" ) ), kind( 0 ), cs( 0 ), ip( 0 ), flat( 0 )
+    {
+        memset( regs, 0, sizeof( regs ) );
+        memset( code, 0, sizeof( code ) );
+    }
+
+    bool valid()
+    {
+        char signature[ sizeof( TraceSignature ) ];
+        uint32_t version = 0;
+        return file.get() && ( 1 == fread( signature, sizeof( signature ), 1, file.get() ) ) &&
+               !memcmp( signature, TraceSignature, sizeof( signature ) ) &&
+               ( 1 == fread( & version, sizeof( version ), 1, file.get() ) ) && ( TraceVersion == version );
+    }
+
+    bool next()
+    {
+        FILE * fp = file.get();
+        if ( 1 != fread( & kind, 1, 1, fp ) )
+            return false;
+
+        if ( 'W' == kind )
+        {
+            uint16_t len = 0;
+            if ( 1 != fread( & flat, 4, 1, fp ) || 1 != fread( & len, 2, 1, fp ) )
+                return false;
+            bytes.resize( len );
+            return ( len == fread( bytes.data(), 1, len, fp ) );
+        }
+
+        uint16_t mask = 0;
+        if ( 'I' != kind || 1 != fread( & cs, 2, 1, fp ) || 1 != fread( & ip, 2, 1, fp ) || 1 != fread( code, 6, 1, fp ) ||
+             1 != fread( & mask, 2, 1, fp ) )
+            return false;
+
+        for ( size_t r = 0; r < TraceRegisters; r++ )
+            if ( ( mask & ( 1 << r ) ) && ( 1 != fread( & regs[ r ], 2, 1, fp ) ) )
+                return false;
+
+        return true;
+    }
+
+    void render( char * buf, size_t len, CDisassemble8086 & dis )
+    {
+        if ( 'W' == kind )
+        {
+            int used = snprintf( buf, len, "  write %05x:", flat );
+            for ( size_t i = 0; i < bytes.size() && i < 16 && used < (int) len; i++ )
+                used += snprintf( buf + used, len - used, " %02x", bytes[ i ] );
+            if ( bytes.size() > 16 && used < (int) len )
+                snprintf( buf + used, len - used, " ... (%zu bytes)", bytes.size() );
+            return;
+        }
+
+        // the same format as i8086::trace_state()
+
+        static const char flag_chars[] = "OoDdIiTtSsZzAaPpCc";
+        static const uint8_t flag_bits[] = { 11, 10, 9, 8, 7, 6, 4, 2, 0 };
+        char acflags[ 10 ];
+        uint16_t f = regs[ 12 ];
+        for ( size_t i = 0; i < 9; i++ )
+            acflags[ i ] = flag_chars[ 2 * i + ( ( f & ( 1 << flag_bits[ i ] ) ) ? 0 : 1 ) ];
+        acflags[ 9 ] = 0;
+
+        dis.ClearLastIP(); // every record decodes from the same buffer
+        const char * pdisassemble = dis.Disassemble( code );
+        snprintf( buf, len, "ip %4x, opc %02x %02x %02x %02x %02x, ax %04x, bx %04x, cx %04x, dx %04x, di %04x, "
+                  "si %04x, ds %04x, es %04x, cs %04x, ss %04x, bp %04x, sp %04x, %s, %s ; %u",
+                  ip, code[ 0 ], code[ 1 ], code[ 2 ], code[ 3 ], code[ 4 ],
+                  regs[ 0 ], regs[ 1 ], regs[ 2 ], regs[ 3 ], regs[ 5 ], regs[ 4 ], regs[ 11 ], regs[ 8 ], cs, regs[ 10 ], regs[ 6 ], regs[ 7 ],
+                  acflags, pdisassemble, dis.BytesConsumed() );
+    }
+
+    bool same( const TraceReader & o ) const
+    {
+        if ( kind != o.kind )
+            return false;
+        if ( 'W' == kind )
+            return ( flat == o.flat ) && ( bytes == o.bytes );
+        return ( cs == o.cs ) && ( ip == o.ip ) && !memcmp( code, o.code, 6 ) && !memcmp( regs, o.regs, sizeof( regs ) );
+    }
+};
+
+bool i8086_print_trace( const char * path, FILE * out, int only_cs )
+{
+    TraceReader reader( path );
+    if ( !reader.valid() )
+        return false;
+
+    CDisassemble8086 dis;
+    char ac[ 300 ];
+    bool shown = false;  // whether the last instruction was printed, so its writes are too
+
+    while ( reader.next() )
+    {
+        if ( 'I' == reader.kind )
+            shown = ( only_cs < 0 ) || ( reader.cs == only_cs );
+
+        if ( shown )
+        {
+            reader.render( ac, sizeof( ac ), dis );
+            fprintf( out, "%s\n", ac );
+        }
+    }
+
+    return true;
+} //i8086_print_trace
+
+bool i8086_diff_traces( const char * pathA, const char * pathB, FILE * out )
+{
+    TraceReader a( pathA ), b( pathB );
+    if ( !a.valid() || !b.valid() )
+        return false;
+
+    const size_t Context = 8;
+    CDisassemble8086 dis;
+    char ac[ 300 ];
+    vector<string> history;        // the last records that matched
+    uint64_t records = 0;
+
+    do
+    {
+        bool moreA = a.next();
+        bool moreB = b.next();
+
+        if ( !moreA && !moreB )
+        {
+            fprintf( out, "the traces match: %llu records\n", (unsigned long long) records );
+            return true;
+        }
+
+        if ( moreA && moreB && a.same( b ) )
+        {
+            a.render( ac, sizeof( ac ), dis );
+            history.push_back( ac );
+            if ( history.size() > Context )
+                history.erase( history.begin() );
+            records++;
+            continue;
+        }
+
+        fprintf( out, "the traces differ at record %llu, after:\n", (unsigned long long) records );
+        for ( auto & h : history )
+            fprintf( out, "  %s\n", h.c_str() );
+
+        if ( moreA )
+            a.render( ac, sizeof( ac ), dis );
+        fprintf( out, "%s:\n  %s\n", pathA, moreA ? ac : "(end of trace)" );
+        if ( moreB )
+            b.render( ac, sizeof( ac ), dis );
+        fprintf( out, "%s:\n  %s\n", pathB, moreB ? ac : "(end of trace)" );
+        return true;
+    } while ( true );
+} //i8086_diff_traces
+
 // base cycle count per opcode; will be higher for multi-byte instructions, memory references,
 // ea calculations, jumps taken, loops taken, rotate cl-times, and reps
 static const uint8_t i8086_cycles[ 256 ] =
@@ -132,7 +551,7 @@ force_inlined uint8_t i8086::op_sub8( uint8_t lhs, uint8_t rhs, bool borrow )
     fCarry = ( 0 == ( res16 & 0x100 ) );
     set_PSZ8( res8 );
     fOverflow = ( ! ( ( lhs ^ com_rhs ) & 0x80 ) ) && ( ( lhs ^ res8 ) & 0x80 );
-    fAuxCarry = ( 0 != ( ( ( lhs & 0xf ) - ( rhs & 0xf ) - ( borrow ? 1 : 0 ) ) & ~0xf ) );
+    lazy_aux = lhs ^ rhs ^ res8;
     return res8;
 } //op_sub8
 
@@ -145,7 +564,7 @@ force_inlined uint16_t i8086::op_sub16( uint16_t lhs, uint16_t rhs, bool borrow
     fCarry = ( 0 == ( res32 & 0x10000 ) );
     set_PSZ16( res16 );
     fOverflow = ( ! ( ( lhs ^ com_rhs ) & 0x8000 ) ) && ( ( lhs ^ res16 ) & 0x8000 );
-    fAuxCarry = ( 0 != ( ( ( lhs & 0xf ) - ( rhs & 0xf ) - ( borrow ? 1 : 0 ) ) & ~0xf ) );
+    lazy_aux = lhs ^ rhs ^ res16;
     return res16;
 } //op_sub16
 
@@ -157,7 +576,7 @@ force_inlined uint8_t i8086::op_add8( uint8_t lhs, uint8_t rhs, bool carry )
     fCarry = ( 0 != ( res16 & 0x100 ) );
     set_PSZ8( res8 );
     fOverflow = ( ! ( ( lhs ^ rhs ) & 0x80 ) ) && ( ( lhs ^ res8 ) & 0x80 );
-    fAuxCarry = ( 0 != ( ( ( 0xf & lhs ) + ( 0xf & rhs ) + carry_int ) & 0x10 ) );
+    lazy_aux = lhs ^ rhs ^ res8;
     return res8;
 } //op_add8
 
@@ -169,7 +588,7 @@ force_inlined uint16_t i8086::op_add16( uint16_t lhs, uint16_t rhs, bool carry )
     fCarry = ( 0 != ( res32 & 0x10000 ) );
     set_PSZ16( res16 );
     fOverflow = ( ! ( ( lhs ^ rhs ) & 0x8000 ) ) && ( ( lhs ^ res16 ) & 0x8000 );
-    fAuxCarry = ( 0 != ( ( ( 0xf & lhs ) + ( 0xf & rhs ) + carry_int ) & 0x10 ) );
+    lazy_aux = lhs ^ rhs ^ res16;
     return res16;
 } //op_add16
 
@@ -257,7 +676,7 @@ uint8_t i8086::op_inc8( uint8_t val )
 {
    fOverflow = ( 0x7f == val );
    val++;
-   fAuxCarry = ( 0 == ( val & 0xf ) );
+   set_aux_carry( 0 == ( val & 0xf ) );
    set_PSZ8( val );
    return val;
 } //op_inc8
@@ -266,7 +685,7 @@ uint16_t i8086::op_inc16( uint16_t val )
 {
    fOverflow = ( 0x7fff == val );
    val++;
-   fAuxCarry = ( 0 == ( val & 0xf ) );
+   set_aux_carry( 0 == ( val & 0xf ) );
    set_PSZ16( val );
    return val;
 } //op_inc16
@@ -275,7 +694,7 @@ uint8_t i8086::op_dec8( uint8_t val )
 {
    fOverflow = ( 0x80 == val );
    val--;
-   fAuxCarry = ( 0xf == ( val & 0xf ) );
+   set_aux_carry( 0xf == ( val & 0xf ) );
    set_PSZ8( val );
    return val;
 } //op_dec8
@@ -284,7 +703,7 @@ uint16_t i8086::op_dec16( uint16_t val )
 {
    fOverflow = ( 0x8000 == val );
    val--;
-   fAuxCarry = ( 0xf == ( val & 0xf ) );
+   set_aux_carry( 0xf == ( val & 0xf ) );
    set_PSZ16( val );
    return val;
 } //op_dec16
@@ -597,25 +1016,25 @@ void i8086::op_cmps16()
 
 void i8086::op_movs8()
 {
-    * flat_address8( es, di ) = * flat_address8( get_seg_value(), si );
+    * (uint8_t *) track_store( flat_address( es, di ), 1 ) = * flat_address8( get_seg_value(), si );
     update_rep_sidi8();
 } //op_movs8
 
 void i8086::op_movs16()
 {
-    * flat_address16( es, di ) = * flat_address16( get_seg_value(), si );
+    * (uint16_t *) track_store( flat_address( es, di ), 2 ) = * flat_address16( get_seg_value(), si );
     update_rep_sidi16();
 } //op_movs16
 
 void i8086::op_sto8()
 {
-    * flat_address8( es, di ) = al();
+    * (uint8_t *) track_store( flat_address( es, di ), 1 ) = al();
     update_index8( di );
 } //op_sto8
 
 void i8086::op_sto16()
 {
-    * flat_address16( es, di ) = ax;
+    * (uint16_t *) track_store( flat_address( es, di ), 2 ) = ax;
     update_index16( di );
 } //op_sto16
 
@@ -643,6 +1062,195 @@ void i8086::op_scas16()
     update_index16( di );
 } //op_scas16
 
+// Bulk versions of the rep string instructions. Each handles all cx elements at once when no element
+// wraps within its segment or past 1MB, and returns false to leave the rest to the element-by-element
+// loop. si, di, cx, flags, and cycles end up just as the loop would leave them.
+
+uint16_t i8086::rep_source_segment( uint8_t & cycles_per_element ) // like get_seg_value(), which costs 2 cycles per element
+{
+    if ( 0xff == prefix_segment_override )
+        return ds;
+
+    cycles_per_element += 2;
+    return * seg_reg( prefix_segment_override );
+} //rep_source_segment
+
+bool i8086::rep_range( uint16_t seg, uint16_t offset, uint32_t bytes, uint8_t width, uint32_t & flat )
+{
+    // find the lowest flat address of the bytes touched starting at offset and moving in the current direction
+
+    uint32_t low;
+    if ( fDirection )
+    {
+        if ( ( offset + (uint32_t) width < bytes ) || ( offset + (uint32_t) width > 0x10000 ) )
+            return false;
+        low = offset + width - bytes;
+    }
+    else
+    {
+        if ( offset + bytes > 0x10000 )
+            return false;
+        low = offset;
+    }
+
+    flat = ( ( (uint32_t) seg ) << 4 ) + low;
+    return ( flat + bytes <= 0x100000 );
+} //rep_range
+
+bool i8086::rep_movs( uint8_t width )
+{
+    if ( 0 == cx )
+        return true;
+
+    uint8_t cycles_per_element = 17;
+    uint16_t src_seg = rep_source_segment( cycles_per_element );
+    uint32_t bytes = (uint32_t) cx * width;
+    uint32_t src, dst;
+    if ( !rep_range( src_seg, si, bytes, width, src ) || !rep_range( es, di, bytes, width, dst ) )
+        return false;
+
+    if ( ( src < dst + bytes ) && ( dst < src + bytes ) ) // overlapping moves can replicate data; that needs the loop
+        return false;
+
+    memcpy( memory + dst, memory + src, bytes );
+    track_store_range( dst, bytes );
+    rep_advance( si, bytes );
+    rep_advance( di, bytes );
+    AddCycles( cycles_per_element, cx );
+    cx = 0;
+    return true;
+} //rep_movs
+
+bool i8086::rep_stos( uint8_t width )
+{
+    if ( 0 == cx )
+        return true;
+
+    uint32_t bytes = (uint32_t) cx * width;
+    uint32_t dst;
+    if ( !rep_range( es, di, bytes, width, dst ) )
+        return false;
+
+    if ( ( 1 == width ) || ( al() == ah() ) )
+        memset( memory + dst, al(), bytes );
+    else
+    {
+        uint16_t * p = (uint16_t *) ( memory + dst );
+        for ( uint32_t i = 0; i < cx; i++ )
+            p[ i ] = ax;
+    }
+
+    track_store_range( dst, bytes );
+    rep_advance( di, bytes );
+    AddCycles( ( 1 == width ) ? 10 : 14, cx );
+    cx = 0;
+    return true;
+} //rep_stos
+
+void i8086::rep_lods( uint8_t width ) // only the last element loaded matters, so this never needs the loop
+{
+    if ( 0 == cx )
+        return;
+
+    uint8_t cycles_per_element = 10;
+    uint16_t src_seg = rep_source_segment( cycles_per_element );
+    uint32_t skip = (uint32_t) ( cx - 1 ) * width;
+    uint16_t last = fDirection ? ( si - skip ) : ( si + skip );
+
+    if ( 1 == width )
+        set_al( * flat_address8( src_seg, last ) );
+    else
+        ax = * flat_address16( src_seg, last );
+
+    si = fDirection ? ( last - width ) : ( last + width );
+    AddCycles( cycles_per_element, cx );
+    cx = 0;
+} //rep_lods
+
+bool i8086::rep_scas( uint8_t width )
+{
+    if ( 0 == cx )
+        return true;
+
+    uint32_t bytes = (uint32_t) cx * width;
+    uint32_t dst;
+    if ( !rep_range( es, di, bytes, width, dst ) )
+        return false;
+
+    bool stop_if_equal = ( 0xf2 == prefix_repeat_opcode ); // repne stops at the first match, repe at the first mismatch
+    int32_t step = fDirection ? -width : width;
+    uint8_t * p = memory + dst + ( fDirection ? ( bytes - width ) : 0 );
+    uint32_t count;
+
+    if ( 1 == width && !fDirection && stop_if_equal ) // the common strlen idiom
+    {
+        uint8_t * found = (uint8_t *) memchr( p, al(), bytes );
+        count = found ? (uint32_t) ( found - p ) + 1 : cx;
+    }
+    else
+    {
+        for ( count = 1; count < cx; count++, p += step )
+        {
+            bool equal = ( 1 == width ) ? ( al() == *p ) : ( ax == * (uint16_t *) p );
+            if ( equal == stop_if_equal )
+                break;
+        }
+    }
+
+    // set flags by comparing the last element examined
+
+    uint8_t * plast = memory + dst + ( fDirection ? ( bytes - count * width ) : ( ( count - 1 ) * width ) );
+    if ( 1 == width )
+        op_sub8( al(), *plast );
+    else
+        op_sub16( ax, * (uint16_t *) plast );
+
+    rep_advance( di, count * width );
+    AddCycles( ( 1 == width ) ? 15 : 19, count );
+    cx -= count;
+    return true;
+} //rep_scas
+
+bool i8086::rep_cmps( uint8_t width )
+{
+    if ( 0 == cx )
+        return true;
+
+    uint8_t cycles_per_element = 30;
+    uint16_t src_seg = rep_source_segment( cycles_per_element );
+    uint32_t bytes = (uint32_t) cx * width;
+    uint32_t src, dst;
+    if ( !rep_range( src_seg, si, bytes, width, src ) || !rep_range( es, di, bytes, width, dst ) )
+        return false;
+
+    bool stop_if_equal = ( 0xf2 == prefix_repeat_opcode ); // repne stops at the first match, repe at the first mismatch
+    int32_t first = fDirection ? ( bytes - width ) : 0;
+    int32_t step = fDirection ? -width : width;
+    uint8_t * ps = memory + src + first;
+    uint8_t * pd = memory + dst + first;
+    uint32_t count;
+
+    for ( count = 1; count < cx; count++, ps += step, pd += step )
+    {
+        bool equal = ( 1 == width ) ? ( *ps == *pd ) : ( * (uint16_t *) ps == * (uint16_t *) pd );
+        if ( equal == stop_if_equal )
+            break;
+    }
+
+    // set flags by comparing the last elements examined
+
+    if ( 1 == width )
+        op_sub8( *ps, *pd );
+    else
+        op_sub16( * (uint16_t *) ps, * (uint16_t *) pd );
+
+    rep_advance( si, count * width );
+    rep_advance( di, count * width );
+    AddCycles( cycles_per_element, count );
+    cx -= count;
+    return true;
+} //rep_cmps
+
 void i8086::op_rotate8( uint8_t * pval, uint8_t operation, uint8_t amount )
 {
     switch( operation )
@@ -682,7 +1290,7 @@ not_inlined void i8086::op_interrupt( uint8_t interrupt_num, uint8_t instruction
     push( flags );
     fInterrupt = false; // will be set again if/when flags are popped on iret
     fTrap = false;
-    fAuxCarry = false;
+    set_aux_carry( false );
     push( cs );
     push( ip + instruction_length );
 
@@ -697,14 +1305,14 @@ not_inlined void i8086::op_daa()
     bool oldCarry = fCarry;
     fCarry = false;
 
-    if ( ( ( al() & 0xf ) > 9 ) || fAuxCarry )
+    if ( ( ( al() & 0xf ) > 9 ) || get_aux_carry() )
     {
         fCarry = oldCarry || ( al() > 9 );
         set_al( al() + 6 );
-        fAuxCarry = true;
+        set_aux_carry( true );
     }
     else
-        fAuxCarry = false;
+        set_aux_carry( false );
 
     if ( ( old_al > 0x99 ) || oldCarry )
     {
@@ -722,14 +1330,14 @@ not_inlined void i8086::op_das()
     uint8_t old_al = al();
     bool oldCarry = fCarry;
     fCarry = false;
-    if ( ( ( al() & 0xf ) > 9 ) || ( fAuxCarry ) )
+    if ( ( ( al() & 0xf ) > 9 ) || get_aux_carry() )
     {
         fCarry = ( oldCarry || ( al() < 6 ) );
         set_al( al() - 6 );
-        fAuxCarry = true;
+        set_aux_carry( true );
     }
     else
-        fAuxCarry = false;
+        set_aux_carry( false );
 
     if ( ( old_al > 0x99 ) || ( oldCarry ) )
     {
@@ -741,17 +1349,17 @@ not_inlined void i8086::op_das()
 
 not_inlined void i8086::op_aas()
 {
-    if ( ( ( al() & 0x0f ) > 0 ) || fAuxCarry )
+    if ( ( ( al() & 0x0f ) > 0 ) || get_aux_carry() )
     {
         ax = ax - 6;
         set_ah( ah() - 1 );
-        fAuxCarry = 1;
+        set_aux_carry( true );
         fCarry = 1;
         set_al( al() & 0x0f );
     }
     else
     {
-        fAuxCarry = false;
+        set_aux_carry( false );
         fCarry = false;
         set_al( al() & 0x0f );
     }
@@ -759,15 +1367,15 @@ not_inlined void i8086::op_aas()
 
 not_inlined void i8086::op_aaa()
 {
-    if ( ( ( al() & 0xf ) > 9 ) || fAuxCarry )
+    if ( ( ( al() & 0xf ) > 9 ) || get_aux_carry() )
     {
         ax = ax + 0x106;
-        fAuxCarry = true;
+        set_aux_carry( true );
         fCarry = true;
     }
     else
     {
-        fAuxCarry = false;
+        set_aux_carry( false );
         fCarry = false;
     }
 
@@ -777,20 +1385,18 @@ not_inlined void i8086::op_aaa()
 not_inlined void i8086::op_sahf()
 {
     uint8_t fl = ah();
-    fSign = ( 0 != ( fl & 0x80 ) );
-    fZero = ( 0 != ( fl & 0x40 ) );
-    fAuxCarry = ( 0 != ( fl & 0x20 ) );
-    fParityEven = ( 0 != ( fl & 0x04 ) );
+    set_PSZ( 0 != ( fl & 0x04 ), 0 != ( fl & 0x80 ), 0 != ( fl & 0x40 ) );
+    set_aux_carry( 0 != ( fl & 0x20 ) );
     fCarry = ( 0 != ( fl & 1 ) );
 } //op_sahf
 
 not_inlined void i8086::op_lahf()
 {
     uint8_t fl = 0x02;
-    if ( fSign ) fl |= 0x80;
-    if ( fZero ) fl |= 0x40;
-    if ( fAuxCarry ) fl |= 0x10;
-    if ( fParityEven ) fl |= 0x04;
+    if ( get_sign() ) fl |= 0x80;
+    if ( get_zero() ) fl |= 0x40;
+    if ( get_aux_carry() ) fl |= 0x10;
+    if ( get_parity_even() ) fl |= 0x04;
     if ( fCarry ) fl |= 1;
     set_ah( fl );
 } //op_lahf
@@ -809,13 +1415,13 @@ not_inlined bool i8086::op_f6() // return true if divide by 0
     else if ( 2 == _reg ) // not reg8/mem8 -- no flags updated
     {
         AddMemCycles( 19 );
-        uint8_t * pval = get_rm_ptr8();
+        uint8_t * pval = get_rm_store_ptr8();
         *pval = ~ ( *pval );
     }
     else if ( 3 == _reg ) // neg reg8/mem8 (subtract from 0)
     {
         AddMemCycles( 19 );
-        uint8_t * pval = get_rm_ptr8();
+        uint8_t * pval = get_rm_store_ptr8();
         *pval = op_sub8( 0, *pval );
     }
     else if ( 4 == _reg ) // mul. ax = al * r/m8
@@ -826,7 +1432,7 @@ not_inlined bool i8086::op_f6() // return true if divide by 0
         fCarry = fOverflow = ( 0 != ah() );
         //fAuxCarry = ( ax > 0xfff ); // documentation says that aux carry is undefined, but real hardware does this
         set_PSZ16( ax ); // documentation says these bits are undefined, but real hardware does this
-        fSign = ( 0 != ( 0x80 & al() ) ); // documentation says these bits are undefined, but real hardware does this
+        set_sign( 0 != ( 0x80 & al() ) ); // documentation says these bits are undefined, but real hardware does this
     }
     else if ( 5 == _reg ) // imul. ax = al * r/m8
     {
@@ -891,13 +1497,13 @@ not_inlined bool i8086::op_f7() // return true if divide by 0
     else if ( 2 == _reg ) // not reg16/mem16 -- no flags updated
     {
         AddMemCycles( 19 );
-        uint16_t * pval = get_rm_ptr16();
+        uint16_t * pval = get_rm_store_ptr16();
         *pval = ~ ( *pval );
     }
     else if ( 3 == _reg ) // neg reg16/mem16 (subtract from 0)
     {
         AddMemCycles( 19 );
-        uint16_t * pval = get_rm_ptr16();
+        uint16_t * pval = get_rm_store_ptr16();
         *pval = op_sub16( 0, *pval );
     }
     else if ( 4 == _reg ) // mul. dx:ax = ax * src
@@ -965,14 +1571,14 @@ not_inlined bool i8086::op_ff()
     if ( 0 == _reg ) // inc mem16
     {
         AddCycles( 21 );
-        uint16_t * pval = get_rm_ptr16();
+        uint16_t * pval = get_rm_store_ptr16();
         *pval = op_inc16( *pval );
         _bc++;
     }
     else if ( 1 == _reg ) // dec mem16
     {
         AddCycles( 21 );
-        uint16_t * pval = get_rm_ptr16();
+        uint16_t * pval = get_rm_store_ptr16();
         *pval = op_dec16( *pval );
         _bc++;
     }
@@ -1057,90 +1663,1630 @@ not_inlined bool i8086::handle_state()
             op_interrupt( 1, 0 );
         }
     }
+
+    if ( g_State & stateBinaryTrace )
+        trace_binary_record();
+
     return false;
 } //handle_state
 
-#ifndef NDEBUG
-static uint64_t opcode_usage[ 256 ] = {0};
+// Block cache. When enabled, straight-line code is decoded once into a basic block keyed by flat address.
+// Each block holds the decoded fields and length of its instructions and a copy of the code bytes.
+// Building a block marks its bytes (and the one before, for word stores) with i8086_watch_code, so a store
+// there takes the slow path in track_store(). That bumps a write count for the 256-byte page, clears the
+// page's marks so later stores to it are fast again, and ends the executing block if the store landed in it.
+// A block whose pages were written since it was built, or that was built before the host last had a chance
+// to write memory (DOS loading a program, say), compares its copy of the code when it's entered. If the
+// code is unchanged the block is marked again and kept; otherwise it's decoded again.
 
-uint8_t i8086::trace_opcode_usage()
+struct i8086_decoded
 {
-    uint8_t used = 0;
-    for ( size_t i = 0; i < 256; i++ )
-        if ( opcode_usage[ i ] )
-        {
-            tracer.Trace( "%02zx: %llu\n", i, opcode_usage[ i ] );
-            used++;
-        }
-    tracer.Trace( "number of unique first opcodes: %zd\n", used );
-    return used;
-} //trace_opcode_usage
-#endif //DEBUG
+    uint8_t b0, b1;        // the first two bytes of the instruction
+    uint8_t rm, reg, mod;  // decoded from b1 just like decode_instruction()
+    uint8_t offset;        // from the start of the block
+    uint8_t length;        // bytes in the instruction. prefixes are 1-byte instructions of their own
+};
 
-uint64_t i8086::emulate( uint64_t maxcycles )
-{
-    cycles = 0;
+const uint32_t BlockCacheEntries = 8192;    // must be a power of 2. direct-mapped by flat address
+const uint32_t BlockMaxInstructions = 32;
+const uint32_t BlockMaxBytes = 96;
+const uint32_t BlockEmpty = 0xffffffff;
+
+#if defined( __amd64 ) || defined( _M_AMD64 )
+    #define I8086_JIT // blocks can be compiled to native code. see the JIT below
+#endif
 
-    while ( cycles < maxcycles )                           // 4.8% of runtime
+typedef void ( * i8086_jitted )( i8086 * pcpu, uint8_t * pmemory );
+
+const uint8_t JitNotTried = 0, JitCompiled = 1, JitFailed = 2;      // i8086_block::jit_state
+const uint8_t JitAfBool = 0, JitAfFlags = 1, JitAfSaved = 2;        // i8086::_jit_af
+const uint16_t JitCF = 0x1, JitPF = 0x4, JitAF = 0x10, JitZF = 0x40, JitSF = 0x80, JitOF = 0x800; // same bits as 8086 flags
+const uint16_t JitArith = JitCF | JitPF | JitZF | JitSF | JitOF;   // AF is tracked on its own
+
+struct i8086_block
+{
+    uint32_t flat;         // flat address of the first instruction or BlockEmpty
+    uint8_t count;         // # of instructions in the block. 0 if the first can't be cached
+    uint8_t bytes;         // # of code bytes covered by the block
+    uint16_t entries;      // # of times entered since it was decoded. hot blocks are compiled
+    uint8_t jit_state;     // JitNotTried, JitCompiled, or JitFailed
+    bool jit_reads_flags;  // true if i8086::flags must be materialized before the compiled code runs
+    i8086_jitted jit;      // the compiled code if jit_state is JitCompiled
+    i8086_decoded instructions[ BlockMaxInstructions ];
+    uint32_t host_epoch;   // g_hostEpoch when the block was built or last compared with memory
+    uint32_t page_writes;  // page_writes() at the same time
+    uint64_t image[ BlockMaxBytes / 8 ]; // code bytes when the block was decoded. 0-padded
+
+    bool matches_memory()
     {
-        prefix_segment_override = 0xff;                    // .69% of runtime though both are updated at once
-        prefix_repeat_opcode = 0xff;
+        // memcmp isn't a builtin with -fno-builtin
 
-_prefix_set:
-        if ( 0 != g_State )                                // 1.6% of runtime
-            if ( handle_state() )
-                break;
+        const uint64_t * pmem = (const uint64_t *) ( memory + flat );
+        uint32_t whole = bytes / 8;
+        for ( uint32_t i = 0; i < whole; i++ )
+            if ( image[ i ] != pmem[ i ] )
+                return false;
 
-        #ifndef NDEBUG
-            opcode_usage[ _b0 ]++;
-            assert( 0 != cs || 0 != ip );                  // almost certainly an app bug.
-        #endif
+        uint32_t partial = bytes % 8;
+        if ( 0 == partial )
+            return true;
 
-        decode_instruction( flat_address8( cs, ip ) );     // 23% of runtime
+        uint64_t mask = ( ( (uint64_t) 1 ) << ( 8 * partial ) ) - 1;
+        return ( image[ whole ] == ( pmem[ whole ] & mask ) );
+    } //matches_memory
+};
 
-        #ifdef I8086_TRACK_CYCLES
-            cycles += i8086_cycles[ _b0 ];                 // 2% of runtime
-        #else
-            cycles += 18; // average for the mips.com benchmark
-        #endif
+static i8086_block * g_blockCache = 0;
+static i8086_block g_blockNone = { BlockEmpty, 0, 0 }; // the current block when there isn't one
+static uint64_t g_blockBuilds = 0;
+static uint64_t g_blockInvalidations = 0;
+static uint32_t g_pageWrites[ 0x1001 ];  // guest stores to each 256-byte page that held cached code
+static uint32_t g_hostEpoch = 0;         // bumped whenever the host may have written memory
 
-        // 30% of runtime setting up for use of the jumptables because they are in TEXT and
-        // the LEA instruction has a terrible interaction with L1/L2 instruction cache misses
-        // for each of the lookups (the 1-byte element table with ~251 entries and the 4-byte
-        // element table with ~115 entries).
-        // Update: newer versions of the compiler no longer use lea, but the tables are still
-        // in TEXT even with the /jumptablerdata flag set. It's a frustration, Microsoft.
+static uint32_t watch_start( const i8086_block & block ) { return ( 0 == block.flat ) ? 0 : ( block.flat - 1 ); }
 
-        switch( _b0 )
-        {
-            case 0x00: case 0x01: case 0x02: case 0x03: case 0x08: case 0x09: case 0x0a: case 0x0b:  // add, or, adc, sbb, and, sub, xor, cmp
-            case 0x10: case 0x11: case 0x12: case 0x13: case 0x18: case 0x19: case 0x1a: case 0x1b: 
-            case 0x20: case 0x21: case 0x22: case 0x23: case 0x28: case 0x29: case 0x2a: case 0x2b: 
-            case 0x30: case 0x31: case 0x32: case 0x33: case 0x38: case 0x39: case 0x3a: case 0x3b: 
-            {
-                _bc = 2;
-                if ( toreg() )
-                    AddMemCycles( 10 );
-                else
-                    AddCycles( 21 );
+static uint32_t page_writes( const i8086_block & block ) // changes if either page the block's marks are in is written
+{
+    return g_pageWrites[ watch_start( block ) >> 8 ] + g_pageWrites[ ( block.flat + block.bytes ) >> 8 ];
+} //page_writes
 
-                uint8_t math = ( _b0 >> 3 ) & 7;
-                if ( isword() )
+static void watch_block( i8086_block & block )
+{
+    for ( uint32_t i = watch_start( block ); i < block.flat + block.bytes; i++ )
+        i8086_store_watch[ i ] |= i8086_watch_code;
+
+    block.host_epoch = g_hostEpoch;
+    block.page_writes = page_writes( block );
+} //watch_block
+
+not_inlined void i8086::store_watched( uint32_t flat, uint8_t bytes )
+{
+    uint8_t watch = i8086_store_watch[ flat ];
+    if ( watch & i8086_watch_video )
+        video_generation++;
+
+    if ( watch & i8086_watch_trace )
+        trace_note_store( flat, bytes );
+
+    if ( watch & i8086_watch_code )
+    {
+        g_pageWrites[ flat >> 8 ]++;
+        if ( ( ( flat + 1 ) >> 8 ) != ( flat >> 8 ) ) // a word store can reach the next page
+            g_pageWrites[ ( flat + 1 ) >> 8 ]++;
+
+        uint8_t * page = i8086_store_watch + ( flat & ~0xff );
+        for ( uint32_t i = 0; i < 0x100; i++ )
+            page[ i ] &= ~i8086_watch_code;
+
+        if ( ( flat + 1 - _pblock->flat ) <= _pblock->bytes ) // it may have changed an instruction yet to run
+            _pblock = & g_blockNone;
+    }
+} //store_watched
+
+void i8086::track_store_range( uint32_t flat, uint32_t bytes ) // for rep movs and stos. the range is within 1MB
+{
+    if ( ( flat < 0xc0000 ) && ( ( flat + bytes ) > 0xb8000 ) )
+        video_generation++;
+
+    if ( g_traceRing )
+        trace_note_store( flat, bytes );
+
+    if ( !g_blockCache )
+        return;
+
+    for ( uint32_t page = ( flat >> 8 ); page <= ( ( flat + bytes ) >> 8 ); page++ )
+        g_pageWrites[ page ]++;
+
+    if ( ( flat < _pblock->flat + _pblock->bytes ) && ( flat + bytes > _pblock->flat ) )
+        _pblock = & g_blockNone;
+} //track_store_range
+
+void i8086::enable_block_cache( bool enable )
+{
+    if ( enable && !g_blockCache )
+    {
+        g_blockCache = new i8086_block[ BlockCacheEntries ];
+        for ( uint32_t i = 0; i < BlockCacheEntries; i++ )
+            g_blockCache[ i ].flat = BlockEmpty;
+    }
+    else if ( !enable && g_blockCache )
+    {
+        delete [] g_blockCache;
+        g_blockCache = 0;
+    }
+
+    _pblock = & g_blockNone;
+} //enable_block_cache
+
+void i8086::save_registers( i8086_registers & r )
+{
+    materializeFlags();
+    r.ax = ax; r.bx = bx; r.cx = cx; r.dx = dx;
+    r.si = si; r.di = di; r.bp = bp; r.sp = sp; r.ip = ip;
+    r.es = es; r.cs = cs; r.ss = ss; r.ds = ds;
+    r.flags = flags;
+} //save_registers
+
+void i8086::restore_registers( const i8086_registers & r )
+{
+    ax = r.ax; bx = r.bx; cx = r.cx; dx = r.dx;
+    si = r.si; di = r.di; bp = r.bp; sp = r.sp; ip = r.ip;
+    es = r.es; cs = r.cs; ss = r.ss; ds = r.ds;
+    flags = r.flags;
+    unmaterializeFlags();
+
+    // the block being executed and a pending single-step trap belonged to the previous register state
+
+    _pblock = & g_blockNone;
+    fIgnoreTrap = false;
+    if ( fTrap )
+        g_State |= stateTrapSet;
+    else
+        g_State &= ~stateTrapSet;
+} //restore_registers
+
+void i8086::block_cache_stats( uint64_t & builds, uint64_t & invalidations )
+{
+    builds = g_blockBuilds;
+    invalidations = g_blockInvalidations;
+} //block_cache_stats
+
+static uint8_t modrm_length( uint8_t b1 ) // the mod reg r/m byte plus displacement
+{
+    uint8_t mod = ( b1 >> 6 );
+    if ( 1 == mod )
+        return 2;
+    if ( ( 2 == mod ) || ( ( 0 == mod ) && ( 6 == ( b1 & 7 ) ) ) )
+        return 3;
+    return 1;
+} //modrm_length
+
+static uint8_t instruction_length( const uint8_t * p, bool & ends_block )
+{
+    // returns 0 for instructions the cache leaves to decode_instruction(). Those end the block too.
+
+    uint8_t b0 = p[ 0 ];
+    ends_block = false;
+
+    if ( b0 < 0x40 )
+    {
+        switch ( b0 & 7 )
+        {
+            case 0: case 1: case 2: case 3: return 1 + modrm_length( p[ 1 ] ); // add, or, adc, sbb, and, sub, xor, cmp
+            case 4: return 2;                                                  // math al, immed8
+            case 5: return 3;                                                  // math ax, immed16
+            default: return ( 0x0f == b0 ) ? 0 : 1;                            // push/pop sreg, prefixes, daa, etc.
+        }
+    }
+
+    if ( b0 < 0x60 )
+        return 1; // inc, dec, push, pop
+
+    if ( b0 >= 0x70 && b0 <= 0x7f )
+    {
+        ends_block = true; // jcc
+        return 2;
+    }
+
+    if ( b0 >= 0xb0 && b0 <= 0xbf )
+        return ( b0 <= 0xb7 ) ? 2 : 3; // mov r8/r16, immed
+
+    switch ( b0 )
+    {
+        case i8086_opcode_interrupt: { ends_block = true; return 2; } // DOS/BIOS may load code anywhere
+        case 0x80: case 0x82: case 0x83: return 2 + modrm_length( p[ 1 ] );
+        case 0x81: return 3 + modrm_length( p[ 1 ] );
+        case 0x84: case 0x85: case 0x86: case 0x87: case 0x88: case 0x89: case 0x8a: case 0x8b:
+        case 0x8c: case 0x8d: case 0x8e: case 0x8f: case 0xc4: case 0xc5:
+        case 0xd0: case 0xd1: case 0xd2: case 0xd3:
+        case 0xd8: case 0xd9: case 0xda: case 0xdb: case 0xdc: case 0xdd: case 0xde:
+        case 0xfe: return 1 + modrm_length( p[ 1 ] );
+        case 0x90: case 0x91: case 0x92: case 0x93: case 0x94: case 0x95: case 0x96: case 0x97:
+        case 0x98: case 0x99: case 0x9b: case 0x9c: case 0x9d: case 0x9e: case 0x9f:
+        case 0xa4: case 0xa5: case 0xa6: case 0xa7: case 0xaa: case 0xab: case 0xac: case 0xad: case 0xae: case 0xaf:
+        case 0xd6: case 0xd7: case 0xec: case 0xed: case 0xee: case 0xef:
+        case 0xf0: case 0xf2: case 0xf3: case 0xf5: case 0xf8: case 0xf9: case 0xfa: case 0xfb: case 0xfc: case 0xfd:
+            return 1;
+        case 0xa0: case 0xa1: case 0xa2: case 0xa3: case 0xa9: return 3;
+        case 0xa8: case 0xd4: case 0xd5: case 0xe4: case 0xe5: case 0xe6: case 0xe7: return 2;
+        case 0xc6: return 2 + modrm_length( p[ 1 ] );
+        case 0xc7: return 3 + modrm_length( p[ 1 ] );
+        case 0xf6: return 1 + modrm_length( p[ 1 ] ) + ( ( ( p[ 1 ] >> 3 ) & 7 ) <= 1 ? 1 : 0 ); // test has an immediate
+        case 0xf7: return 1 + modrm_length( p[ 1 ] ) + ( ( ( p[ 1 ] >> 3 ) & 7 ) <= 1 ? 2 : 0 );
+        case 0xff:
+        {
+            uint8_t reg = ( ( p[ 1 ] >> 3 ) & 7 );
+            ends_block = ( reg >= 2 && reg <= 5 ); // call and jmp
+            return 1 + modrm_length( p[ 1 ] );
+        }
+        case 0x9a: case 0xea: { ends_block = true; return 5; }             // call far, jmp far
+        case 0xc2: case 0xca: case 0xe8: case 0xe9: { ends_block = true; return 3; } // ret immed, call, jmp near
+        case 0xc3: case 0xcb: case 0xcc: case 0xce: case 0xcf: case 0xf4: { ends_block = true; return 1; }
+        case 0xcd: case 0xe0: case 0xe1: case 0xe2: case 0xe3: case 0xeb: { ends_block = true; return 2; }
+    }
+
+    return 0;
+} //instruction_length
+
+static void build_block( i8086_block & block, uint32_t flat )
+{
+    g_blockBuilds++;
+    block.flat = flat;
+    block.count = 0;
+    block.bytes = 0;
+    block.entries = 0;
+    block.jit_state = JitNotTried;
+
+    do
+    {
+        const uint8_t * p = memory + flat + block.bytes;
+        bool ends_block;
+        uint8_t length = instruction_length( p, ends_block );
+
+        if ( ( 0 == length ) || ( ( block.bytes + length ) > BlockMaxBytes ) || ( ( flat + block.bytes + length ) > 0x100000 ) )
+            break;
+
+        i8086_decoded & d = block.instructions[ block.count++ ];
+        d.b0 = p[ 0 ];
+        d.b1 = p[ 1 ];
+        d.rm = ( d.b1 & 7 );
+        d.reg = ( ( d.b1 >> 3 ) & 7 );
+        d.mod = ( d.b1 >> 6 );
+        d.offset = block.bytes;
+        d.length = length;
+        block.bytes += length;
+
+        if ( ends_block )
+            break;
+    } while ( block.count < BlockMaxInstructions );
+
+    memset( block.image, 0, sizeof( block.image ) );
+    memcpy( block.image, memory + flat, block.bytes );
+    watch_block( block );
+} //build_block
+
+// JIT. On x86-64 hosts, blocks entered JitHotEntries times are compiled to native code. The compiled code
+// covers the instructions at the start of the block that the compiler understands and the interpreter
+// continues from the first one it doesn't. sp, bp, si, and di live in host registers while compiled code
+// runs. ax, bx, cx, and dx stay in the i8086 object, a deliberate exception: their high bytes ah..bh are only
+// addressable on the host as ah..bh of rax..rbx, and those are the scratch registers for mul, div, shifts by
+// cl, and address math. The six callee-saved registers all hold the cpu, memory, and sp..di already. With
+// the object pinned in rbx, each access is one memory operand that the host's L1 serves. Math is done with the
+// same host instruction, so host flags are the 8086 flags. They're saved with pushfq only when something
+// would clobber them and are copied to the bool flags once when the compiled code returns.
+// Each exit tells enter_block() where the interpreter continues and which flags it left where. A store to a
+// byte marked with i8086_watch_code exits before the instruction that makes it, so the interpreter runs that
+// instruction, sees the store in track_store(), and code changed by it is decoded and compiled again.
+// One difference from the interpreter: and, or, xor, test, and shifts leave the aux carry flag as the host
+// does rather than unchanged. Intel documents it as undefined for those instructions.
+
+#ifdef I8086_JIT
+
+const uint16_t JitHotEntries = 32;
+const size_t JitCodeBytes = 16 * 1024 * 1024;
+const size_t JitMaxBlockBytes = 4096;   // more than the worst case for BlockMaxInstructions
+
+static uint8_t * g_jitCode = 0;         // executable memory for compiled blocks or 0 if the JIT is off
+static uint8_t * g_jitNext = 0;         // next free byte in g_jitCode
+static uint64_t g_jitCompiles = 0;
+static uint64_t g_jitRuns = 0;
+
+enum JitRegister { jit_rax, jit_rcx, jit_rdx, jit_rbx, jit_rsp, jit_rbp, jit_rsi, jit_rdi,
+                   jit_r8, jit_r9, jit_r10, jit_r11, jit_r12, jit_r13, jit_r14, jit_r15 };
+
+enum JitResult { JitUnsupported, JitNext, JitExited };
+enum JitFlagsState { JitFlagsInBools, JitFlagsLive, JitFlagsSpilled };
+
+struct JitOperand
+{
+    int8_t reg;      // host register or -1 for memory
+    int8_t base;     // memory: base register or -1 for none
+    int8_t index;    // memory: index register or -1 for none
+    uint8_t scale;   // memory: index is shifted left this many bits
+    int32_t disp;    // memory: displacement
+};
+
+static JitOperand jit_reg( int8_t reg ) { JitOperand o = { reg, -1, -1, 0, 0 }; return o; }
+static JitOperand jit_mem( int8_t base, int32_t disp, int8_t index = -1, uint8_t scale = 0 ) { JitOperand o = { -1, base, index, scale, disp }; return o; }
+
+// Register use in compiled code:
+//   rbx: the i8086 object    r12: memory    rbp: sp    r15: bp    r13: si    r14: di
+//   rax: flat address of the memory operand    rcx, rdx, r8: scratch
+
+class i8086_jit
+{
+  public:
+    i8086_jit( uint8_t * pcode ) : p( pcode ), state( JitFlagsInBools ), written( 0 ), af( JitAfBool ), segment( 0xff ), cycles( 0 ),
+                                   next_index( 0 ), bail_index( 0 ), bail_offset( 0 ), bail_cycles( 0 ) {}
+
+    uint8_t * compile( i8086_block & block ) // returns the byte after the compiled code or 0 if nothing could be compiled
+    {
+        uint8_t * start = p;
+        reads_flags = false;
+        prologue();
+
+        uint8_t resume = 0;          // first instruction not covered by the compiled code
+        uint32_t resume_cycles = 0;
+        bool exited = false;
+
+        for ( uint8_t i = 0; i < block.count; i++ )
+        {
+            const i8086_decoded & dec = block.instructions[ i ];
+            const uint8_t * pcode = memory + block.flat + dec.offset;
+
+            if ( ( p - start ) > (ptrdiff_t) ( JitMaxBlockBytes - 512 ) )
+                break;
+
+            if ( 0xff == segment ) // a store to watched code exits here, before any prefixes
+            {
+                bail_index = i;
+                bail_offset = dec.offset;
+                bail_cycles = cycles;
+            }
+
+            if ( 0x26 == ( dec.b0 & 0xe7 ) ) // es, cs, ss, ds segment override prefixes
+            {
+                segment = ( ( dec.b0 >> 3 ) & 3 );
+                cycles += i8086_cycles[ dec.b0 ];
+                continue;
+            }
+
+            uint8_t * before = p;
+            JitFlagsState before_state = state;
+            uint16_t before_written = written;
+            uint8_t before_af = af;
+            uint32_t before_cycles = cycles;
+
+            cycles += i8086_cycles[ dec.b0 ];
+            next_index = i + 1;
+            JitResult result = instruction( dec, pcode, dec.offset + dec.length );
+            if ( JitUnsupported == result )
+            {
+                p = before;
+                state = before_state;
+                written = before_written;
+                af = before_af;
+                cycles = before_cycles;
+                break;
+            }
+
+            segment = 0xff;
+            resume = i + 1;
+            resume_cycles = cycles;
+
+            if ( JitExited == result )
+            {
+                exited = true;
+                break;
+            }
+        }
+
+        if ( 0 == resume )
+            return 0;
+
+        if ( !exited )
+            exit_block( resume, ( resume < block.count ) ? block.instructions[ resume ].offset : block.bytes, resume_cycles );
+
+        block.jit_reads_flags = reads_flags;
+        return p;
+    } //compile
+
+  private:
+    uint8_t * p;            // where the next host instruction is written
+    JitFlagsState state;    // where the flags in written are at this point in the compiled code
+    uint16_t written;       // arithmetic flags other than AF written by compiled code so far
+    uint8_t af;             // JitAfBool, JitAfFlags (with the others), or JitAfSaved (in _jit_aux)
+    uint8_t segment;        // segment override for the current instruction or 0xff
+    uint32_t cycles;        // for the instructions compiled so far
+    bool reads_flags;       // true if the compiled code reads i8086::flags
+    uint8_t next_index;     // index in the block of the instruction after the one being compiled
+    uint8_t bail_index;     // index of the one being compiled or of its first prefix
+    int32_t bail_offset;    // and its offset in the block
+    uint32_t bail_cycles;   // cycles for the instructions before it
+
+    void b( uint8_t x ) { * p++ = x; }
+    void w( uint16_t x ) { * (uint16_t *) p = x; p += 2; }
+    void d( uint32_t x ) { * (uint32_t *) p = x; p += 4; }
+
+    void op( int size, uint32_t opcode, uint8_t reg, const JitOperand & rm )
+    {
+        // size is 8, 16, 32, or 64. opcode is 1 byte or 0x0fxx. reg is a host register or the /digit opcode extension
+
+        if ( 16 == size )
+            b( 0x66 );
+
+        uint8_t rex = ( 64 == size ) ? 8 : 0;
+        if ( reg & 8 )
+            rex |= 4;
+        if ( rm.reg >= 0 )
+        {
+            if ( rm.reg & 8 )
+                rex |= 1;
+        }
+        else
+        {
+            if ( ( rm.index >= 0 ) && ( rm.index & 8 ) )
+                rex |= 2;
+            if ( ( rm.base >= 0 ) && ( rm.base & 8 ) )
+                rex |= 1;
+        }
+        if ( rex )
+            b( 0x40 | rex );
+
+        if ( opcode > 0xff )
+            b( (uint8_t) ( opcode >> 8 ) );
+        b( (uint8_t) opcode );
+
+        uint8_t r = ( ( reg & 7 ) << 3 );
+        if ( rm.reg >= 0 )
+        {
+            b( 0xc0 | r | ( rm.reg & 7 ) );
+            return;
+        }
+
+        if ( rm.base < 0 ) // [ index * scale + disp32 ]
+        {
+            b( 0x04 | r );
+            b( ( rm.scale << 6 ) | ( ( rm.index & 7 ) << 3 ) | 5 );
+            d( rm.disp );
+            return;
+        }
+
+        uint8_t mod = 2;
+        if ( ( 0 == rm.disp ) && ( 5 != ( rm.base & 7 ) ) )
+            mod = 0;
+        else if ( rm.disp >= -128 && rm.disp <= 127 )
+            mod = 1;
+
+        if ( ( rm.index >= 0 ) || ( 4 == ( rm.base & 7 ) ) )
+        {
+            b( ( mod << 6 ) | r | 4 );
+            b( ( rm.scale << 6 ) | ( ( ( rm.index >= 0 ) ? ( rm.index & 7 ) : 4 ) << 3 ) | ( rm.base & 7 ) );
+        }
+        else
+            b( ( mod << 6 ) | r | ( rm.base & 7 ) );
+
+        if ( 1 == mod )
+            b( (uint8_t) rm.disp );
+        else if ( 2 == mod )
+            d( rm.disp );
+    } //op
+
+    static JitOperand cpu_field( size_t offset ) { return jit_mem( jit_rbx, (int32_t) offset ); }
+    static JitOperand guest_memory() { return jit_mem( jit_r12, 0, jit_rax ); }
+    static JitOperand segreg( uint8_t s ) { return cpu_field( offsetof( i8086, es ) + 2 * s ); } // es, cs, ss, ds
+
+    static JitOperand guest16( uint8_t r ) // ax cx dx bx sp bp si di
+    {
+        static const int8_t hosts[ 8 ] = { -1, -1, -1, -1, jit_rbp, jit_r15, jit_r13, jit_r14 };
+        static const uint8_t offsets[ 8 ] = { offsetof( i8086, ax ), offsetof( i8086, cx ), offsetof( i8086, dx ), offsetof( i8086, bx ),
+                                             offsetof( i8086, sp ), offsetof( i8086, bp ), offsetof( i8086, si ), offsetof( i8086, di ) };
+
+        if ( hosts[ r ] >= 0 )
+            return jit_reg( hosts[ r ] );
+        return cpu_field( offsets[ r ] );
+    } //guest16
+
+    static const size_t host_fields[ 4 ]; // sp, bp, si, di. they're in host registers while compiled code runs
+
+    static JitOperand guest8( uint8_t r ) // al cl dl bl ah ch dh bh
+    {
+        JitOperand o = guest16( r & 3 );
+        o.disp += ( r >> 2 );
+        return o;
+    } //guest8
+
+    void load( bool word, int8_t reg, const JitOperand & src ) { op( word ? 16 : 8, word ? 0x8b : 0x8a, reg, src ); }
+    void store( bool word, const JitOperand & dst, int8_t reg ) { op( word ? 16 : 8, word ? 0x89 : 0x88, reg, dst ); }
+
+    void move( bool word, const JitOperand & dst, const JitOperand & src )
+    {
+        if ( src.reg >= 0 )
+            store( word, dst, src.reg );
+        else if ( dst.reg >= 0 )
+            load( word, dst.reg, src );
+        else
+        {
+            load( word, jit_rdx, src );
+            store( word, dst, jit_rdx );
+        }
+    } //move
+
+    void prologue()
+    {
+        b( 0x53 ); b( 0x55 );                           // push rbx, rbp
+        b( 0x41 ); b( 0x54 ); b( 0x41 ); b( 0x55 );     // push r12, r13
+        b( 0x41 ); b( 0x56 ); b( 0x41 ); b( 0x57 );     // push r14, r15
+
+        #ifdef _WIN32
+            op( 64, 0x8b, jit_rbx, jit_reg( jit_rcx ) );
+            op( 64, 0x8b, jit_r12, jit_reg( jit_rdx ) );
+        #else
+            op( 64, 0x8b, jit_rbx, jit_reg( jit_rdi ) );
+            op( 64, 0x8b, jit_r12, jit_reg( jit_rsi ) );
+        #endif
+
+        for ( uint8_t r = 4; r < 8; r++ )
+            op( 32, 0x0fb7, guest16( r ).reg, cpu_field( host_fields[ r - 4 ] ) ); // movzx
+    } //prologue
+
+    void exit_block( uint8_t resume, int32_t ip_delta, uint32_t exit_cycles, int8_t ip_reg = -1 )
+    {
+        // the interpreter continues with instruction resume in the block.
+        // ip becomes ip at entry + ip_delta, or the value in ip_reg if it's a register
+
+        spill_flags();
+        op( 8, 0xc6, 0, cpu_field( offsetof( i8086, _block_next ) ) );
+        b( resume );
+        op( 16, 0xc7, 0, cpu_field( offsetof( i8086, _jit_written ) ) );
+        w( written );
+        op( 8, 0xc6, 0, cpu_field( offsetof( i8086, _jit_af ) ) );
+        b( af );
+
+        JitOperand ip = cpu_field( offsetof( i8086, ip ) );
+        if ( ip_reg >= 0 )
+            store( true, ip, ip_reg );
+        else if ( 0 != ip_delta )
+        {
+            op( 16, 0x81, 0, ip );                      // add word [ip], delta
+            w( (uint16_t) ip_delta );
+        }
+
+        op( 64, 0x81, 0, cpu_field( offsetof( i8086, cycles ) ) );
+        d( exit_cycles );
+
+        for ( uint8_t r = 4; r < 8; r++ )
+            store( true, cpu_field( host_fields[ r - 4 ] ), guest16( r ).reg );
+
+        b( 0x41 ); b( 0x5f ); b( 0x41 ); b( 0x5e );     // pop r15, r14
+        b( 0x41 ); b( 0x5d ); b( 0x41 ); b( 0x5c );     // pop r13, r12
+        b( 0x5d ); b( 0x5b ); b( 0xc3 );                // pop rbp, rbx. ret
+    } //exit_block
+
+    uint8_t * jcc( uint8_t condition ) // returns where the rel32 goes
+    {
+        b( 0x0f );
+        b( 0x80 | condition );
+        d( 0 );
+        return p - 4;
+    } //jcc
+
+    void branch_exits( uint8_t * ptaken, int32_t not_taken_delta, int32_t taken_delta )
+    {
+        JitFlagsState was = state;
+        exit_block( next_index, not_taken_delta, cycles );
+        state = was;
+        * (int32_t *) ptaken = (int32_t) ( p - ( ptaken + 4 ) );
+        exit_block( next_index, taken_delta, cycles + 12 );
+    } //branch_exits
+
+    void spill_flags()
+    {
+        if ( JitFlagsLive == state )
+        {
+            b( 0x9c );                                                      // pushfq
+            op( 32, 0x8f, 0, cpu_field( offsetof( i8086, _jit_flags ) ) );  // pop [_jit_flags]
+            state = JitFlagsSpilled;
+        }
+    } //spill_flags
+
+    void prepare_flags( uint16_t defines, bool defines_af, bool reads_carry )
+    {
+        // called right before a host instruction that writes the flags in defines. Carry must be
+        // correct in host flags first if the instruction reads it or leaves it alone after it was written.
+
+        if ( !defines_af && ( JitAfFlags == af ) )
+        {
+            if ( JitFlagsLive == state )
+            {
+                b( 0x9c );
+                op( 32, 0x8f, 0, cpu_field( offsetof( i8086, _jit_aux ) ) );
+            }
+            else
+            {
+                op( 64, 0x8b, jit_rcx, cpu_field( offsetof( i8086, _jit_flags ) ) );
+                op( 64, 0x89, jit_rcx, cpu_field( offsetof( i8086, _jit_aux ) ) );
+            }
+            af = JitAfSaved;
+        }
+
+        if ( reads_carry || ( ( 0 == ( defines & JitCF ) ) && ( written & JitCF ) ) )
+        {
+            JitOperand carry = cpu_field( offsetof( i8086, fCarry ) );
+            if ( written & JitCF )
+                carry = cpu_field( offsetof( i8086, _jit_flags ) );
+
+            if ( ( JitFlagsLive != state ) || ( 0 == ( written & JitCF ) ) )
+            {
+                op( 32, 0x0fba, 4, carry );                 // bt dword [carry], 0
+                b( 0 );
+            }
+        }
+
+        state = JitFlagsLive;
+        written |= defines;
+        if ( defines_af )
+            af = JitAfFlags;
+    } //prepare_flags
+
+    void flags_to_host( uint16_t needed )
+    {
+        // make host flags hold the 8086 flags in needed so a host jcc can test them. Rare: most blocks
+        // compare right before they branch. Flags not yet written by compiled code come from i8086::flags,
+        // which is materialized before blocks that do this run. The exception is carry, which comes from
+        // fCarry because clc, stc, and cmc update that directly until something writes host carry.
+
+        if ( ( JitFlagsLive == state ) && ( needed == ( needed & written ) ) )
+            return;
+
+        spill_flags();
+        op( 32, 0x0fb7, jit_rcx, cpu_field( offsetof( i8086, flags ) ) );  // movzx ecx, word [flags]
+        op( 32, 0x81, 4, jit_reg( jit_rcx ) );                              // and ecx, imm32
+        d( JitArith & ~written & ~JitCF );
+        if ( 0 == ( written & JitCF ) )
+            op( 8, 0x0a, jit_rcx, cpu_field( offsetof( i8086, fCarry ) ) ); // or cl, byte [fCarry]
+
+        if ( written )
+        {
+            op( 64, 0x8b, jit_rax, cpu_field( offsetof( i8086, _jit_flags ) ) );
+            b( 0x25 );                                                      // and eax, imm32
+            d( ~ (uint32_t) ( JitArith & ~written ) );
+            op( 32, 0x09, jit_rcx, jit_reg( jit_rax ) );                    // or eax, ecx
+            b( 0x50 );                                                      // push rax
+        }
+        else
+            b( 0x51 );                                                      // push rcx
+
+        b( 0x9d );                                                          // popfq
+        state = JitFlagsLive;
+        written |= JitArith;
+        reads_flags = true;
+    } //flags_to_host
+
+    void effective_offset( const i8086_decoded & dec, const uint8_t * pcode )
+    {
+        // eax = the 16-bit offset of a mod reg r/m memory operand, zero-extended. Doesn't change flags
+
+        int32_t disp = 0;
+        if ( 1 == dec.mod )
+            disp = (int8_t) pcode[ 2 ];
+        else if ( 2 == dec.mod )
+            disp = * (uint16_t *) ( pcode + 2 );
+        else if ( 6 == dec.rm )
+        {
+            b( 0xb8 );                                      // mov eax, offset
+            d( * (uint16_t *) ( pcode + 2 ) );
+            return;
+        }
+
+        const int8_t bx = -2;
+        static const int8_t bases[ 8 ] = { bx, bx, jit_r15, jit_r15, jit_r13, jit_r14, jit_r15, bx };
+        static const int8_t indexes[ 8 ] = { jit_r13, jit_r14, jit_r13, jit_r14, -1, -1, -1, -1 };
+
+        int8_t base = bases[ dec.rm ];
+        if ( bx == base )
+        {
+            op( 32, 0x0fb7, jit_rax, guest16( 3 ) );        // movzx eax, word [bx]
+            if ( ( indexes[ dec.rm ] < 0 ) && ( 0 == disp ) )
+                return;
+            base = jit_rax;
+        }
+
+        op( 16, 0x8d, jit_rax, jit_mem( base, disp, indexes[ dec.rm ] ) ); // lea ax, [ base + index + disp ]
+        op( 32, 0x0fb7, jit_rax, jit_reg( jit_rax ) );                      // movzx eax, ax
+    } //effective_offset
+
+    void flat_address( uint8_t seg, bool store )
+    {
+        // eax = flat address of seg:ax with the same wrap as i8086::flatten(). store is true if it'll be written
+
+        spill_flags();
+        op( 32, 0x0fb7, jit_rcx, segreg( seg ) );                      // movzx ecx, word [seg]
+        op( 32, 0x8d, jit_rcx, jit_mem( -1, 0, jit_rcx, 3 ) );         // lea ecx, [ rcx * 8 ]
+        op( 32, 0x8d, jit_rax, jit_mem( jit_rax, 0, jit_rcx, 1 ) );    // lea eax, [ rax + rcx * 2 ]
+        b( 0x25 );                                                     // and eax, 0xfffff
+        d( 0xfffff );
+
+        if ( !store )
+            return;
+
+        // like i8086::track_store(). Nothing has changed yet, so a store to cached code exits to the interpreter.
+        // i8086_watch_trace is never set here since compiled code doesn't run while a binary trace is recorded.
+
+        ptrdiff_t watch = i8086_store_watch - memory;
+        assert( watch == (int32_t) watch );
+        op( 32, 0x0fb6, jit_rcx, jit_mem( jit_r12, (int32_t) watch, jit_rax ) ); // movzx ecx, byte [ i8086_store_watch + rax ]
+        op( 8, 0xf6, 0, jit_reg( jit_rcx ) );                          // test cl, i8086_watch_code
+        b( i8086_watch_code );
+        uint8_t * pstore = jcc( 4 );                                   // jz
+        exit_block( bail_index, bail_offset, bail_cycles );
+        * (int32_t *) pstore = (int32_t) ( p - ( pstore + 4 ) );
+
+        op( 32, 0xd1, 5, jit_reg( jit_rcx ) );                         // shr ecx, 1. i8086_watch_video is 2
+        op( 32, 0x01, jit_rcx, cpu_field( offsetof( i8086, video_generation ) ) ); // add dword [video_generation], ecx
+    } //flat_address
+
+    JitOperand rm_operand( const i8086_decoded & dec, const uint8_t * pcode, bool word, bool store )
+    {
+        if ( 3 == dec.mod )
+            return word ? guest16( dec.rm ) : guest8( dec.rm );
+
+        effective_offset( dec, pcode );
+        uint8_t seg = segment;
+        if ( 0xff == seg )
+            seg = ( 2 == dec.rm || 3 == dec.rm || ( 6 == dec.rm && 0 != dec.mod ) ) ? 2 : 3; // bp defaults to ss
+        flat_address( seg, store );
+
+        // same cycles as get_rm_ptr_common()
+
+        if ( 0 != dec.mod )
+            cycles += ( 1 == dec.mod ) ? 4 : 5;
+        else if ( 6 == dec.rm )
+            cycles += 5;
+        ea_cycles( dec );
+        if ( 0xff != segment )
+            cycles += 2;
+        return guest_memory();
+    } //rm_operand
+
+    void ea_cycles( const i8086_decoded & dec ) // same as get_displacement(), which a direct address doesn't use
+    {
+        static const uint8_t register_cycles[ 8 ] = { 7, 7, 8, 8, 6, 6, 6, 6 };
+        if ( 0 != dec.mod || 6 != dec.rm )
+            cycles += register_cycles[ dec.rm ];
+    } //ea_cycles
+
+    void mem_cycles( const i8086_decoded & dec, uint8_t amount ) // same as i8086::AddMemCycles()
+    {
+        if ( 3 != dec.mod )
+            cycles += amount;
+        else if ( 0 == ( dec.b0 & 2 ) )
+            cycles += 21;
+    } //mem_cycles
+
+    void push() // push dx. sp changes after flat_address() so a store to watched code can exit before the push
+    {
+        op( 32, 0x8d, jit_rax, jit_mem( jit_rbp, -2 ) );    // lea eax, [rbp - 2]
+        op( 32, 0x0fb7, jit_rax, jit_reg( jit_rax ) );      // movzx eax, ax
+        flat_address( 2, true );
+        store( true, guest_memory(), jit_rdx );
+        op( 16, 0x8d, jit_rbp, jit_mem( jit_rbp, -2 ) );    // lea bp, [rbp - 2]
+    } //push
+
+    void pop() // pop dx
+    {
+        op( 32, 0x0fb7, jit_rax, jit_reg( jit_rbp ) );
+        flat_address( 2, false );
+        load( true, jit_rdx, guest_memory() );
+        op( 16, 0x8d, jit_rbp, jit_mem( jit_rbp, 2 ) );     // lea bp, [rbp + 2]
+    } //pop
+
+    void return_address( int32_t next ) // dx = ip at entry + next
+    {
+        op( 32, 0x0fb7, jit_rdx, cpu_field( offsetof( i8086, ip ) ) );
+        op( 16, 0x8d, jit_rdx, jit_mem( jit_rdx, next ) );
+    } //return_address
+
+    static bool is_logical( uint8_t math ) { return ( 1 == math || 4 == math || 6 == math ); } // or, and, xor
+
+    void math( uint8_t math, bool word, const JitOperand & dst, JitOperand src )
+    {
+        // math is the /r operation shared by the 8086 and x86: add or adc sbb and sub xor cmp
+
+        if ( ( src.reg < 0 ) && ( dst.reg < 0 ) )
+        {
+            load( word, jit_rdx, src );
+            src = jit_reg( jit_rdx );
+        }
+
+        prepare_flags( JitArith, !is_logical( math ), ( 2 == math || 3 == math ) );
+        uint8_t opcode = ( math << 3 ) | ( word ? 1 : 0 );
+        if ( src.reg >= 0 )
+            op( word ? 16 : 8, opcode, src.reg, dst );
+        else
+            op( word ? 16 : 8, opcode | 2, dst.reg, src );
+    } //math
+
+    void math_immediate( uint8_t math, bool word, const JitOperand & dst, uint16_t immediate, bool sign_extended )
+    {
+        prepare_flags( JitArith, !is_logical( math ), ( 2 == math || 3 == math ) );
+        if ( !word )
+        {
+            op( 8, 0x80, math, dst );
+            b( (uint8_t) immediate );
+        }
+        else if ( sign_extended )
+        {
+            op( 16, 0x83, math, dst );
+            b( (uint8_t) immediate );
+        }
+        else
+        {
+            op( 16, 0x81, math, dst );
+            w( immediate );
+        }
+    } //math_immediate
+
+    void test( bool word, const JitOperand & dst, JitOperand src )
+    {
+        if ( ( src.reg < 0 ) && ( dst.reg < 0 ) )
+        {
+            load( word, jit_rdx, src );
+            src = jit_reg( jit_rdx );
+        }
+
+        prepare_flags( JitArith, false, false );
+        if ( src.reg >= 0 )
+            op( word ? 16 : 8, word ? 0x85 : 0x84, src.reg, dst );
+        else
+            op( word ? 16 : 8, word ? 0x85 : 0x84, dst.reg, src );
+    } //test
+
+    void test_immediate( bool word, const JitOperand & dst, uint16_t immediate )
+    {
+        prepare_flags( JitArith, false, false );
+        op( word ? 16 : 8, word ? 0xf7 : 0xf6, 0, dst );
+        if ( word )
+            w( immediate );
+        else
+            b( (uint8_t) immediate );
+    } //test_immediate
+
+    void carry_flag( uint8_t b0 ) // clc, stc, and cmc have the same opcodes on the host
+    {
+        if ( written & JitCF )
+        {
+            if ( JitFlagsLive == state )
+                b( b0 );
+            else
+            {
+                op( 32, 0x83, ( 0xf8 == b0 ) ? 4 : ( 0xf9 == b0 ) ? 1 : 6, cpu_field( offsetof( i8086, _jit_flags ) ) ); // and, or, xor
+                b( ( 0xf8 == b0 ) ? 0xfe : 1 );
+            }
+            return;
+        }
+
+        JitOperand carry = cpu_field( offsetof( i8086, fCarry ) );
+        if ( 0xf5 == b0 )
+        {
+            spill_flags();
+            op( 8, 0x80, 6, carry );                        // xor byte [fCarry], 1
+            b( 1 );
+        }
+        else
+        {
+            op( 8, 0xc6, 0, carry );                        // mov byte [fCarry], 0 or 1
+            b( b0 & 1 );
+        }
+    } //carry_flag
+
+    JitResult instruction( const i8086_decoded & dec, const uint8_t * pcode, int32_t next )
+    {
+        // next is the offset of the next instruction from the start of the block
+
+        uint8_t b0 = dec.b0;
+        bool word = ( b0 & 1 );
+
+        if ( ( b0 < 0x40 ) && ( ( b0 & 7 ) <= 3 ) ) // add, or, adc, sbb, and, sub, xor, cmp
+        {
+            uint8_t operation = ( b0 >> 3 ) & 7;
+            if ( b0 & 2 )
+                mem_cycles( dec, 10 );
+            else
+                cycles += 21;
+            JitOperand rm = rm_operand( dec, pcode, word, !( b0 & 2 ) && ( 7 != operation ) );
+            JitOperand reg = word ? guest16( dec.reg ) : guest8( dec.reg );
+            if ( b0 & 2 )
+                math( operation, word, reg, rm );
+            else
+                math( operation, word, rm, reg );
+            return JitNext;
+        }
+
+        if ( ( b0 < 0x40 ) && ( ( b0 & 7 ) <= 5 ) ) // math al, immed8. math ax, immed16
+        {
+            math_immediate( ( b0 >> 3 ) & 7, word, word ? guest16( 0 ) : guest8( 0 ), word ? * (uint16_t *) ( pcode + 1 ) : pcode[ 1 ], false );
+            return JitNext;
+        }
+
+        if ( b0 >= 0x40 && b0 <= 0x4f ) // inc, dec r16
+        {
+            prepare_flags( JitArith & ~JitCF, true, false );
+            op( 16, 0xff, ( b0 >= 0x48 ) ? 1 : 0, guest16( b0 & 7 ) );
+            return JitNext;
+        }
+
+        if ( b0 >= 0x50 && b0 <= 0x57 ) // push r16. push sp pushes the value before the push like the interpreter
+        {
+            load( true, jit_rdx, guest16( b0 & 7 ) );
+            push();
+            return JitNext;
+        }
+
+        if ( b0 >= 0x58 && b0 <= 0x5f ) // pop r16
+        {
+            pop();
+            store( true, guest16( b0 & 7 ), jit_rdx );
+            return JitNext;
+        }
+
+        if ( b0 >= 0x70 && b0 <= 0x7f ) // jcc. the condition codes are the same on the host
+        {
+            static const uint16_t needed[ 8 ] = { JitOF, JitCF, JitZF, JitCF | JitZF, JitSF, JitPF, JitSF | JitOF, JitZF | JitSF | JitOF };
+            flags_to_host( needed[ ( b0 & 0xf ) >> 1 ] );
+            uint8_t * ptaken = jcc( b0 & 0xf );
+            branch_exits( ptaken, next, next + (int8_t) pcode[ 1 ] );
+            return JitExited;
+        }
+
+        if ( b0 >= 0xb0 && b0 <= 0xbf ) // mov r8/r16, immed
+        {
+            if ( b0 <= 0xb7 )
+            {
+                op( 8, 0xc6, 0, guest8( b0 & 7 ) );
+                b( pcode[ 1 ] );
+            }
+            else
+            {
+                op( 16, 0xc7, 0, guest16( b0 & 7 ) );
+                w( * (uint16_t *) ( pcode + 1 ) );
+            }
+            return JitNext;
+        }
+
+        switch ( b0 )
+        {
+            case 0x06: case 0x0e: case 0x16: case 0x1e: // push sreg
+            {
+                load( true, jit_rdx, segreg( b0 >> 3 ) );
+                push();
+                return JitNext;
+            }
+            case 0x07: case 0x17: case 0x1f: // pop sreg
+            {
+                pop();
+                store( true, segreg( b0 >> 3 ), jit_rdx );
+                return JitNext;
+            }
+            case 0x80: case 0x81: case 0x82: case 0x83: // math r/m, immed
+            {
+                cycles += ( 0 == dec.mod && 6 == dec.rm ) ? 13 : 6;
+                JitOperand rm = rm_operand( dec, pcode, word, 7 != dec.reg );
+                const uint8_t * pimmediate = pcode + dec.length - ( ( 0x81 == b0 ) ? 2 : 1 );
+                math_immediate( dec.reg, word, rm, ( 0x81 == b0 ) ? * (uint16_t *) pimmediate : * pimmediate, ( 0x83 == b0 ) );
+                return JitNext;
+            }
+            case 0x84: case 0x85: // test r/m, reg
+            {
+                mem_cycles( dec, 8 );
+                JitOperand rm = rm_operand( dec, pcode, word, false );
+                test( word, rm, word ? guest16( dec.reg ) : guest8( dec.reg ) );
+                return JitNext;
+            }
+            case 0x86: case 0x87: // xchg reg, r/m
+            {
+                mem_cycles( dec, 21 );
+                JitOperand rm = rm_operand( dec, pcode, word, true );
+                JitOperand reg = word ? guest16( dec.reg ) : guest8( dec.reg );
+                load( word, jit_rdx, rm );
+                load( word, jit_rcx, reg );
+                store( word, rm, jit_rcx );
+                store( word, reg, jit_rdx );
+                return JitNext;
+            }
+            case 0x88: case 0x89: case 0x8a: case 0x8b: // mov
+            {
+                mem_cycles( dec, 11 );
+                JitOperand rm = rm_operand( dec, pcode, word, !( b0 & 2 ) );
+                JitOperand reg = word ? guest16( dec.reg ) : guest8( dec.reg );
+                if ( b0 & 2 )
+                    move( word, reg, rm );
+                else
+                    move( word, rm, reg );
+                return JitNext;
+            }
+            case 0x8c: // mov r/m16, sreg
+            {
+                if ( dec.reg > 3 )
+                    return JitUnsupported;
+                mem_cycles( dec, 11 );
+                move( true, rm_operand( dec, pcode, true, true ), segreg( dec.reg ) );
+                return JitNext;
+            }
+            case 0x8d: // lea
+            {
+                if ( 3 == dec.mod )
+                    return JitUnsupported;
+                ea_cycles( dec );
+                effective_offset( dec, pcode );
+                store( true, guest16( dec.reg ), jit_rax );
+                return JitNext;
+            }
+            case 0x8e: // mov sreg, r/m16. not cs; that's a jump
+            {
+                if ( dec.reg > 3 || 1 == dec.reg )
+                    return JitUnsupported;
+                mem_cycles( dec, 11 );
+                move( true, segreg( dec.reg ), rm_operand( dec, pcode, true, false ) );
+                return JitNext;
+            }
+            case 0x90: return JitNext; // nop
+            case 0x91: case 0x92: case 0x93: case 0x94: case 0x95: case 0x96: case 0x97: // xchg ax, r16
+            {
+                load( true, jit_rdx, guest16( 0 ) );
+                load( true, jit_rcx, guest16( b0 & 7 ) );
+                store( true, guest16( 0 ), jit_rcx );
+                store( true, guest16( b0 & 7 ), jit_rdx );
+                return JitNext;
+            }
+            case 0x98: // cbw
+            {
+                op( 32, 0x0fbe, jit_rax, guest8( 0 ) );          // movsx eax, byte [al]
+                store( true, guest16( 0 ), jit_rax );
+                return JitNext;
+            }
+            case 0x99: // cwd
+            {
+                load( true, jit_rax, guest16( 0 ) );
+                b( 0x66 );
+                b( 0x99 );
+                store( true, guest16( 2 ), jit_rdx );
+                return JitNext;
+            }
+            case 0xa0: case 0xa1: case 0xa2: case 0xa3: // mov al/ax, [immed16] and the reverse
+            {
+                if ( 0xff != segment )
+                    cycles += 2; // same as get_seg_value()
+                b( 0xb8 );
+                d( * (uint16_t *) ( pcode + 1 ) );
+                flat_address( ( 0xff == segment ) ? 3 : segment, 0 != ( b0 & 2 ) );
+                JitOperand reg = word ? guest16( 0 ) : guest8( 0 );
+                if ( b0 & 2 )
+                    move( word, guest_memory(), reg );
+                else
+                    move( word, reg, guest_memory() );
+                return JitNext;
+            }
+            case 0xa8: { test_immediate( false, guest8( 0 ), pcode[ 1 ] ); return JitNext; }
+            case 0xa9: { test_immediate( true, guest16( 0 ), * (uint16_t *) ( pcode + 1 ) ); return JitNext; }
+            case 0xc2: // ret immed16
+            {
+                pop();
+                op( 16, 0x8d, jit_rbp, jit_mem( jit_rbp, * (uint16_t *) ( pcode + 1 ) ) );
+                exit_block( next_index, 0, cycles, jit_rdx );
+                return JitExited;
+            }
+            case 0xc3: // ret
+            {
+                pop();
+                exit_block( next_index, 0, cycles, jit_rdx );
+                return JitExited;
+            }
+            case 0xc6: case 0xc7: // mov r/m, immed
+            {
+                if ( 0 != dec.reg )
+                    return JitUnsupported;
+                JitOperand rm = rm_operand( dec, pcode, word, true );
+                op( word ? 16 : 8, b0, 0, rm );
+                if ( word )
+                    w( * (uint16_t *) ( pcode + dec.length - 2 ) );
+                else
+                    b( pcode[ dec.length - 1 ] );
+                return JitNext;
+            }
+            case 0xd0: case 0xd1: // shl, shr, and sar by 1. sar8 sets sign differently in the interpreter
+            {
+                if ( 4 != dec.reg && 5 != dec.reg && !( 7 == dec.reg && word ) )
+                    return JitUnsupported;
+                mem_cycles( dec, 13 );
+                JitOperand rm = rm_operand( dec, pcode, word, true );
+                prepare_flags( JitArith, false, false );
+                op( word ? 16 : 8, b0, dec.reg, rm );
+                return JitNext;
+            }
+            case 0xe2: // loop
+            case 0xe3: // jcxz
+            {
+                spill_flags();
+                op( 16, 0x83, ( 0xe2 == b0 ) ? 5 : 7, guest16( 1 ) ); // sub word [cx], 1 or cmp word [cx], 0
+                b( ( 0xe2 == b0 ) ? 1 : 0 );
+                uint8_t * ptaken = jcc( ( 0xe2 == b0 ) ? 5 : 4 );    // jnz or jz
+                branch_exits( ptaken, next, next + (int8_t) pcode[ 1 ] );
+                return JitExited;
+            }
+            case 0xe8: // call rel16
+            {
+                return_address( next );
+                push();
+                exit_block( next_index, next + (int16_t) * (uint16_t *) ( pcode + 1 ), cycles );
+                return JitExited;
+            }
+            case 0xe9: { exit_block( next_index, next + (int16_t) * (uint16_t *) ( pcode + 1 ), cycles ); return JitExited; } // jmp near
+            case 0xeb: { exit_block( next_index, next + (int8_t) pcode[ 1 ], cycles ); return JitExited; }                   // jmp short
+            case 0xf5: case 0xf8: case 0xf9: { carry_flag( b0 ); return JitNext; } // cmc, clc, stc
+            case 0xfa: case 0xfb: // cli, sti
+            {
+                op( 8, 0xc6, 0, cpu_field( offsetof( i8086, fInterrupt ) ) );
+                b( b0 & 1 );
+                return JitNext;
+            }
+            case 0xfc: case 0xfd: // cld, std
+            {
+                op( 8, 0xc6, 0, cpu_field( offsetof( i8086, fDirection ) ) );
+                b( b0 & 1 );
+                return JitNext;
+            }
+            case 0xf6: case 0xf7: // test immed, not, neg. not mul and div
+            {
+                if ( 0 != dec.reg && 2 != dec.reg && 3 != dec.reg )
+                    return JitUnsupported;
+                mem_cycles( dec, ( 0 == dec.reg ) ? 10 : 19 );
+                JitOperand rm = rm_operand( dec, pcode, word, 0 != dec.reg );
+                if ( 0 == dec.reg )
+                    test_immediate( word, rm, word ? * (uint16_t *) ( pcode + dec.length - 2 ) : pcode[ dec.length - 1 ] );
+                else
+                {
+                    if ( 3 == dec.reg )
+                        prepare_flags( JitArith, true, false );
+                    op( word ? 16 : 8, b0, dec.reg, rm );
+                }
+                return JitNext;
+            }
+            case 0xfe: case 0xff: // inc, dec r/m. push r/m16. call and jmp near indirect
+            {
+                if ( dec.reg <= 1 )
+                {
+                    if ( 0xfe == b0 )
+                        mem_cycles( dec, 12 );
+                    else
+                        cycles += 21;
+                    JitOperand rm = rm_operand( dec, pcode, word, true );
+                    prepare_flags( JitArith & ~JitCF, true, false );
+                    op( word ? 16 : 8, b0, dec.reg, rm );
+                    return JitNext;
+                }
+
+                if ( !word )
+                    return JitUnsupported;
+
+                if ( 6 == dec.reg )
+                {
+                    cycles += 22;
+                    load( true, jit_rdx, rm_operand( dec, pcode, true, false ) );
+                    push();
+                    return JitNext;
+                }
+
+                if ( 4 == dec.reg )
+                {
+                    cycles += 13;
+                    mem_cycles( dec, 3 );
+                    load( true, jit_rdx, rm_operand( dec, pcode, true, false ) );
+                    exit_block( next_index, 0, cycles, jit_rdx );
+                    return JitExited;
+                }
+
+                if ( 2 == dec.reg )
+                {
+                    cycles += 18;
+                    mem_cycles( dec, 9 );
+                    load( true, jit_r8, rm_operand( dec, pcode, true, false ) );
+                    return_address( next );
+                    push();
+                    exit_block( next_index, 0, cycles, jit_r8 );
+                    return JitExited;
+                }
+
+                return JitUnsupported;
+            }
+        }
+
+        return JitUnsupported;
+    } //instruction
+}; //i8086_jit
+
+const size_t i8086_jit::host_fields[ 4 ] = { offsetof( i8086, sp ), offsetof( i8086, bp ), offsetof( i8086, si ), offsetof( i8086, di ) };
+
+static void jit_compile( i8086_block & block )
+{
+    if ( ( g_jitNext + JitMaxBlockBytes ) > ( g_jitCode + JitCodeBytes ) )
+    {
+        // out of space. throw away all compiled code; hot blocks will be compiled again
+
+        for ( uint32_t i = 0; i < BlockCacheEntries; i++ )
+        {
+            g_blockCache[ i ].jit_state = JitNotTried;
+            g_blockCache[ i ].entries = 0;
+        }
+        g_jitNext = g_jitCode;
+    }
+
+    i8086_jit jit( g_jitNext );
+    uint8_t * pend = jit.compile( block );
+    if ( 0 == pend )
+    {
+        block.jit_state = JitFailed;
+        return;
+    }
+
+    g_jitCompiles++;
+    block.jit = (i8086_jitted) g_jitNext;
+    block.jit_state = JitCompiled;
+    g_jitNext = (uint8_t *) ( ( (uintptr_t) pend + 15 ) & ~ (uintptr_t) 15 );
+} //jit_compile
+
+#endif //I8086_JIT
+
+bool i8086::enable_jit( bool enable )
+{
+    #ifdef I8086_JIT
+        if ( enable && !g_jitCode )
+        {
+            #ifdef _WIN32
+                g_jitCode = (uint8_t *) VirtualAlloc( 0, JitCodeBytes, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE );
+            #else
+                void * pcode = mmap( 0, JitCodeBytes, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+                g_jitCode = ( MAP_FAILED == pcode ) ? 0 : (uint8_t *) pcode;
+            #endif
+
+            g_jitNext = g_jitCode;
+            if ( g_jitCode )
+                enable_block_cache( true );
+        }
+        else if ( !enable && g_jitCode )
+        {
+            if ( g_blockCache )
+                for ( uint32_t i = 0; i < BlockCacheEntries; i++ )
+                    g_blockCache[ i ].jit_state = JitNotTried;
+
+            #ifdef _WIN32
+                VirtualFree( g_jitCode, 0, MEM_RELEASE );
+            #else
+                munmap( g_jitCode, JitCodeBytes );
+            #endif
+            g_jitCode = 0;
+            g_jitNext = 0;
+        }
+
+        return ( enable == ( 0 != g_jitCode ) );
+    #else
+        return !enable; // the JIT only generates x86-64 code
+    #endif
+} //enable_jit
+
+void i8086::jit_stats( uint64_t & compiled, uint64_t & runs )
+{
+    #ifdef I8086_JIT
+        compiled = g_jitCompiles;
+        runs = g_jitRuns;
+    #else
+        compiled = 0;
+        runs = 0;
+    #endif
+} //jit_stats
+
+// Sampling profiler. emulate() stops its loop when the next sample is due, reports cs:ip, and carries on.
+// Samples land between instructions, or between compiled blocks when the JIT is running.
+
+static uint32_t g_profileInterval = 0;   // cycles between samples or 0 if the profiler is off
+static uint64_t g_profileCountdown = 0;  // cycles until the next sample, carried across calls to emulate()
+
+void i8086::enable_profiler( uint32_t cycles_per_sample )
+{
+    g_profileInterval = cycles_per_sample;
+    g_profileCountdown = cycles_per_sample;
+} //enable_profiler
+
+not_inlined bool i8086::enter_block()
+{
+    uint32_t flat = flatten( cs, ip );
+    i8086_block & block = g_blockCache[ ( flat ^ ( flat >> 12 ) ) & ( BlockCacheEntries - 1 ) ];
+
+    if ( block.flat != flat )
+        build_block( block, flat );
+    else if ( ( block.host_epoch != g_hostEpoch ) || ( block.page_writes != page_writes( block ) ) )
+    {
+        if ( block.matches_memory() )
+            watch_block( block );
+        else
+        {
+            g_blockInvalidations++;
+            build_block( block, flat );
+        }
+    }
+
+    if ( 0 == block.count )
+    {
+        _pblock = & g_blockNone;
+        return false;
+    }
+
+    _pblock = & block;
+    _block_next = 0;
+    _block_cs = cs;
+    _block_ip = ip;
+
+    #ifdef I8086_JIT
+        if ( g_jitCode && ( 0xff == prefix_segment_override ) && ( 0xff == prefix_repeat_opcode ) &&
+             ( 0 == ( g_State & ( stateTraceInstructions | stateTrapSet | stateBinaryTrace ) ) ) )
+        {
+            if ( ( JitNotTried == block.jit_state ) && ( ++block.entries >= JitHotEntries ) )
+                jit_compile( block );
+
+            if ( JitCompiled == block.jit_state )
+            {
+                if ( block.jit_reads_flags )
+                    materializeFlags();
+
+                block.jit( this, memory );
+                g_jitRuns++;
+
+                if ( g_countInstructions ) // it ran the instructions before the one the interpreter continues with
+                    for ( uint8_t i = 0; i < _block_next && i < block.count; i++ )
+                        count_instruction( block.instructions[ i ].b0, block.instructions[ i ].b1 );
+
+                uint16_t written = _jit_written;
+                if ( written ) // parity, sign, and zero are always written together
+                {
+                    uint64_t f = _jit_flags;
+                    if ( written & JitCF ) fCarry = ( 0 != ( f & JitCF ) );
+                    if ( written & JitOF ) fOverflow = ( 0 != ( f & JitOF ) );
+                    set_PSZ( 0 != ( f & JitPF ), 0 != ( f & JitSF ), 0 != ( f & JitZF ) );
+                }
+
+                if ( JitAfFlags == _jit_af )
+                    set_aux_carry( 0 != ( _jit_flags & JitAF ) );
+                else if ( JitAfSaved == _jit_af )
+                    set_aux_carry( 0 != ( _jit_aux & JitAF ) );
+
+                _block_ip = ip; // the compiled code set _block_next to where the interpreter continues, if anywhere
+            }
+        }
+    #endif
+
+    return true;
+} //enter_block
+
+force_inlined bool i8086::fetch_decoded_instruction() // returns false if compiled code ran in place of an instruction
+{
+    if ( ( ip != _block_ip ) || ( cs != _block_cs ) || ( _block_next >= _pblock->count ) )
+    {
+        if ( !enter_block() )
+        {
+            decode_instruction( flat_address8( cs, ip ) );
+            return true;
+        }
+
+        if ( _block_next >= _pblock->count ) // compiled code ran the whole block
+            return false;
+    }
+
+    const i8086_decoded & d = _pblock->instructions[ _block_next++ ];
+    _bc = 1;
+    _b0 = d.b0;
+    _b1 = d.b1;
+    _rm = d.rm;
+    _reg = d.reg;
+    _mod = d.mod;
+    _pcode = memory + _pblock->flat + d.offset;
+    _block_ip = ip + d.length;
+    return true;
+} //fetch_decoded_instruction
+
+#ifndef NDEBUG
+static uint64_t opcode_usage[ 256 ] = {0};
+
+uint8_t i8086::trace_opcode_usage()
+{
+    uint8_t used = 0;
+    for ( size_t i = 0; i < 256; i++ )
+        if ( opcode_usage[ i ] )
+        {
+            tracer.Trace( "%02zx: %llu\n", i, opcode_usage[ i ] );
+            used++;
+        }
+    tracer.Trace( "number of unique first opcodes: %zd\n", used );
+    return used;
+} //trace_opcode_usage
+#endif //DEBUG
+
+// GCC and Clang support computed goto. With it, each opcode handler decodes the next instruction
+// and jumps straight to its handler through a table of labels rather than going back to the top
+// of the loop and through the switch. The branch predictor then gets one indirect jump per
+// opcode to learn from instead of one for all of them. MSVC doesn't support it, so it uses the switch.
+// The switch remains in both cases for the rare paths, which still end with break or continue.
+// How much this helps depends on the host's indirect branch predictor; recent x64 cores predict the
+// single switch jump well and show little difference. Define I8086_SWITCH_DISPATCH to compare.
+
+#if ( defined( __GNUC__ ) || defined( __clang__ ) ) && !defined( I8086_SWITCH_DISPATCH )
+    #define I8086_THREADED_DISPATCH
+#endif
+
+#ifdef I8086_THREADED_DISPATCH
+    #define op_case( x ) op_##x
+    #define op_default op_unhandled
+    #define op_jumped { if ( decode_next( limit ) ) goto * op_labels[ _b0 ]; continue; } // ip is already updated
+    #define op_next { ip += _bc; op_jumped; }
+
+force_inlined bool i8086::decode_next( uint64_t maxcycles ) // false if the top of the loop must handle the next instruction
+{
+    if ( ( cycles >= maxcycles ) || ( 0 != g_State ) || g_blockCache )
+        return false;
+
+    prefix_segment_override = 0xff;
+    prefix_repeat_opcode = 0xff;
+
+    #ifndef NDEBUG
+        opcode_usage[ _b0 ]++;
+        assert( 0 != cs || 0 != ip );
+    #endif
+
+    decode_instruction( flat_address8( cs, ip ) );
+
+    if ( g_countInstructions )
+        count_instruction( _b0, _b1 );
+
+    #ifdef I8086_TRACK_CYCLES
+        cycles += i8086_cycles[ _b0 ];
+    #else
+        cycles += 18;
+    #endif
+
+    return true;
+} //decode_next
+
+#else
+    #define op_case( x ) case x
+    #define op_default default
+    #define op_jumped continue
+    #define op_next break
+#endif
+
+uint64_t i8086::emulate( uint64_t maxcycles )
+{
+    #ifdef I8086_THREADED_DISPATCH
+        static const void * op_labels[ 256 ] =
+        {
+            &&op_0x00, &&op_0x01, &&op_0x02, &&op_0x03, &&op_0x04, &&op_0x05, &&op_0x06, &&op_0x07,
+            &&op_0x08, &&op_0x09, &&op_0x0a, &&op_0x0b, &&op_0x0c, &&op_0x0d, &&op_0x0e, &&op_unhandled,
+            &&op_0x10, &&op_0x11, &&op_0x12, &&op_0x13, &&op_0x14, &&op_0x15, &&op_0x16, &&op_0x17,
+            &&op_0x18, &&op_0x19, &&op_0x1a, &&op_0x1b, &&op_0x1c, &&op_0x1d, &&op_0x1e, &&op_0x1f,
+            &&op_0x20, &&op_0x21, &&op_0x22, &&op_0x23, &&op_0x24, &&op_0x25, &&op_0x26, &&op_0x27,
+            &&op_0x28, &&op_0x29, &&op_0x2a, &&op_0x2b, &&op_0x2c, &&op_0x2d, &&op_0x2e, &&op_0x2f,
+            &&op_0x30, &&op_0x31, &&op_0x32, &&op_0x33, &&op_0x34, &&op_0x35, &&op_0x36, &&op_0x37,
+            &&op_0x38, &&op_0x39, &&op_0x3a, &&op_0x3b, &&op_0x3c, &&op_0x3d, &&op_0x3e, &&op_0x3f,
+            &&op_0x40, &&op_0x41, &&op_0x42, &&op_0x43, &&op_0x44, &&op_0x45, &&op_0x46, &&op_0x47,
+            &&op_0x48, &&op_0x49, &&op_0x4a, &&op_0x4b, &&op_0x4c, &&op_0x4d, &&op_0x4e, &&op_0x4f,
+            &&op_0x50, &&op_0x51, &&op_0x52, &&op_0x53, &&op_0x54, &&op_0x55, &&op_0x56, &&op_0x57,
+            &&op_0x58, &&op_0x59, &&op_0x5a, &&op_0x5b, &&op_0x5c, &&op_0x5d, &&op_0x5e, &&op_0x5f,
+            &&op_unhandled, &&op_unhandled, &&op_unhandled, &&op_unhandled, &&op_unhandled, &&op_unhandled, &&op_unhandled, &&op_unhandled,
+            &&op_unhandled, &&op_0x69, &&op_unhandled, &&op_unhandled, &&op_unhandled, &&op_unhandled, &&op_unhandled, &&op_unhandled,
+            &&op_0x70, &&op_0x71, &&op_0x72, &&op_0x73, &&op_0x74, &&op_0x75, &&op_0x76, &&op_0x77,
+            &&op_0x78, &&op_0x79, &&op_0x7a, &&op_0x7b, &&op_0x7c, &&op_0x7d, &&op_0x7e, &&op_0x7f,
+            &&op_0x80, &&op_0x81, &&op_0x82, &&op_0x83, &&op_0x84, &&op_0x85, &&op_0x86, &&op_0x87,
+            &&op_0x88, &&op_0x89, &&op_0x8a, &&op_0x8b, &&op_0x8c, &&op_0x8d, &&op_0x8e, &&op_0x8f,
+            &&op_0x90, &&op_0x91, &&op_0x92, &&op_0x93, &&op_0x94, &&op_0x95, &&op_0x96, &&op_0x97,
+            &&op_0x98, &&op_0x99, &&op_0x9a, &&op_0x9b, &&op_0x9c, &&op_0x9d, &&op_0x9e, &&op_0x9f,
+            &&op_0xa0, &&op_0xa1, &&op_0xa2, &&op_0xa3, &&op_0xa4, &&op_0xa5, &&op_0xa6, &&op_0xa7,
+            &&op_0xa8, &&op_0xa9, &&op_0xaa, &&op_0xab, &&op_0xac, &&op_0xad, &&op_0xae, &&op_0xaf,
+            &&op_0xb0, &&op_0xb1, &&op_0xb2, &&op_0xb3, &&op_0xb4, &&op_0xb5, &&op_0xb6, &&op_0xb7,
+            &&op_0xb8, &&op_0xb9, &&op_0xba, &&op_0xbb, &&op_0xbc, &&op_0xbd, &&op_0xbe, &&op_0xbf,
+            &&op_unhandled, &&op_unhandled, &&op_0xc2, &&op_0xc3, &&op_0xc4, &&op_0xc5, &&op_0xc6, &&op_0xc7,
+            &&op_unhandled, &&op_unhandled, &&op_0xca, &&op_0xcb, &&op_0xcc, &&op_0xcd, &&op_0xce, &&op_0xcf,
+            &&op_0xd0, &&op_0xd1, &&op_0xd2, &&op_0xd3, &&op_0xd4, &&op_0xd5, &&op_0xd6, &&op_0xd7,
+            &&op_0xd8, &&op_0xd9, &&op_0xda, &&op_0xdb, &&op_0xdc, &&op_0xdd, &&op_0xde, &&op_unhandled,
+            &&op_0xe0, &&op_0xe1, &&op_0xe2, &&op_0xe3, &&op_0xe4, &&op_0xe5, &&op_0xe6, &&op_0xe7,
+            &&op_0xe8, &&op_0xe9, &&op_0xea, &&op_0xeb, &&op_0xec, &&op_0xed, &&op_0xee, &&op_0xef,
+            &&op_0xf0, &&op_unhandled, &&op_0xf2, &&op_0xf3, &&op_0xf4, &&op_0xf5, &&op_0xf6, &&op_0xf7,
+            &&op_0xf8, &&op_0xf9, &&op_0xfa, &&op_0xfb, &&op_0xfc, &&op_0xfd, &&op_0xfe, &&op_0xff
+        };
+    #endif
+
+    cycles = 0;
+    g_hostEpoch++;                                         // the host may have written memory since the last call
+    uint64_t limit = maxcycles;                            // less than maxcycles when a profile sample is due first
+    uint64_t sample_at = 0;
+    if ( 0 != g_profileInterval )
+    {
+        sample_at = g_profileCountdown;
+        limit = get_min( maxcycles, sample_at );
+    }
+
+_emulate_more:
+    while ( cycles < limit )                               // 4.8% of runtime
+    {
+        prefix_segment_override = 0xff;                    // .69% of runtime though both are updated at once
+        prefix_repeat_opcode = 0xff;
+
+_prefix_set:
+        if ( 0 != g_State )                                // 1.6% of runtime
+            if ( handle_state() )
+                goto _all_done;
+
+        #ifndef NDEBUG
+            opcode_usage[ _b0 ]++;
+            assert( 0 != cs || 0 != ip );                  // almost certainly an app bug.
+        #endif
+
+        if ( g_blockCache )
+        {
+            if ( !fetch_decoded_instruction() )
+                continue;
+        }
+        else
+            decode_instruction( flat_address8( cs, ip ) ); // 23% of runtime
+
+        if ( g_countInstructions )
+            count_instruction( _b0, _b1 );
+
+        #ifdef I8086_TRACK_CYCLES
+            cycles += i8086_cycles[ _b0 ];                 // 2% of runtime
+        #else
+            cycles += 18; // average for the mips.com benchmark
+        #endif
+
+        // 30% of runtime setting up for use of the jumptables because they are in TEXT and
+        // the LEA instruction has a terrible interaction with L1/L2 instruction cache misses
+        // for each of the lookups (the 1-byte element table with ~251 entries and the 4-byte
+        // element table with ~115 entries).
+        // Update: newer versions of the compiler no longer use lea, but the tables are still
+        // in TEXT even with the /jumptablerdata flag set. It's a frustration, Microsoft.
+        // Threaded dispatch (above) avoids the switch altogether after the first instruction.
+
+        #ifdef I8086_THREADED_DISPATCH
+            goto * op_labels[ _b0 ];
+        #else
+            switch( _b0 )
+        #endif
+        {
+            op_case( 0x00 ): op_case( 0x01 ): op_case( 0x02 ): op_case( 0x03 ): op_case( 0x08 ): op_case( 0x09 ): op_case( 0x0a ): op_case( 0x0b ):  // add, or, adc, sbb, and, sub, xor, cmp
+            op_case( 0x10 ): op_case( 0x11 ): op_case( 0x12 ): op_case( 0x13 ): op_case( 0x18 ): op_case( 0x19 ): op_case( 0x1a ): op_case( 0x1b ): 
+            op_case( 0x20 ): op_case( 0x21 ): op_case( 0x22 ): op_case( 0x23 ): op_case( 0x28 ): op_case( 0x29 ): op_case( 0x2a ): op_case( 0x2b ): 
+            op_case( 0x30 ): op_case( 0x31 ): op_case( 0x32 ): op_case( 0x33 ): op_case( 0x38 ): op_case( 0x39 ): op_case( 0x3a ): op_case( 0x3b ): 
+            {
+                _bc = 2;
+                if ( toreg() )
+                    AddMemCycles( 10 );
+                else
+                    AddCycles( 21 );
+
+                uint8_t math = ( _b0 >> 3 ) & 7;
+                if ( isword() )
                 {
                     uint16_t src;
-                    uint16_t * pdst = get_op_args16( src );
+                    uint16_t * pdst = get_op_args16( src, 7 != math );
                     do_math16( math, pdst, src );
                 }
                 else
                 {
                     uint8_t src;
-                    uint8_t * pdst = get_op_args8( src );
+                    uint8_t * pdst = get_op_args8( src, 7 != math );
                     do_math8( math, pdst, src );
                 }
-                break;
+                op_next;
             }
-            case 0x04: case 0x05: case 0x0c: case 0x0d: case 0x14: case 0x15: case 0x1c: case 0x1d: // add al, immed8. add ax, immed16. etc.
-            case 0x24: case 0x25: case 0x2c: case 0x2d: case 0x34: case 0x35: case 0x3c: case 0x3d:
+            op_case( 0x04 ): op_case( 0x05 ): op_case( 0x0c ): op_case( 0x0d ): op_case( 0x14 ): op_case( 0x15 ): op_case( 0x1c ): op_case( 0x1d ): // add al, immed8. add ax, immed16. etc.
+            op_case( 0x24 ): op_case( 0x25 ): op_case( 0x2c ): op_case( 0x2d ): op_case( 0x34 ): op_case( 0x35 ): op_case( 0x3c ): op_case( 0x3d ):
             {
                 uint8_t math = ( _b0 >> 3 ) & 7;
                 if ( isword() )
@@ -1153,96 +3299,97 @@ _prefix_set:
                     do_math8( math, get_preg8( 0 ), _b1 );
                     _bc++;
                 }
-                break;
+                op_next;
             }
-            case 0x06: { push( es ); break; } // push es
-            case 0x07: { es = pop(); break; } // pop es
-            case 0x0e: { push( cs ); break; } // push cs
-            case 0x16: { push( ss ); break; } // push ss
-            case 0x17: { ss = pop(); break; } // pop ss
-            case 0x1e: { push( ds ); break; } // push ds
-            case 0x1f: { ds = pop(); break; } // pop ds
-            case 0x26: { prefix_segment_override = 0; ip++; goto _prefix_set; } // es segment override
-            case 0x27: { op_daa(); break; } // daa
-            case 0x2e: { prefix_segment_override = 1; ip++; goto _prefix_set; } // cs segment override
-            case 0x2f: { op_das(); break; } // das
-            case 0x36: { prefix_segment_override = 2; ip++; goto _prefix_set; } // ss segment override
-            case 0x37: { op_aaa(); break; } // aaa. ascii adjust after addition
-            case 0x3e: { prefix_segment_override = 3; ip++; goto _prefix_set; } // ds segment override
-            case 0x3f: { op_aas(); break; } // aas. ascii adjust al after subtraction
-            case 0x40: case 0x41: case 0x42: case 0x43: case 0x44: case 0x45: case 0x46: case 0x47: // inc ax..di
+            op_case( 0x06 ): { push( es ); op_next; } // push es
+            op_case( 0x07 ): { es = pop(); op_next; } // pop es
+            op_case( 0x0e ): { push( cs ); op_next; } // push cs
+            op_case( 0x16 ): { push( ss ); op_next; } // push ss
+            op_case( 0x17 ): { ss = pop(); op_next; } // pop ss
+            op_case( 0x1e ): { push( ds ); op_next; } // push ds
+            op_case( 0x1f ): { ds = pop(); op_next; } // pop ds
+            op_case( 0x26 ): { prefix_segment_override = 0; ip++; goto _prefix_set; } // es segment override
+            op_case( 0x27 ): { op_daa(); op_next; } // daa
+            op_case( 0x2e ): { prefix_segment_override = 1; ip++; goto _prefix_set; } // cs segment override
+            op_case( 0x2f ): { op_das(); op_next; } // das
+            op_case( 0x36 ): { prefix_segment_override = 2; ip++; goto _prefix_set; } // ss segment override
+            op_case( 0x37 ): { op_aaa(); op_next; } // aaa. ascii adjust after addition
+            op_case( 0x3e ): { prefix_segment_override = 3; ip++; goto _prefix_set; } // ds segment override
+            op_case( 0x3f ): { op_aas(); op_next; } // aas. ascii adjust al after subtraction
+            op_case( 0x40 ): op_case( 0x41 ): op_case( 0x42 ): op_case( 0x43 ): op_case( 0x44 ): op_case( 0x45 ): op_case( 0x46 ): op_case( 0x47 ): // inc ax..di
             {
                 uint16_t *pval = get_preg16( _b0 & 7 );
                 *pval = op_inc16( *pval );
-                break;
+                op_next;
             }
-            case 0x48: case 0x49: case 0x4a: case 0x4b: case 0x4c: case 0x4d: case 0x4e: case 0x4f: // dec ax..di
+            op_case( 0x48 ): op_case( 0x49 ): op_case( 0x4a ): op_case( 0x4b ): op_case( 0x4c ): op_case( 0x4d ): op_case( 0x4e ): op_case( 0x4f ): // dec ax..di
             {
                 uint16_t *pval = get_preg16( _b0 & 7 );
                 *pval = op_dec16( *pval );
-                break;
+                op_next;
             }
-            case 0x50: case 0x51: case 0x52: case 0x53: case 0x54: case 0x55: case 0x56: case 0x57: // push
-            case 0x58: case 0x59: case 0x5a: case 0x5b: case 0x5c: case 0x5d: case 0x5e: case 0x5f: // pop
+            op_case( 0x50 ): op_case( 0x51 ): op_case( 0x52 ): op_case( 0x53 ): op_case( 0x54 ): op_case( 0x55 ): op_case( 0x56 ): op_case( 0x57 ): // push
+            op_case( 0x58 ): op_case( 0x59 ): op_case( 0x5a ): op_case( 0x5b ): op_case( 0x5c ): op_case( 0x5d ): op_case( 0x5e ): op_case( 0x5f ): // pop
             {
                 uint16_t * preg = get_preg16( _b0 & 7 );
                 if ( _b0 <= 0x57 )
                     push( *preg );
                 else 
                     *preg = pop();
-                break;
+                op_next;
             }
-            case 0x69: // fint FAKE Opcode: i8086_opcode_interrupt. default interrupt routines execute this to get to C++ code
+            op_case( 0x69 ): // fint FAKE Opcode: i8086_opcode_interrupt. default interrupt routines execute this to get to C++ code
             {
                 uint16_t old_ip = ip;
                 uint16_t old_cs = cs;
 
                 i8086_invoke_interrupt( _b1 );
+                g_hostEpoch++;
 
                 // if ip or cs changed, it's likely the interrupt loaded or ended an app via int21 4b execute program or int21 4c exit app
                 // the ip/cs now point to the new app or old parent app.
                 
                  if ( old_ip != ip || old_cs != cs )
-                    continue;
+                    op_jumped;
 
                 _bc++;
-                break;
+                op_next;
             }
-            case 0x70: case 0x71: case 0x72: case 0x73: case 0x74: case 0x75: case 0x76: case 0x77: // jcc
-            case 0x78: case 0x79: case 0x7a: case 0x7b: case 0x7c: case 0x7d: case 0x7e: case 0x7f:
+            op_case( 0x70 ): op_case( 0x71 ): op_case( 0x72 ): op_case( 0x73 ): op_case( 0x74 ): op_case( 0x75 ): op_case( 0x76 ): op_case( 0x77 ): // jcc
+            op_case( 0x78 ): op_case( 0x79 ): op_case( 0x7a ): op_case( 0x7b ): op_case( 0x7c ): op_case( 0x7d ): op_case( 0x7e ): op_case( 0x7f ):
             {
                 bool takejmp;
                 switch( _b0 & 0xf )
-                {                                                                //                   hints:
-                    case 0:  takejmp = fOverflow; break;                         // jo                o = overflow
-                    case 1:  takejmp = !fOverflow; break;                        // jno               n = not
-                    case 2:  takejmp = fCarry; break;                            // jb / jnae / jc    b = below, ae = above or equal, c = carry
-                    case 3:  takejmp = !fCarry; break;                           // jnb / jae / jnc
-                    case 4:  takejmp = fZero; break;                             // je / jz           e = equal, z = zero
-                    case 5:  takejmp = !fZero; break;                            // jne / jnz
-                    case 6:  takejmp = fCarry || fZero; break;                   // jbe / jna         be = below or equal, na = not above
-                    case 7:  takejmp = !fCarry && !fZero; break;                 // jnbe / ja
-                    case 8:  takejmp = fSign; break;                             // js                s = signed
-                    case 9:  takejmp = !fSign; break;                            // jns
-                    case 10: takejmp = fParityEven; break;                       // jp / jpe          p / pe = parity even
-                    case 11: takejmp = !fParityEven; break;                      // jnp / jpo         po = parity odd
-                    case 12: takejmp = ( fSign != fOverflow ); break;            // jl / jnge         l = less than, nge = not greater than or equal
-                    case 13: takejmp = ( fSign == fOverflow ); break;            // jnl / jge
-                    case 14: takejmp = fZero || ( fSign != fOverflow ); break;   // jle / jng         le = less than or equal, ng = not greather than
-                    default: takejmp = !fZero && ( fSign == fOverflow  ); break; // jnle / jg   must be 15, but to work around a bogus compiler warning
+                {                                                                          //                   hints:
+                    case 0:  takejmp = fOverflow; break;                                   // jo                o = overflow
+                    case 1:  takejmp = !fOverflow; break;                                  // jno               n = not
+                    case 2:  takejmp = fCarry; break;                                      // jb / jnae / jc    b = below, ae = above or equal, c = carry
+                    case 3:  takejmp = !fCarry; break;                                     // jnb / jae / jnc
+                    case 4:  takejmp = get_zero(); break;                                  // je / jz           e = equal, z = zero
+                    case 5:  takejmp = !get_zero(); break;                                 // jne / jnz
+                    case 6:  takejmp = fCarry || get_zero(); break;                        // jbe / jna         be = below or equal, na = not above
+                    case 7:  takejmp = !fCarry && !get_zero(); break;                      // jnbe / ja
+                    case 8:  takejmp = get_sign(); break;                                  // js                s = signed
+                    case 9:  takejmp = !get_sign(); break;                                 // jns
+                    case 10: takejmp = get_parity_even(); break;                           // jp / jpe          p / pe = parity even
+                    case 11: takejmp = !get_parity_even(); break;                          // jnp / jpo         po = parity odd
+                    case 12: takejmp = ( get_sign() != fOverflow ); break;                 // jl / jnge         l = less than, nge = not greater than or equal
+                    case 13: takejmp = ( get_sign() == fOverflow ); break;                 // jnl / jge
+                    case 14: takejmp = get_zero() || ( get_sign() != fOverflow ); break;   // jle / jng         le = less than or equal, ng = not greather than
+                    default: takejmp = !get_zero() && ( get_sign() == fOverflow  ); break; // jnle / jg   must be 15, but to work around a bogus compiler warning
                 }
     
                 if ( takejmp )
                 {
                     ip += ( 2 + (int) (int8_t) _b1 );
                     AddCycles( 12 );
-                    continue;
+                    op_jumped;
                 }
 
                 _bc = 2;
-                break;
+                op_next;
             }
-            case 0x80: case 0x81: case 0x82: case 0x83: // math: reg8/mem8, imm8; reg16/mem16, imm16; reg16/mem16, imm8
+            op_case( 0x80 ): op_case( 0x81 ): op_case( 0x82 ): op_case( 0x83 ): // math: reg8/mem8, imm8; reg16/mem16, imm16; reg16/mem16, imm8
             {
                 uint8_t math = _reg; // the _reg field is the math operator, not a register
                 _bc = 3;
@@ -1273,390 +3420,384 @@ _prefix_set:
                         rhs = * (uint16_t *) ( _pcode + imm_offset );
                     }
         
-                    do_math16( math, get_rm_ptr16(), rhs );
+                    do_math16( math, ( 7 == math ) ? get_rm_ptr16() : get_rm_store_ptr16(), rhs );
                 }
                 else
                 {
                     uint8_t rhs = _pcode[ imm_offset ];
-                    do_math8( math, get_rm_ptr8(), rhs );
+                    do_math8( math, ( 7 == math ) ? get_rm_ptr8() : get_rm_store_ptr8(), rhs );
                 }
-                break;
+                op_next;
             }
-            case 0x84: // test reg8/mem8, reg8
+            op_case( 0x84 ): // test reg8/mem8, reg8
             {
                 _bc++;
                 AddMemCycles( 8 );
                 uint8_t src;
-                uint8_t * pleft = get_op_args8( src );
+                uint8_t * pleft = get_op_args8( src, false );
                 op_and8( *pleft, src );
-                break;
+                op_next;
             }
-            case 0x85: // test reg16/mem16, reg16
+            op_case( 0x85 ): // test reg16/mem16, reg16
             {
                 _bc++;
                 AddMemCycles( 8 );
                 uint16_t src;
-                uint16_t * pleft = get_op_args16( src );
+                uint16_t * pleft = get_op_args16( src, false );
                 op_and16( *pleft, src );
-                break;
+                op_next;
             }
-            case 0x86: // xchg reg8, reg8/mem8
+            op_case( 0x86 ): // xchg reg8, reg8/mem8
             {
                 AddMemCycles( 21 );
-                swap( * get_preg8( _reg ), * get_rm_ptr8() );
+                swap( * get_preg8( _reg ), * get_rm_store_ptr8() );
                 _bc++;
-                break;
+                op_next;
             }
-            case 0x87: // xchg reg16, reg16/mem16
+            op_case( 0x87 ): // xchg reg16, reg16/mem16
             {
                 AddMemCycles( 21 );
-                swap( * get_preg16( _reg ), * get_rm_ptr16() );
+                swap( * get_preg16( _reg ), * get_rm_store_ptr16() );
                 _bc++;
-                break;
+                op_next;
             }
-            case 0x88: // mov reg8/mem8, reg8
+            op_case( 0x88 ): // mov reg8/mem8, reg8
             {
                 _bc++;
                 AddMemCycles( 11 ); // 10/11/12 possible
                 uint8_t src;
-                uint8_t * pdst = get_op_args8( src );
+                uint8_t * pdst = get_op_args8( src, true );
                 * pdst = src;
-                break;
+                op_next;
             }
-            case 0x89: // mov reg16/mem16, reg16
+            op_case( 0x89 ): // mov reg16/mem16, reg16
             {
                 _bc++;
                 AddMemCycles( 11 ); // 10/11/12 possible
                 uint16_t src;
-                uint16_t * pdst = get_op_args16( src );
+                uint16_t * pdst = get_op_args16( src, true );
                 * pdst = src;
-                break;
+                op_next;
             }
-            case 0x8a: // mov reg8, r/m8
+            op_case( 0x8a ): // mov reg8, r/m8
             {
                 _bc++;
                 AddMemCycles( 11 ); // 10/11/12 possible
                 * get_preg8( _reg ) = * get_rm_ptr8();
-                break;
+                op_next;
             }
-            case 0x8b: // mov reg16, r/m16
+            op_case( 0x8b ): // mov reg16, r/m16
             {
                 _bc++;
                 AddMemCycles( 11 ); // 10/11/12 possible
                 * get_preg16( _reg ) = * get_rm_ptr16();
-                break;
+                op_next;
             } 
-            case 0x8c: // mov reg16/m16, sreg
+            op_case( 0x8c ): // mov reg16/m16, sreg
             {
                 _bc++;
                 AddMemCycles( 11 ); // 10/11/12 possible
-                * get_rm_ptr16() = * seg_reg( _reg ); // 0x8c is even, but it's a word instruction not byte
-                break;
+                * get_rm_store_ptr16() = * seg_reg( _reg ); // 0x8c is even, but it's a word instruction not byte
+                op_next;
             }
-            case 0x8d: { _bc++; * get_preg16( _reg ) = get_rm_ea(); break; } // lea reg16, mem16
-            case 0x8e: // mov sreg, reg16/mem16
+            op_case( 0x8d ): { _bc++; * get_preg16( _reg ) = get_rm_ea(); op_next; } // lea reg16, mem16
+            op_case( 0x8e ): // mov sreg, reg16/mem16
             {
                 _bc++;
                 AddMemCycles( 11 ); // 10/11/12 possible
                 * seg_reg( _reg ) = * get_rm_ptr16();
-                break;
+                op_next;
             }
-            case 0x8f: // pop reg16/mem16
+            op_case( 0x8f ): // pop reg16/mem16
             {
                 AddMemCycles( 14 );
-                * get_rm_ptr16() = pop();
+                * get_rm_store_ptr16() = pop();
                 _bc++;
-                break;
+                op_next;
             }
-            case 0x90: case 0x91: case 0x92: case 0x93: case 0x94: case 0x95: case 0x96: case 0x97: // nop + xchg ax, cx/dx/bx/sp/bp/si/di
+            op_case( 0x90 ): op_case( 0x91 ): op_case( 0x92 ): op_case( 0x93 ): op_case( 0x94 ): op_case( 0x95 ): op_case( 0x96 ): op_case( 0x97 ): // nop + xchg ax, cx/dx/bx/sp/bp/si/di
             {
                 swap( ax, * get_preg16( _b0 & 7 ) );
-                break;
+                op_next;
             }
-            case 0x98: { set_ah( ( al() & 0x80 ) ? 0xff : 0 ); break; } // cbw -- covert byte in al to word in ax. sign extend
-            case 0x99: { dx = ( ax & 0x8000 ) ? 0xffff : 0; break; } // cwd -- convert word in ax to to double-word in dx:ax. sign extend
-            case 0x9a: // call far proc
+            op_case( 0x98 ): { set_ah( ( al() & 0x80 ) ? 0xff : 0 ); op_next; } // cbw -- covert byte in al to word in ax. sign extend
+            op_case( 0x99 ): { dx = ( ax & 0x8000 ) ? 0xffff : 0; op_next; } // cwd -- convert word in ax to to double-word in dx:ax. sign extend
+            op_case( 0x9a ): // call far proc
             {
                 push( cs );
                 push( ip + 5 );
                 ip = b12();
                 cs = b34();
-                continue;
+                op_jumped;
             }
-            case 0x9b: break; // wait for pending floating point exceptions
-            case 0x9c: { materializeFlags(); push( flags ); break; } // pushf
-            case 0x9d: { flags = pop(); unmaterializeFlags(); break; } // popf
-            case 0x9e: { op_sahf(); break; } // sahf -- stores a subset of flags from ah
-            case 0x9f: { op_lahf(); break; } // lahf -- loads a subset of flags to ah
-            case 0xa0: // mov al, mem8
+            op_case( 0x9b ): op_next; // wait for pending floating point exceptions
+            op_case( 0x9c ): { materializeFlags(); push( flags ); op_next; } // pushf
+            op_case( 0x9d ): { flags = pop(); unmaterializeFlags(); op_next; } // popf
+            op_case( 0x9e ): { op_sahf(); op_next; } // sahf -- stores a subset of flags from ah
+            op_case( 0x9f ): { op_lahf(); op_next; } // lahf -- loads a subset of flags to ah
+            op_case( 0xa0 ): // mov al, mem8
             {
                 set_al( * flat_address8( get_seg_value(), b12() ) );
                 _bc += 2;
-                break;
+                op_next;
             }
-            case 0xa1: // mov ax, mem16
+            op_case( 0xa1 ): // mov ax, mem16
             {
                 ax = * flat_address16( get_seg_value(), b12() );
                 _bc += 2;
-                break;
+                op_next;
             }
-            case 0xa2: // mov mem8, al
+            op_case( 0xa2 ): // mov mem8, al
             {
-                * flat_address8( get_seg_value(), b12() ) = al();
+                * (uint8_t *) track_store( flat_address( get_seg_value(), b12() ), 1 ) = al();
                 _bc += 2;
-                break;
+                op_next;
             }
-            case 0xa3: // mov mem16, ax
+            op_case( 0xa3 ): // mov mem16, ax
             {
-                * flat_address16( get_seg_value(), b12() ) = ax;
+                * (uint16_t *) track_store( flat_address( get_seg_value(), b12() ), 2 ) = ax;
                 _bc += 2;
-                break;
+                op_next;
             }
-            case 0xa4: // movs dst-str8, src-str8.  movsb
+            op_case( 0xa4 ): // movs dst-str8, src-str8.  movsb
             {
                 if ( 0xff != prefix_repeat_opcode ) // f3 is legal, but f2 is used here in ms-dos link.exe v2.0
                 {
-                    while ( 0 != cx )
-                    {
-                        AddCycles( 17 );
-                        op_movs8();
-                        cx--;
-                    }
+                    if ( !rep_movs( 1 ) )
+                        while ( 0 != cx )
+                        {
+                            AddCycles( 17 );
+                            op_movs8();
+                            cx--;
+                        }
                 }
                 else
                     op_movs8();
-                break;
+                op_next;
             }
-            case 0xa5: // movs dest-str16, src-str16.  movsw
+            op_case( 0xa5 ): // movs dest-str16, src-str16.  movsw
             {
                 if ( 0xff != prefix_repeat_opcode ) // f3 is legal, but f2 is used here in ms-dos link.exe v2.0
                 {
-                    while ( 0 != cx )
-                    {
-                        AddCycles( 17 );
-                        op_movs16();
-                        cx--;
-                    }
+                    if ( !rep_movs( 2 ) )
+                        while ( 0 != cx )
+                        {
+                            AddCycles( 17 );
+                            op_movs16();
+                            cx--;
+                        }
                 }
                 else
                     op_movs16();
-                break;
+                op_next;
             }
-            case 0xa6: // cmps m8, m8. cmpsb
+            op_case( 0xa6 ): // cmps m8, m8. cmpsb
             {
                 if ( 0xff != prefix_repeat_opcode )
                 {
-                    while ( 0 != cx )
-                    {
-                        AddCycles( 30 );
-                        op_cmps8();
-                        cx--;
-                        if ( (  fZero && ( 0xf2 == prefix_repeat_opcode ) ) ||
-                             ( !fZero && ( 0xf3 == prefix_repeat_opcode ) ) )
-                            break;
-                    }
+                    if ( !rep_cmps( 1 ) )
+                        while ( 0 != cx )
+                        {
+                            AddCycles( 30 );
+                            op_cmps8();
+                            cx--;
+                            if ( (  get_zero() && ( 0xf2 == prefix_repeat_opcode ) ) ||
+                                 ( !get_zero() && ( 0xf3 == prefix_repeat_opcode ) ) )
+                                break;
+                        }
                 }
                 else
                     op_cmps8();
-                break;
+                op_next;
             }
-            case 0xa7: // cmps dest-str16, src-str16. cmpsw
+            op_case( 0xa7 ): // cmps dest-str16, src-str16. cmpsw
             {
                 if ( 0xff != prefix_repeat_opcode )
                 {
-                    while ( 0 != cx )
-                    {
-                        AddCycles( 30 );
-                        op_cmps16();
-                        cx--;
-                        if ( (  fZero && ( 0xf2 == prefix_repeat_opcode ) ) ||
-                             ( !fZero && ( 0xf3 == prefix_repeat_opcode ) ) )
-                            break;
-                    }
+                    if ( !rep_cmps( 2 ) )
+                        while ( 0 != cx )
+                        {
+                            AddCycles( 30 );
+                            op_cmps16();
+                            cx--;
+                            if ( (  get_zero() && ( 0xf2 == prefix_repeat_opcode ) ) ||
+                                 ( !get_zero() && ( 0xf3 == prefix_repeat_opcode ) ) )
+                                break;
+                        }
                 }
                 else
                     op_cmps16();
-                break;
+                op_next;
             }
-            case 0xa8: { _bc++; op_and8( al(), _b1 ); break; } // test al, immed8
-            case 0xa9: // test ax, immed16
+            op_case( 0xa8 ): { _bc++; op_and8( al(), _b1 ); op_next; } // test al, immed8
+            op_case( 0xa9 ): // test ax, immed16
             {
                 _bc += 2;
                 op_and16( ax, b12() );
-                break;
+                op_next;
             }
-            case 0xaa: // stos8 -- fill bytes with al. stosb
+            op_case( 0xaa ): // stos8 -- fill bytes with al. stosb
             {
                 if ( 0xff != prefix_repeat_opcode ) // f3 is legal, but f2 is used here in ms-dos link.exe v2.0
                 {
-                    while ( 0 != cx )
-                    {
-                        AddCycles( 10 );
-                        op_sto8();
-                        cx--;
-                    }
+                    if ( !rep_stos( 1 ) )
+                        while ( 0 != cx )
+                        {
+                            AddCycles( 10 );
+                            op_sto8();
+                            cx--;
+                        }
                 }
                 else
                     op_sto8();
-                break;
+                op_next;
             }
-            case 0xab: // stos16 -- fill words with ax. stosw
+            op_case( 0xab ): // stos16 -- fill words with ax. stosw
             {
                 if ( 0xff != prefix_repeat_opcode ) // f3 is legal, but f2 is used here in ms-dos link.exe v2.0
                 {
-                    while ( 0 != cx )
-                    {
-                        AddCycles( 14 );
-                        op_sto16();
-                        cx--;
-                    }
+                    if ( !rep_stos( 2 ) )
+                        while ( 0 != cx )
+                        {
+                            AddCycles( 14 );
+                            op_sto16();
+                            cx--;
+                        }
                 }
                 else
                     op_sto16();
-                break;
+                op_next;
             }
-            case 0xac: // lods8 src-str8. lodsb
+            op_case( 0xac ): // lods8 src-str8. lodsb
             {
                 if ( 0xff != prefix_repeat_opcode ) // f3 is odd but supported. f2 here is illegal but used
-                {
-                    while ( 0 != cx )
-                    {
-                        AddCycles( 10 ); // a guess
-                        op_lods8();
-                        cx--;
-                    }
-                }
+                    rep_lods( 1 );
                 else
                     op_lods8();
-                break;
+                op_next;
             }
-            case 0xad: // lods16 src-str16. lodsw
+            op_case( 0xad ): // lods16 src-str16. lodsw
             {
                 if ( 0xff != prefix_repeat_opcode ) // f3 is odd but supported. f2 here is illegal but used
-                {
-                    while ( 0 != cx )
-                    {
-                        AddCycles( 10 ); // a guess
-                        op_lods16();
-                        cx--;
-                    }
-                }
+                    rep_lods( 2 );
                 else
                     op_lods16();
-                break;
+                op_next;
             }
-            case 0xae: // scas8 compare al with byte at es:di. scasb
+            op_case( 0xae ): // scas8 compare al with byte at es:di. scasb
             {
                 if ( 0xff != prefix_repeat_opcode )
                 {
-                    while ( 0 != cx )
-                    {
-                        AddCycles( 15 ); // a guess
-                        op_scas8();
-                        cx--;
-                        if ( (  fZero && ( 0xf2 == prefix_repeat_opcode ) ) ||
-                             ( !fZero && ( 0xf3 == prefix_repeat_opcode ) ) )
-                            break;
-                    }
+                    if ( !rep_scas( 1 ) )
+                        while ( 0 != cx )
+                        {
+                            AddCycles( 15 ); // a guess
+                            op_scas8();
+                            cx--;
+                            if ( (  get_zero() && ( 0xf2 == prefix_repeat_opcode ) ) ||
+                                 ( !get_zero() && ( 0xf3 == prefix_repeat_opcode ) ) )
+                                break;
+                        }
                 }
                 else
                     op_scas8();
-                break;
+                op_next;
             }
-            case 0xaf: // scas16 compare ax with word at es:di. scasw
+            op_case( 0xaf ): // scas16 compare ax with word at es:di. scasw
             {
                 if ( 0xff != prefix_repeat_opcode )
                 {
-                    while ( 0 != cx )
-                    {
-                        AddCycles( 19 ); // a guess
-                        op_scas16();
-                        cx--;
-                        if ( (  fZero && ( 0xf2 == prefix_repeat_opcode ) ) ||
-                             ( !fZero && ( 0xf3 == prefix_repeat_opcode ) ) )
-                            break;
-                    }
+                    if ( !rep_scas( 2 ) )
+                        while ( 0 != cx )
+                        {
+                            AddCycles( 19 ); // a guess
+                            op_scas16();
+                            cx--;
+                            if ( (  get_zero() && ( 0xf2 == prefix_repeat_opcode ) ) ||
+                                 ( !get_zero() && ( 0xf3 == prefix_repeat_opcode ) ) )
+                                break;
+                        }
                 }
                 else
                     op_scas16();
-                break;
+                op_next;
             }
-            case 0xb0: case 0xb1: case 0xb2: case 0xb3: case 0xb4: case 0xb5: case 0xb6: case 0xb7: // mov r8, immed
+            op_case( 0xb0 ): op_case( 0xb1 ): op_case( 0xb2 ): op_case( 0xb3 ): op_case( 0xb4 ): op_case( 0xb5 ): op_case( 0xb6 ): op_case( 0xb7 ): // mov r8, immed
             {
                 * get_preg8( _b0 & 7 ) = _b1;
                 _bc = 2;
-                break;
+                op_next;
             }
-            case 0xb8: case 0xb9: case 0xba: case 0xbb: case 0xbc: case 0xbd: case 0xbe: case 0xbf: // mov r16, immed
+            op_case( 0xb8 ): op_case( 0xb9 ): op_case( 0xba ): op_case( 0xbb ): op_case( 0xbc ): op_case( 0xbd ): op_case( 0xbe ): op_case( 0xbf ): // mov r16, immed
             {
                 * get_preg16( _b0 & 7 ) = b12();
                 _bc = 3;
-                break;
+                op_next;
             }
-            case 0xc2: { ip = pop(); sp += b12(); continue; } // ret immed16 intrasegment
-            case 0xc3: { ip = pop(); continue; } // ret intrasegment
-            case 0xc4: // les reg16, [mem16]
+            op_case( 0xc2 ): { ip = pop(); sp += b12(); op_jumped; } // ret immed16 intrasegment
+            op_case( 0xc3 ): { ip = pop(); op_jumped; } // ret intrasegment
+            op_case( 0xc4 ): // les reg16, [mem16]
             {
                 _bc++;
                 uint16_t * preg = get_preg16( _reg );
                 uint16_t * pvalue = get_rm_ptr16();
                 *preg = pvalue[ 0 ];
                 es = pvalue[ 1 ];
-                break;
+                op_next;
             }
-            case 0xc5: // lds reg16, [mem16]
+            op_case( 0xc5 ): // lds reg16, [mem16]
             {
                 _bc++;
                 uint16_t * preg = get_preg16( _reg );
                 uint16_t * pvalue = get_rm_ptr16();
                 *preg = pvalue[ 0 ];
                 ds = pvalue[ 1 ];
-                break;
+                op_next;
             }
-            case 0xc6: // mov mem8, immed8
+            op_case( 0xc6 ): // mov mem8, immed8
             {
                 if ( 0 != _reg )
                     unhandled_instruction();
                 _bc++;
-                uint8_t * pdst = get_rm_ptr8();
+                uint8_t * pdst = get_rm_store_ptr8();
                 *pdst = _pcode[ _bc ];
                 _bc++;
-                break;
+                op_next;
             }
-            case 0xc7: // mov mem16, immed16
+            op_case( 0xc7 ): // mov mem16, immed16
             {
                 if ( 0 != _reg )
                     unhandled_instruction();
                 _bc++;
-                uint16_t * pdst = get_rm_ptr16();
+                uint16_t * pdst = get_rm_store_ptr16();
                 *pdst = * (uint16_t *) & _pcode[ _bc ];
                 _bc += 2;
-                break;
+                op_next;
             }
-            case 0xca: { ip = pop(); cs = pop(); sp += b12(); continue; } // retf immed16
-            case 0xcb: { ip = pop(); cs = pop(); continue; } // retf
-            case 0xcc:  // int3
+            op_case( 0xca ): { ip = pop(); cs = pop(); sp += b12(); op_jumped; } // retf immed16
+            op_case( 0xcb ): { ip = pop(); cs = pop(); op_jumped; } // retf
+            op_case( 0xcc ):  // int3
             {
                 op_interrupt( 3, 1 );
                 fIgnoreTrap = true; // don't trap after an int3
-                continue;
+                op_jumped;
             }
-            case 0xcd: // int
+            op_case( 0xcd ): // int
             {
                 op_interrupt( _b1, 2 );
-                continue;
+                op_jumped;
             }
-            case 0xce: // into
+            op_case( 0xce ): // into
             {
                 if ( fOverflow )
                 {
                     AddCycles( 69 );
                     op_interrupt( 4, 1 ); // overflow
-                    continue;
+                    op_jumped;
                 }
-                break;
+                op_next;
             }
-            case 0xcf: // iret
+            op_case( 0xcf ): // iret
             {
                 bool previousTrap = fTrap;
                 ip = pop();
@@ -1672,45 +3813,45 @@ _prefix_set:
                     if ( !previousTrap )
                         fIgnoreTrap = true;
                 }
-                continue;
+                op_jumped;
             }
-            case 0xd0: // bit shift reg8/mem8, 1
+            op_case( 0xd0 ): // bit shift reg8/mem8, 1
             {
                 _bc++;
                 AddMemCycles( 13 );
-                uint8_t *pval = get_rm_ptr8();
+                uint8_t *pval = get_rm_store_ptr8();
                 op_rotate8( pval, _reg, 1 );
-                break;
+                op_next;
             }
-            case 0xd1: // bit shift reg16/mem16, 1
+            op_case( 0xd1 ): // bit shift reg16/mem16, 1
             {
                 _bc++;
                 AddMemCycles( 13 );
-                uint16_t *pval = get_rm_ptr16();
+                uint16_t *pval = get_rm_store_ptr16();
                 op_rotate16( pval, _reg, 1 );
-                break;
+                op_next;
             }
-            case 0xd2: // bit shift reg8/mem8, cl
+            op_case( 0xd2 ): // bit shift reg8/mem8, cl
             {
                 _bc++;
                 AddMemCycles( 12 );
-                uint8_t *pval = get_rm_ptr8();
+                uint8_t *pval = get_rm_store_ptr8();
                 uint8_t amount = cl() & 0x1f;
                 AddCycles( 4 * amount );
                 op_rotate8( pval, _reg, amount );
-                break;
+                op_next;
             }
-            case 0xd3: // bit shift reg16/mem16, cl
+            op_case( 0xd3 ): // bit shift reg16/mem16, cl
             {
                 _bc++;
                 AddMemCycles( 12 );
-                uint16_t *pval = get_rm_ptr16();
+                uint16_t *pval = get_rm_store_ptr16();
                 uint8_t amount = cl() & 0x1f;
                 AddCycles( 4 * amount );
                 op_rotate16( pval, _reg, amount );
-                break;
+                op_next;
             }
-            case 0xd4: // aam
+            op_case( 0xd4 ): // aam
             {
                 _bc++;
                 if ( 0 != _b1 )
@@ -1723,147 +3864,159 @@ _prefix_set:
                 else
                 {
                     op_interrupt( 0, _bc );
-                    continue;
+                    op_jumped;
                 }
-                break;
+                op_next;
             }
-            case 0xd5: // aad
+            op_case( 0xd5 ): // aad
             {
                 set_al( ( al() + ( ah() * _b1 ) ) & 0xff );
                 set_ah( 0 );
                 _bc++;
-                break;
+                op_next;
             }
-            case 0xd6: { set_al( fCarry ? 0xff : 0 ); break; } // salc (undocumented. IP protection scheme?)
-            case 0xd7: // xlat
+            op_case( 0xd6 ): { set_al( fCarry ? 0xff : 0 ); op_next; } // salc (undocumented. IP protection scheme?)
+            op_case( 0xd7 ): // xlat
             {
                 uint8_t * ptable = flat_address8( get_seg_value(), bx );
                 set_al( ptable[ al() ] );
-                break;
+                op_next;
             }
-            case 0xd8: case 0xd9: case 0xda: case 0xdb: case 0xdc: case 0xdd: case 0xde:  // esc (8087 instructions)
+            op_case( 0xd8 ): op_case( 0xd9 ): op_case( 0xda ): op_case( 0xdb ): op_case( 0xdc ): op_case( 0xdd ): op_case( 0xde ):  // esc (8087 instructions)
             {
                 _bc++;
                 if ( isword() )
                     get_rm_ptr16();
                 else
                     get_rm_ptr8();
-                break;
+                op_next;
             }
-            case 0xe0: // loopne/loopnz short-label
+            op_case( 0xe0 ): // loopne/loopnz short-label
             {
                 cx--;
-                if ( 0 != cx && !fZero )
+                if ( 0 != cx && !get_zero() )
                 {
                     AddCycles( 14 );
                     ip += ( 2 + (int16_t) (int8_t) _b1 );
-                    continue;
+                    op_jumped;
                 }
                 _bc++;
-                break;
+                op_next;
             }
-            case 0xe1: // loope/loopz short-label
+            op_case( 0xe1 ): // loope/loopz short-label
             {
                 cx--;
-                if ( 0 != cx && fZero )
+                if ( 0 != cx && get_zero() )
                 {
                     AddCycles( 12 );
                     ip += ( 2 + (int16_t) (int8_t) _b1 );
-                    continue;
+                    op_jumped;
                 }
                 _bc++;
-                break;
+                op_next;
             }
-            case 0xe2: // loop short-label
+            op_case( 0xe2 ): // loop short-label
             {
                 cx--;
                 if ( 0 != cx )
                 {
                     AddCycles( 12 );
                     ip += ( 2 + (int16_t) (int8_t) _b1 );
-                    continue;
+                    op_jumped;
                 }
                 _bc++;
-                break;
+                op_next;
             }
-            case 0xe3: // jcxz rel8  jump if cx is 0
+            op_case( 0xe3 ): // jcxz rel8  jump if cx is 0
             {
                 if ( 0 == cx )
                 {
                     AddCycles( 12 );
                     ip += ( 2 + (int16_t) (int8_t) _b1 );
-                    continue;
+                    op_jumped;
                 }
                 _bc++;
-                break;
+                op_next;
             }
-            case 0xe4: { set_al( i8086_invoke_in_byte( _b1 ) ); _bc++; break; } // in al, immed8
-            case 0xe5: { ax = i8086_invoke_in_word( _b1 ); _bc++; break; } // in ax, immed8
-            case 0xe6: { i8086_invoke_out_byte( _b1, al() ); _bc++; break; } // out al, immed8
-            case 0xe7: { i8086_invoke_out_word( _b1, ax ); _bc++; break; } // out ax, immed8
-            case 0xe8: // call rel16
+            op_case( 0xe4 ): { set_al( i8086_invoke_in_byte( _b1 ) ); _bc++; op_next; } // in al, immed8
+            op_case( 0xe5 ): { ax = i8086_invoke_in_word( _b1 ); _bc++; op_next; } // in ax, immed8
+            op_case( 0xe6 ): { i8086_invoke_out_byte( _b1, al() ); _bc++; op_next; } // out al, immed8
+            op_case( 0xe7 ): { i8086_invoke_out_word( _b1, ax ); _bc++; op_next; } // out ax, immed8
+            op_case( 0xe8 ): // call rel16
             {
                 uint16_t return_address = ip + 3;
                 push( return_address );
                 ip = return_address + b12();
-                continue;
+                op_jumped;
             }
-            case 0xe9: { ip += ( 3 + (int16_t) b12() ); continue; } // jmp near
-            case 0xea: { ip = b12(); cs = b34(); continue; } // jmp far
-            case 0xeb: { ip += ( 2 + (int16_t) (int8_t) _b1 ); continue; } // jmp short i8
-            case 0xec: { set_al( i8086_invoke_in_byte( dx ) ); break; } // in al, dx
-            case 0xed: { ax = i8086_invoke_in_word( dx ); break; } // in ax, dx
-            case 0xee: { break; } // out al, dx
-            case 0xef: { break; } // out ax, dx
-            case 0xf0: { break; } // lock prefix. ignore since interrupts won't happen
-            case 0xf2: // repne/repnz -- fall through to the f3 code
-            case 0xf3: { prefix_repeat_opcode = _b0; ip++; goto _prefix_set; } // rep/repe/repz
-            case 0xf4: { i8086_invoke_halt(); goto _all_done; } // hlt
-            case 0xf5: { fCarry = !fCarry; break; } //cmc
-            case 0xf6: // test/UNUSED/not/neg/mul/imul/div/idiv r/m8
+            op_case( 0xe9 ): { ip += ( 3 + (int16_t) b12() ); op_jumped; } // jmp near
+            op_case( 0xea ): { ip = b12(); cs = b34(); op_jumped; } // jmp far
+            op_case( 0xeb ): { ip += ( 2 + (int16_t) (int8_t) _b1 ); op_jumped; } // jmp short i8
+            op_case( 0xec ): { set_al( i8086_invoke_in_byte( dx ) ); op_next; } // in al, dx
+            op_case( 0xed ): { ax = i8086_invoke_in_word( dx ); op_next; } // in ax, dx
+            op_case( 0xee ): { op_next; } // out al, dx
+            op_case( 0xef ): { op_next; } // out ax, dx
+            op_case( 0xf0 ): { op_next; } // lock prefix. ignore since interrupts won't happen
+            op_case( 0xf2 ): // repne/repnz -- fall through to the f3 code
+            op_case( 0xf3 ): { prefix_repeat_opcode = _b0; ip++; goto _prefix_set; } // rep/repe/repz
+            op_case( 0xf4 ): { i8086_invoke_halt(); goto _all_done; } // hlt
+            op_case( 0xf5 ): { fCarry = !fCarry; op_next; } //cmc
+            op_case( 0xf6 ): // test/UNUSED/not/neg/mul/imul/div/idiv r/m8
             {
                 if ( op_f6() )
                 {
                     op_interrupt( 0, _bc ); // divide by 0
-                    continue;
+                    op_jumped;
                 }
-                break;
+                op_next;
             }
-            case 0xf7: // test/UNUSED/not/neg/mul/imul/div/idiv r/m16
+            op_case( 0xf7 ): // test/UNUSED/not/neg/mul/imul/div/idiv r/m16
             {
                 if ( op_f7() )
                 {
                     op_interrupt( 0, _bc ); // divide by 0
-                    continue;
+                    op_jumped;
                 }
-                break;
+                op_next;
             }
-            case 0xf8: { fCarry = false; break; } // clc
-            case 0xf9: { fCarry = true; break; } // stc
-            case 0xfa: { fInterrupt = false; break; } // cli
-            case 0xfb: { fInterrupt = true; break; } // sti
-            case 0xfc: { fDirection = false; break; } // cld
-            case 0xfd: { fDirection = true; break; } // std
-            case 0xfe: // inc/dec reg8/mem8
+            op_case( 0xf8 ): { fCarry = false; op_next; } // clc
+            op_case( 0xf9 ): { fCarry = true; op_next; } // stc
+            op_case( 0xfa ): { fInterrupt = false; op_next; } // cli
+            op_case( 0xfb ): { fInterrupt = true; op_next; } // sti
+            op_case( 0xfc ): { fDirection = false; op_next; } // cld
+            op_case( 0xfd ): { fDirection = true; op_next; } // std
+            op_case( 0xfe ): // inc/dec reg8/mem8
             {
                 _bc++;
                 AddMemCycles( 12 );
-                uint8_t * pdst = get_rm_ptr8();
+                uint8_t * pdst = get_rm_store_ptr8();
 
                 if ( 0 == _reg ) // inc
                     *pdst = op_inc8( *pdst );
                 else
                     *pdst = op_dec8( *pdst );
-                break;
+                op_next;
             }
-            case 0xff: { if ( op_ff() ) continue; break; } // many
-            default:
+            op_case( 0xff ): { if ( op_ff() ) op_jumped; op_next; } // many
+            op_default:
                 unhandled_instruction();
         } //switch
   
         ip += _bc;                                         // 8.7% of runtime (includes while check above)
     } //while
 
+    if ( ( 0 != g_profileInterval ) && ( cycles >= sample_at ) )
+    {
+        i8086_invoke_profile_sample( cs, ip );
+        sample_at = cycles + g_profileInterval;
+        limit = get_min( maxcycles, sample_at );
+        if ( cycles < maxcycles )
+            goto _emulate_more;
+    }
+
 _all_done:
+    if ( 0 != g_profileInterval )
+        g_profileCountdown = ( sample_at > cycles ) ? ( sample_at - cycles ) : 1;
+
     return cycles;
 } //emulate
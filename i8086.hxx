@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdio.h>
 #include <bitset>
 using namespace std;
 
@@ -8,6 +9,32 @@ const uint8_t i8086_opcode_interrupt = 0x69;
 
 extern uint8_t memory[ 0x10fff0 ];
 
+// One byte per byte of the 1MB address space saying why a store there needs attention. see track_store()
+
+const uint8_t i8086_watch_code = 1;   // the block cache holds instructions decoded from this byte or the next
+const uint8_t i8086_watch_video = 2;  // CGA memory, 0xb8000..0xbffff
+const uint8_t i8086_watch_trace = 4;  // every byte while trace_binary() is recording stores
+extern uint8_t i8086_store_watch[ 0x100000 ];
+
+struct i8086_block; // a basic block of pre-decoded instructions. see the block cache in i8086.cxx
+
+// registers and flags saved while another machine is using the emulator. see DosMachine in ntvdm.cxx
+
+struct i8086_registers
+{
+    uint16_t ax, bx, cx, dx, si, di, bp, sp, ip;
+    uint16_t es, cs, ss, ds;
+    uint16_t flags;
+};
+
+// instruction counts kept while counters are enabled. see enable_counters()
+
+struct i8086_counters
+{
+    uint64_t opcodes[ 256 ];  // by first byte. prefixes are counted as opcodes of their own
+    uint64_t modrm[ 256 ];    // by mod reg r/m byte, for opcodes that have one
+};
+
 // tracking cycles slows execution by >6%
 
 #define I8086_TRACK_CYCLES
@@ -61,12 +88,12 @@ struct i8086
     void set_ds( uint16_t val ) { ds = val; }
 
     void set_carry( bool f ) { fCarry = f; }
-    void set_zero( bool f ) { fZero = f; }
+    void set_zero( bool f ) { set_PSZ( get_parity_even(), get_sign(), f ); }
     void set_trap( bool f ) { fTrap = f; }
     void set_interrupt( bool f ) { fInterrupt = f; }
 
     bool get_carry() { return fCarry; }
-    bool get_zero() { return fZero; }
+    bool get_zero() { return ( 0 == ( lazy_psz & 0xffff ) ); }
     bool get_trap() { return fTrap; }
     bool get_interrupt() { return fInterrupt; }
 
@@ -78,6 +105,19 @@ struct i8086
     void trace_instructions( bool trace );              // enable/disable tracing each instruction
     void trace_state( void );                           // trace the registers
     void end_emulation( void );                         // make the emulator return at the start of the next instruction
+    void enable_block_cache( bool enable );             // decode straight-line code once into cached basic blocks
+    void block_cache_stats( uint64_t & builds, uint64_t & invalidations ); // # of blocks decoded and # thrown away
+    bool enable_jit( bool enable );                     // compile hot blocks to x86-64 code. false if it's not available
+    void jit_stats( uint64_t & compiled, uint64_t & runs ); // # of blocks compiled and # of times compiled code ran
+    void enable_profiler( uint32_t cycles_per_sample );  // call i8086_invoke_profile_sample this often. 0 to stop
+    void enable_counters( bool enable );                // count every instruction. compiled code isn't run meanwhile
+    const i8086_counters & get_counters();              // counts since the emulator started
+    bool trace_binary( const char * path );             // write a binary trace of each instruction to path. 0 to stop
+    void save_registers( i8086_registers & r );         // copy out the registers and flags
+    void restore_registers( const i8086_registers & r ); // replace the registers and flags. call between emulate() calls
+    uint32_t get_video_generation() { return video_generation; } // changes when 0xb8000..0xbffff may have been written
+    void note_video_write() { video_generation++; }     // the host wrote video memory outside of emulated instructions
+    uint64_t get_cycles() { return cycles; }            // cycles run so far by the current or last call to emulate()
 
 #ifndef NDEBUG
     uint8_t trace_opcode_usage( void );                    // trace trends in opcode usage
@@ -86,9 +126,11 @@ struct i8086
     i8086() : ax( 0 ), bx( 0 ), cx( 0 ), dx(0 ), si( 0 ), di( 0 ), bp( 0 ), sp( 0 ), ip( 0 ),
               es( 0 ), cs( 0 ), ss( 0 ), ds( 0 ), flags( 0 ),
               prefix_segment_override( 0xff ), prefix_repeat_opcode( 0xff ),
-              _pcode( 0 ), _bc( 0 ), _b0( 0 ), _b1( 0 ), _mod( 0 ), _reg( 0 ), _rm( 0 ),
-              fCarry( false ), fParityEven( false ), fAuxCarry( false ), fZero( false ), fSign( false ),
-              fTrap( false ), fInterrupt( false ), fDirection( false ), fOverflow( false ), fIgnoreTrap( false ), cycles( 0 )
+              fCarry( false ), fTrap( false ), fInterrupt( false ), fDirection( false ), fOverflow( false ), fIgnoreTrap( false ),
+              lazy_psz( 0x20100 ), lazy_aux( 0 ),
+              _bc( 0 ), _b0( 0 ), _b1( 0 ), _rm( 0 ), _reg( 0 ), _mod( 0 ), _pcode( 0 ), cycles( 0 ),
+              _pblock( 0 ), _block_cs( 0 ), _block_ip( 0 ), _block_next( 0 ), _jit_flags( 0 ), _jit_aux( 0 ), _jit_written( 0 ), _jit_af( 0 ),
+              video_generation( 0 )
     {
         reg8_pointers[ 0 ] = (uint8_t *) & ax;  // al
         reg8_pointers[ 1 ] = (uint8_t *) & cx;  // cl
@@ -107,6 +149,9 @@ struct i8086
         reg16_pointers[ 5 ] = & bp;
         reg16_pointers[ 6 ] = & si;
         reg16_pointers[ 7 ] = & di;
+
+        for ( uint32_t i = 0xb8000; i < 0xc0000; i++ )
+            i8086_store_watch[ i ] = i8086_watch_video;
     } //i8086
 
     void push( uint16_t val )
@@ -138,10 +183,18 @@ struct i8086
     uint8_t prefix_segment_override; // 0xff for none, 0..3 for es, cs, ss, ds
     uint8_t prefix_repeat_opcode;    // 0xff for none, f2 repne/repnz, f3 rep/repe/repz
 
-    // bits   0,           2,         4,     6,     7,     8,          9,         10,        11
-    bool fCarry, fParityEven, fAuxCarry, fZero, fSign, fTrap, fInterrupt, fDirection, fOverflow;
+    // bits   0,     8,          9,         10,        11
+    bool fCarry, fTrap, fInterrupt, fDirection, fOverflow;
     bool fIgnoreTrap;
 
+    // Parity, sign, and zero (bits 2, 7, 6) are computed from lazy_psz only when they're read since nearly every
+    // result is overwritten before then. Bits 15:0 are the last result with 8-bit results sign-extended, bit 16
+    // forces sign on, and bit 17 inverts parity so any combination can be set. Aux carry (bit 4) is bit 4 of
+    // lazy_aux, which add and subtract set to lhs ^ rhs ^ result.
+
+    uint32_t lazy_psz;
+    uint16_t lazy_aux;
+
     // state used for instruction decoding. these start with underscore to differentiate them
 
     uint8_t _bc;      // # of bytes consumed by the currently running instruction
@@ -156,11 +209,33 @@ struct i8086
     uint16_t * reg16_pointers[ 8 ];
     uint64_t cycles;  // # of cycles executed so far during a call to emulate()
 
+    // state used when the block cache is enabled
+
+    i8086_block * _pblock; // the block currently executing or 0 if none
+    uint16_t _block_cs;    // cs of the next instruction in _pblock
+    uint16_t _block_ip;    // ip of the next instruction in _pblock
+    uint8_t _block_next;   // index of the next instruction in _pblock
+
+    // state used by compiled code. see the JIT in i8086.cxx
+
+    uint64_t _jit_flags;   // host flags saved by compiled code
+    uint64_t _jit_aux;     // host flags holding the aux carry flag when a later instruction doesn't set it
+    uint16_t _jit_written; // flags the compiled code left in _jit_flags. set along with _block_next as it returns
+    uint8_t _jit_af;       // where the compiled code left the aux carry flag
+
+    // Bumped whenever a store may have landed in CGA memory so the display only diffs and redraws after a change.
+    // Every guest store goes through track_store() or track_store_range(); loads leave it alone.
+
+    uint32_t video_generation;
+
+    friend class i8086_jit;
+
     void decode_instruction( uint8_t * pcode )
     {
         _bc = 1;
         _pcode = pcode;
-        * (uint16_t *) & _b0 = * (uint16_t *) pcode; // updates both _b0 and _b1 with one copy
+        _b0 = pcode[ 0 ]; // byte copies. one uint16_t store through & _b0 into two uint8_t members is aliasing UB
+        _b1 = pcode[ 1 ];
         _rm = ( _b1 & 7 );
         _reg = ( ( _b1 >> 3 ) & 7 );
         _mod = ( _b1 >> 6 );
@@ -181,10 +256,10 @@ struct i8086
     {
         flags = 0xf002; // these bits are meaningless, but always turned on on real hardware
         if ( fCarry ) flags |= ( 1 << 0 );
-        if ( fParityEven ) flags |= ( 1 << 2 );
-        if ( fAuxCarry ) flags |=  ( 1 << 4 );
-        if ( fZero ) flags |= ( 1 << 6 );
-        if ( fSign ) flags |= ( 1 << 7 );
+        if ( get_parity_even() ) flags |= ( 1 << 2 );
+        if ( get_aux_carry() ) flags |=  ( 1 << 4 );
+        if ( get_zero() ) flags |= ( 1 << 6 );
+        if ( get_sign() ) flags |= ( 1 << 7 );
         if ( fTrap ) flags |= ( 1 << 8 );
         if ( fInterrupt ) flags |= ( 1 << 9 );
         if ( fDirection ) flags |= ( 1 << 10 );
@@ -194,10 +269,8 @@ struct i8086
     void unmaterializeFlags()
     {
         fCarry = ( 0 != ( flags & ( 1 << 0 ) ) );
-        fParityEven = ( 0 != ( flags & ( 1 << 2 ) ) );
-        fAuxCarry = ( 0 != ( flags & ( 1 << 4 ) ) );
-        fZero = ( 0 != ( flags & ( 1 << 6 ) ) );
-        fSign = ( 0 != ( flags & ( 1 << 7 ) ) );
+        set_PSZ( 0 != ( flags & ( 1 << 2 ) ), 0 != ( flags & ( 1 << 7 ) ), 0 != ( flags & ( 1 << 6 ) ) );
+        set_aux_carry( 0 != ( flags & ( 1 << 4 ) ) );
         fTrap = ( 0 != ( flags & ( 1 << 8 ) ) );
         fInterrupt = ( 0 != ( flags & ( 1 << 9 ) ) );
         fDirection = ( 0 != ( flags & ( 1 << 10 ) ) );
@@ -215,19 +288,20 @@ struct i8086
 #endif
     } //is_parity_even8
 
-    void set_PSZ16( uint16_t val )
-    {
-        fParityEven = is_parity_even8( (uint8_t) val ); // only the lower 8 bits are used to determine parity on the 8086
-        fZero = ( 0 == val );
-        fSign = ( 0 != ( 0x8000 & val ) );
-    } //set_PSZ16
+    void set_PSZ16( uint16_t val ) { lazy_psz = val; }
+    void set_PSZ8( uint8_t val ) { lazy_psz = (uint16_t) (int16_t) (int8_t) val; }
 
-    void set_PSZ8( uint8_t val )
+    void set_PSZ( bool parity_even, bool sign, bool zero )
     {
-        fParityEven = is_parity_even8( val );
-        fZero = ( 0 == val );
-        fSign = ( 0 != ( 0x80 & val ) );
-    } //set_PSZ8
+        lazy_psz = ( zero ? 0 : 0x100 ) | ( sign ? 0x10000 : 0 ) | ( parity_even ? 0 : 0x20000 );
+    } //set_PSZ
+
+    // only the lower 8 bits are used to determine parity on the 8086
+    bool get_parity_even() { return ( is_parity_even8( (uint8_t) lazy_psz ) != ( 0 != ( lazy_psz & 0x20000 ) ) ); }
+    bool get_sign() { return ( 0 != ( lazy_psz & 0x18000 ) ); }
+    void set_sign( bool f ) { set_PSZ( get_parity_even(), f, get_zero() ); }
+    bool get_aux_carry() { return ( 0 != ( lazy_aux & 0x10 ) ); }
+    void set_aux_carry( bool f ) { lazy_aux = f ? 0x10 : 0; }
 
     void reset_carry_overflow() { fCarry = false; fOverflow = false; }
 
@@ -275,7 +349,18 @@ struct i8086
     } //flatten
 
     void unhandled_instruction();
-    void setmword( uint16_t seg, uint16_t offset, uint16_t value ) { * flat_address16( seg, offset ) = value; }
+    void setmword( uint16_t seg, uint16_t offset, uint16_t value ) { * (uint16_t *) track_store( flat_address( seg, offset ), 2 ) = value; }
+
+    void * track_store( void * p, uint8_t bytes ) // call before storing 1 or 2 bytes through p, which is in memory[] and from flat_address()
+    {
+        uint32_t flat = (uint32_t) ( (uint8_t *) p - memory );
+        if ( i8086_store_watch[ flat ] )
+            store_watched( flat, bytes );
+        return p;
+    } //track_store
+
+    void store_watched( uint32_t flat, uint8_t bytes );
+    void track_store_range( uint32_t flat, uint32_t bytes );
 
     uint16_t get_displacement()
     {
@@ -359,6 +444,24 @@ struct i8086
         return (uint8_t *) get_rm_ptr_common();
     } //get_rm_ptr8
 
+    // same as get_rm_ptr16/8 for instructions that write the r/m operand
+
+    uint16_t * get_rm_store_ptr16()
+    {
+        if ( 3 == _mod )
+            return get_preg16( _rm );
+
+        return (uint16_t *) track_store( get_rm_ptr_common(), 2 );
+    } //get_rm_store_ptr16
+
+    uint8_t * get_rm_store_ptr8()
+    {
+        if ( 3 == _mod )
+            return get_preg8( _rm );
+
+        return (uint8_t *) track_store( get_rm_ptr_common(), 1 );
+    } //get_rm_store_ptr8
+
     uint16_t get_rm_ea() // effective address. used strictly for lea
     {
         assert( isword() );
@@ -388,7 +491,7 @@ struct i8086
         return get_displacement();
     } //get_rm_ea
 
-    uint16_t * get_op_args16( uint16_t & rhs )
+    uint16_t * get_op_args16( uint16_t & rhs, bool store ) // store is false for cmp and test, which only read
     {
         assert( isword() );
         if ( toreg() )
@@ -398,10 +501,10 @@ struct i8086
         }
 
         rhs = * get_preg16( _reg );
-        return get_rm_ptr16();
+        return store ? get_rm_store_ptr16() : get_rm_ptr16();
     } //get_op_args16
     
-    uint8_t * get_op_args8( uint8_t & rhs )
+    uint8_t * get_op_args8( uint8_t & rhs, bool store ) // store is false for cmp and test, which only read
     {
         assert( !isword() );
         if ( toreg() )
@@ -411,7 +514,7 @@ struct i8086
         }
 
         rhs = * get_preg8( _reg );
-        return get_rm_ptr8();
+        return store ? get_rm_store_ptr8() : get_rm_ptr8();
     } //get_op_args8
     
     const char * render_flags() // show the subset actually used with any frequency
@@ -422,16 +525,20 @@ struct i8086
         acflags[ next++ ] = fDirection ? 'D' : 'd';
         acflags[ next++ ] = fInterrupt ? 'I' : 'i';
         acflags[ next++ ] = fTrap ? 'T' : 't';
-        acflags[ next++ ] = fSign ? 'S' : 's';
-        acflags[ next++ ] = fZero ? 'Z' : 'z';
-        acflags[ next++ ] = fAuxCarry ? 'A' : 'a';
-        acflags[ next++ ] = fParityEven ? 'P' : 'p';
+        acflags[ next++ ] = get_sign() ? 'S' : 's';
+        acflags[ next++ ] = get_zero() ? 'Z' : 'z';
+        acflags[ next++ ] = get_aux_carry() ? 'A' : 'a';
+        acflags[ next++ ] = get_parity_even() ? 'P' : 'p';
         acflags[ next++ ] = fCarry ? 'C' : 'c';
         acflags[ next ] = 0;
         return acflags;
     } //render_flags
 
     bool handle_state();
+    void trace_binary_record();
+    bool enter_block();
+    bool fetch_decoded_instruction();
+    bool decode_next( uint64_t maxcycles );
     void do_math8( uint8_t math, uint8_t * psrc, uint8_t rhs );
     void do_math16( uint8_t math, uint16_t * psrc, uint16_t rhs );
     uint8_t op_sub8( uint8_t lhs, uint8_t rhs, bool borrow = false );
@@ -472,6 +579,14 @@ struct i8086
     void update_index8( uint16_t & index_register );
     void update_rep_sidi8();
     void update_rep_sidi16();
+    uint16_t rep_source_segment( uint8_t & cycles_per_element );
+    bool rep_range( uint16_t seg, uint16_t offset, uint32_t bytes, uint8_t width, uint32_t & flat );
+    void rep_advance( uint16_t & index_register, uint32_t bytes ) { if ( fDirection ) index_register -= bytes; else index_register += bytes; }
+    bool rep_movs( uint8_t width );
+    bool rep_stos( uint8_t width );
+    void rep_lods( uint8_t width );
+    bool rep_scas( uint8_t width );
+    bool rep_cmps( uint8_t width );
     uint8_t op_inc8( uint8_t val );
     uint8_t op_dec8( uint8_t val );
     uint16_t op_inc16( uint16_t val );
@@ -491,9 +606,11 @@ struct i8086
 
     #ifdef I8086_TRACK_CYCLES
         void AddCycles( uint8_t amount ) { cycles += amount; }
+        void AddCycles( uint8_t amount, uint32_t times ) { cycles += (uint64_t) amount * times; }
         void AddMemCycles( uint8_t amount ) { if ( 3 != _mod ) cycles += amount; else if ( !toreg() ) cycles += 21; }
     #else
         void AddCycles( uint8_t amount ) {}
+        void AddCycles( uint8_t amount, uint32_t times ) {}
         void AddMemCycles( uint8_t amount ) {}
     #endif
 
@@ -510,3 +627,8 @@ extern uint16_t i8086_invoke_in_word( uint16_t port );            // called for
 extern void i8086_invoke_out_byte( uint16_t port, uint8_t val );  // called for the instructions: out of size byte
 extern void i8086_invoke_out_word( uint16_t port, uint16_t val ); // called for the instructions: out of size word
 extern void i8086_hard_exit( const char * pcerror, uint8_t arg ); // called for fatal errors
+extern void i8086_invoke_profile_sample( uint16_t cs, uint16_t ip ); // called periodically once enable_profiler() is called
+
+// decode files written by trace_binary()
+bool i8086_print_trace( const char * path, FILE * out, int only_cs ); // in trace_state() format. only_cs < 0 for all
+bool i8086_diff_traces( const char * pathA, const char * pathB, FILE * out ); // show where two traces first differ
@@ -0,0 +1,12 @@
+ntvdm -c tasm\tasm testdup.asm
+
+if %ERRORLEVEL% NEQ 0 goto eof
+
+ntvdm -c tasm\tlink /t testdup.obj
+
+if %ERRORLEVEL% NEQ 0 goto eof
+
+ntvdm -c testdup.com
+
+:eof
+
@@ -0,0 +1,11 @@
+@echo off
+del ntvdm.obj >nul 2>nul
+del i8086.obj >nul 2>nul
+cl /nologo /EHsc /DNTVDM_LIBRARY /O2 /I. ntvdm.cxx i8086.cxx testhost.cxx /link user32.lib
+
+if %ERRORLEVEL% NEQ 0 goto eof
+
+testhost
+
+:eof
+
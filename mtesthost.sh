@@ -0,0 +1 @@
+g++ -O2 -fno-builtin -D NTVDM_LIBRARY -I . ntvdm.cxx i8086.cxx testhost.cxx -o testhost && ./testhost
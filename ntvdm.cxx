@@ -66,23 +66,45 @@
 #include <chrono>
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 #include <locale.h>
 #include <wchar.h>
 
 #ifdef _WIN32
 #include <io.h>
+#include <fcntl.h>
 #else
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <time.h>
 #include <string>
-#include <regex>
 #endif
 
 #include <assert.h>
 #include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <queue>
+#include <atomic>
+#include <stdexcept>
+
+#if defined( __amd64 ) || defined( _M_AMD64 ) || defined( __SSE2__ )
+#include <emmintrin.h>
+#define USE_SSE2_FOR_DISPLAY_DIFF
+#elif defined( __aarch64__ ) || defined( _M_ARM64 )
+#include <arm_neon.h>
+#define USE_NEON_FOR_DISPLAY_DIFF
+#endif
 
 #include <djltrace.hxx>
 #include <djl_con.hxx>
@@ -92,6 +114,7 @@
 #include <djl_kslog.hxx>
 #include <djl8086d.hxx>
 #include "i8086.hxx"
+#include "ntvdm.hxx"
 
 using namespace std;
 using namespace std::chrono;
@@ -129,6 +152,8 @@ uint16_t AllocateEnvironment( uint16_t segStartingEnv, const char * pathToExecut
 uint16_t LoadBinary( const char * app, const char * acAppArgs, uint8_t lenAppArgs, uint16_t segment, bool setupRegs,
                      uint16_t * reg_ss, uint16_t * reg_sp, uint16_t * reg_cs, uint16_t * reg_ip, bool bootSectorLoad );
 uint16_t LoadOverlay( const char * app, uint16_t segLoadAddress, uint16_t segmentRelocationFactor );
+uint32_t GetBiosDailyTimer();
+void CreditSleepCycles( high_resolution_clock::time_point tStart );
 
 uint16_t GetSegment( uint8_t * p )
 {
@@ -140,8 +165,8 @@ uint16_t GetSegment( uint8_t * p )
 
 struct FileEntry
 {
-    char path[ MAX_PATH ];
-    FILE * fp;
+    const char * path; // interned by InternPath() so entries stay small and duplicated handles share it
+    FILE * fp;         // 0 if the entry isn't in use
     uint16_t handle; // DOS handle, not host OS
     uint8_t mode; // 0=ro, 1=wo, 2=rw. upper bits are used for sharing/private
     uint16_t seg_process; // process that opened the file
@@ -238,13 +263,6 @@ struct DosAllocation
     uint16_t seg_process;      // the process PSP that allocated the memory or 0 prior to the app running
 };
 
-struct IntCalled
-{
-    uint8_t i;      // interrupt #
-    uint16_t c;     // ah command (0xffff if n/a)
-    uint32_t calls; // # of times invoked
-};
-
 const uint8_t DefaultVideoAttribute = 7;                          // light grey text
 const uint8_t DefaultVideoMode = 3;                               // 3=80x25 16 colors
 const uint32_t ScreenColumns = 80;      
@@ -259,6 +277,7 @@ const uint32_t firstAppTerminateAddress = 0xf000dead;             // exit ntvdm
 const uint16_t SegmentListOfLists = 0x50;
 const uint16_t OffsetListOfLists = 0xb0;
 const uint64_t OffsetDeviceControlBlock = 0xe0;
+const size_t MaxOpenFindFirst = 64;                               // find first searches kept open at once, one per DTA
 #if 0
 const uint16_t OffsetSystemFileTable = 0xf0;
 #endif
@@ -272,8 +291,11 @@ static ConsoleConfiguration g_consoleConfig;         // to get into and out of 8
 static bool g_haltExecution = false;                 // true when the app is shutting down
 static uint16_t g_diskTransferSegment = 0;           // segment of current disk transfer area
 static uint16_t g_diskTransferOffset = 0;            // offset of current disk transfer area
-static vector<FileEntry> g_fileEntries;              // vector of currently open files
-static vector<FileEntry> g_fileEntriesFCB;           // vector of currently open files with FCBs
+static vector<FileEntry> g_fileEntries;              // currently open files indexed by DOS handle. fp is 0 for free handles
+static uint16_t g_firstFreeFileHandle = 5;           // no handle below this is free. 0-4 are built in
+static unordered_multimap<string, uint16_t> g_fileHandlesByPath; // lowercase path to handles of files open with that path
+static unordered_map<string, FileEntry> g_fileEntriesFCB; // currently open files with FCBs keyed by lowercase path
+static unordered_map<string, uint32_t> g_filePaths;  // interned paths referenced by FileEntry::path and how many entries use each
 static vector<DosAllocation> g_allocEntries;         // vector of blocks allocated to DOS apps
 static uint16_t g_currentPSP = 0;                    // psp of the currently running process
 static bool g_use80xRowsMode = false;                // true to force 80 x 25/43/50 with cursor positioning
@@ -281,11 +303,15 @@ static bool g_forceConsole = false;                  // true to force teletype m
 static bool g_int16_1_loop = false;                  // true if an app is looping to get keyboard input. don't busy loop.
 static bool g_KbdPeekAvailable = false;              // true when peek on the keyboard sees keystrokes
 static bool g_int9_pending = false;                  // true if an int9 was scheduled but not yet invoked
+static bool g_int8_pending = false;                  // true if the bios tick changed and int 8 hasn't been raised for it
+static bool g_keyboardActivity = false;              // true if the app read or polled the keyboard since the main loop looked
 static long g_injectedControlC = 0;                  // # of control c events to inject
 static int g_appTerminationReturnCode = 0;           // when int 21 function 4c is invoked to terminate an app, this is the app return code
 static char g_acRoot[ MAX_PATH ];                    // host folder ending in slash/backslash that maps to DOS "C:\"
 static char g_acApp[ MAX_PATH ];                     // the DOS .com or .exe being run
+#ifndef NTVDM_LIBRARY
 static char g_thisApp[ MAX_PATH ];                   // name of this exe (argv[0]), likely NTVDM
+#endif
 static char g_lastLoadedApp[ MAX_PATH ] = {0};       // path of most recenly loaded program (though it may have terminated)
 static bool g_PackedFileCorruptWorkaround = false;   // if true, allocate memory starting at 64k, not AppSegment
 static uint16_t g_int21_3f_seg = 0;                  // segment where this code resides with ip = 0
@@ -294,14 +320,25 @@ static uint16_t g_int21_1_seg = 0;                   // "
 static uint16_t g_int21_8_seg = 0;                   // "
 static uint16_t g_int16_0_seg = 0;                   // "
 static char cwd[ MAX_PATH ] = {0};                   // used as a temporary in several locations
-static vector<IntCalled> g_InterruptsCalled;         // track interrupt usage
+static vector<uint32_t> g_InterruptsCalled( 256 * 256 ); // calls indexed by interrupt << 8 | ah
 static high_resolution_clock::time_point g_tAppStart; // system time at app start
 static uint8_t g_bufferLastUpdate[ 80 * 50 * 2 ] = {0}; // used to check for changes in video memory. At most we support 80 by 50
 static CKeyStrokes g_keyStrokes;                     // read or write keystrokes between kslog.txt and the app
 static bool g_UseOneThread = false;                  // true if no keyboard thread should be used
+static bool g_keyboardThreadActive = false;          // true while PeekKeyboardThreadProc reads and decodes host keystrokes
+#if !defined( NTVDM_LIBRARY ) || defined( __riscv )
 static bool g_InRVOS = false;                        // true if running in the RISC-V + Linux emulator RVOS
-static uint64_t g_msAtStart = 0;                     // milliseconds since epoch at app start
-static bool g_SendControlCInt = false;               // set to true when/if a ^C is detected and an interrupt should be sent
+#endif
+static std::atomic<bool> g_SendControlCInt( false ); // set by the keyboard thread or ^C handler when an interrupt should be sent
+static const char * g_snapshotPath = 0;              // --snapshot: file to write at the first keyboard or stdin read
+static string * g_consoleSink = 0;                   // when not 0, teletype output is appended here instead of going to stdout
+static bool g_pipedStdin = false;                    // stdin isn't a terminal. DOS console input reads it directly, not the keyboard
+static bool g_pipedStdout = false;                   // stdout isn't a terminal. DOS console output is written in blocks
+#if !defined( _WIN32 ) && !defined( NTVDM_LIBRARY )
+static const char * g_forkServerPath = 0;            // --server: socket to listen on at the first keyboard or stdin read
+static string g_forkServerOutput;                    // --server: app output before that read, replayed to each client
+static void RunForkServer( const char * path );
+#endif
 
 
 // Set to true to fill dos memory allocations with patterns to detect apps that use memory they previously freed.
@@ -319,6 +356,615 @@ static bool g_forcePathsLower = false;               // helpful for Linux
 static bool g_altPressedRecently = false;            // hack because I can't figure out if ALT is currently pressed
 #endif
 
+void ConsolePutChar( char ch )
+{
+    if ( g_consoleSink )
+        g_consoleSink->push_back( ch );
+    else
+        printf( "%c", ch );
+} //ConsolePutChar
+
+// Dirty page tracking for memory[]. While tracking, its pages are read-only; the first write to each page faults,
+// the handler records the page and makes it writable, and the write is retried. This covers the interpreter, the
+// jit, and host code alike. The kernel won't fault on behalf of read(), so fread() into a protected page fails;
+// call PrepareMemoryForRead() first. Windows and the partial page at the end of memory[] are always dirty.
+
+const size_t MemoryPageSize = 4096;
+const size_t MemoryPages = sizeof( memory ) / MemoryPageSize;
+static uint8_t g_dirtyPages[ MemoryPages ];          // 1 if the page has been written since tracking started, 2 by a host read
+static bool g_dirtyTracking = false;                 // true while memory[] pages are protected
+static uint8_t * g_dirtyPageOriginals = 0;           // if set, pages are copied here before their first write
+
+#ifndef _WIN32
+static struct sigaction g_previousSegvAction;
+
+static void DirtyPageFault( int sig, siginfo_t * info, void * context )
+{
+    uint8_t * p = (uint8_t *) info->si_addr;
+    if ( g_dirtyTracking && p >= memory && p < ( memory + MemoryPages * MemoryPageSize ) )
+    {
+        size_t page = ( p - memory ) / MemoryPageSize;
+        g_dirtyPages[ page ] = 1;
+        if ( g_dirtyPageOriginals )
+            memcpy( g_dirtyPageOriginals + page * MemoryPageSize, memory + page * MemoryPageSize, MemoryPageSize );
+        mprotect( memory + page * MemoryPageSize, MemoryPageSize, PROT_READ | PROT_WRITE );
+        return;
+    }
+
+    // not a tracked page. put back the prior handler so the fault reoccurs and is reported as usual
+
+    sigaction( SIGSEGV, & g_previousSegvAction, 0 );
+} //DirtyPageFault
+#endif
+
+void StartDirtyTracking()
+{
+#ifdef _WIN32
+    memset( g_dirtyPages, 1, sizeof( g_dirtyPages ) );
+#else
+    static bool installed = false;
+    if ( !installed )
+    {
+        struct sigaction sa = {};
+        sa.sa_sigaction = DirtyPageFault;
+        sa.sa_flags = SA_SIGINFO;
+        sigemptyset( & sa.sa_mask );
+        installed = ( 0 == sigaction( SIGSEGV, & sa, & g_previousSegvAction ) );
+    }
+
+    memset( g_dirtyPages, 0, sizeof( g_dirtyPages ) );
+    g_dirtyTracking = installed && ( 0 == mprotect( memory, MemoryPages * MemoryPageSize, PROT_READ ) );
+    if ( !g_dirtyTracking )
+        memset( g_dirtyPages, 1, sizeof( g_dirtyPages ) );
+#endif
+} //StartDirtyTracking
+
+void StopDirtyTracking()
+{
+#ifndef _WIN32
+    if ( g_dirtyTracking )
+    {
+        g_dirtyTracking = false;
+        mprotect( memory, MemoryPages * MemoryPageSize, PROT_READ | PROT_WRITE );
+    }
+#endif
+} //StopDirtyTracking
+
+void PrepareMemoryForRead( void * p, size_t len )
+{
+    // mark the pages a host read is about to fill as dirty and writable
+
+#ifndef _WIN32
+    if ( g_dirtyTracking && len )
+    {
+        size_t first = ( (uint8_t *) p - memory ) / MemoryPageSize;
+        size_t last = get_min( ( (uint8_t *) p - memory + len - 1 ) / MemoryPageSize, MemoryPages - 1 );
+        if ( first <= last )
+        {
+            memset( g_dirtyPages + first, 2, last - first + 1 );
+            mprotect( memory + first * MemoryPageSize, ( last - first + 1 ) * MemoryPageSize, PROT_READ | PROT_WRITE );
+        }
+    }
+#endif
+} //PrepareMemoryForRead
+
+// copy the pages of memory[] written since StartDirtyTracking() to dest, which is the same size as memory[]
+
+void CopyDirtyPages( uint8_t * dest )
+{
+    for ( size_t page = 0; page < MemoryPages; page++ )
+        if ( g_dirtyPages[ page ] )
+            memcpy( dest + page * MemoryPageSize, memory + page * MemoryPageSize, MemoryPageSize );
+
+    size_t tail = MemoryPages * MemoryPageSize;
+    memcpy( dest + tail, memory + tail, sizeof( memory ) - tail );
+} //CopyDirtyPages
+
+// Record and replay. --record: logs each input the app gets from the host, in the order the app gets it: keyboard
+// peeks, keys put in the bios buffer, console lines, the bios timer, the date and time, ^C, and bytes read from
+// files. --replay: runs the same command line and takes those inputs from the log rather than the host, so the
+// app runs the same instructions in the same order. Inputs polled far more often than they change (the timer,
+// whether a key is waiting) are logged only when they change, tagged with the number of polls so far.
+// Both modes poll the keyboard from the cpu thread so emulate() slices end at the same cycles every run.
+// Replay opens and reads the same files, so they must exist, but the bytes the app sees come from the log.
+
+const char ReplaySignature[ 8 ] = { 'N', 'T', 'V', 'D', 'M', 'R', 'E', 'C' };
+const uint32_t ReplayVersion = 1;
+
+enum ReplayKind : uint8_t
+{
+    replayTimer = 'T',           // GetBiosDailyTimer() when it changed
+    replayKeyWaiting = 'K',      // the console had a keystroke when polled
+    replayPeekDue = 'D',         // a throttled keyboard peek went to the console
+    replayPeek = 'P',            // ascii and scancode peek_keyboard() found
+    replayKeys = 'C',            // bios keyboard flags and the keys consume_keyboard() added to the buffer
+    replayInjected = 'J',        // keys InjectKeystrokes() added to the buffer
+    replayKeyFlags = 'F',        // shift, control, and alt state when it changed
+    replayRedrew = 'U',          // an int 16 poll redrew the display
+    replayControlC = 'c',        // the main loop saw a ^C
+    replayLine = 'L',            // a line read from the console, with its null. empty if the read failed
+    replayClock = 'R',           // al, cx, and dx returned by the date and time calls
+    replayFileRead = 'f',        // bytes read from a host file
+    replayInterrupt = 'I',       // interrupt number and total cycles when the main loop raised it. only checked
+};
+
+struct ReplayRecord
+{
+    uint8_t kind;
+    uint8_t reserved[ 3 ];
+    uint32_t bytes;              // payload bytes that follow
+    uint64_t poll;               // polls when the record was written
+};
+
+struct ReplayLog
+{
+    FILE * fp;                   // 0 unless recording or replaying
+    bool replaying;
+    uint64_t polls;              // inputs requested so far
+    bool pending;                // replaying: next and data were read but not yet used
+    ReplayRecord next;
+    vector<uint8_t> data;
+};
+
+static ReplayLog g_replay = { 0, false, 0, false };
+
+static bool Replaying() { return ( 0 != g_replay.fp ) && g_replay.replaying; }
+
+static void ReplayDiverged( uint8_t kind )
+{
+    i8086_hard_exit( "the app diverged from the replay log. it asked for an input of kind '%c'\n", kind );
+} //ReplayDiverged
+
+#ifndef NTVDM_LIBRARY
+static bool OpenReplayLog( const char * path, bool replay )
+{
+    g_replay.fp = fopen( path, replay ? "rb" : "wb" );
+    if ( !g_replay.fp )
+        return false;
+
+    g_replay.replaying = replay;
+    setvbuf( g_replay.fp, 0, _IOFBF, 1024 * 1024 );
+
+    if ( !replay )
+        return ( 1 == fwrite( ReplaySignature, sizeof( ReplaySignature ), 1, g_replay.fp ) ) &&
+               ( 1 == fwrite( & ReplayVersion, sizeof( ReplayVersion ), 1, g_replay.fp ) );
+
+    char signature[ sizeof( ReplaySignature ) ];
+    uint32_t version = 0;
+    return ( 1 == fread( signature, sizeof( signature ), 1, g_replay.fp ) ) && !memcmp( signature, ReplaySignature, sizeof( signature ) ) &&
+           ( 1 == fread( & version, sizeof( version ), 1, g_replay.fp ) ) && ( ReplayVersion == version );
+} //OpenReplayLog
+
+static void CloseReplayLog()
+{
+    if ( g_replay.fp )
+    {
+        fclose( g_replay.fp );
+        g_replay.fp = 0;
+    }
+} //CloseReplayLog
+#endif //NTVDM_LIBRARY
+
+static bool ReplayInput( uint8_t kind, void * p, uint32_t & bytes, uint32_t capacity, bool log )
+{
+    // recording: writes the bytes at p if log is true, and returns log.
+    // replaying: if the next record is this kind and was written at this poll, copies it to p and returns true.
+
+    if ( !g_replay.fp )
+        return log;
+
+    g_replay.polls++;
+
+    if ( !g_replay.replaying )
+    {
+        if ( log )
+        {
+            ReplayRecord r = { kind, { 0, 0, 0 }, bytes, g_replay.polls };
+            fwrite( & r, sizeof( r ), 1, g_replay.fp );
+            if ( bytes )
+                fwrite( p, 1, bytes, g_replay.fp );
+            if ( replayTimer == kind )
+                fflush( g_replay.fp ); // so a session that's killed keeps nearly all of its log
+        }
+        return log;
+    }
+
+    if ( !g_replay.pending )
+    {
+        if ( 1 != fread( & g_replay.next, sizeof( g_replay.next ), 1, g_replay.fp ) )
+            return false; // the end of the log. the app exits soon, polling inputs that never change
+
+        g_replay.data.resize( g_replay.next.bytes );
+        if ( g_replay.next.bytes && ( g_replay.next.bytes != fread( g_replay.data.data(), 1, g_replay.next.bytes, g_replay.fp ) ) )
+            return false;
+
+        g_replay.pending = true;
+    }
+
+    if ( g_replay.next.poll > g_replay.polls )
+        return false;
+
+    if ( ( g_replay.next.poll < g_replay.polls ) || ( kind != g_replay.next.kind ) || ( g_replay.next.bytes > capacity ) )
+        ReplayDiverged( kind );
+
+    bytes = g_replay.next.bytes;
+    if ( bytes )
+        memcpy( p, g_replay.data.data(), bytes );
+    g_replay.pending = false;
+    return true;
+} //ReplayInput
+
+static bool ReplayFlag( uint8_t kind, bool value )
+{
+    // for inputs that are usually false. only true is logged
+
+    uint32_t bytes = 0;
+    return ReplayInput( kind, 0, bytes, 0, value );
+} //ReplayFlag
+
+static uint32_t ReplayBytes( uint8_t kind, void * p, uint32_t bytes, uint32_t capacity )
+{
+    // logged every time. returns the number of bytes at p
+
+    if ( !ReplayInput( kind, p, bytes, capacity, true ) && Replaying() )
+        ReplayDiverged( kind );
+    return bytes;
+} //ReplayBytes
+
+static void ReplayValue( uint8_t kind, void * p, uint32_t bytes )
+{
+    if ( bytes != ReplayBytes( kind, p, bytes, bytes ) )
+        ReplayDiverged( kind );
+} //ReplayValue
+
+// Piped standard handles. When stdin or stdout isn't a terminal the app is likely a filter in a pipeline, so DOS
+// handles 0, 1, and 2 go straight to the host's streams instead of through the keyboard and console layers.
+// Input is read from the host in large blocks and handed to the app as it asks, unchanged, as DOS does for redirected
+// input. Output is written in runs and flushed when the app waits for the keyboard or exits, not after each character.
+// The keyboard stops reading stdin, so keystroke polling can't take bytes the app will read with int 21.
+
+const size_t PipedBufferSize = 64 * 1024;
+
+struct PipedInput
+{
+    uint8_t bytes[ PipedBufferSize ];
+    size_t next, count;
+    bool ended;                  // stdin reached its end or failed
+};
+
+static PipedInput g_pipedInput;
+
+static bool FillPipedInput()
+{
+    while ( ( g_pipedInput.next >= g_pipedInput.count ) && !g_pipedInput.ended )
+    {
+#ifdef _WIN32
+        int r = _read( 0, g_pipedInput.bytes, (unsigned) sizeof( g_pipedInput.bytes ) );
+#else
+        ssize_t r = read( STDIN_FILENO, g_pipedInput.bytes, sizeof( g_pipedInput.bytes ) );
+        if ( ( -1 == r ) && ( EINTR == errno ) )
+            continue;
+#endif
+        if ( r <= 0 )
+            g_pipedInput.ended = true;
+        else
+        {
+            g_pipedInput.next = 0;
+            g_pipedInput.count = (size_t) r;
+        }
+    }
+
+    return ( g_pipedInput.next < g_pipedInput.count );
+} //FillPipedInput
+
+static size_t ReadPipedInput( uint8_t * p, size_t len )
+{
+    // returns what's buffered, or waits for one read from the host if nothing is. 0 is the end of input.
+    // bytes are logged like file reads, so a replay doesn't touch stdin.
+
+    size_t numRead = 0;
+    if ( !Replaying() && FillPipedInput() )
+    {
+        numRead = get_min( len, g_pipedInput.count - g_pipedInput.next );
+        memcpy( p, g_pipedInput.bytes + g_pipedInput.next, numRead );
+        g_pipedInput.next += numRead;
+    }
+
+    return ReplayBytes( replayFileRead, p, (uint32_t) numRead, (uint32_t) len );
+} //ReadPipedInput
+
+static int GetPipedChar()
+{
+    uint8_t ch = 0;
+    return ( 1 == ReadPipedInput( & ch, 1 ) ) ? ch : EOF;
+} //GetPipedChar
+
+static bool PipedInputReady()
+{
+    // like DOS with redirected input, a character is available until the end of input
+
+    return ReplayFlag( replayKeyWaiting, !Replaying() && FillPipedInput() );
+} //PipedInputReady
+
+static void WritePipedOutput( FILE * fp, const uint8_t * p, size_t len )
+{
+    // carriage returns and vertical tabs are dropped as in teletype mode. the runs between them are written whole
+
+    size_t start = 0;
+    for ( size_t i = 0; i < len; i++ )
+    {
+        if ( 0x0d == p[ i ] || 0x0b == p[ i ] )
+        {
+            fwrite( p + start, 1, i - start, fp );
+            start = i + 1;
+        }
+    }
+
+    fwrite( p + start, 1, len - start, fp );
+} //WritePipedOutput
+
+static void FlushConsoleOutput()
+{
+    if ( !g_pipedStdout )
+        fflush( stdout );
+} //FlushConsoleOutput
+
+#ifndef NTVDM_LIBRARY
+static void ConfigurePipedHandles()
+{
+#ifdef _WIN32
+    g_pipedStdin = !_isatty( _fileno( stdin ) );
+    g_pipedStdout = !_isatty( _fileno( stdout ) );
+    if ( g_pipedStdin )
+        _setmode( _fileno( stdin ), _O_BINARY ); // apps see CRs, as they would on DOS
+#else
+    g_pipedStdin = !isatty( STDIN_FILENO );
+    g_pipedStdout = !isatty( STDOUT_FILENO );
+#endif
+
+    if ( g_pipedStdout )
+        setvbuf( stdout, 0, _IOFBF, PipedBufferSize );
+
+    g_pipedInput.next = 0;
+    g_pipedInput.count = 0;
+    g_pipedInput.ended = false;
+    tracer.Trace( "piped stdin: %d, piped stdout: %d\n", g_pipedStdin, g_pipedStdout );
+} //ConfigurePipedHandles
+#endif //NTVDM_LIBRARY
+
+static bool KeystrokeWaiting()
+{
+    return ReplayFlag( replayKeyWaiting, !Replaying() && !g_pipedStdin && g_consoleConfig.throttled_kbhit() );
+} //KeystrokeWaiting
+
+#if !USE_ASSEMBLY_FOR_KBD
+static char * ReadConsoleLine( char * buf, size_t bufsize )
+{
+    char * result = Replaying() ? 0 : ConsoleConfiguration::portable_gets_s( buf, bufsize );
+    uint32_t bytes = result ? (uint32_t) strlen( result ) + 1 : 0;
+    if ( result && ( result != buf ) )
+        memmove( buf, result, bytes );
+
+    bytes = ReplayBytes( replayLine, buf, bytes, (uint32_t) bufsize );
+    return bytes ? buf : 0;
+} //ReadConsoleLine
+#endif
+
+static void ReplayClock()
+{
+    // the date and time calls return in al, cx, and dx
+
+    uint16_t regs[ 3 ] = { cpu.al(), cpu.get_cx(), cpu.get_dx() };
+    ReplayValue( replayClock, regs, sizeof( regs ) );
+    cpu.set_al( (uint8_t) regs[ 0 ] );
+    cpu.set_cx( regs[ 1 ] );
+    cpu.set_dx( regs[ 2 ] );
+} //ReplayClock
+
+static void ReplayInterrupt( uint8_t interrupt_num, uint64_t total_cycles )
+{
+    // interrupts follow from the logged inputs. log them anyway to catch a replay that went astray
+
+    uint8_t raised[ 9 ];
+    raised[ 0 ] = interrupt_num;
+    memcpy( raised + 1, & total_cycles, sizeof( total_cycles ) );
+    uint8_t logged[ sizeof( raised ) ];
+    memcpy( logged, raised, sizeof( raised ) );
+    ReplayValue( replayInterrupt, logged, sizeof( logged ) );
+    if ( memcmp( logged, raised, sizeof( raised ) ) )
+        ReplayDiverged( replayInterrupt );
+} //ReplayInterrupt
+
+// Idle detection. Editors waiting for a keystroke spin in loops like "cmp bx, es:[6ch] / je" or a keyboard status
+// poll, keeping a host core busy for hours. Between emulate() slices the main loop hashes the registers; when a hash
+// repeats, it protects memory[] with the dirty page tracking above and waits for the same registers to come around
+// again. If by then no byte of memory changed and only side-effect free polls ran, the machine is back in a state
+// it was already in, and just a timer tick or keystroke can make the next pass any different. So the main loop
+// parks until one is due. Protection is needed to prove memory didn't change, so this is off on Windows. It's also
+// off while recording or replaying since parking would poll the keyboard a timing-dependent number of times.
+
+struct IdleDetector
+{
+    uint64_t recent[ 8 ];   // register hashes at the ends of recent slices
+    size_t next;            // where the next hash goes in recent
+    uint64_t watched;       // the hash that must come around again with memory unchanged
+    uint32_t slicesLeft;    // slices left for watched to come around again. 0 when not watching
+    uint32_t backoff;       // slices to skip after a watch fails, so busy loops don't keep paying for protection
+    uint32_t skip;          // slices left to skip
+    bool busy;              // an interrupt or port access with side effects happened while watching
+    uint64_t parks;         // times the main loop parked
+};
+
+static IdleDetector g_idle = {};
+
+static bool IsPollingInterrupt( uint8_t i, uint8_t ah )
+{
+    // interrupts that only report state. calling them over and over changes nothing
+
+    switch ( i )
+    {
+        case 0x10: return ( 3 == ah || 8 == ah || 0xf == ah );                                // cursor, character, mode
+        case 0x16: return ( 1 == ah || 2 == ah || 0x11 == ah || 0x12 == ah );               // keystroke waiting, shift flags
+        case 0x1a: return ( 0 == ah || 2 == ah );                                             // ticks, rtc time
+        case 0x21: return ( 0xb == ah || 0x2a == ah || 0x2c == ah ||                          // input status, date, time
+                            ( 6 == ah && 0xff == cpu.dl() ) );                                // direct console input
+        case 0x28: return true;                                                               // dos idle
+        case 0x2f: return ( 0x1680 == cpu.get_ax() );                                         // release timeslice
+        case 0x33: return ( 3 == cpu.get_ax() );                                              // mouse status
+    }
+
+    return false;
+} //IsPollingInterrupt
+
+#ifndef _WIN32
+static pthread_mutex_t g_idleMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_idleWake = PTHREAD_COND_INITIALIZER; // signaled by the keyboard thread when a keystroke arrives
+
+static void WakeParkedCPU()
+{
+    C_pthread_mutex_t_lock lock( g_idleMutex );
+    pthread_cond_signal( & g_idleWake );
+} //WakeParkedCPU
+
+static void WaitForKeystroke( uint64_t ns )
+{
+    // sleep for up to ns or until the keyboard thread signals that it decoded a keystroke
+
+    struct timespec to;
+    clock_gettime( CLOCK_REALTIME, & to );
+    to.tv_sec += (time_t) ( ( to.tv_nsec + ns ) / 1000000000 );
+    to.tv_nsec = (long) ( ( to.tv_nsec + ns ) % 1000000000 );
+
+    C_pthread_mutex_t_lock lock( g_idleMutex );
+    if ( !g_KbdPeekAvailable )
+        pthread_cond_timedwait( & g_idleWake, & g_idleMutex, & to );
+} //WaitForKeystroke
+
+#ifndef NTVDM_LIBRARY
+static uint64_t RegisterHash()
+{
+    i8086_registers r;
+    cpu.save_registers( r );
+
+    uint64_t h = 14695981039346656037ull; // FNV-1a
+    const uint8_t * p = (const uint8_t *) & r;
+    for ( size_t i = 0; i < sizeof( r ); i++ )
+        h = ( h ^ p[ i ] ) * 1099511628211ull;
+    return h;
+} //RegisterHash
+
+static bool MemoryUnchangedWhileWatching()
+{
+    for ( size_t page = 0; page < MemoryPages; page++ )
+    {
+        if ( 2 == g_dirtyPages[ page ] )
+            return false;
+
+        if ( g_dirtyPages[ page ] &&
+             memcmp( g_dirtyPageOriginals + page * MemoryPageSize, memory + page * MemoryPageSize, MemoryPageSize ) )
+            return false;
+    }
+
+    return true;
+} //MemoryUnchangedWhileWatching
+
+static void StopIdleWatch( bool failed )
+{
+    StopDirtyTracking();
+    g_dirtyPageOriginals = 0;
+    g_idle.slicesLeft = 0;
+
+    if ( failed )
+    {
+        memset( g_idle.recent, 0, sizeof( g_idle.recent ) );
+        g_idle.backoff = get_min( 2 * g_idle.backoff + 1, (uint32_t) 1023 );
+        g_idle.skip = g_idle.backoff;
+    }
+    else
+        g_idle.backoff = 0;
+} //StopIdleWatch
+
+static bool IdleAfterSlice()
+{
+    // called after each emulate() slice. returns true once the app is provably waiting for a timer tick or keystroke
+
+    if ( g_replay.fp )
+        return false;
+
+    if ( g_idle.skip )
+    {
+        g_idle.skip--;
+        return false;
+    }
+
+    uint64_t h = RegisterHash();
+
+    if ( g_idle.slicesLeft )
+    {
+        if ( g_idle.busy )
+            StopIdleWatch( true );
+        else if ( h == g_idle.watched )
+        {
+            bool unchanged = MemoryUnchangedWhileWatching();
+            StopIdleWatch( !unchanged );
+            return unchanged;
+        }
+        else if ( 0 == --g_idle.slicesLeft )
+            StopIdleWatch( true );
+
+        return false;
+    }
+
+    bool repeated = false;
+    for ( size_t i = 0; i < _countof( g_idle.recent ); i++ )
+        repeated |= ( h == g_idle.recent[ i ] );
+
+    g_idle.recent[ g_idle.next ] = h;
+    g_idle.next = ( g_idle.next + 1 ) % _countof( g_idle.recent );
+
+    if ( repeated && !g_dirtyTracking ) // a DosContext may be tracking already
+    {
+        static vector<uint8_t> originals( MemoryPages * MemoryPageSize );
+        g_dirtyPageOriginals = originals.data();
+        g_idle.watched = h;
+        g_idle.busy = false;
+        g_idle.slicesLeft = 2 * _countof( g_idle.recent );
+        StartDirtyTracking();
+        if ( !g_dirtyTracking )
+            StopIdleWatch( true );
+    }
+
+    return false;
+} //IdleAfterSlice
+
+static void ParkUntilTickOrKeystroke()
+{
+    const uint64_t tickNs = 54925100; // see BiosTickNs
+    high_resolution_clock::time_point now = high_resolution_clock::now();
+    uint64_t elapsed = duration_cast<std::chrono::nanoseconds>( now - g_tAppStart ).count();
+    high_resolution_clock::time_point tick = g_tAppStart + std::chrono::nanoseconds( ( elapsed / tickNs + 1 ) * tickNs );
+    g_idle.parks++;
+    tracer.Trace( "  idle loop detected at %04x:%04x; parking\n", cpu.get_cs(), cpu.get_ip() );
+
+    while ( now < tick )
+    {
+        // without a keyboard thread nothing signals the condition, so check the keyboard every 10 milliseconds
+
+        uint64_t wait = duration_cast<std::chrono::nanoseconds>( tick - now ).count();
+        if ( g_UseOneThread )
+            wait = get_min( wait, (uint64_t) 10000000 );
+
+        WaitForKeystroke( wait );
+
+        if ( g_KbdPeekAvailable || ( g_UseOneThread && !g_pipedStdin && g_consoleConfig.portable_kbhit() ) )
+            break;
+
+        now = high_resolution_clock::now();
+    }
+} //ParkUntilTickOrKeystroke
+#endif //NTVDM_LIBRARY
+#endif
+
 bool ValidDOSFilename( char * pc )
 {
     if ( 0 == *pc )
@@ -495,6 +1141,7 @@ static HANDLE g_heventKeyStroke;
 #endif
 
 uint8_t * GetDiskTransferAddress() { return cpu.flat_address8( g_diskTransferSegment, g_diskTransferOffset ); }
+uint32_t DiskTransferKey() { return (uint32_t) ( GetDiskTransferAddress() - memory ); }
 
 #pragma pack( push, 1 )
 struct DosFindFile
@@ -511,6 +1158,7 @@ struct DosFindFile
 };
 #pragma pack(pop)
 
+#ifndef NTVDM_LIBRARY
 static void version()
 {
     printf( "%s\n", build_string() );
@@ -525,6 +1173,11 @@ static void usage( char const * perr )
         printf( "error: %s\n", perr );
 
     printf( "Usage: %s [OPTION]... PROGRAM [ARGUMENT]...\n", g_thisApp );
+    printf( "       %s [OPTION]... --restore:FILE\n", g_thisApp );
+    printf( "       %s --batch:JOBFILE [--workers:N]\n", g_thisApp );
+#ifndef _WIN32
+    printf( "       %s --client:SOCKET [ARGUMENT]...\n", g_thisApp );
+#endif
     printf( "Emulates an 8086 and MS-DOS 3.30 runtime environment.\n" );
     printf( "\n" );
     printf( "  -b               load/run program as the boot sector at 07c0:0000\n" );
@@ -535,6 +1188,7 @@ static void usage( char const * perr )
     printf( "  -f               fill memory blocks with patterns to find app bugs\n" );
     printf( "  -h               load high above 64k and below 0xa0000.\n" );
     printf( "  -i               trace instructions to %s.log.\n", g_thisApp );
+    printf( "  -j               compile frequently run code to x86-64 code. implies -x.\n" );
     printf( "  -m               after the app ends, print video memory\n" );
     printf( "  -p               show performance stats on exit.\n" );
     printf( "  -r:root          root folder that maps to C:\\\n" );
@@ -553,7 +1207,25 @@ static void usage( char const * perr )
     printf( "            -kw    write keywtrokes to kslog.txt\n" );
 */
     printf( "  -v               output version information and exit.\n" );
+    printf( "  -x               decode straight-line code once into a cache of basic blocks.\n" );
     printf( "  -?               output this help and exit.\n" );
+    printf( "  --batch:JOBFILE  run each line of JOBFILE, [OPTION]... PROGRAM [ARGUMENT]..., in parallel.\n" );
+    printf( "                     output is printed in job order. job options are -r: -e: -u -l\n" );
+    printf( "  --workers:N      jobs to run at once with --batch. default is the number of cores.\n" );
+    printf( "  --snapshot:FILE  save the machine to FILE when the app first reads the keyboard or stdin.\n" );
+    printf( "  --restore:FILE   resume the machine saved in FILE instead of loading a PROGRAM.\n" );
+    printf( "  --record:FILE    log keystrokes, the clock, and file reads to FILE so --replay can rerun the session.\n" );
+    printf( "  --replay:FILE    rerun a --record session, taking its inputs from FILE. use the same command line.\n" );
+    printf( "  --stats:FILE     count instructions, prefixes, mod r/m forms, and interrupts. write them to FILE as JSON.\n" );
+    printf( "  --trace:FILE     write a compact binary trace of every instruction and memory write to FILE.\n" );
+    printf( "  --tracedump:FILE[,SEG]  as the first argument, print a --trace file like -i does. SEG: only this cs.\n" );
+    printf( "  --tracediff:A,B  as the first argument, show where two --trace files first differ.\n" );
+    printf( "  --profile:FILE   sample cs:ip and write hot segments and addresses to FILE, flamegraph input to FILE.folded.\n" );
+    printf( "  --profilecycles:N  cycles between --profile samples. default is 1000.\n" );
+#ifndef _WIN32
+    printf( "  --server:SOCKET  run PROGRAM to its first input read, then fork there for each --client request.\n" );
+    printf( "  --client:SOCKET  as the first argument, run [ARGUMENT]... with the server's PROGRAM.\n" );
+#endif
     printf( "\n" );
     printf( "Examples:\n" );
 #ifdef _WIN32
@@ -571,6 +1243,7 @@ static void usage( char const * perr )
     printf( "%s\n", build_string() );
     exit( 1 );
 } //usage
+#endif //NTVDM_LIBRARY
 
 class CKbdBuffer
 {
@@ -748,27 +1421,87 @@ uint8_t * GetVideoMem()
     return cpu.flat_address8( ScreenBufferSegment, 0x1000 * GetActiveDisplayPage() );
 } //GetVideoMem
 
+// Sets a bit in dirty for each cell (character plus attribute) that differs between a and b. Each
+// uint16_t in dirty covers 16 cells, so an 80 column row is 5 of them. Returns true if any cell differs.
+
+bool FindDirtyCells( const uint8_t * a, const uint8_t * b, size_t cells, uint16_t * dirty )
+{
+    assert( 0 == ( cells % 16 ) );
+    uint32_t any = 0;
+
+    for ( size_t i = 0; i < cells; i += 16 )
+    {
+        const uint8_t * pa = a + i * 2;
+        const uint8_t * pb = b + i * 2;
+        uint16_t bits;
+
+#if defined( USE_SSE2_FOR_DISPLAY_DIFF )
+        __m128i eq0 = _mm_cmpeq_epi16( _mm_loadu_si128( (const __m128i *) pa ), _mm_loadu_si128( (const __m128i *) pb ) );
+        __m128i eq1 = _mm_cmpeq_epi16( _mm_loadu_si128( (const __m128i *) ( pa + 16 ) ), _mm_loadu_si128( (const __m128i *) ( pb + 16 ) ) );
+        bits = (uint16_t) ~ _mm_movemask_epi8( _mm_packs_epi16( eq0, eq1 ) ); // one byte and so one mask bit per cell
+#elif defined( USE_NEON_FOR_DISPLAY_DIFF )
+        static const uint8_t weights[ 16 ] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+        uint16x8_t eq0 = vceqq_u16( vld1q_u16( (const uint16_t *) pa ), vld1q_u16( (const uint16_t *) pb ) );
+        uint16x8_t eq1 = vceqq_u16( vld1q_u16( (const uint16_t *) ( pa + 16 ) ), vld1q_u16( (const uint16_t *) ( pb + 16 ) ) );
+        uint8x16_t ne = vmvnq_u8( vcombine_u8( vmovn_u16( eq0 ), vmovn_u16( eq1 ) ) );
+        uint8x16_t w = vandq_u8( ne, vld1q_u8( weights ) );
+        bits = (uint16_t) ( vaddv_u8( vget_low_u8( w ) ) | ( vaddv_u8( vget_high_u8( w ) ) << 8 ) );
+#else
+        bits = 0;
+        for ( size_t c = 0; c < 16; c++ )
+            if ( ( pa[ c * 2 ] != pb[ c * 2 ] ) || ( pa[ c * 2 + 1 ] != pb[ c * 2 + 1 ] ) )
+                bits |= ( 1 << c );
+#endif
+
+        dirty[ i / 16 ] = bits;
+        any |= bits;
+    }
+
+    return ( 0 != any );
+} //FindDirtyCells
+
+static uint16_t g_dirtyCells[ 80 * 50 / 16 ]; // bits set by FindDirtyCells for the last display update check
+static uint32_t g_videoGenerationChecked = 0;  // cpu video generation at the last display update check
+static uint32_t g_videoGenerationDrawn = 0;    // cpu video generation the display is known to reflect
+
+bool VideoMemoryMayHaveChanged() { return ( cpu.get_video_generation() != g_videoGenerationDrawn ); }
+
 bool DisplayUpdateRequired()
 {
-    return ( 0 != memcmp( g_bufferLastUpdate, GetVideoMem(), ScreenColumns * GetScreenRows() * 2 ) );
+    // skip the buffer diff entirely unless the cpu or a bios/dos handler may have written video memory
+
+    g_videoGenerationChecked = cpu.get_video_generation();
+    if ( g_videoGenerationChecked == g_videoGenerationDrawn )
+        return false;
+
+    bool required = FindDirtyCells( g_bufferLastUpdate, GetVideoMem(), ScreenColumns * GetScreenRows(), g_dirtyCells );
+    if ( !required )
+        g_videoGenerationDrawn = g_videoGenerationChecked;
+
+    return required;
 } //DisplayUpdateRequired
 
 void SleepAndScheduleInterruptCheck()
 {
-    if ( g_UseOneThread && g_consoleConfig.throttled_kbhit() )
+    if ( g_UseOneThread && KeystrokeWaiting() )
         g_KbdPeekAvailable = true; // make sure an int9 gets scheduled
 
     CKbdBuffer kbd_buf;
     if ( kbd_buf.IsEmpty() && !DisplayUpdateRequired() && !g_KbdPeekAvailable )
     {
         tracer.Trace( "  sleeping in SleepAndScheduleInterruptCheck. g_KbdPeekAvailable %d\n", g_KbdPeekAvailable );
+        high_resolution_clock::time_point tStart = high_resolution_clock::now();
 #ifdef _WIN32
         DWORD dw = WaitForSingleObject( g_heventKeyStroke, 1 );
         tracer.Trace( "  sleep woke up due to %s\n", ( 0 == dw ) ? "keystroke event signaled" : "timeout" );
 #else
-        sleep_ms( 10 );
+        if ( g_keyboardThreadActive )
+            WaitForKeystroke( 10000000 );
+        else
+            sleep_ms( 10 );
 #endif
         // just because the event was signaled doesn't ensure a keystroke is available. It may be from earlier, but that's OK
+        CreditSleepCycles( tStart );
     }
     cpu.exit_emulate_early(); // fall out of the instruction loop early to check for a timer or keyboard interrupt
 } //SleepAndScheduleInterruptCheck
@@ -793,25 +1526,24 @@ static const char * get_access_mode( uint8_t mode )
 
 static void trace_all_open_files()
 {
-    size_t cEntries = g_fileEntries.size();
-    tracer.Trace( "  all files, count %d:\n", cEntries );
-    for ( size_t i = 0; i < cEntries; i++ )
+    tracer.Trace( "  all files:\n" );
+    for ( size_t h = 0; h < g_fileEntries.size(); h++ )
     {
-        FileEntry & fe = g_fileEntries[ i ];
-        tracer.Trace( "    file entry %d, fp %p, handle %u, mode %s, process %u, path %s\n",
-                      i, fe.fp, fe.handle, get_access_mode( fe.mode ), fe.seg_process, fe.path );
+        FileEntry & fe = g_fileEntries[ h ];
+        if ( fe.fp )
+            tracer.Trace( "    file entry fp %p, handle %u, mode %s, process %u, path %s\n",
+                          fe.fp, fe.handle, get_access_mode( fe.mode ), fe.seg_process, fe.path );
     }
 } //trace_all_open_files
 
 static void trace_all_open_files_fcb()
 {
-    size_t cEntries = g_fileEntriesFCB.size();
-    tracer.Trace( "  all fcb files, count %d:\n", cEntries );
-    for ( size_t i = 0; i < cEntries; i++ )
+    tracer.Trace( "  all fcb files, count %d:\n", g_fileEntriesFCB.size() );
+    for ( auto it = g_fileEntriesFCB.begin(); it != g_fileEntriesFCB.end(); it++ )
     {
-        FileEntry & fe = g_fileEntriesFCB[ i ];
-        tracer.Trace( "    fcb file entry %d, fp %p, handle %u, mode %s, process %u, path %s\n",
-                      i, fe.fp, fe.handle, get_access_mode( fe.mode ), fe.seg_process, fe.path );
+        FileEntry & fe = it->second;
+        tracer.Trace( "    fcb file entry fp %p, handle %u, mode %s, process %u, path %s\n",
+                      fe.fp, fe.handle, get_access_mode( fe.mode ), fe.seg_process, fe.path );
     }
 } //trace_all_open_files_fcb
 
@@ -821,10 +1553,11 @@ static bool tc_build_file_open()
     // all the time regardless of whether it's building something.
 
     static const char * build_ext[] = { ".obj", ".c", ".h", ".exe", ".lib", };
-    size_t cEntries = g_fileEntries.size();
-    for ( size_t i = 0; i < cEntries; i++ )
+    for ( size_t h = 0; h < g_fileEntries.size(); h++ )
     {
-        FileEntry & fe = g_fileEntries[ i ];
+        FileEntry & fe = g_fileEntries[ h ];
+        if ( !fe.fp )
+            continue;
 
         for ( size_t e = 0; e < _countof( build_ext ); e++ )
           if ( ends_with( fe.path, build_ext[ e ] ) )
@@ -846,55 +1579,261 @@ uint8_t get_current_drive()
 #endif
 } //get_current_drive
 
-static int compare_int_entries( const void * a, const void * b )
+static string FilePathKey( const char * path )
 {
-    // sort by int then ah
+    // paths are compared case-insensitively, like _stricmp()
 
-    IntCalled const * pa = (IntCalled const *) a;
-    IntCalled const * pb = (IntCalled const *) b;
+    string key( path );
+    for ( size_t i = 0; i < key.length(); i++ )
+        key[ i ] = (char) tolower( key[ i ] );
+    return key;
+} //FilePathKey
 
-    if ( pa->i > pb->i )
-        return 1;
+const char * InternPath( const char * path )
+{
+    // each call adds a reference that ReleasePath() drops when the entry goes away
 
-    if ( pa->i == pb->i )
-    {
-        if ( pa->c > pb->c )
-            return 1;
+    auto it = g_filePaths.insert( make_pair( string( path ), 0 ) ).first;
+    it->second++;
+    return it->first.c_str(); // unordered_map nodes don't move, so the pointer stays valid
+} //InternPath
 
-        if ( pa->c == pb->c )
-            return 0;
-    }
+void ReleasePath( const char * path )
+{
+    auto it = g_filePaths.find( path );
+    assert( it != g_filePaths.end() );
+    if ( it != g_filePaths.end() && 0 == --it->second )
+        g_filePaths.erase( it );
+} //ReleasePath
 
-    return -1;
-} //compare_int_entries
+// Host streams behind DOS file handles and FCBs. Apps read and write in small records (linkers write EXEs 512 bytes
+// at a time), so each stream gets a large buffer that serves reads ahead and collects writes behind, and the stream
+// is only repositioned when it has to be: a seek to where it already is or a read following a read is free. The host
+// kernel's page cache does the actual I/O asynchronously; what's left to save is syscalls on the CPU thread.
+// A file can have more than one stream, e.g. a handle duplicated with int 21 45/46 gets its own FILE *. Those are
+// marked shared, and a read on one first pushes the others' buffered writes to the file and drops its own
+// read-ahead if they wrote since it was filled.
 
-static int compare_file_entries( const void * a, const void * b )
+struct HostStream
 {
-    // sort by file handle, low to high
+    vector<char> buffer;
+    string path;       // host path the stream was opened with
+    int64_t position;  // -1 when unknown, e.g. after a seek relative to the end
+    bool writing;      // direction of the last transfer. C requires a seek between a write and a following read
+    bool shared;       // another stream has been opened on the same path
+    bool dirty;        // written since the last flush. only tracked for shared streams
+    bool stale;        // another stream on the path wrote since this one's read buffer was filled
+};
 
-    FileEntry const * pa = (FileEntry const *) a;
-    FileEntry const * pb = (FileEntry const *) b;
+static unordered_map<FILE *, HostStream> g_hostStreams;
+static const size_t HostStreamBufferBytes = 64 * 1024;
 
-    if ( pa->handle > pb->handle )
-        return 1;
+static FILE * OpenHostFile( const char * path, const char * mode )
+{
+    fflush( 0 ); // write-behind data on another stream for this file must be on disk before it's opened again
 
-    if ( pa->handle == pb->handle )
-        return 0;
+    FILE * fp = fopen( path, mode );
+    if ( fp )
+    {
+        HostStream & hs = g_hostStreams[ fp ];
+        hs.buffer.resize( HostStreamBufferBytes );
+        hs.path = path;
+        hs.position = 0;
+        hs.writing = false;
+        hs.shared = false;
+        hs.dirty = false;
+        hs.stale = false;
 
-    return -1;
-} //compare_file_entries
+        for ( auto & e : g_hostStreams )
+        {
+            if ( e.first != fp && e.second.path == hs.path )
+            {
+                e.second.shared = true;
+                hs.shared = true;
+            }
+        }
+
+        setvbuf( fp, hs.buffer.data(), _IOFBF, hs.buffer.size() );
+#ifdef __linux__
+        posix_fadvise( fileno( fp ), 0, 0, POSIX_FADV_SEQUENTIAL ); // a larger kernel read-ahead window
+#endif
+    }
+
+    return fp;
+} //OpenHostFile
+
+static int CloseHostFile( FILE * fp )
+{
+    auto it = g_hostStreams.find( fp ); // before fclose; fp can't be used as a key once it's closed
+    int result = fclose( fp );
+    if ( it != g_hostStreams.end() )
+        g_hostStreams.erase( it ); // after fclose; the buffer is in use until then
+    return result;
+} //CloseHostFile
+
+static HostStream * LookupHostStream( FILE * fp )
+{
+    auto it = g_hostStreams.find( fp );
+    return ( it == g_hostStreams.end() ) ? 0 : & it->second;
+} //LookupHostStream
+
+static void SyncSharedHostStream( FILE * fp, HostStream & hs )
+{
+    // before reading fp, get writes buffered by other streams on its file to the file and drop fp's stale read-ahead
+
+    for ( auto & e : g_hostStreams )
+    {
+        if ( e.second.dirty && e.first != fp && e.second.path == hs.path )
+        {
+            fflush( e.first );
+            e.second.dirty = false;
+        }
+    }
+
+    if ( hs.stale )
+    {
+        fseek( fp, 0, SEEK_CUR ); // discards the read buffer and keeps the position
+        hs.stale = false;
+    }
+} //SyncSharedHostStream
+
+static void NoteSharedHostStreamWrite( FILE * fp, HostStream & hs )
+{
+    hs.dirty = true;
+    for ( auto & e : g_hostStreams )
+        if ( e.first != fp && e.second.path == hs.path )
+            e.second.stale = true;
+} //NoteSharedHostStreamWrite
+
+static int64_t SeekHostFile( FILE * fp, int64_t offset, int origin = SEEK_SET )
+{
+    // returns the new position or -1 on failure
+
+    HostStream * hs = LookupHostStream( fp );
+    if ( hs && SEEK_CUR == origin && -1 != hs->position )
+    {
+        offset += hs->position; // so asking where the stream is doesn't flush or discard its buffer
+        origin = SEEK_SET;
+    }
+
+    if ( hs && SEEK_SET == origin && offset == hs->position )
+        return offset;
+
+    if ( hs && hs->shared && SEEK_END == origin )
+        SyncSharedHostStream( fp, *hs ); // the end includes what the other streams wrote
+
+    if ( fseek( fp, (long) offset, origin ) )
+    {
+        if ( hs )
+            hs->position = -1;
+        return -1;
+    }
+
+    int64_t position = ( SEEK_SET == origin ) ? offset : (int64_t) ftell( fp );
+    if ( hs )
+        hs->position = position;
+    return position;
+} //SeekHostFile
+
+static size_t TransferHostFile( FILE * fp, void * p, size_t len, bool write )
+{
+    HostStream * hs = LookupHostStream( fp );
+    if ( hs && hs->writing != write )
+    {
+        fseek( fp, 0, SEEK_CUR ); // switching direction needs a positioning call in between
+        hs->writing = write;
+    }
+
+    if ( hs && hs->shared )
+    {
+        if ( write )
+            NoteSharedHostStreamWrite( fp, *hs );
+        else
+            SyncSharedHostStream( fp, *hs );
+    }
+
+    size_t n;
+    if ( write )
+        n = fwrite( p, 1, len, fp );
+    else
+    {
+        clearerr( fp ); // another stream may have extended the file since this one hit the end
+        PrepareMemoryForRead( p, len );
+        n = fread( p, 1, len, fp );
+    }
+
+    if ( hs && -1 != hs->position )
+        hs->position += n;
+    return n;
+} //TransferHostFile
+
+static size_t ReadHostFile( FILE * fp, void * p, size_t len )
+{
+    return TransferHostFile( fp, p, len, false );
+} //ReadHostFile
+
+static size_t WriteHostFile( FILE * fp, const void * p, size_t len )
+{
+    return TransferHostFile( fp, (void *) p, len, true );
+} //WriteHostFile
+
+FileEntry * LookupFileEntry( uint16_t handle )
+{
+    if ( ( handle < g_fileEntries.size() ) && ( 0 != g_fileEntries[ handle ].fp ) )
+        return & g_fileEntries[ handle ];
+
+    return 0;
+} //LookupFileEntry
+
+void AddFileEntry( FileEntry & fe )
+{
+    // fe.handle is from FindFirstFreeFileHandle()
+
+    if ( fe.handle >= g_fileEntries.size() )
+        g_fileEntries.resize( fe.handle + 1 );
+
+    assert( 0 == g_fileEntries[ fe.handle ].fp );
+    g_fileEntries[ fe.handle ] = fe;
+    g_fileHandlesByPath.insert( make_pair( FilePathKey( fe.path ), fe.handle ) );
+} //AddFileEntry
+
+void AddFileEntryFCB( FileEntry & fe )
+{
+    string key = FilePathKey( fe.path );
+    auto it = g_fileEntriesFCB.find( key );
+    if ( it != g_fileEntriesFCB.end() )
+    {
+        tracer.Trace( "  closing fcb file '%s' that was open when it was created again\n", it->second.path );
+        CloseHostFile( it->second.fp );
+        ReleasePath( it->second.path );
+    }
+
+    g_fileEntriesFCB[ key ] = fe;
+} //AddFileEntryFCB
 
 FILE * RemoveFileEntry( uint16_t handle )
 {
-    for ( size_t i = 0; i < g_fileEntries.size(); i++ )
+    FileEntry * pfe = LookupFileEntry( handle );
+    if ( pfe )
     {
-        if ( handle == g_fileEntries[ i ].handle )
+        FILE * fp = pfe->fp;
+        tracer.Trace( "  removing file entry %s: %d\n", pfe->path, handle );
+
+        auto range = g_fileHandlesByPath.equal_range( FilePathKey( pfe->path ) );
+        for ( auto it = range.first; it != range.second; it++ )
         {
-            FILE * fp = g_fileEntries[ i ].fp;
-            tracer.Trace( "  removing file entry %s: %d\n", g_fileEntries[ i ].path, i );
-            g_fileEntries.erase( g_fileEntries.begin() + i );
-            return fp;
+            if ( handle == it->second )
+            {
+                g_fileHandlesByPath.erase( it );
+                break;
+            }
         }
+
+        ReleasePath( pfe->path );
+        memset( pfe, 0, sizeof( FileEntry ) );
+        if ( handle < g_firstFreeFileHandle )
+            g_firstFreeFileHandle = handle;
+        return fp;
     }
 
     tracer.Trace( "  ERROR: could not remove file entry for handle %04x\n", handle );
@@ -903,15 +1842,14 @@ FILE * RemoveFileEntry( uint16_t handle )
 
 FILE * RemoveFileEntryFCB( const char * pname )
 {
-    for ( size_t i = 0; i < g_fileEntriesFCB.size(); i++ )
+    auto it = g_fileEntriesFCB.find( FilePathKey( pname ) );
+    if ( it != g_fileEntriesFCB.end() )
     {
-        if ( !_stricmp( pname, g_fileEntriesFCB[ i ].path ) )
-        {
-            FILE * fp = g_fileEntriesFCB[ i ].fp;
-            tracer.Trace( "  removing fcb file entry %s: %d\n", g_fileEntriesFCB[ i ].path, i );
-            g_fileEntriesFCB.erase( g_fileEntriesFCB.begin() + i );
-            return fp;
-        }
+        FILE * fp = it->second.fp;
+        tracer.Trace( "  removing fcb file entry %s\n", it->second.path );
+        ReleasePath( it->second.path );
+        g_fileEntriesFCB.erase( it );
+        return fp;
     }
 
     tracer.Trace( "  ERROR: could not remove fcb file entry for name '%s'\n", pname );
@@ -920,28 +1858,24 @@ FILE * RemoveFileEntryFCB( const char * pname )
 
 FILE * FindFileEntry( uint16_t handle )
 {
-    for ( size_t i = 0; i < g_fileEntries.size(); i++ )
+    FileEntry * pfe = LookupFileEntry( handle );
+    if ( pfe )
     {
-        if ( handle == g_fileEntries[ i ].handle )
-        {
-            tracer.Trace( "  found file entry '%s': %d\n", g_fileEntries[ i ].path, i );
-            return g_fileEntries[ i ].fp;
-        }
+        tracer.Trace( "  found file entry '%s': %d\n", pfe->path, handle );
+        return pfe->fp;
     }
 
     tracer.Trace( "  ERROR: could not find file entry for handle %04x\n", handle );
     return 0;
 } //FindFileEntry
 
-size_t FindFileEntryIndex( uint16_t handle )
+size_t FindFileEntryIndex( uint16_t handle ) // the index into g_fileEntries is the handle
 {
-    for ( size_t i = 0; i < g_fileEntries.size(); i++ )
+    FileEntry * pfe = LookupFileEntry( handle );
+    if ( pfe )
     {
-        if ( handle == g_fileEntries[ i ].handle )
-        {
-            tracer.Trace( "  found file entry '%s': %d\n", g_fileEntries[ i ].path, i );
-            return i;
-        }
+        tracer.Trace( "  found file entry '%s': %d\n", pfe->path, handle );
+        return handle;
     }
 
     tracer.Trace( "  ERROR: could not find file entry for handle %04x\n", handle );
@@ -950,33 +1884,31 @@ size_t FindFileEntryIndex( uint16_t handle )
 
 size_t FindFileEntryIndexByProcess( uint16_t seg )
 {
-    for ( size_t i = 0; i < g_fileEntries.size(); i++ )
+    for ( size_t h = 0; h < g_fileEntries.size(); h++ )
     {
-        if ( seg == g_fileEntries[ i ].seg_process )
-            return i;
+        if ( g_fileEntries[ h ].fp && ( seg == g_fileEntries[ h ].seg_process ) )
+            return h;
     }
     return (size_t) -1;
 } //FindFileEntryIndexByProcess
 
-size_t FindFileEntryIndexByProcessFCB( uint16_t seg )
+const char * FindFileEntryPathByProcessFCB( uint16_t seg )
 {
-    for ( size_t i = 0; i < g_fileEntriesFCB.size(); i++ )
+    for ( auto it = g_fileEntriesFCB.begin(); it != g_fileEntriesFCB.end(); it++ )
     {
-        if ( seg == g_fileEntriesFCB[ i ].seg_process )
-            return i;
+        if ( seg == it->second.seg_process )
+            return it->second.path;
     }
-    return (size_t) -1;
-} //FindFileEntryIndexByProcessFCB
+    return 0;
+} //FindFileEntryPathByProcessFCB
 
 const char * FindFileEntryPath( uint16_t handle )
 {
-    for ( size_t i = 0; i < g_fileEntries.size(); i++ )
+    FileEntry * pfe = LookupFileEntry( handle );
+    if ( pfe )
     {
-        if ( handle == g_fileEntries[ i ].handle )
-        {
-            tracer.Trace( "  found file entry '%s': %d\n", g_fileEntries[ i ].path, i );
-            return g_fileEntries[ i ].path;
-        }
+        tracer.Trace( "  found file entry '%s': %d\n", pfe->path, handle );
+        return pfe->path;
     }
 
     tracer.Trace( "  ERROR: could not find file entry for handle %04x\n", handle );
@@ -985,37 +1917,36 @@ const char * FindFileEntryPath( uint16_t handle )
 
 void TraceOpenFiles()
 {
-    for ( size_t i = 0; i < g_fileEntries.size(); i++ )
+    for ( size_t h = 0; h < g_fileEntries.size(); h++ )
     {
-        tracer.Trace( "    file index %d\n", i );
-        g_fileEntries[ i ].Trace();
+        if ( g_fileEntries[ h ].fp )
+            g_fileEntries[ h ].Trace();
     }
 } //TraceOpenFiles
 
 size_t FindFileEntryFromPath( const char * pfile )
 {
-    for ( size_t i = 0; i < g_fileEntries.size(); i++ )
-    {
-        if ( !_stricmp( pfile, g_fileEntries[ i ].path ) )
-        {
-            tracer.Trace( "  found file entry '%s': %d\n", g_fileEntries[ i ].path, i );
-            return i;
-        }
-    }
+    // if the file is open more than once, return the lowest handle
 
-    tracer.Trace( "  NOTICE: could not find file entry for path %s\n", pfile );
-    return (size_t) -1;
+    size_t found = (size_t) -1;
+    auto range = g_fileHandlesByPath.equal_range( FilePathKey( pfile ) );
+    for ( auto it = range.first; it != range.second; it++ )
+        found = get_min( found, (size_t) it->second );
+
+    if ( -1 != found )
+        tracer.Trace( "  found file entry '%s': %d\n", g_fileEntries[ found ].path, found );
+    else
+        tracer.Trace( "  NOTICE: could not find file entry for path %s\n", pfile );
+    return found;
 } //FindFileEntryFromPath
 
 FILE * FindFileEntryFromFileFCB( const char * pfile )
 {
-    for ( size_t i = 0; i < g_fileEntriesFCB.size(); i++ )
+    auto it = g_fileEntriesFCB.find( FilePathKey( pfile ) );
+    if ( it != g_fileEntriesFCB.end() )
     {
-        if ( !_stricmp( pfile, g_fileEntriesFCB[ i ].path ) )
-        {
-            tracer.Trace( "  found fcb file entry '%s': %d\n", g_fileEntriesFCB[ i ].path, i );
-            return g_fileEntriesFCB[ i ].fp;
-        }
+        tracer.Trace( "  found fcb file entry '%s'\n", it->second.path );
+        return it->second.fp;
     }
 
     tracer.Trace( "  NOTICE: could not find fcb file entry for path %s\n", pfile );
@@ -1027,22 +1958,12 @@ uint16_t FindFirstFreeFileHandle()
     // Apps like the QuickBasic compiler (bc.exe) depend on the side effect that after a file
     // is closed and a new file is opened the lowest possible free handle value is used for the
     // newly opened file. It's a bug in the app, but it's not getting fixed.
+    // DOS starts at 5, since 0-4 are for built-in handles. stdin, stdout, stderr, com1, lpt1
 
-    qsort( g_fileEntries.data(), g_fileEntries.size(), sizeof( FileEntry ), compare_file_entries );
-
-    // DOS uses this, since 0-4 are for built-in handles. stdin, stdout, stderr, com1, lpt1
-
-    uint16_t freehandle = 5;
-
-    for ( size_t i = 0; i < g_fileEntries.size(); i++ )
-    {
-        if ( g_fileEntries[ i ].handle != freehandle )
-            return freehandle;
-        else
-            freehandle++;
-    }
+    while ( LookupFileEntry( g_firstFreeFileHandle ) )
+        g_firstFreeFileHandle++;
 
-    return freehandle;
+    return g_firstFreeFileHandle;
 } //FindFirstFreeFileHandle
 
 #pragma pack( push, 1 )
@@ -1325,6 +2246,74 @@ bool keyState( int vkey )
 } //keyState
 #endif
 
+#ifndef _WIN32
+
+// Display updates on Linux/MacOS are built up in one buffer: cursor moves, attribute changes, and utf-8
+// text for every changed span, then the final cursor position. The whole frame goes out with one write()
+// so a repaint over ssh or tmux is one syscall rather than a printf and fflush per row.
+
+static char g_frame[ 80 * 50 * 22 + 32 ]; // per cell worst case: 3 for utf-8, 11 for attributes, 8 for a cursor move
+static size_t g_frameLength = 0;
+static uint16_t g_frameAttribute = 0xffff; // attribute the terminal is using in this frame or 0xffff if not known
+
+void FrameFlush()
+{
+    if ( 0 == g_frameLength )
+        return;
+
+    fflush( stdout ); // anything written with printf before the frame goes first
+
+    size_t sent = 0;
+    while ( sent < g_frameLength )
+    {
+        ssize_t result = write( 1, g_frame + sent, g_frameLength - sent );
+        if ( result <= 0 )
+        {
+            if ( ( result < 0 ) && ( EINTR == errno ) )
+                continue;
+            tracer.Trace( "  write of display frame failed, errno %d\n", errno );
+            break;
+        }
+        sent += result;
+    }
+
+    g_frameLength = 0;
+    g_frameAttribute = 0xffff; // other output may change the terminal's attributes between frames
+} //FrameFlush
+
+void FrameReserve( size_t bytes )
+{
+    if ( ( g_frameLength + bytes ) > sizeof( g_frame ) )
+        FrameFlush();
+} //FrameReserve
+
+void FrameAppendNumber( uint32_t n )
+{
+    char ac[ 10 ];
+    int len = 0;
+    do
+    {
+        ac[ len++ ] = (char) ( '0' + ( n % 10 ) );
+        n /= 10;
+    } while ( 0 != n );
+
+    while ( len > 0 )
+        g_frame[ g_frameLength++ ] = ac[ --len ];
+} //FrameAppendNumber
+
+void FrameAppendCursorMove( uint32_t row, uint32_t col ) // 0-based
+{
+    FrameReserve( 8 );
+    g_frame[ g_frameLength++ ] = 0x1b;
+    g_frame[ g_frameLength++ ] = '[';
+    FrameAppendNumber( row + 1 ); // vt-100 row/col are 1-based
+    g_frame[ g_frameLength++ ] = ';';
+    FrameAppendNumber( col + 1 );
+    g_frame[ g_frameLength++ ] = 'H';
+} //FrameAppendCursorMove
+
+#endif
+
 void UpdateScreenCursorPosition( uint8_t row, uint8_t col )
 {
     //tracer.Trace( "  updating screen cursor position to %d %d\n", row, col );
@@ -1333,8 +2322,8 @@ void UpdateScreenCursorPosition( uint8_t row, uint8_t col )
     COORD pos = { col, row };
     SetConsoleCursorPosition( g_hConsoleOutput, pos );
 #else
-    printf( "\x1b[%d;%dH", row + 1, col + 1 );    // vt-100 row/col are 1-based
-    fflush( stdout );
+    FrameAppendCursorMove( row, col );
+    FrameFlush(); // the cursor position always ends a frame
 #endif
 } //UpdateScreenCursorPosition
 
@@ -1613,16 +2602,11 @@ void UpdateHandleMap()
     DOSPSP * psp = (DOSPSP *) cpu.flat_address( g_currentPSP, 0 );
     memset( & ( psp->fileHandles[5] ), 0xff, sizeof( psp->fileHandles ) - 5 );
 
-    size_t cEntries = g_fileEntries.size();
-    if ( 0 != cEntries )
+    size_t cEntries = get_min( g_fileEntries.size(), _countof( psp->fileHandles ) );
+    for ( size_t h = 5; h < cEntries; h++ )
     {
-        cEntries = get_min( cEntries, _countof( psp->fileHandles ) );
-
-        for ( int i = 0; i < cEntries; i++ )
-        {
-            FileEntry & fe = g_fileEntries[ i ];
-            psp->fileHandles[ fe.handle ] = (uint8_t) fe.handle;
-        }
+        if ( g_fileEntries[ h ].fp )
+            psp->fileHandles[ h ] = (uint8_t) h;
     }
 
     psp->TraceHandleMap();
@@ -1687,6 +2671,7 @@ bool GetDOSFilenameFromFCB( DOSFCB &fcb, char * filename )
 void ClearLastUpdateBuffer()
 {
     memset( g_bufferLastUpdate, 0, sizeof( g_bufferLastUpdate ) );
+    cpu.note_video_write(); // force the next update to diff against the cleared buffer
 } //ClearLastUpdateBuffer
 
 void traceDisplayBuffers()
@@ -1796,39 +2781,33 @@ static const wchar_t CP437_to_Unicode[ 256 ] =
 
 #ifdef _WIN32
 
-void UpdateDisplayRow( uint32_t y )
+void UpdateDisplaySpan( uint32_t y, uint32_t x0, uint32_t count ) // redraw count cells starting at column x0. the caller restores the cursor
 {
-    assert( g_use80xRowsMode );
-    if ( y >= GetScreenRows() )
-        return;
-
     uint8_t * pbuf = GetVideoMem();
-    uint32_t yoffset = y * ScreenColumns * 2;
-    memcpy( g_bufferLastUpdate + yoffset, pbuf + yoffset, ScreenColumns * 2 );
+    uint32_t offset = ( y * ScreenColumns + x0 ) * 2;
+    memcpy( g_bufferLastUpdate + offset, pbuf + offset, count * 2 );
     WORD aAttribs[ ScreenColumns ];
     WCHAR awcLine[ ScreenColumns ];
 
-    for ( size_t x = 0; x < ScreenColumns; x++ )
+    for ( size_t x = 0; x < count; x++ )
     {
-        size_t offset = yoffset + x * 2;
-        awcLine[ x ] = CP437_to_Unicode[ pbuf[ offset ] ];
-        aAttribs[ x ] = pbuf[ 1 + offset ]; 
+        size_t o = offset + x * 2;
+        awcLine[ x ] = CP437_to_Unicode[ pbuf[ o ] ];
+        aAttribs[ x ] = pbuf[ 1 + o ]; 
     }
 
-    COORD pos = { 0, (SHORT) y };
+    COORD pos = { (SHORT) x0, (SHORT) y };
     SetConsoleCursorPosition( g_hConsoleOutput, pos );
     
-    BOOL ok = WriteConsoleW( g_hConsoleOutput, awcLine, ScreenColumns, 0, 0 );
+    BOOL ok = WriteConsoleW( g_hConsoleOutput, awcLine, count, 0, 0 );
     if ( !ok )
         tracer.Trace( "writeconsole failed row %u with error %d\n", y, GetLastError() );
     
     DWORD dwWritten; // not optional
-    ok = WriteConsoleOutputAttribute( g_hConsoleOutput, aAttribs, ScreenColumns, pos, &dwWritten );
+    ok = WriteConsoleOutputAttribute( g_hConsoleOutput, aAttribs, count, pos, &dwWritten );
     if ( !ok )
         tracer.Trace( "writeconsoleoutputattribute failed row %u with error %d\n", y, GetLastError() );
-
-    UpdateScreenCursorPosition(); // restore original position of the cursor
-} //UpdateDisplayRow
+} //UpdateDisplaySpan
 
 #else // everything but Windows
 
@@ -1872,24 +2851,75 @@ static const uint8_t BGColorMap[ 8 ] =
     40, 44, 42, 46, 41, 45, 43, 47,
 };
 
-void UpdateDisplayRow( uint32_t y )
+void FrameAppendAttribute( uint8_t a )
 {
-    assert( g_use80xRowsMode );
-    if ( y >= GetScreenRows() )
+    // emit just the parts of the SGR sequence that differ from the attribute already in effect
+
+    a &= 0x7f; // blink isn't supported
+    if ( a == g_frameAttribute )
         return;
 
+    uint8_t fg, bg;
+    bool intense;
+    DecodeAttributes( a, fg, bg, intense );
+
+    FrameReserve( 11 );
+    g_frame[ g_frameLength++ ] = 0x1b;
+    g_frame[ g_frameLength++ ] = '[';
+
+    if ( 0xffff == g_frameAttribute )
+    {
+        g_frame[ g_frameLength++ ] = intense ? '1' : '0';
+        g_frame[ g_frameLength++ ] = ';';
+        FrameAppendNumber( FGColorMap[ fg ] );
+        g_frame[ g_frameLength++ ] = ';';
+        FrameAppendNumber( BGColorMap[ bg ] );
+    }
+    else
+    {
+        uint8_t fgPrev, bgPrev;
+        bool intensePrev;
+        DecodeAttributes( (uint8_t) g_frameAttribute, fgPrev, bgPrev, intensePrev );
+        bool first = true;
+
+        if ( intense != intensePrev )
+        {
+            FrameAppendNumber( intense ? 1 : 22 );
+            first = false;
+        }
+
+        if ( fg != fgPrev )
+        {
+            if ( !first )
+                g_frame[ g_frameLength++ ] = ';';
+            FrameAppendNumber( FGColorMap[ fg ] );
+            first = false;
+        }
+
+        if ( bg != bgPrev )
+        {
+            if ( !first )
+                g_frame[ g_frameLength++ ] = ';';
+            FrameAppendNumber( BGColorMap[ bg ] );
+        }
+    }
+
+    g_frame[ g_frameLength++ ] = 'm';
+    g_frameAttribute = a;
+} //FrameAppendAttribute
+
+void UpdateDisplaySpan( uint32_t y, uint32_t x0, uint32_t count ) // redraw count cells starting at column x0. the caller restores the cursor
+{
     uint8_t * pbuf = GetVideoMem();
-    uint32_t yoffset = y * ScreenColumns * 2;
+    uint32_t yoffset = ( y * ScreenColumns + x0 ) * 2;
 
-    memcpy( g_bufferLastUpdate + yoffset, pbuf + yoffset, ScreenColumns * 2 );
-    uint8_t attribs[ ScreenColumns ];
-    wchar_t awc[ ScreenColumns ];
+    memcpy( g_bufferLastUpdate + yoffset, pbuf + yoffset, count * 2 );
+    FrameAppendCursorMove( y, x0 );
 
-    for ( size_t x = 0; x < ScreenColumns; x++ )
+    for ( size_t x = 0; x < count; x++ )
     {
         size_t offset = yoffset + x * 2;
-        awc[ x ] = CP437_to_Unicode[ pbuf[ offset ] ];
-        attribs[ x ] = pbuf[ 1 + offset ];
+        wchar_t wc = CP437_to_Unicode[ pbuf[ offset ] ];
 
 #if defined( __riscv ) || defined( _WIN32 )
         // When NTVDM built for RISC-V runs in RVOS emulation on Windows, CP 437
@@ -1906,52 +2936,68 @@ void UpdateDisplayRow( uint32_t y )
 #endif
         {
             if ( pbuf[ offset ] >= 7 && pbuf[ offset ] <= 27 )
-                awc[ x ] = CP437_to_Unicode_Windows_Hack[ pbuf[ offset ] ];
+                wc = CP437_to_Unicode_Windows_Hack[ pbuf[ offset ] ];
         }
 #endif
-    }
-
-    printf( "\x1b[%d;1H", y + 1 ); // move to the correct row and column
-
-    uint8_t fgRGB, bgRGB;
-    bool intense;
-    static char acLine[ ScreenColumns * 13 ]; // 3 for utf-8 + 10 per attribute escape sequence worst-case per character
-    int len = 0;
-
-    for ( size_t x = 0; x < ScreenColumns; x++ )
-    {
-        if ( ( 0 == x ) || ( attribs[ x ] != attribs[ x - 1 ] ) )
-        {
-            DecodeAttributes( attribs[ x ], fgRGB, bgRGB, intense );
-            len += snprintf( & acLine[ len ], 11, "\x1b[%d;%d;%dm", intense ? 1 : 0, FGColorMap[ fgRGB ], BGColorMap[ bgRGB ] );
-        }
 
-        len += unicode_to_utf8( & ( acLine[ len ] ), awc[ x ] );
-        assert( len < _countof( acLine ) );
+        FrameAppendAttribute( pbuf[ 1 + offset ] );
+        FrameReserve( 3 );
+        g_frameLength += unicode_to_utf8( g_frame + g_frameLength, (unsigned short) wc );
     }
+} //UpdateDisplaySpan
+
+#endif
 
-    //tracer.Trace( "termwrite '%.*s'\n", len, acLine );
-    printf( "%.*s", len, acLine );  // write( 1, acLine, len ) is faster but can't intersperse write() and printf() without flushing.
+void UpdateDisplayRow( uint32_t y )
+{
+    assert( g_use80xRowsMode );
+    if ( y >= GetScreenRows() )
+        return;
 
-    UpdateScreenCursorPosition(); // this does a fflush( stdout ) to get everything to the screen
+    UpdateDisplaySpan( y, 0, ScreenColumns );
+    UpdateScreenCursorPosition(); // restore the cursor. on Linux/MacOS this does a fflush( stdout ) to get everything to the screen
 } //UpdateDisplayRow
 
-#endif
+bool IsCellDirty( const uint16_t * rowdirty, uint32_t x ) { return ( 0 != ( rowdirty[ x / 16 ] & ( 1 << ( x % 16 ) ) ) ); }
 
 bool UpdateDisplay()
 {
     assert( g_use80xRowsMode );
-    uint8_t * pbuf = GetVideoMem();
 
     if ( DisplayUpdateRequired() )
     {
+        // redraw just the runs of changed cells. Gaps of a few unchanged cells are redrawn along with
+        // their neighbors because that's cheaper than another cursor move.
+
+        const uint32_t maxGap = 4;
+
         for ( uint32_t y = 0; y < GetScreenRows(); y++ )
         {
-            uint32_t yoffset = y * ScreenColumns * 2;
-            if ( memcmp( g_bufferLastUpdate + yoffset, pbuf + yoffset, ScreenColumns * 2 ) )
-                UpdateDisplayRow( y );
+            const uint16_t * rowdirty = g_dirtyCells + y * ( ScreenColumns / 16 );
+            uint32_t x = 0;
+
+            while ( x < ScreenColumns )
+            {
+                if ( !IsCellDirty( rowdirty, x ) )
+                {
+                    x++;
+                    continue;
+                }
+
+                uint32_t start = x;
+                uint32_t end = x + 1; // one past the last changed cell in the run
+                for ( x = end; ( x < ScreenColumns ) && ( x < end + maxGap ); x++ )
+                    if ( IsCellDirty( rowdirty, x ) )
+                        end = x + 1;
+
+                UpdateDisplaySpan( y, start, end - start );
+                x = end;
+            }
         }
 
+        UpdateScreenCursorPosition(); // restore the cursor
+        g_videoGenerationDrawn = g_videoGenerationChecked;
+
         //if ( tracer.IsEnabled() )
         //    traceDisplayBufferAsHex();
 
@@ -1979,6 +3025,8 @@ void ClearDisplay()
 
     for ( size_t y = 0; y < GetScreenRows(); y++ )
         memcpy( pbuf + ( y * 2 * ScreenColumns ), blankLine, sizeof( blankLine ) );
+
+    cpu.note_video_write();
 } //ClearDisplay
 
 #ifdef _WIN32
@@ -2186,6 +3234,67 @@ const char * get_interrupt_string( uint8_t i, uint8_t c, bool & ah_used )
     return "unknown";
 } //get_interrupt_string
 
+bool peek_keyboard( uint8_t & asciiChar, uint8_t & scancode );
+
+// Keystroke handoff. The keyboard thread reads and decodes host key events itself and pushes finished ascii and
+// scancode pairs here. The cpu thread drains them into the bios buffer on int 9 and peeks them for int 16 without a
+// lock or a system call. Without a keyboard thread the cpu thread decodes into the ring just before draining it.
+
+struct KeystrokeRing
+{
+    static const uint32_t Capacity = 256;   // a power of two so the free-running indexes wrap cleanly
+    uint32_t keys[ Capacity ];              // ascii | scancode << 8 | AltFlag
+    std::atomic<uint32_t> head;             // next key to drain. only the cpu thread writes it
+    std::atomic<uint32_t> tail;             // next free slot. only the thread decoding keystrokes writes it
+
+    static const uint32_t AltFlag = 0x10000; // linux: alt was part of the batch this key was decoded in
+
+    uint32_t FreeSpots() { return Capacity - ( tail.load( std::memory_order_relaxed ) - head.load( std::memory_order_acquire ) ); }
+    bool IsEmpty() { return ( head.load( std::memory_order_relaxed ) == tail.load( std::memory_order_acquire ) ); }
+
+    bool Push( uint32_t key )
+    {
+        if ( 0 == FreeSpots() )
+            return false;
+
+        uint32_t t = tail.load( std::memory_order_relaxed );
+        keys[ t % Capacity ] = key;
+        tail.store( t + 1, std::memory_order_release );
+        return true;
+    } //Push
+
+    bool Peek( uint32_t & key )
+    {
+        if ( IsEmpty() )
+            return false;
+
+        key = keys[ head.load( std::memory_order_relaxed ) % Capacity ];
+        return true;
+    } //Peek
+
+    void Pop() { head.store( head.load( std::memory_order_relaxed ) + 1, std::memory_order_release ); }
+};
+
+static KeystrokeRing g_hostKeys;
+
+static void DrainHostKeys()
+{
+    // keys that don't fit in the bios buffer stay in the ring for the next int 9
+
+    CKbdBuffer kbd_buf;
+    uint32_t key;
+    while ( !kbd_buf.IsFull() && g_hostKeys.Peek( key ) )
+    {
+        tracer.Trace( "    consumed ascii %02x, scancode %02x\n", key & 0xff, ( key >> 8 ) & 0xff );
+        kbd_buf.Add( key & 0xff, ( key >> 8 ) & 0xff );
+#ifndef _WIN32
+        if ( key & KeystrokeRing::AltFlag )
+            g_altPressedRecently = true;
+#endif
+        g_hostKeys.Pop();
+    }
+} //DrainHostKeys
+
 #ifdef _WIN32
 bool process_key_event( INPUT_RECORD & rec, uint8_t & asciiChar, uint8_t & scancode )
 {
@@ -2222,10 +3331,8 @@ bool process_key_event( INPUT_RECORD & rec, uint8_t & asciiChar, uint8_t & scanc
     if ( falt && ( '\'' == asc || '`' == asc || ',' == asc || '.' == asc || '/' == asc || 0x4c == sc ) )
         return false;
 
-    // if the buffer is full, stop consuming new characters
-    CKbdBuffer kbd_buf;
-    if ( kbd_buf.IsFull() )
-        return false;
+    // no check for room in the BIOS buffer here. this runs on the keyboard thread, which must not read guest memory,
+    // and a key it rejected would already be off the console. callers limit what they take to the room they have
 
     if ( falt )
     {
@@ -2371,7 +3478,30 @@ bool process_key_event( INPUT_RECORD & rec, uint8_t & asciiChar, uint8_t & scanc
     return true;
 } //process_key_event
 
-bool peek_keyboard( uint8_t & asciiChar, uint8_t & scancode )
+void read_host_key_events()
+{
+    // called on the keyboard thread. console records stay queued in the console until the ring has room for them
+
+    lock_guard<mutex> lock( g_mtxEverything );
+
+    DWORD available = 0;
+    BOOL ok = GetNumberOfConsoleInputEvents( g_hConsoleInput, &available );
+    if ( !ok || ( 0 == available ) )
+        return;
+
+    INPUT_RECORD records[ 10 ];
+    DWORD toRead = get_min( available, (DWORD) get_min( (uint32_t) _countof( records ), g_hostKeys.FreeSpots() ) );
+    DWORD numRead = 0;
+    if ( ( 0 != toRead ) && ReadConsoleInput( g_hConsoleInput, records, toRead, &numRead ) )
+    {
+        uint8_t asciiChar = 0, scancode = 0;
+        for ( DWORD x = 0; x < numRead; x++ )
+            if ( process_key_event( records[ x ], asciiChar, scancode ) )
+                g_hostKeys.Push( ( (uint32_t) scancode << 8 ) | asciiChar );
+    }
+} //read_host_key_events
+
+bool peek_host_keyboard( uint8_t & asciiChar, uint8_t & scancode )
 {
     // this mutex is because I don't know if PeekConsoleInput and ReadConsoleInput are individually or mutually reenterant.
     lock_guard<mutex> lock( g_mtxEverything );
@@ -2391,6 +3521,17 @@ bool peek_keyboard( uint8_t & asciiChar, uint8_t & scancode )
         return true;
     }
 
+    uint32_t key;
+    if ( g_hostKeys.Peek( key ) )
+    {
+        asciiChar = key & 0xff;
+        scancode = ( key >> 8 ) & 0xff;
+        return true;
+    }
+
+    if ( g_keyboardThreadActive || g_pipedStdin )
+        return false;
+
     INPUT_RECORD records[ 10 ];
     DWORD numRead = 0;
     BOOL ok = PeekConsoleInput( g_hConsoleInput, records, _countof( records ), &numRead );
@@ -2413,14 +3554,14 @@ bool peek_keyboard( uint8_t & asciiChar, uint8_t & scancode )
         ReadConsoleInput( g_hConsoleInput, records, numRead, &numRead );
 
     return false;
-} //peek_keyboard
+} //peek_host_keyboard
 
 bool peek_keyboard( bool throttle = false, bool sleep_on_throttle = false, bool update_display = false )
 {
     static CDuration _durationLastPeek;
     static CDuration _durationLastUpdate;
 
-    if ( throttle && !_durationLastPeek.HasTimeElapsedMS( 100 ) )
+    if ( throttle && !ReplayFlag( replayPeekDue, _durationLastPeek.HasTimeElapsedMS( 100 ) ) )
     {
         if ( update_display && g_use80xRowsMode && _durationLastUpdate.HasTimeElapsedMS( 333 ) )
             UpdateDisplay();
@@ -2438,7 +3579,7 @@ bool peek_keyboard( bool throttle = false, bool sleep_on_throttle = false, bool
     return peek_keyboard( a, s );
 } //peek_keyboard
 
-void InjectKeystrokes()
+void inject_host_keystrokes()
 {
     CKbdBuffer kbd_buf;
     while ( g_keyStrokes.KeystrokeAvailable() && !kbd_buf.IsFull() )
@@ -2454,15 +3595,19 @@ void InjectKeystrokes()
         InterlockedDecrement( &g_injectedControlC );
         kbd_buf.Add( 0x03, 0x2e );
     }
-} //InjectKeystrokes
+} //inject_host_keystrokes
 
-void consume_keyboard()
+void consume_host_keyboard()
 {
     // this mutex is because I don't know if PeekConsoleInput and ReadConsoleInput are individually or mutually reenterant.
     lock_guard<mutex> lock( g_mtxEverything );
 
-    InjectKeystrokes();
-    CKbdBuffer kbd_buf;
+    inject_host_keystrokes();
+    DrainHostKeys();
+    if ( g_keyboardThreadActive || g_pipedStdin )
+        return;
+
+    CKbdBuffer kbd_buf;
 
     // An extra int9 may have been triggered after all input events have been consumed.
     // Check GetNumberOfConsoleInputEvents before ReadConsoleInput, because the latter will block for a keystroke
@@ -2495,13 +3640,13 @@ void consume_keyboard()
             }
         }
     }
-} //consume_keyboard
+} //consume_host_keyboard
 
 #else
 
-void InjectKeystrokes()
+void inject_host_keystrokes()
 {
-} //InjectKeystrokes
+} //inject_host_keystrokes
 
 const uint8_t ascii_to_scancode[ 128 ] =
 {
@@ -2523,6 +3668,58 @@ const uint8_t ascii_to_scancode[ 128 ] =
      45,  21,  24,  26,  43,  27,  41,  14, // 120  x y z { | } ~ DEL
 };     
 
+// console bytes for decode_host_keys(). kbhit() reports bytes already read, or what one more nonblocking read finds
+// while the batch has room, so a pass ends even when a lot of text is pasted. getch() waits briefly for the rest of an
+// escape sequence. a pass's keys go to the ring together at the end so they share the alt flag as they always have.
+
+class HostKeyReader
+{
+    public:
+        static const size_t BatchSize = 128; // most keys one pass can decode
+
+    private:
+        uint8_t bytes[ 32 ];
+        size_t next, count;
+        uint32_t batch[ BatchSize ];
+        size_t batched;
+
+        bool Fill( int timeoutMs )
+        {
+            struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+            if ( ended || ( poll( &pfd, 1, timeoutMs ) <= 0 ) )
+                return false;
+
+            ssize_t r = read( STDIN_FILENO, bytes, sizeof( bytes ) );
+            if ( r <= 0 )
+            {
+                ended = ( 0 == r ) || ( EINTR != errno && EAGAIN != errno ); // readable with nothing to read is end of input
+                return false;
+            }
+
+            next = 0;
+            count = (size_t) r;
+            return true;
+        } //Fill
+
+    public:
+        bool alt;           // the alt key was part of a sequence in this pass
+        bool ended;         // stdin reached its end or failed
+
+        HostKeyReader() : next( 0 ), count( 0 ), batched( 0 ), alt( false ), ended( false ) {}
+
+        bool Wait( int timeoutMs ) { return ( next < count ) || Fill( timeoutMs ); }
+        bool kbhit() { return ( next < count ) || ( ( batched + 2 * sizeof( bytes ) <= _countof( batch ) ) && Fill( 0 ) ); }
+        uint8_t getch() { return ( ( next < count ) || Fill( 100 ) ) ? bytes[ next++ ] : 0; }
+
+        void Add( uint8_t asciiChar, uint8_t scancode )
+        {
+            if ( batched < _countof( batch ) )
+                batch[ batched++ ] = ( (uint32_t) scancode << 8 ) | asciiChar;
+        } //Add
+
+        void Decode();      // decode what's available into g_hostKeys
+};
+
 // broken cases on Linux:
 // - no way to determine if keypad + is from the keypad and not the plus key (Brief is sad)
 // - linux maps tab, ctrl+enter, and enter to ^i, ^j, and ^m. so those ctrl characters can't return what they should for DOS
@@ -2533,238 +3730,236 @@ const uint8_t ascii_to_scancode[ 128 ] =
 // - ^; comes through as a plain ESC
 // helpful: http://www.osfree.org/docs/cmdref/cmdref.2.0476.php
 
-void consume_keyboard()
+static void decode_host_keys( HostKeyReader & keys )
 {
     const uint8_t CTRL_DOWN = 53;
     const uint8_t ALT_DOWN = 51;
     const uint8_t SHIFT_DOWN = 50;
     const uint8_t MODIFIER_DOWN = 59;
-    CKbdBuffer kbd_buf;
-    g_altPressedRecently = false;
 
-    while ( g_consoleConfig.portable_kbhit() )
+    while ( keys.kbhit() )
     {
-        uint8_t asciiChar = 0xff & g_consoleConfig.portable_getch();
+        uint8_t asciiChar = 0xff & keys.getch();
         uint8_t scanCode = ascii_to_scancode[ asciiChar ];
         tracer.Trace( "    consumed ascii %02x, scancode %02x\n", asciiChar, scanCode );
         if ( 27 == asciiChar ) // escape
         {
-            if ( g_consoleConfig.portable_kbhit() )
+            if ( keys.kbhit() )
             {
-                uint8_t secondAscii = g_consoleConfig.portable_getch();
+                uint8_t secondAscii = keys.getch();
                 tracer.Trace( "    secondAscii: '%c' == %d\n", secondAscii, secondAscii );
                 if ( '[' == secondAscii )
                 {
-                    if ( g_consoleConfig.portable_kbhit() )
+                    if ( keys.kbhit() )
                     {
-                        uint8_t thirdAscii = g_consoleConfig.portable_getch();
+                        uint8_t thirdAscii = keys.getch();
                         tracer.Trace( "    thirdAscii: '%c' == %d\n", thirdAscii, thirdAscii );
                         if ( 'D' == thirdAscii )
-                            kbd_buf.Add( 0, 75 ); // left arrow
+                            keys.Add( 0, 75 ); // left arrow
                         else if ( 'B' == thirdAscii )
-                            kbd_buf.Add( 0, 80 ); // down arrow
+                            keys.Add( 0, 80 ); // down arrow
                         else if ( 'C' == thirdAscii )
-                            kbd_buf.Add( 0, 77 ); // right arrow
+                            keys.Add( 0, 77 ); // right arrow
                         else if ( 'A' == thirdAscii )
-                            kbd_buf.Add( 0, 72 ); // up arrow
+                            keys.Add( 0, 72 ); // up arrow
                         else if ( '1' == thirdAscii ) // F5-F8
                         {
-                            uint8_t fnumber = g_consoleConfig.portable_getch();
+                            uint8_t fnumber = keys.getch();
                             tracer.Trace( "    f5-f8 fnumber: %d\n", fnumber );
-                            uint8_t following = g_consoleConfig.portable_getch(); // discard the following character
+                            uint8_t following = keys.getch(); // discard the following character
                             tracer.Trace( "    following character: %d\n", following );
 
                             if ( MODIFIER_DOWN == following ) // ALT/CTRL depressed for F5-F8
                             {
-                                int nextA = g_consoleConfig.portable_getch(); // consume yet more
+                                int nextA = keys.getch(); // consume yet more
                                 tracer.Trace( "    nextA: %d\n", nextA );
 
                                 if ( 53 == fnumber )
                                 {
-                                    int nextB = g_consoleConfig.portable_getch(); // consume yet more
+                                    int nextB = keys.getch(); // consume yet more
                                     tracer.Trace( "    nextB: %d\n", nextB );
                                     if ( CTRL_DOWN == nextA )
-                                        kbd_buf.Add( 0, 98 ); // CTRL
+                                        keys.Add( 0, 98 ); // CTRL
                                     else if ( ALT_DOWN == nextA )
                                     {
-                                        kbd_buf.Add( 0, 108 ); // ALT
-                                        g_altPressedRecently = true;
+                                        keys.Add( 0, 108 ); // ALT
+                                        keys.alt = true;
                                     }
                                     else if ( SHIFT_DOWN == nextA )
-                                        kbd_buf.Add( 0, 88 ); // F5
+                                        keys.Add( 0, 88 ); // F5
                                 }
                                 else if ( fnumber >= 55 && fnumber <= 57 )
                                 {
-                                    int nextB = g_consoleConfig.portable_getch(); // consume yet more
+                                    int nextB = keys.getch(); // consume yet more
                                     if ( CTRL_DOWN == nextA )
-                                        kbd_buf.Add( 0, fnumber + 44 ); // CTRL
+                                        keys.Add( 0, fnumber + 44 ); // CTRL
                                     else if ( ALT_DOWN == nextA )
                                     {
-                                        kbd_buf.Add( 0, fnumber + 54 ); // ALT
-                                        g_altPressedRecently = true;
+                                        keys.Add( 0, fnumber + 54 ); // ALT
+                                        keys.alt = true;
                                     }
                                     else if ( SHIFT_DOWN == nextA )
-                                        kbd_buf.Add( 0, fnumber + 34 ); // SHIFT
+                                        keys.Add( 0, fnumber + 34 ); // SHIFT
                                 }
                             }
                             else if ( ALT_DOWN == following ) // ALT depressed for F1-F4, HOME, etc.
                             {
-                                g_altPressedRecently = true;
-                                int next = g_consoleConfig.portable_getch();
+                                keys.alt = true;
+                                int next = keys.getch();
                                 tracer.Trace( "    next: %d\n", next );
                                 if ( next >= 80 && next <= 83 ) // F1-F4
-                                    kbd_buf.Add( 0, next + 24 );
+                                    keys.Add( 0, next + 24 );
                                 else if ( 70 == next ) // END
-                                    kbd_buf.Add( 0, 159 );
+                                    keys.Add( 0, 159 );
                                 else if ( 72 == next ) // HOME
-                                    kbd_buf.Add( 0, 151 );
+                                    keys.Add( 0, 151 );
                                 else if ( 68 == next ) // LEFT
-                                    kbd_buf.Add( 0, 155 );
+                                    keys.Add( 0, 155 );
                                 else if ( 66 == next ) // DOWN
-                                    kbd_buf.Add( 0, 160 );
+                                    keys.Add( 0, 160 );
                                 else if ( 67 == next ) // RIGHT
-                                    kbd_buf.Add( 0, 157 );
+                                    keys.Add( 0, 157 );
                                 else if ( 65 == next ) // UP
-                                    kbd_buf.Add( 0, 152 );
+                                    keys.Add( 0, 152 );
                                 else
                                     tracer.Trace( "    unhandled ALT F1-F4 etc.\n" );
                             }
                             else if ( CTRL_DOWN == following ) // CTRL depressed for F1-F4, etc.
                             {
-                                int next = g_consoleConfig.portable_getch();
+                                int next = keys.getch();
                                 tracer.Trace( "    next: %d\n", next );
                                 if ( 68 == next ) // left
-                                    kbd_buf.Add( 0, 115 );
+                                    keys.Add( 0, 115 );
                                 else if ( 66 == next ) // down
-                                    kbd_buf.Add( 0, 145 );
+                                    keys.Add( 0, 145 );
                                 else if ( 67 == next ) // right
-                                    kbd_buf.Add( 0, 116 );
+                                    keys.Add( 0, 116 );
                                 else if ( 65 == next ) // up
-                                    kbd_buf.Add( 0, 141 );
+                                    keys.Add( 0, 141 );
                                 else if ( 72 == next ) // home
-                                    kbd_buf.Add( 0, 119 );
+                                    keys.Add( 0, 119 );
                                 else if ( 70 == next ) // end
-                                    kbd_buf.Add( 0, 117 );
+                                    keys.Add( 0, 117 );
                                 else if ( next >= 80 && next <= 83) // F1-F4
-                                    kbd_buf.Add( 0, next + 14 );
+                                    keys.Add( 0, next + 14 );
                                 else
                                     tracer.Trace( "    unhandled CTRL F1-F4 etc.\n" );
                             }
                             else if ( SHIFT_DOWN == following ) // SHIFT pressed for F1-F4, etc.
                             {
-                                int next = g_consoleConfig.portable_getch();
+                                int next = keys.getch();
                                 tracer.Trace( "    next: %d\n", next );
                                 if ( 68 == next ) // left
-                                    kbd_buf.Add( 52, 75 );
+                                    keys.Add( 52, 75 );
                                 else if ( 66 == next ) // down
-                                    kbd_buf.Add( 50, 80 );
+                                    keys.Add( 50, 80 );
                                 else if ( 67 == next ) // right
-                                    kbd_buf.Add( 54, 77 );
+                                    keys.Add( 54, 77 );
                                 else if ( 65 == next ) // up
-                                    kbd_buf.Add( 56, 72 );
+                                    keys.Add( 56, 72 );
                                 else if ( 72 == next ) // home
-                                    kbd_buf.Add( 55, 71 );
+                                    keys.Add( 55, 71 );
                                 else if ( 70 == next ) // end
-                                    kbd_buf.Add( 49, 79 );
+                                    keys.Add( 49, 79 );
                                 else if ( next >= 80 && next <= 83) // F1-F4
-                                    kbd_buf.Add( 0, next + 4 );
+                                    keys.Add( 0, next + 4 );
                                 else
                                     tracer.Trace( "    unhandled SHIFT F1-F4 etc.\n" );
                             }
                             else
                             {
                                 if ( 53 == fnumber )
-                                    kbd_buf.Add( 0, 63 ); // F5
+                                    keys.Add( 0, 63 ); // F5
                                 else if ( fnumber >= 55 && fnumber <= 57 ) // F6..F8
-                                    kbd_buf.Add( 0, fnumber + 9 );
+                                    keys.Add( 0, fnumber + 9 );
                                 else
                                     tracer.Trace( "    unhandled unmodified fnumber\n" );
                             }
                         }
                         else if ( '2' == thirdAscii ) // INS + F9-F12
                         {
-                            uint8_t fnumber = g_consoleConfig.portable_getch();
+                            uint8_t fnumber = keys.getch();
                             tracer.Trace( "    ins + f9-f12 fnumber: %d\n", fnumber );
                             if ( 126 == fnumber )
-                                kbd_buf.Add( 0, 82 ); // INS
+                                keys.Add( 0, 82 ); // INS
                             else
                             {
                                 int next = 0;
                                 if ( fnumber < 121 )
-                                    next = g_consoleConfig.portable_getch();
+                                    next = keys.getch();
 
                                 tracer.Trace( "    next %d\n", next );
 
                                 if ( MODIFIER_DOWN == next ) // ALT/CTRL is pressed
                                 {
-                                    int nextA = g_consoleConfig.portable_getch();
-                                    int nextB = g_consoleConfig.portable_getch();
+                                    int nextA = keys.getch();
+                                    int nextB = keys.getch();
                                     tracer.Trace( "    nextA: %d, nextB: %d\n", nextA, nextB );
 
                                     if ( ALT_DOWN == nextA ) // ALT
                                     {
-                                        g_altPressedRecently = true;
+                                        keys.alt = true;
                                         if ( 48 == fnumber )
-                                            kbd_buf.Add( 0, 112 );
+                                            keys.Add( 0, 112 );
                                         else if ( 49 == fnumber )
-                                            kbd_buf.Add( 0, 113 );
+                                            keys.Add( 0, 113 );
                                         else if ( 51 == fnumber )
-                                            kbd_buf.Add( 0, 139 );
+                                            keys.Add( 0, 139 );
                                         else if ( 52 == fnumber )
-                                            kbd_buf.Add( 0, 140 );
+                                            keys.Add( 0, 140 );
                                         else
                                             tracer.Trace( "unknown ESC [ 2 escape sequence %d\n", fnumber );
                                     }
                                     else if ( CTRL_DOWN == nextA ) // CTRL
                                     {
                                         if ( 48 == fnumber )
-                                            kbd_buf.Add( 0, 102 );
+                                            keys.Add( 0, 102 );
                                         else if ( 49 == fnumber )
-                                            kbd_buf.Add( 0, 103 );
+                                            keys.Add( 0, 103 );
                                         else if ( 51 == fnumber )
-                                            kbd_buf.Add( 0, 137 );
+                                            keys.Add( 0, 137 );
                                         else if ( 52 == fnumber )
-                                            kbd_buf.Add( 0, 138 );
+                                            keys.Add( 0, 138 );
                                         else
                                             tracer.Trace( "unknown ESC [ 2 escape sequence %d\n", fnumber );
                                     }
                                     else if (SHIFT_DOWN == nextA )
                                     {
                                         if ( 48 == fnumber )
-                                            kbd_buf.Add( 0, 92 );
+                                            keys.Add( 0, 92 );
                                         else if ( 49 == fnumber )
-                                            kbd_buf.Add( 0, 93 );
+                                            keys.Add( 0, 93 );
                                         else if ( 51 == fnumber )
-                                            kbd_buf.Add( 0, 135 );
+                                            keys.Add( 0, 135 );
                                         else if ( 52 == fnumber )
-                                            kbd_buf.Add( 0, 136 );
+                                            keys.Add( 0, 136 );
                                         else
                                             tracer.Trace( "unknown ESC [ 2 escape sequence %d\n", fnumber );
                                     }
                                 }
                                 else if ( 51 == next )
                                 {
-                                    uint8_t nextA = g_consoleConfig.portable_getch();
+                                    uint8_t nextA = keys.getch();
                                     tracer.Trace( "    nextA: %d\n", nextA );
-                                    kbd_buf.Add( 0, 162 ); // ALT + INS
-                                    g_altPressedRecently = true;
+                                    keys.Add( 0, 162 ); // ALT + INS
+                                    keys.alt = true;
                                 }
                                 else if ( 53 == next )
                                 {
-                                    uint8_t nextA = g_consoleConfig.portable_getch();
+                                    uint8_t nextA = keys.getch();
                                     tracer.Trace( "    nextA: %d\n", nextA );
-                                    kbd_buf.Add( 0, 146 ); // INS
+                                    keys.Add( 0, 146 ); // INS
                                 }
                                 else if ( 126 == next )
                                 {
                                     if ( 48 == fnumber )
-                                        kbd_buf.Add( 0, 67 );
+                                        keys.Add( 0, 67 );
                                     else if ( 49 == fnumber )
-                                        kbd_buf.Add( 0, 68 );
+                                        keys.Add( 0, 68 );
                                     else if ( 51 == fnumber )
-                                        kbd_buf.Add( 0, 133 );
+                                        keys.Add( 0, 133 );
                                     else if ( 52 == fnumber )
-                                        kbd_buf.Add( 0, 134 );
+                                        keys.Add( 0, 134 );
                                     else
                                         tracer.Trace( "unknown ESC [ 2 escape sequence %d\n", fnumber );
                                 }
@@ -2774,85 +3969,85 @@ void consume_keyboard()
                         }                       
                         else if ( '3' == thirdAscii ) // DEL
                         {
-                            uint8_t nextA = g_consoleConfig.portable_getch();
+                            uint8_t nextA = keys.getch();
                             tracer.Trace( "    nextA for DEL: %d\n", nextA );
                             if ( MODIFIER_DOWN == nextA )
                             {
-                                uint8_t nextB = g_consoleConfig.portable_getch();
-                                uint8_t nextC = g_consoleConfig.portable_getch();
+                                uint8_t nextB = keys.getch();
+                                uint8_t nextC = keys.getch();
                                 tracer.Trace( "    DEL nextB %d, nextC %d\n", nextB, nextC );
                                 if ( ALT_DOWN == nextB )
                                 {
-                                    kbd_buf.Add( 0, 163 ); // ALT + DEL  // MS-DOS ignores this keystroke
-                                    g_altPressedRecently = true;
+                                    keys.Add( 0, 163 ); // ALT + DEL  // MS-DOS ignores this keystroke
+                                    keys.alt = true;
                                 }
                                 else if ( CTRL_DOWN == nextB )
-                                    kbd_buf.Add( 0, 147 ); // CTRL + DEL  // MS-DOS ignores this keystroke
+                                    keys.Add( 0, 147 ); // CTRL + DEL  // MS-DOS ignores this keystroke
                                 else if ( SHIFT_DOWN == nextB )
-                                    kbd_buf.Add( 46, 83 ); // SHIFT + DEL
+                                    keys.Add( 46, 83 ); // SHIFT + DEL
                             }
                             else if ( 126 == nextA )
-                                kbd_buf.Add( 0, 83 );
+                                keys.Add( 0, 83 );
                             else
                                 tracer.Trace( "unknown nextA %d\n", nextA );
                         }
                         else if ( '5' == thirdAscii ) // pgup
                         {
-                            uint8_t nextA = g_consoleConfig.portable_getch(); 
+                            uint8_t nextA = keys.getch(); 
                             tracer.Trace( "    nextA for pgup: %d\n", nextA );
                             if ( MODIFIER_DOWN == nextA )
                             {
-                                uint8_t nextB = g_consoleConfig.portable_getch();
-                                uint8_t nextC = g_consoleConfig.portable_getch();
+                                uint8_t nextB = keys.getch();
+                                uint8_t nextC = keys.getch();
                                 tracer.Trace( "    nextB: %d, nextC %d\n", nextB, nextC );
                                 if ( CTRL_DOWN == nextB ) // CTRL
-                                    kbd_buf.Add( 0, 132 ); // CTRL + pgup
+                                    keys.Add( 0, 132 ); // CTRL + pgup
                                 else if ( ALT_DOWN == nextB ) // ALT
                                 {
-                                    kbd_buf.Add( 0, 153 ); // ALT + pgup
-                                    g_altPressedRecently = true;
+                                    keys.Add( 0, 153 ); // ALT + pgup
+                                    keys.alt = true;
                                 }
                                 else if ( SHIFT_DOWN == nextB )
-                                    kbd_buf.Add( 57, 73 ); // SHIFT + pgup
+                                    keys.Add( 57, 73 ); // SHIFT + pgup
                             }
                             else
-                                kbd_buf.Add( 0, 73 );
+                                keys.Add( 0, 73 );
                         }
                         else if ( '6' == thirdAscii ) // pgdown
                         {
-                            uint8_t nextA = g_consoleConfig.portable_getch(); 
+                            uint8_t nextA = keys.getch(); 
                             tracer.Trace( "    nextA for pgup: %d\n", nextA );
                             if ( MODIFIER_DOWN == nextA )
                             {
-                                uint8_t nextB = g_consoleConfig.portable_getch();
-                                uint8_t nextC = g_consoleConfig.portable_getch();
+                                uint8_t nextB = keys.getch();
+                                uint8_t nextC = keys.getch();
                                 tracer.Trace( "    nextB: %d, nextC %d\n", nextB, nextC );
                                 if ( CTRL_DOWN == nextB ) // CTRL
-                                    kbd_buf.Add( 0, 118 );
+                                    keys.Add( 0, 118 );
                                 else if ( ALT_DOWN == nextB ) // ALT
                                 {
-                                    kbd_buf.Add( 0, 161 ); // ALT + pgdown
-                                    g_altPressedRecently = true;
+                                    keys.Add( 0, 161 ); // ALT + pgdown
+                                    keys.alt = true;
                                 }
                                 else if ( SHIFT_DOWN == nextB )
-                                    kbd_buf.Add( 51, 81 );
+                                    keys.Add( 51, 81 );
                             }
                             else
-                                kbd_buf.Add( 0, 81 );
+                                keys.Add( 0, 81 );
                         }
                         else if ( 'H' == thirdAscii ) // home
-                            kbd_buf.Add( 0, 71 );
+                            keys.Add( 0, 71 );
                         else if ( 'F' == thirdAscii ) // end
-                            kbd_buf.Add( 0, 79 );
+                            keys.Add( 0, 79 );
                         else if ( 'Z' == thirdAscii ) // shift tab
-                            kbd_buf.Add( 0, 15 );
+                            keys.Add( 0, 15 );
                         else
                             tracer.Trace( "unknown [ ESC sequence char %d == '%c'\n", thirdAscii, thirdAscii );
                     }
                     else
                     {
-                        kbd_buf.Add( 0, 26 ); // ALT '['
-                        g_altPressedRecently = true;
+                        keys.Add( 0, 26 ); // ALT '['
+                        keys.alt = true;
                     }
                 }
                 else if ( secondAscii <= 'z' && secondAscii >= 'a' )
@@ -2860,7 +4055,7 @@ void consume_keyboard()
                     // ALT + a through z 
 
                     // somewhat massive hack because I don't know how to tell if ALT is pressed on Linux
-                    g_altPressedRecently = true;
+                    keys.alt = true;
 
                     if ( 'i' == secondAscii )
                         scanCode = 0x17;
@@ -2871,133 +4066,162 @@ void consume_keyboard()
                     else
                         scanCode = ascii_to_scancode[ secondAscii - 'a' + 1 ];
 
-                    kbd_buf.Add( 0, scanCode );
+                    keys.Add( 0, scanCode );
                 }
                 else if ( 'O' == secondAscii ) // F1-F4 and keypad
                 {
-                    uint8_t fnumber = g_consoleConfig.portable_getch();
+                    uint8_t fnumber = keys.getch();
                     tracer.Trace( "f1-f4 fnumber: %d\n", fnumber );
                     
                     if ( fnumber >= 80 && fnumber <= 83 ) // 80-83 map to scancode 59-62
-                        kbd_buf.Add( 0, fnumber - 21 );
+                        keys.Add( 0, fnumber - 21 );
                     else if ( 65 == fnumber )
-                        kbd_buf.Add( 0, 0x48 ); // up
+                        keys.Add( 0, 0x48 ); // up
                     else if ( 66 == fnumber )
-                        kbd_buf.Add( 0, 0x50 ); // down
+                        keys.Add( 0, 0x50 ); // down
                     else if ( 67 == fnumber )
-                        kbd_buf.Add( 0, 0x4d ); // right
+                        keys.Add( 0, 0x4d ); // right
                     else if ( 68 == fnumber )
-                        kbd_buf.Add( 0, 0x4b ); // left
+                        keys.Add( 0, 0x4b ); // left
                     else if ( 70 == fnumber ) 
-                        kbd_buf.Add( 0, 0x4f ); // end
+                        keys.Add( 0, 0x4f ); // end
                     else if ( 72 == fnumber ) 
-                        kbd_buf.Add( 0, 0x47 ); // home
+                        keys.Add( 0, 0x47 ); // home
                     else
                         tracer.Trace( "unknown ESC O fnumber %d\n", fnumber );
                 }
                 else if ( '\\' == secondAscii )
                 {
-                    kbd_buf.Add( 0, 38 ); // ALT '\\'
-                    g_altPressedRecently = true;
+                    keys.Add( 0, 38 ); // ALT '\\'
+                    keys.alt = true;
                 }
                 else if ( ';' == secondAscii )
                 {
-                    kbd_buf.Add( 0, 39 ); // ALT ';'
-                    g_altPressedRecently = true;
+                    keys.Add( 0, 39 ); // ALT ';'
+                    keys.alt = true;
                 }
                 else if ( ']' == secondAscii )
                 {
-                    kbd_buf.Add( 0, 27 ); // ALT ']'
-                    g_altPressedRecently = true;
+                    keys.Add( 0, 27 ); // ALT ']'
+                    keys.alt = true;
                 }
                 else if ( '-' == secondAscii )
                 {
-                    kbd_buf.Add( 0, 130 ); // ALT '-' (normal and numeric keypad, can't distinguish)
-                    g_altPressedRecently = true;
+                    keys.Add( 0, 130 ); // ALT '-' (normal and numeric keypad, can't distinguish)
+                    keys.alt = true;
                 }
                 else if ( '=' == secondAscii )
                 {
-                    kbd_buf.Add( 0, 131 ); // ALT '='
-                    g_altPressedRecently = true;
+                    keys.Add( 0, 131 ); // ALT '='
+                    keys.alt = true;
                 }
                 else if ( '*' == secondAscii )
                 {
-                    kbd_buf.Add( 0, 55 ); // ALT '*'
-                    g_altPressedRecently = true;
+                    keys.Add( 0, 55 ); // ALT '*'
+                    keys.alt = true;
                 }
                 else if ( 127 == secondAscii ) // ALT + DEL   // MS-DOS ignores this keystroke
                 {
-                    kbd_buf.Add( 0, 14 );
-                    g_altPressedRecently = true;
+                    keys.Add( 0, 14 );
+                    keys.alt = true;
                 }
                 else if ( '+' == secondAscii ) // ALT + numeric keypad +
                 {
-                    kbd_buf.Add( 0, 78 );
-                    g_altPressedRecently = true;
+                    keys.Add( 0, 78 );
+                    keys.alt = true;
                 }
                 else if ( ',' == secondAscii || '.' == secondAscii || '/' == secondAscii || '\'' == secondAscii || '`' == secondAscii )
                     tracer.Trace( "  swallowing ALT + character '%c' == %d\n", secondAscii, secondAscii );
                 else if ( '0' == secondAscii )
                 {
-                    kbd_buf.Add( 0, 129 ); // digit 0
-                    g_altPressedRecently = true;
+                    keys.Add( 0, 129 ); // digit 0
+                    keys.alt = true;
                 }
                 else if ( secondAscii >= '1' && secondAscii <= '9' )
                 {
-                    kbd_buf.Add( 0, 120 + secondAscii - '1' ); // digits 1-9
-                    g_altPressedRecently = true;
+                    keys.Add( 0, 120 + secondAscii - '1' ); // digits 1-9
+                    keys.alt = true;
                 }
                 else
                 {
                     tracer.Trace( "unknown ESC second character %d == '%c'\n", secondAscii, secondAscii );
-                    kbd_buf.Add( asciiChar, scanCode );
-                    kbd_buf.Add( secondAscii, ascii_to_scancode[ secondAscii ] );
+                    keys.Add( asciiChar, scanCode );
+                    keys.Add( secondAscii, ascii_to_scancode[ secondAscii ] );
                 }
             }
             else
             {
                 tracer.Trace( "  no character following ESC\n" );
-                kbd_buf.Add( asciiChar, 1 ); // plain old escape character
+                keys.Add( asciiChar, 1 ); // plain old escape character
             }
         }
 #if 0
         else if ( 8 == asciiChar ) // swap ^h with ^backspace
-            kbd_buf.Add( 127, 14 );
+            keys.Add( 127, 14 );
 #endif
         else if ( 127 == asciiChar )
-            kbd_buf.Add( 8, 14 ); // swap backspace with ^h
+            keys.Add( 8, 14 ); // swap backspace with ^h
         else
         {
             if ( 0x3 == asciiChar && 0x2e == scanCode )
                 g_SendControlCInt = true;
-            kbd_buf.Add( asciiChar, scanCode );
+            keys.Add( asciiChar, scanCode );
         }
     }
+} //decode_host_keys
+
+void HostKeyReader::Decode()
+{
+    decode_host_keys( *this );
+
+    for ( size_t i = 0; i < batched; i++ )
+        if ( !g_hostKeys.Push( batch[ i ] | ( alt ? KeystrokeRing::AltFlag : 0 ) ) )
+            tracer.Trace( "  dropping keystroke on the floor because the keystroke ring is full\n" );
+
+    batched = 0;
+    alt = false;
+} //Decode
+
+void consume_host_keyboard()
+{
+    if ( !g_keyboardThreadActive && !g_pipedStdin )
+    {
+        HostKeyReader reader;
+        reader.Decode();
+    }
+
+    g_altPressedRecently = false;
+    DrainHostKeys();
 
     uint8_t * pbiosdata = cpu.flat_address8( 0x40, 0 );
     pbiosdata[ 0x17 ] = get_keyboard_flags_depressed();
-} //consume_keyboard
+} //consume_host_keyboard
 
-bool peek_keyboard( uint8_t & asciiChar, uint8_t & scancode )
+bool peek_host_keyboard( uint8_t & asciiChar, uint8_t & scancode )
 {
-    if ( g_consoleConfig.portable_kbhit() )
+    uint32_t key;
+    if ( g_hostKeys.Peek( key ) )
     {
-        if ( g_UseOneThread )
-            g_KbdPeekAvailable = true; // make sure an int9 gets scheduled
+        asciiChar = key & 0xff;
+        scancode = ( key >> 8 ) & 0xff;
+        return true;
+    }
 
+    if ( !g_keyboardThreadActive && !g_pipedStdin && g_consoleConfig.portable_kbhit() )
+    {
         asciiChar = 'a'; // not sure how to peek and not consume the character on linux, so lie
         scancode = 30;
         return true;
     }
     return false;
-} //peek_keyboard
+} //peek_host_keyboard
 
 bool peek_keyboard( bool throttle = false, bool sleep_on_throttle = false, bool update_display = false )
 {
     static CDuration _durationLastPeek;
     static CDuration _durationLastUpdate;
 
-    if ( throttle && !_durationLastPeek.HasTimeElapsedMS( 100 ) )
+    if ( throttle && !ReplayFlag( replayPeekDue, _durationLastPeek.HasTimeElapsedMS( 100 ) ) )
     {
         if ( update_display && g_use80xRowsMode && _durationLastUpdate.HasTimeElapsedMS( 333 ) )
             UpdateDisplay();
@@ -3017,8 +4241,113 @@ bool peek_keyboard( bool throttle = false, bool sleep_on_throttle = false, bool
 
 #endif
 
+// the keyboard as the app sees it. these log what the host keyboard functions return and replay it
+
+bool peek_keyboard( uint8_t & asciiChar, uint8_t & scancode )
+{
+    uint8_t peeked[ 2 ] = { 0, 0 };
+    bool available = !Replaying() && peek_host_keyboard( peeked[ 0 ], peeked[ 1 ] );
+    uint32_t bytes = sizeof( peeked );
+    available = ReplayInput( replayPeek, peeked, bytes, sizeof( peeked ), available );
+
+#ifndef _WIN32
+    if ( available && g_UseOneThread )
+        g_KbdPeekAvailable = true; // make sure an int9 gets scheduled
+#endif
+
+    if ( available )
+    {
+        asciiChar = peeked[ 0 ];
+        scancode = peeked[ 1 ];
+    }
+
+    return available;
+} //peek_keyboard
+
+static void ReplayKeyboardBuffer( uint8_t kind, void ( * host_update )(), bool always )
+{
+    // host_update adds host keystrokes to the bios buffer. log the bios keyboard flags and the keys it added,
+    // or when replaying, add the logged keys instead of calling it. unless always, log only if keys were added.
+
+    if ( !g_replay.fp )
+    {
+        host_update();
+        return;
+    }
+
+    uint8_t * pbiosdata = cpu.flat_address8( 0x40, 0 );
+    uint16_t * ptail = (uint16_t *) ( pbiosdata + 0x1c );
+    uint8_t logged[ 1 + 32 ];            // flags then ascii, scancode pairs. the buffer holds 16 keys
+    uint32_t bytes = 0;
+
+    if ( Replaying() )
+    {
+        if ( ReplayInput( kind, logged, bytes, sizeof( logged ), always ) )
+        {
+            CKbdBuffer kbd_buf;
+            for ( uint32_t i = 1; i + 1 < bytes; i += 2 )
+                kbd_buf.Add( logged[ i ], logged[ i + 1 ] );
+            pbiosdata[ 0x17 ] = logged[ 0 ];
+        }
+        else if ( always )
+            ReplayDiverged( kind );
+        return;
+    }
+
+    uint16_t tail = *ptail;
+    host_update();
+
+    logged[ bytes++ ] = pbiosdata[ 0x17 ];
+    while ( tail != *ptail && bytes < sizeof( logged ) )
+    {
+        logged[ bytes++ ] = pbiosdata[ tail ];
+        logged[ bytes++ ] = pbiosdata[ tail + 1 ];
+        tail += 2;
+        if ( tail >= 0x3e )
+            tail = 0x1e;
+    }
+
+    ReplayInput( kind, logged, bytes, sizeof( logged ), always || ( bytes > 1 ) );
+} //ReplayKeyboardBuffer
+
+void InjectKeystrokes()
+{
+    ReplayKeyboardBuffer( replayInjected, inject_host_keystrokes, false );
+} //InjectKeystrokes
+
+void consume_keyboard()
+{
+    ReplayKeyboardBuffer( replayKeys, consume_host_keyboard, true );
+} //consume_keyboard
+
+static uint8_t KeyboardFlags()
+{
+    // get_keyboard_flags_depressed(), logged when it changes
+
+    static uint8_t last = 0;
+    uint8_t flags = Replaying() ? last : get_keyboard_flags_depressed();
+    uint32_t bytes = sizeof( flags );
+    ReplayInput( replayKeyFlags, & flags, bytes, sizeof( flags ), flags != last );
+    last = flags;
+    return flags;
+} //KeyboardFlags
+
+class HardExit : public runtime_error
+{
+    // thrown by i8086_hard_exit in library builds so one app's fatal error doesn't end the host process
+
+    public:
+        HardExit( const char * message ) : runtime_error( message ) {}
+};
+
 void i8086_hard_exit( const char * pcerror, uint8_t arg )
 {
+#ifdef NTVDM_LIBRARY
+    char acError[ 256 ];
+    snprintf( acError, sizeof( acError ), pcerror, arg );
+    tracer.Trace( "%s", acError );
+    throw HardExit( acError );
+#else
     g_consoleConfig.RestoreConsole( false );
 
     tracer.Trace( pcerror, arg );
@@ -3027,6 +4356,7 @@ void i8086_hard_exit( const char * pcerror, uint8_t arg )
     printf( "  %s\n", build_string() );
 
     exit( 1 );
+#endif
 } //i8086_hard_exit
 
 uint8_t i8086_invoke_in_byte( uint16_t port )
@@ -3034,6 +4364,9 @@ uint8_t i8086_invoke_in_byte( uint16_t port )
     static uint8_t port40 = 0;
     //tracer.Trace( "invoke_in_byte port %#x\n", port );
 
+    if ( ( port >= 0x40 && port <= 0x42 ) || 0x3da == port || 0x3ba == port )
+        g_idle.busy = true; // these count or toggle on each read, so a loop reading them is making progress
+
     if ( 0x3da == port )
     {
         // toggle this or apps will spin waiting for the I/O port to work.
@@ -3102,6 +4435,7 @@ uint16_t i8086_invoke_in_word( uint16_t port )
 void i8086_invoke_out_byte( uint16_t port, uint8_t val )
 {
     tracer.Trace( "invoke_out_byte port %#x, val %#x\n", port, val );
+    g_idle.busy = true;
 
     if ( 0x20 == port && 0x20 == val ) // End Of Interrupt to 8259A PIC. Enable subsequent interrupts
         g_int9_pending = false;
@@ -3110,6 +4444,7 @@ void i8086_invoke_out_byte( uint16_t port, uint8_t val )
 void i8086_invoke_out_word( uint16_t port, uint16_t val )
 {
     tracer.Trace( "invoke_out_word port %#x, val %#x\n", port, val );
+    g_idle.busy = true;
 } //i8086_invoke_out_word
 
 void i8086_invoke_halt()
@@ -3259,88 +4594,135 @@ bool starts_with( const char * str, const char * start )
         return true;
     } //ProcessFoundFileFCB
     
-    static HANDLE g_hFindFirst = INVALID_HANDLE_VALUE;
+    // open searches keyed by the flat address of the DTA they fill, so an app can nest searches with separate DTAs
+
+    static unordered_map<uint32_t, HANDLE> g_hFindFirst;
 
-    void CloseFindFirst()
+    HANDLE FindFirstForDTA()
     {
-        if ( INVALID_HANDLE_VALUE != g_hFindFirst )
+        auto it = g_hFindFirst.find( DiskTransferKey() );
+        return ( g_hFindFirst.end() == it ) ? INVALID_HANDLE_VALUE : it->second;
+    } //FindFirstForDTA
+
+    void CloseFindFirst() // the search for the current DTA, if any
+    {
+        auto it = g_hFindFirst.find( DiskTransferKey() );
+        if ( g_hFindFirst.end() != it )
         {
-            FindClose( g_hFindFirst );
-            g_hFindFirst = INVALID_HANDLE_VALUE;
+            FindClose( it->second );
+            g_hFindFirst.erase( it );
         }
     } //CloseFindFirst
 
+    void CloseAllFindFirst()
+    {
+        for ( auto & e : g_hFindFirst )
+            FindClose( e.second );
+        g_hFindFirst.clear();
+    } //CloseAllFindFirst
+
+    void SaveFindFirst( HANDLE h ) // for the current DTA. apps can abandon searches, so cap how many stay open
+    {
+        if ( g_hFindFirst.size() >= MaxOpenFindFirst )
+        {
+            FindClose( g_hFindFirst.begin()->second );
+            g_hFindFirst.erase( g_hFindFirst.begin() );
+        }
+        g_hFindFirst[ DiskTransferKey() ] = h;
+    } //SaveFindFirst
+
 #else
 
     #include <dirent.h>
-    static DIR * g_FindFirst = 0;
-    static char g_acFindFirstFolder[ MAX_PATH ] = {0};
-    static char g_acFindFirstPattern[ MAX_PATH ] = {0};
     struct LINUX_FIND_DATA
     {
         char cFileName[ MAX_PATH ];
     };
 
-    // regex code found on stackoverflow from pooya13
+    struct LinuxFindSearch
+    {
+        vector<string> names; // matching entries read from the directory by find first, with the folder prefix
+        size_t next;          // index in names of the entry find next returns
+    };
+
+    // open searches keyed by the flat address of the DTA they fill, so an app can nest searches with separate DTAs
+
+    static unordered_map<uint32_t, LinuxFindSearch *> g_FindFirst;
 
-    std::regex wildcardToRegex( const std::string& wildcard, bool caseSensitive = true )
+    class DosWildcard
     {
-        std::string regexString( wildcard );
-        regexString = std::regex_replace( regexString, std::regex("\\\\"), "\\\\" );
-        regexString = std::regex_replace( regexString, std::regex("\\^"), "\\^" );
-        regexString = std::regex_replace( regexString, std::regex("\\."), "\\." );
-        regexString = std::regex_replace( regexString, std::regex("\\$"), "\\$" );
-        regexString = std::regex_replace( regexString, std::regex("\\|"), "\\|" );
-        regexString = std::regex_replace( regexString, std::regex("\\("), "\\(" );
-        regexString = std::regex_replace( regexString, std::regex("\\)"), "\\)" );
-        regexString = std::regex_replace( regexString, std::regex("\\{"), "\\{" );
-        regexString = std::regex_replace( regexString, std::regex("\\{"), "\\}" );
-        regexString = std::regex_replace( regexString, std::regex("\\["), "\\[" );
-        regexString = std::regex_replace( regexString, std::regex("\\]"), "\\]" );
-        regexString = std::regex_replace( regexString, std::regex("\\+"), "\\+" );
-        regexString = std::regex_replace( regexString, std::regex("\\/"), "\\/" );
+        // A DOS wildcard compiled once per search. Matching is case-insensitive, ? matches any one character,
+        // and * matches any run of characters. Matches() doesn't allocate.
 
-        // Convert wildcard specific chars * and ? to their regex equivalents:
+        public:
+            void Compile( const char * wildcard )
+            {
+                // in DOS, ???????? for filename and ??? for extension are really *, not literally matching that number of characters
 
-        regexString = std::regex_replace( regexString, std::regex("\\?"), "." );
-        regexString = std::regex_replace( regexString, std::regex("\\*"), ".*" );
+                if ( !strcmp( wildcard, "????????.???" ) )
+                    strcpy( pattern, "*.*" );
+                else if ( starts_with( wildcard, "????????." ) )
+                {
+                    strcpy( pattern, "*." );
+                    strcat( pattern, wildcard + 9 );
+                }
+                else if ( ends_with( wildcard, ".???" ) )
+                {
+                    strcpy( pattern, wildcard );
+                    char * pdot = strchr( pattern, '.' );
+                    strcpy( pdot, ".*" );
+                }
+                else
+                    strcpy( pattern, wildcard );
 
-        return std::regex( regexString, caseSensitive ? std::regex_constants::ECMAScript : std::regex_constants::icase );
-    } //wildcardToRegex
+                for ( char * p = pattern; *p; p++ )
+                    *p = (char) tolower( *p );
 
-    bool wildMatch( const std::string & input, const std::string & wildcard )
-    {
-        // very expensive to initialize this every time, but it's an emulator doing disk I/O, so it's OK
+                matchAll = !strcmp( pattern, "*.*" );
+                tracer.Trace( "  compiled wildcard '%s' as '%s'\n", wildcard, pattern );
+            } //Compile
 
-        std::string wc = wildcard;
-        const char * pwildcard = wildcard.c_str();
-        char ac[ 20 ];
+            bool Matches( const char * name ) const
+            {
+                if ( matchAll )
+                    return true;
 
-        // in DOS, ???????? for filename and ??? for extension are really *, not literally matching that number of characters
+                const char * p = pattern;
+                const char * star = 0;   // pattern just past the last * seen
+                const char * resume = 0; // where in name that * started matching
 
-        if ( !strcmp( pwildcard, "????????.???" ) )
-            wc = "*.*";
-        else if ( starts_with( pwildcard, "????????." ) )
-        {
-            strcpy( ac, "*." );
-            strcat( ac, pwildcard + 9);
-            wc = ac;
-        }
-        else if ( ends_with ( pwildcard, ".???" ) )
-        {
-            strcpy( ac, pwildcard );
-            char * pdot = strchr( ac, '.' );
-            strcpy( pdot, ".*" );
-            wc = ac;
-        }
+                while ( *name )
+                {
+                    char c = (char) tolower( *name );
+                    if ( ( '?' == *p ) || ( c == *p ) )
+                    {
+                        p++;
+                        name++;
+                    }
+                    else if ( '*' == *p )
+                    {
+                        star = ++p;
+                        resume = name;
+                    }
+                    else if ( star )
+                    {
+                        p = star;  // let the last * absorb one more character and try again
+                        name = ++resume;
+                    }
+                    else
+                        return false;
+                }
 
-        if ( !strcmp( wc.c_str(), "*.*" ) )
-            return true;
+                while ( '*' == *p )
+                    p++;
+
+                return ( 0 == *p );
+            } //Matches
 
-        tracer.Trace( "  modified wildcard from '%s' to '%s'\n", wildcard.c_str(), wc.c_str() );
-        std::regex rgx = wildcardToRegex( wc, false );
-        return std::regex_match( input, rgx );
-    } //wildMatch
+        private:
+            char pattern[ MAX_PATH ];
+            bool matchAll;
+    };
 
     void tmTimeToDos( long sec, uint16_t & dos_time, uint16_t & dos_date )
     {
@@ -3480,67 +4862,61 @@ bool starts_with( const char * str, const char * start )
         return true;
     } //ProcessFoundFileFCB
 
-    void CloseFindFirst()
+    LinuxFindSearch * FindFirstForDTA()
+    {
+        auto it = g_FindFirst.find( DiskTransferKey() );
+        return ( g_FindFirst.end() == it ) ? 0 : it->second;
+    } //FindFirstForDTA
+
+    void CloseFindFirst() // the search for the current DTA, if any
     {
-        if ( 0 != g_FindFirst )
+        auto it = g_FindFirst.find( DiskTransferKey() );
+        if ( g_FindFirst.end() != it )
         {
-            closedir( g_FindFirst );
-            g_FindFirst = 0;
+            delete it->second;
+            g_FindFirst.erase( it );
         }
     } //CloseFindFirst
 
-    void FindCloseLinux( DIR * pdir )
+    void CloseAllFindFirst()
     {
-        closedir( pdir );
-    } //FindCloseLinux
+        for ( auto & e : g_FindFirst )
+            delete e.second;
+        g_FindFirst.clear();
+    } //CloseAllFindFirst
 
-    bool FindNextFileLinux( DIR * pdir, LINUX_FIND_DATA & fd )
+    void SaveFindFirst( LinuxFindSearch * psearch ) // for the current DTA. apps can abandon searches, so cap how many stay open
     {
-        const char * justPattern = g_acFindFirstPattern;
-
-        do
+        if ( g_FindFirst.size() >= MaxOpenFindFirst )
         {
-            struct dirent * pent = readdir( pdir );
-            if ( 0 == pent )
-            {
-                tracer.Trace( "  readdir returned a 0 for dirent pointer. pdir is %p\n", pdir );
-                return false;
-            }
-
-            // ignore files DOS just wouldn't understand
-
-            tracer.Trace( "  checking filename '%s'\n", pent->d_name );
-            if ( !ValidDOSPathname( pent->d_name ) )
-            {
-                tracer.Trace( "  filename isn't valid\n" );
-                continue;
-            }
-
-            if ( !wildMatch( pent->d_name, justPattern ) )
-            {
-                tracer.Trace( "  filename didn't match pattern\n" );
-                continue;
-            }
+            delete g_FindFirst.begin()->second;
+            g_FindFirst.erase( g_FindFirst.begin() );
+        }
+        g_FindFirst[ DiskTransferKey() ] = psearch;
+    } //SaveFindFirst
 
-            fd.cFileName[ 0 ] = 0;
-            if ( 0 != g_acFindFirstFolder[0] )
-            {
-                strcpy( fd.cFileName, g_acFindFirstFolder );
-                strcat( fd.cFileName, "/" );
-            }
+    bool FindNextFileLinux( LinuxFindSearch * psearch, LINUX_FIND_DATA & fd )
+    {
+        if ( psearch->next >= psearch->names.size() )
+        {
+            tracer.Trace( "  no more matching entries in the search\n" );
+            return false;
+        }
 
-            strcat( fd.cFileName, pent->d_name );
-            tracer.Trace( "  FindNextFileLinux is returning '%s'\n", fd.cFileName );
-            return true;
-        } while ( true );
+        const string & name = psearch->names[ psearch->next++ ];
+        if ( name.length() >= sizeof( fd.cFileName ) )
+            return false;
 
-        return false;            
+        strcpy( fd.cFileName, name.c_str() );
+        tracer.Trace( "  FindNextFileLinux is returning '%s'\n", fd.cFileName );
+        return true;
     } //FindNextFileLinux
 
-    DIR * FindFirstFileLinux( const char * pattern, LINUX_FIND_DATA & fd )
+    LinuxFindSearch * FindFirstFileLinux( const char * pattern, LINUX_FIND_DATA & fd )
     {
-        g_acFindFirstFolder[ 0 ] = 0;
-        g_acFindFirstPattern[ 0 ] = 0;
+        // read the whole directory once and keep the matches so find next doesn't go back to the host
+
+        char folder[ MAX_PATH ] = {0};
         const char * justPattern = pattern;
         DIR * pdir = 0;
         const char * plast = strrchr( pattern, '/' );
@@ -3548,10 +4924,10 @@ bool starts_with( const char * str, const char * start )
             pdir = opendir( "." );
         else
         {
-            strcpy( g_acFindFirstFolder, pattern );
-            g_acFindFirstFolder[ plast - pattern ] = 0;
-            pdir = opendir( g_acFindFirstFolder );
-            tracer.Trace( "  opendir for folder '%s'\n", g_acFindFirstFolder );
+            strcpy( folder, pattern );
+            folder[ plast - pattern ] = 0;
+            pdir = opendir( folder );
+            tracer.Trace( "  opendir for folder '%s'\n", folder );
             justPattern = 1 + plast;
         }
 
@@ -3563,17 +4939,48 @@ bool starts_with( const char * str, const char * start )
             return 0;
         }
 
-        strcpy( g_acFindFirstPattern, justPattern );
-        bool found = FindNextFileLinux( pdir, fd );
+        DosWildcard wildcard;
+        wildcard.Compile( justPattern );
+        LinuxFindSearch * psearch = new LinuxFindSearch();
+        psearch->next = 0;
+
+        do
+        {
+            struct dirent * pent = readdir( pdir );
+            if ( 0 == pent )
+                break;
+
+            // ignore files DOS just wouldn't understand
+
+            tracer.Trace( "  checking filename '%s'\n", pent->d_name );
+            if ( !ValidDOSPathname( pent->d_name ) )
+            {
+                tracer.Trace( "  filename isn't valid\n" );
+                continue;
+            }
+
+            if ( !wildcard.Matches( pent->d_name ) )
+            {
+                tracer.Trace( "  filename didn't match pattern\n" );
+                continue;
+            }
+
+            if ( 0 != folder[ 0 ] )
+                psearch->names.push_back( string( folder ) + "/" + pent->d_name );
+            else
+                psearch->names.push_back( pent->d_name );
+        } while ( true );
+
+        closedir( pdir );
 
-        if ( !found )
+        if ( !FindNextFileLinux( psearch, fd ) )
         {
-            tracer.Trace( "  FindFirstFileLinux found nothing, so closing the directory\n" );
-            closedir( pdir );
+            tracer.Trace( "  FindFirstFileLinux found nothing\n" );
+            delete psearch;
             return 0;
         }
 
-        return pdir;
+        return psearch;
     } //FindFirstFileLinux
 
 #endif
@@ -3728,8 +5135,8 @@ void handle_int_10( uint8_t c )
             {
                 if ( 0 == col && ( row == ( prevRow + 1 ) ) )
                 {
-                    printf( "\n" );
-                    fflush( stdout );
+                    ConsolePutChar( '\n' );
+                    FlushConsoleOutput();
                 }
             }
 
@@ -3939,8 +5346,8 @@ void handle_int_10( uint8_t c )
 
                 if ( 0xd != ch )
                 {
-                    printf( "%c", ch );
-                    fflush( stdout );
+                    ConsolePutChar( ch );
+                    FlushConsoleOutput();
                 }
             }
 
@@ -3972,8 +5379,8 @@ void handle_int_10( uint8_t c )
             {
                 if ( 0xd != ch )
                 {
-                    printf( "%c", ch );
-                    fflush( stdout );
+                    ConsolePutChar( ch );
+                    FlushConsoleOutput();
                 }
             }
 
@@ -4049,8 +5456,8 @@ void handle_int_10( uint8_t c )
             {
                 if ( 0xd != ch )
                 {
-                    printf( "%c", ch );
-                    fflush( stdout );
+                    ConsolePutChar( ch );
+                    FlushConsoleOutput();
                 }
             }
 
@@ -4250,7 +5657,7 @@ void handle_int_10( uint8_t c )
 void handle_int_16( uint8_t c )
 {
     uint8_t * pbiosdata = cpu.flat_address8( 0x40, 0 );
-    pbiosdata[ 0x17 ] = get_keyboard_flags_depressed();
+    pbiosdata[ 0x17 ] = KeyboardFlags();
 
     CKbdBuffer kbd_buf;
 
@@ -4299,7 +5706,7 @@ void handle_int_16( uint8_t c )
 
             if ( g_use80xRowsMode )
             {
-                bool update = throttled_UpdateDisplay();
+                bool update = ReplayFlag( replayRedrew, throttled_UpdateDisplay() );
                 if ( update )
                     g_int16_1_loop = false;
             }
@@ -4388,19 +5795,19 @@ void HandleAppExit()
         uint16_t handle = g_fileEntries[ index ].handle;
         tracer.Trace( "  closing file an app leaked: '%s', handle %04x\n", g_fileEntries[ index ].path, handle );
         FILE * fp = RemoveFileEntry( handle );
-        fclose( fp );
+        CloseHostFile( fp );
     } while ( true );
 
     trace_all_open_files_fcb();
 
     do
     {
-        size_t index = FindFileEntryIndexByProcessFCB( g_currentPSP );
-        if ( -1 == index )
+        const char * path = FindFileEntryPathByProcessFCB( g_currentPSP );
+        if ( !path )
             break;
-        tracer.Trace( "  closing fcb file an app leaked: '%s'\n", g_fileEntriesFCB[ index ].path );
-        FILE * fp = RemoveFileEntryFCB( g_fileEntriesFCB[ index ].path );
-        fclose( fp );
+        tracer.Trace( "  closing fcb file an app leaked: '%s'\n", path );
+        FILE * fp = RemoveFileEntryFCB( path );
+        CloseHostFile( fp );
     } while ( true );
 
     g_appTerminationReturnCode = cpu.al();
@@ -4670,9 +6077,12 @@ void output_character( char ch )
         if ( 0x0d != ch )
         {
             if ( 8 == ch )
-                printf( "%c ", ch );
-            printf( "%c", ch );
-            fflush( stdout );
+            {
+                ConsolePutChar( ch );
+                ConsolePutChar( ' ' );
+            }
+            ConsolePutChar( ch );
+            FlushConsoleOutput();
         }
     }
 } //output_character
@@ -4700,10 +6110,21 @@ void handle_int_21( uint8_t c )
             // ^c and ^break are checked.
             // just like function 7 except character is echoed to stdout.
 
+            if ( g_pipedStdin )
+            {
+                // redirected input is echoed too. DOS would hang at the end of input; return ^Z instead
+
+                int ch = GetPipedChar();
+                cpu.set_al( ( EOF == ch ) ? 0x1a : (uint8_t) ch );
+                if ( EOF != ch )
+                    output_character( cpu.al() );
+                return;
+            }
+
             // character input. block until a keystroke is available.
 
             uint8_t * pbiosdata = cpu.flat_address8( 0x40, 0 );
-            pbiosdata[ 0x17 ] = get_keyboard_flags_depressed();
+            pbiosdata[ 0x17 ] = KeyboardFlags();
 
             if ( g_use80xRowsMode)
                 UpdateDisplay();
@@ -4743,6 +6164,14 @@ void handle_int_21( uint8_t c )
                 // input. don't block if nothing is available
                 // Multiplan (v2) is the only app I've found that uses this function for input. Microsoft LISP uses it too.
 
+                if ( g_pipedStdin )
+                {
+                    int ch = GetPipedChar();
+                    cpu.set_zero( EOF == ch );
+                    cpu.set_al( ( EOF == ch ) ? 0 : (uint8_t) ch );
+                    return;
+                }
+
                 CKbdBuffer kbd_buf;
                 InjectKeystrokes();
 
@@ -4795,8 +6224,8 @@ void handle_int_21( uint8_t c )
                 tracer.Trace( "    direct console output %02x, '%c'\n", (uint8_t) ch, printable( (uint8_t) ch ) );
                 if ( 0x0d != ch )
                 {
-                    printf( "%c", ch );
-                    fflush( stdout );
+                    ConsolePutChar( ch );
+                    FlushConsoleOutput();
                 }
             }
     
@@ -4807,8 +6236,15 @@ void handle_int_21( uint8_t c )
         {
             // character input. block until a keystroke is available.
 
+            if ( g_pipedStdin )
+            {
+                int ch = GetPipedChar();
+                cpu.set_al( ( EOF == ch ) ? 0x1a : (uint8_t) ch );
+                return;
+            }
+
             uint8_t * pbiosdata = cpu.flat_address8( 0x40, 0 );
-            pbiosdata[ 0x17 ] = get_keyboard_flags_depressed();
+            pbiosdata[ 0x17 ] = KeyboardFlags();
 
             if ( g_use80xRowsMode)
                 UpdateDisplay();
@@ -4852,8 +6288,8 @@ void handle_int_21( uint8_t c )
             char * p = (char *) cpu.flat_address( cpu.get_ds(), cpu.get_dx() );
             tracer.TraceBinaryData( (uint8_t *) p, 0x40, 2 );
             while ( *p && '$' != *p )
-                printf( "%c", *p++ );
-            fflush( stdout );
+                ConsolePutChar( *p++ );
+            FlushConsoleOutput();
     
             return;
         }
@@ -4862,6 +6298,37 @@ void handle_int_21( uint8_t c )
             // Buffered Keyboard input. DS::DX pointer to buffer. byte 0 count in, byte 1 count out excluding CR, byte 2 starts the response
             // The assembler version enables the emulator to send timer and keyboard interrupts.
 
+            if ( g_pipedStdin )
+            {
+                // a line of redirected input, echoed as DOS does. a CR LF pair ends one line, not two.
+                // characters beyond the buffer are dropped, as DOS beeps and ignores them.
+
+                static bool lastEndedWithCR = false;
+                uint8_t * p = cpu.flat_address8( cpu.get_ds(), cpu.get_dx() );
+                uint8_t maxLen = p[ 0 ]; // includes the CR
+                uint8_t len = 0;
+
+                int ch = GetPipedChar();
+                if ( lastEndedWithCR && ( 0x0a == ch ) )
+                    ch = GetPipedChar();
+
+                while ( ( EOF != ch ) && ( 0x0d != ch ) && ( 0x0a != ch ) )
+                {
+                    if ( len + 1 < maxLen )
+                    {
+                        p[ 2 + len++ ] = (uint8_t) ch;
+                        output_character( (char) ch );
+                    }
+                    ch = GetPipedChar();
+                }
+
+                lastEndedWithCR = ( 0x0d == ch );
+                p[ 1 ] = len;
+                p[ 2 + len ] = 0x0d;
+                tracer.Trace( "  returning length %d, string '%.*s' from piped stdin\n", p[1], p[1], p + 2 );
+                return;
+            }
+
 #if USE_ASSEMBLY_FOR_KBD
             invoke_assembler_routine( g_int21_a_seg );
 #else
@@ -4871,7 +6338,7 @@ void handle_int_21( uint8_t c )
 
             // This blocks and prevents timer interrupts from being processed.
 
-            char * result = ConsoleConfiguration::portable_gets_s( (char *) p + 2, maxLen - 1 );
+            char * result = ReadConsoleLine( (char *) p + 2, maxLen - 1 );
             if ( result )
             {
                 size_t len = strlen( result );
@@ -4894,6 +6361,12 @@ void handle_int_21( uint8_t c )
         {
             // check standard input status. Returns AL: 0xff if char available, 0 if not
 
+            if ( g_pipedStdin )
+            {
+                cpu.set_al( PipedInputReady() ? 0xff : 0 );
+                return;
+            }
+
             InjectKeystrokes();
             CKbdBuffer kbd_buf;
             cpu.set_al( kbd_buf.IsEmpty() ? 0 : 0xff );
@@ -4960,10 +6433,10 @@ void handle_int_21( uint8_t c )
                 if ( 0 != fp )
                 {
                     RemoveFileEntryFCB( filename );
-                    fclose( fp );
+                    CloseHostFile( fp );
                 }
 
-                fp = fopen( filename, "r+b" );
+                fp = OpenHostFile( filename, "r+b" );
                 if ( fp )
                 {
                     tracer.Trace( "  file opened successfully\n" );
@@ -4981,12 +6454,12 @@ void handle_int_21( uint8_t c )
                     // pfcb->recNumber = 0;
     
                     FileEntry fe = {0};
-                    strcpy( fe.path, filename );
+                    fe.path = InternPath( filename );
                     fe.fp = fp;
                     fe.handle = 0; // FCB files don't have handles
                     fe.mode = 2;
                     fe.seg_process = g_currentPSP;
-                    g_fileEntriesFCB.push_back( fe );
+                    AddFileEntryFCB( fe );
                     tracer.Trace( "  successfully opened file\n" );
                     trace_all_open_files_fcb();
         
@@ -5018,7 +6491,7 @@ void handle_int_21( uint8_t c )
                 {
                     cpu.set_al( 0 );
                     tracer.Trace( "  successfully closed already open file\n" );
-                    fclose( fp );
+                    CloseHostFile( fp );
                     trace_all_open_files_fcb();
                 }
                 else
@@ -5057,9 +6530,10 @@ void handle_int_21( uint8_t c )
                 tracer.Trace( "  searching for pattern '%s'\n", search_string );
 #ifdef _WIN32                
                 WIN32_FIND_DATAA fd = {0};
-                g_hFindFirst = FindFirstFileA( search_string, &fd );
-                if ( INVALID_HANDLE_VALUE != g_hFindFirst )
+                HANDLE hFind = FindFirstFileA( search_string, &fd );
+                if ( INVALID_HANDLE_VALUE != hFind )
                 {
+                    SaveFindFirst( hFind );
                     do
                     {
                         ok = ProcessFoundFileFCB( fd, attr, extendedFCB );
@@ -5069,7 +6543,7 @@ void handle_int_21( uint8_t c )
                             break;
                         }
 
-                        BOOL found = FindNextFileA( g_hFindFirst, &fd );
+                        BOOL found = FindNextFileA( hFind, &fd );
                         if ( !found )
                         {
                             cpu.set_al( 0xff );
@@ -5090,9 +6564,10 @@ void handle_int_21( uint8_t c )
                 const char * linuxSearch = DOSToHostPath( search_string );
                 tracer.Trace( "  linux search string: '%s'\n", linuxSearch );
                 tracer.TraceBinaryData( (uint8_t *) linuxSearch, strlen( linuxSearch ), 4 );
-                g_FindFirst = FindFirstFileLinux( linuxSearch, lfd );
-                if ( 0 != g_FindFirst )
+                LinuxFindSearch * psearch = FindFirstFileLinux( linuxSearch, lfd );
+                if ( 0 != psearch )
                 {
+                    SaveFindFirst( psearch );
                     do
                     {
                         bool ok = ProcessFoundFileFCB( lfd, attr, extendedFCB );
@@ -5102,7 +6577,7 @@ void handle_int_21( uint8_t c )
                             break;
                         }
 
-                        bool found = FindNextFileLinux( g_FindFirst, lfd );
+                        bool found = FindNextFileLinux( psearch, lfd );
                         if ( !found )
                         {
                             cpu.set_al( 0xff );
@@ -5135,7 +6610,8 @@ void handle_int_21( uint8_t c )
             //    if found, DTA is used as an FCB ready for an open or delete
 
 #ifdef _WIN32
-            if ( INVALID_HANDLE_VALUE == g_hFindFirst )
+            HANDLE hFind = FindFirstForDTA();
+            if ( INVALID_HANDLE_VALUE == hFind )
                 cpu.set_al( 0xff );
             else
             {
@@ -5154,7 +6630,7 @@ void handle_int_21( uint8_t c )
 
                 do
                 {
-                    BOOL found = FindNextFileA( g_hFindFirst, &fd );
+                    BOOL found = FindNextFileA( hFind, &fd );
                     if ( found )
                     {
                         bool ok = ProcessFoundFileFCB( fd, attr, extendedFCB );
@@ -5174,7 +6650,8 @@ void handle_int_21( uint8_t c )
                 } while( true );
             }
 #else
-            if ( 0 != g_FindFirst )
+            LinuxFindSearch * psearch = FindFirstForDTA();
+            if ( 0 != psearch )
             {
                 DOSFCB *pfcb = (DOSFCB *) cpu.flat_address( cpu.get_ds(), cpu.get_dx() );
                 uint8_t attr = 0;
@@ -5190,7 +6667,7 @@ void handle_int_21( uint8_t c )
                 do
                 {
                     LINUX_FIND_DATA lfd = {0};
-                    bool found = FindNextFileLinux( g_FindFirst, lfd );
+                    bool found = FindNextFileLinux( psearch, lfd );
                     if ( found )
                     {
                         bool ok = ProcessFoundFileFCB( lfd, attr, extendedFCB );
@@ -5238,7 +6715,7 @@ void handle_int_21( uint8_t c )
                 {
                     RemoveFileEntryFCB( filename );
                     tracer.Trace( "  closing an open file before deleting it\n" );
-                    fclose( fp );
+                    CloseHostFile( fp );
                     trace_all_open_files_fcb();
                 }
 
@@ -5281,11 +6758,12 @@ void handle_int_21( uint8_t c )
                     uint32_t seekOffset = pfcb->SequentialOffset();
                     tracer.Trace( "  seek offset: %u\n", seekOffset );
                     tracer.Trace( "  using disk transfer address %04x:%04x\n", g_diskTransferSegment, g_diskTransferOffset );
-                    bool ok = !fseek( fp, seekOffset, SEEK_SET );
+                    bool ok = ( -1 != SeekHostFile( fp, seekOffset ) );
                     if ( ok )
                     {
                         memset( GetDiskTransferAddress(), 0, pfcb->recSize );
-                        size_t num_read = fread( GetDiskTransferAddress(), 1, pfcb->recSize, fp );
+                        size_t num_read = ReadHostFile( fp, GetDiskTransferAddress(), pfcb->recSize );
+                        num_read = ReplayBytes( replayFileRead, GetDiskTransferAddress(), (uint32_t) num_read, pfcb->recSize );
                         if ( num_read )
                         {
                              tracer.Trace( "  read succeded: %u bytes. recsize %u bytes\n", num_read, pfcb->recSize );
@@ -5330,10 +6808,10 @@ void handle_int_21( uint8_t c )
                 {
                     uint32_t seekOffset = pfcb->SequentialOffset();
                     tracer.Trace( "  seek offset: %u\n", seekOffset );
-                    bool ok = !fseek( fp, seekOffset, SEEK_SET );
+                    bool ok = ( -1 != SeekHostFile( fp, seekOffset ) );
                     if ( ok )
                     {
-                        size_t num_written = fwrite( GetDiskTransferAddress(), 1, pfcb->recSize, fp );
+                        size_t num_written = WriteHostFile( fp, GetDiskTransferAddress(), pfcb->recSize );
                         if ( num_written )
                         {
                              tracer.Trace( "  write succeded: %u bytes. recsize %u bytes\n", num_written, pfcb->recSize );
@@ -5374,7 +6852,7 @@ void handle_int_21( uint8_t c )
             {
                 tracer.Trace( "  creating '%s'\n", filename );
     
-                FILE * fp = fopen( filename, "w+b" );
+                FILE * fp = OpenHostFile( filename, "w+b" );
                 if ( fp )
                 {
                     tracer.Trace( "  file created successfully\n" );
@@ -5391,12 +6869,12 @@ void handle_int_21( uint8_t c )
                     // pfcb->recNumber = 0;
 
                     FileEntry fe = {0};
-                    strcpy( fe.path, filename );
+                    fe.path = InternPath( filename );
                     fe.fp = fp;
                     fe.handle = 0;
                     fe.mode = 2;
                     fe.seg_process = g_currentPSP;
-                    g_fileEntriesFCB.push_back( fe );
+                    AddFileEntryFCB( fe );
                     trace_all_open_files_fcb();
 
                     pfcb->Trace();
@@ -5530,11 +7008,12 @@ void handle_int_21( uint8_t c )
                     tracer.Trace( "  seek offset: %u\n", seekOffset );
                     pfcb->SetSequentialFromRandom(); // Digital Research PL/I compiler/linker depends on this
     
-                    bool ok = !fseek( fp, seekOffset, SEEK_SET );
+                    bool ok = ( -1 != SeekHostFile( fp, seekOffset ) );
                     if ( ok )
                     {
                         memset( GetDiskTransferAddress(), 0, pfcb->recSize );
-                        size_t num_read = fread( GetDiskTransferAddress(), 1, pfcb->recSize, fp );
+                        size_t num_read = ReadHostFile( fp, GetDiskTransferAddress(), pfcb->recSize );
+                        num_read = ReplayBytes( replayFileRead, GetDiskTransferAddress(), (uint32_t) num_read, pfcb->recSize );
                         if ( num_read )
                         {
                              tracer.Trace( "  read succeded: %u bytes. recsize %u bytes\n", num_read, pfcb->recSize );
@@ -5578,10 +7057,10 @@ void handle_int_21( uint8_t c )
                     tracer.Trace( "  seek offset: %u\n", seekOffset );
                     pfcb->SetSequentialFromRandom(); // Digital Research PL/I compiler/linker depends on this
     
-                    bool ok = !fseek( fp, seekOffset, SEEK_SET );
+                    bool ok = ( -1 != SeekHostFile( fp, seekOffset ) );
                     if ( ok )
                     {
-                        size_t num_written = fwrite( GetDiskTransferAddress(), 1, pfcb->recSize, fp );
+                        size_t num_written = WriteHostFile( fp, GetDiskTransferAddress(), pfcb->recSize );
                         if ( num_written )
                         {
                              tracer.Trace( "  write succeded: %u bytes\n", pfcb->recSize );
@@ -5675,13 +7154,14 @@ void handle_int_21( uint8_t c )
                     else
                     {
                         tracer.Trace( "  seek offset: %u\n", seekOffset );
-                        bool ok = !fseek( fp, seekOffset, SEEK_SET );
+                        bool ok = ( -1 != SeekHostFile( fp, seekOffset ) );
                         if ( ok )
                         {
                             uint32_t askedBytes = pfcb->recSize * cRecords;
                             memset( GetDiskTransferAddress(), 0, askedBytes );
                             uint32_t toRead = get_min( pfcb->fileSize - seekOffset, askedBytes );
-                            size_t numRead = fread( GetDiskTransferAddress(), 1, toRead, fp );
+                            size_t numRead = ReadHostFile( fp, GetDiskTransferAddress(), toRead );
+                            numRead = ReplayBytes( replayFileRead, GetDiskTransferAddress(), (uint32_t) numRead, toRead );
                             if ( numRead )
                             {
                                 tracer.Trace( "  numRead: %zd, toRead %zd, askedBytes %u\n", numRead, toRead, askedBytes );
@@ -5741,10 +7221,10 @@ void handle_int_21( uint8_t c )
                     uint32_t seekOffset = pfcb->RandomOffset();
                     tracer.Trace( "  seek offset: %u\n", seekOffset );
     
-                    bool ok = !fseek( fp, seekOffset, SEEK_SET );
+                    bool ok = ( -1 != SeekHostFile( fp, seekOffset ) );
                     if ( ok )
                     {
-                        size_t num_written = fwrite( GetDiskTransferAddress(), recsToWrite, pfcb->recSize, fp );
+                        size_t num_written = WriteHostFile( fp, GetDiskTransferAddress(), (size_t) recsToWrite * pfcb->recSize );
                         if ( num_written )
                         {
                              tracer.Trace( "  write succeded: %u bytes\n", recsToWrite * pfcb->recSize );
@@ -5858,6 +7338,7 @@ void handle_int_21( uint8_t c )
             cpu.set_cx( (uint16_t) ( current_dt.tm_year + 1900 ) );
             cpu.set_dh( (uint8_t) current_dt.tm_mon + 1 );
             cpu.set_dl( (uint8_t) current_dt.tm_mday );
+            ReplayClock();
             tracer.Trace( "  returning year %u, month %u, day %u, day of week %u\n", cpu.get_cx(), cpu.dh(), cpu.dl(), cpu.al() );
     
             return;
@@ -5875,6 +7356,7 @@ void handle_int_21( uint8_t c )
             cpu.set_cl( (uint8_t) plocal->tm_min );
             cpu.set_dh( (uint8_t) plocal->tm_sec );
             cpu.set_dl( (uint8_t) ( ms / 10 ) );
+            ReplayClock();
             tracer.Trace( "  system time is %02d:%02d:%02d.%02d\n", cpu.ch(), cpu.cl(), cpu.dh(), cpu.dl() );
 
             #if false // useful when debugging to keep trace files consistent between runs
@@ -6107,16 +7589,16 @@ void handle_int_21( uint8_t c )
             tracer.Trace( "  create file '%s'\n", path );
             cpu.set_ax( 3 );
     
-            FILE * fp = fopen( path, "w+b" );
+            FILE * fp = OpenHostFile( path, "w+b" );
             if ( fp )
             {
                 FileEntry fe = {0};
-                strcpy( fe.path, path );
+                fe.path = InternPath( path );
                 fe.fp = fp;
                 fe.handle = FindFirstFreeFileHandle();
                 fe.mode = 2; // read / write
                 fe.seg_process = g_currentPSP;
-                g_fileEntries.push_back( fe );
+                AddFileEntry( fe );
                 cpu.set_ax( fe.handle );
                 cpu.set_carry( false );
                 tracer.Trace( "  successfully created file and using new handle %04x\n", cpu.get_ax() );
@@ -6156,16 +7638,16 @@ void handle_int_21( uint8_t c )
                 return;
             }
 
-            FILE * fp = fopen( path, ( 0 == openmode ) ? "rb" : "r+b" );
+            FILE * fp = OpenHostFile( path, ( 0 == openmode ) ? "rb" : "r+b" );
             if ( fp )
             {
                 FileEntry fe = {0};
-                strcpy( fe.path, path );
+                fe.path = InternPath( path );
                 fe.fp = fp;
                 fe.handle = FindFirstFreeFileHandle();
                 fe.mode = openmode;
                 fe.seg_process = g_currentPSP;
-                g_fileEntries.push_back( fe );
+                AddFileEntry( fe );
                 cpu.set_ax( fe.handle );
                 cpu.set_carry( false );
                 tracer.Trace( "  successfully opened file, using new handle %04x\n", cpu.get_ax() );
@@ -6203,7 +7685,7 @@ void handle_int_21( uint8_t c )
                     if ( fp )
                     {
                         tracer.Trace( "  close file handle %04x, fp %p\n", handle, fp );
-                        fclose( fp );
+                        CloseHostFile( fp );
                         cpu.set_carry( false );
                         UpdateHandleMap();
                     }
@@ -6233,6 +7715,15 @@ void handle_int_21( uint8_t c )
     
                 if ( 0 == handle )
                 {
+                    if ( g_pipedStdin )
+                    {
+                        uint8_t * p = cpu.flat_address8( cpu.get_ds(), cpu.get_dx() );
+                        cpu.set_ax( (uint16_t) ReadPipedInput( p, cpu.get_cx() ) );
+                        cpu.set_carry( false );
+                        tracer.Trace( "  read %u bytes from piped stdin\n", cpu.get_ax() );
+                        return;
+                    }
+
                     if ( g_use80xRowsMode )
                         UpdateDisplay();
     
@@ -6254,7 +7745,7 @@ void handle_int_21( uint8_t c )
                     {
                         size_t len = _countof( acBuffer );
                         // This blocks and prevents timer interrupts from being processed.
-                        char * result = ConsoleConfiguration::portable_gets_s( acBuffer, _countof( acBuffer ) );
+                        char * result = ReadConsoleLine( acBuffer, _countof( acBuffer ) );
                         if ( result )
                         {
                             strcat( acBuffer, "\r\n" );
@@ -6309,37 +7800,30 @@ void handle_int_21( uint8_t c )
                 uint8_t * p = cpu.flat_address8( cpu.get_ds(), cpu.get_dx() );
                 tracer.Trace( "  read from file using handle %u, %04x bytes at address %02x:%02x. offset just beyond: %02x\n",
                               cpu.get_bx(), len, cpu.get_ds(), cpu.get_dx(), cpu.get_dx() + len );
-                uint32_t cur = ftell( fp );
-                uint32_t size = portable_filelen( fp );
                 cpu.set_ax( 0 );
-                tracer.Trace( "  current file position: %u, file size %u\n", cur, size );
-    
-                if ( cur < size )
+
+                // no up-front size check: a short read at the end of the file is the answer, and asking the size
+                // would reposition the stream and throw away its read-ahead buffer on every call.
+
+                size_t numRead = ReadHostFile( fp, p, len );
+                numRead = ReplayBytes( replayFileRead, p, (uint32_t) numRead, len );
+                if ( numRead )
                 {
-                    uint32_t toRead = get_min( (uint32_t) len, size - cur );
-                    memset( p, 0, toRead );
-                    tracer.Trace( "  attempting to read %u == %04x bytes \n", toRead, toRead );
-                    size_t numRead = fread( p, 1, toRead, fp );
-                    if ( numRead )
-                    {
-                        cpu.set_ax( (uint16_t) toRead );
-                        tracer.Trace( "  successfully read %u == %04x bytes\n", numRead, numRead );
-                        tracer.TraceBinaryData( p, toRead, 4 );
-                    }
-                    else
-                    {
-                        if ( feof( fp ) )
-                            tracer.Trace( "  ERROR: can't read because we're at the end of the file\n" );
-                        else
-                            tracer.Trace( "  ERROR: failed to read fp %p, error %d = %s\n", fp, errno, strerror( errno ) );
-                    }
+                    cpu.set_ax( (uint16_t) numRead );
+                    tracer.Trace( "  successfully read %u == %04x bytes\n", numRead, numRead );
+                    tracer.TraceBinaryData( p, (uint32_t) numRead, 4 );
                 }
                 else
-                    tracer.Trace( "  ERROR: attempt to read beyond the end of file\n" );
-    
-                cpu.set_carry( false );
-            }
-            else
+                {
+                    if ( feof( fp ) )
+                        tracer.Trace( "  ERROR: attempt to read beyond the end of file\n" );
+                    else
+                        tracer.Trace( "  ERROR: failed to read fp %p, error %d = %s\n", fp, errno, strerror( errno ) );
+                }
+
+                cpu.set_carry( false );
+            }
+            else
             {
                 tracer.Trace( "  ERROR: read from file handle couldn't find handle %04x\n", handle );
                 cpu.set_ax( 6 );
@@ -6417,6 +7901,11 @@ void handle_int_21( uint8_t c )
                             }
                         }
                     }
+                    else if ( g_pipedStdout && !g_consoleSink )
+                    {
+                        WritePipedOutput( ( 2 == handle ) ? stderr : stdout, p, cpu.get_cx() );
+                        tracer.Trace( "  wrote %u bytes to piped handle %u\n", cpu.get_cx(), handle );
+                    }
                     else
                     {
                         tracer.Trace( "  writing text to display: '" );
@@ -6424,7 +7913,7 @@ void handle_int_21( uint8_t c )
                         {
                             if ( 0x0d != p[ x ] && 0x0b != p[ x ] )
                             {
-                                printf( "%c", p[ x ] );
+                                ConsolePutChar( p[ x ] );
                                 tracer.Trace( "%c", printable( p[x] ) );
                             }
                         }
@@ -6444,8 +7933,8 @@ void handle_int_21( uint8_t c )
     
                 cpu.set_ax( 0 );
     
-                size_t numWritten = fwrite( p, len, 1, fp );
-                if ( numWritten || ( 0 == len ) )
+                size_t numWritten = WriteHostFile( fp, p, len );
+                if ( numWritten == len )
                 {
                     cpu.set_ax( len );
                     tracer.Trace( "  successfully wrote %u bytes\n", len );
@@ -6485,7 +7974,7 @@ void handle_int_21( uint8_t c )
                 if ( fp )
                 {
                     tracer.Trace( "  closing file handle %04x prior to delete\n", handle );
-                    fclose( fp );
+                    CloseHostFile( fp );
                 }
             }
 
@@ -6535,20 +8024,18 @@ void handle_int_21( uint8_t c )
                 tracer.Trace( "  move file pointer using handle %04x to %d bytes from %s\n", handle, offset,
                               0 == origin ? "beginning" : 1 == origin ? "current" : "end" );
 
-                uint32_t cur = ftell( fp );
-                fseek( fp, 0, SEEK_END );
-                uint32_t size = ftell( fp );
-                fseek( fp, cur, SEEK_SET );
-                tracer.Trace( "  file size is %u, current offset is %u\n", size, cur );
-    
+                if ( tracer.IsEnabled() )
+                    tracer.Trace( "  file size is %u, current offset is %u\n", (uint32_t) portable_filelen( fp ), (uint32_t) ftell( fp ) );
+
+                int64_t position;
                 if ( 0 == origin )
-                    fseek( fp, offset, SEEK_SET );
+                    position = SeekHostFile( fp, offset, SEEK_SET );
                 else if ( 1 == origin )
-                    fseek( fp, offset, SEEK_CUR );
-                else 
-                    fseek( fp, offset, SEEK_END );
-    
-                cur = ftell( fp );
+                    position = SeekHostFile( fp, offset, SEEK_CUR );
+                else
+                    position = SeekHostFile( fp, offset, SEEK_END );
+
+                uint32_t cur = ( -1 == position ) ? (uint32_t) ftell( fp ) : (uint32_t) position;
                 cpu.set_ax( cur & 0xffff );
                 cpu.set_dx( ( cur >> 16 ) & 0xffff );
     
@@ -6741,16 +8228,16 @@ void handle_int_21( uint8_t c )
             {
                 FileEntry & entry = g_fileEntries[ index ];
 
-                FILE * fp = fopen( entry.path, ( 0 != entry.mode ) ? "r+b" : "rb" );
+                FILE * fp = OpenHostFile( entry.path, ( 0 != entry.mode ) ? "r+b" : "rb" );
                 if ( fp )
                 {
                     FileEntry fe = {0};
-                    strcpy( fe.path, entry.path );
+                    fe.path = InternPath( entry.path );
                     fe.fp = fp;
                     fe.handle = FindFirstFreeFileHandle();
                     fe.mode = entry.mode;
                     fe.seg_process = g_currentPSP;
-                    g_fileEntries.push_back( fe );
+                    AddFileEntry( fe );
                     cpu.set_ax( fe.handle );
                     cpu.set_carry( false );
                     tracer.Trace( "  successfully created duplicate handle of %04x as %04x\n", existing_handle, cpu.get_ax() );
@@ -6799,7 +8286,7 @@ void handle_int_21( uint8_t c )
                         if ( fp )
                         {
                             tracer.Trace( "  closed CX file handle %04x, fp %p\n", hcx, fp );
-                            fclose( fp );
+                            CloseHostFile( fp );
                             UpdateHandleMap();
                         }
                     }
@@ -6820,16 +8307,16 @@ void handle_int_21( uint8_t c )
                 {
                     FileEntry & entry = g_fileEntries[ index ];
     
-                    FILE * fp = fopen( entry.path, ( 0 != entry.mode ) ? "r+b" : "rb" );
+                    FILE * fp = OpenHostFile( entry.path, ( 0 != entry.mode ) ? "r+b" : "rb" );
                     if ( fp )
                     {
                         FileEntry fe = {0};
-                        strcpy( fe.path, entry.path );
+                        fe.path = InternPath( entry.path );
                         fe.fp = fp;
                         fe.handle = FindFirstFreeFileHandle();
                         fe.mode = entry.mode;
                         fe.seg_process = g_currentPSP;
-                        g_fileEntries.push_back( fe );
+                        AddFileEntry( fe );
                         cpu.set_cx( fe.handle );
                         cpu.set_carry( false );
                         tracer.Trace( "  successfully created duplicate handle of %04x as %04x\n", hbx, cpu.get_cx() );
@@ -7215,9 +8702,10 @@ void handle_int_21( uint8_t c )
 
 #ifdef _WIN32
             WIN32_FIND_DATAA fd = {0};
-            g_hFindFirst = FindFirstFileA( hostSearch, &fd );
-            if ( INVALID_HANDLE_VALUE != g_hFindFirst )
+            HANDLE hFind = FindFirstFileA( hostSearch, &fd );
+            if ( INVALID_HANDLE_VALUE != hFind )
             {
+                SaveFindFirst( hFind );
                 do
                 {
                     bool ok = ProcessFoundFile( pff, fd );
@@ -7227,7 +8715,7 @@ void handle_int_21( uint8_t c )
                         break;
                     }
 
-                    BOOL found = FindNextFileA( g_hFindFirst, &fd );
+                    BOOL found = FindNextFileA( hFind, &fd );
                     if ( !found )
                     {
                         memset( pff, 0, sizeof( DosFindFile ) );
@@ -7246,9 +8734,10 @@ void handle_int_21( uint8_t c )
 #else
 
             LINUX_FIND_DATA lfd = {0};
-            g_FindFirst = FindFirstFileLinux( hostSearch, lfd );
-            if ( 0 != g_FindFirst )
+            LinuxFindSearch * psearch = FindFirstFileLinux( hostSearch, lfd );
+            if ( 0 != psearch )
             {
+                SaveFindFirst( psearch );
                 do
                 {
                     bool ok = ProcessFoundFile( pff, lfd );
@@ -7259,7 +8748,7 @@ void handle_int_21( uint8_t c )
                         break;
                     }
 
-                    bool found = FindNextFileLinux( g_FindFirst, lfd );
+                    bool found = FindNextFileLinux( psearch, lfd );
                     if ( !found )
                     {
                         memset( pff, 0, sizeof( DosFindFile ) );
@@ -7288,12 +8777,13 @@ void handle_int_21( uint8_t c )
             tracer.Trace( "  Find Next Asciiz\n" );
     
 #ifdef _WIN32
-            if ( INVALID_HANDLE_VALUE != g_hFindFirst )
+            HANDLE hFind = FindFirstForDTA();
+            if ( INVALID_HANDLE_VALUE != hFind )
             {
                 do
                 {
                     WIN32_FIND_DATAA fd = {0};
-                    BOOL found = FindNextFileA( g_hFindFirst, &fd );
+                    BOOL found = FindNextFileA( hFind, &fd );
                     if ( found )
                     {
                         bool ok = ProcessFoundFile( pff, fd );
@@ -7319,12 +8809,13 @@ void handle_int_21( uint8_t c )
                 tracer.Trace( "  ERROR: search for next without a prior successful search for first\n" );
             }
 #else
-            if ( 0 != g_FindFirst )
+            LinuxFindSearch * psearch = FindFirstForDTA();
+            if ( 0 != psearch )
             {
                 do
                 {
                     LINUX_FIND_DATA lfd = {0};
-                    bool found = FindNextFileLinux( g_FindFirst, lfd );
+                    bool found = FindNextFileLinux( psearch, lfd );
                     if ( found )
                     {
                         bool ok = ProcessFoundFile( pff, lfd );
@@ -7579,42 +9070,440 @@ uint8_t toBCD( uint8_t x )
     return ( ( x / 10 ) << 4 ) | ( x % 10 );
 } //toBCD
 
-void TrackInterruptsCalled( uint8_t interrupt_num, uint8_t ah, bool ah_used )
+// Interrupt usage is counted by interrupt and ah for every call. Whether ah selects a function, and so whether
+// the counts for an interrupt should be summed, is only looked up when they're reported.
+
+struct InterruptUsage
 {
-    bool found = false;
-    size_t cEntries = g_InterruptsCalled.size();
-    for ( size_t i = 0; i < cEntries; i++ )
+    uint8_t i;           // interrupt #
+    bool ah_used;        // true if ah is the function #
+    uint8_t c;           // ah if ah_used
+    uint32_t calls;      // # of times invoked
+    const char * name;
+};
+
+#ifndef NTVDM_LIBRARY
+static void GetInterruptUsage( vector<InterruptUsage> & usage )
+{
+    usage.clear();
+
+    for ( size_t i = 0; i < 256; i++ )
     {
-        IntCalled & ic = g_InterruptsCalled[ i ];
-        if ( ( interrupt_num == ic.i ) && ( ( !ah_used ) || ( ah == ic.c ) ) )
+        InterruptUsage other = { (uint8_t) i, false, 0, 0, 0 }; // calls where ah isn't a known function #
+        for ( size_t c = 0; c < 256; c++ )
         {
-            ic.calls++;
-            found = true;
-            break;
+            uint32_t calls = g_InterruptsCalled[ ( i << 8 ) | c ];
+            if ( 0 == calls )
+                continue;
+
+            InterruptUsage u = { (uint8_t) i, false, (uint8_t) c, calls, 0 };
+            u.name = get_interrupt_string( u.i, u.c, u.ah_used );
+            if ( u.ah_used )
+                usage.push_back( u );
+            else
+            {
+                other.calls += calls;
+                other.name = u.name;
+            }
+        }
+
+        if ( 0 != other.calls )
+            usage.push_back( other );
+    }
+} //GetInterruptUsage
+#endif //NTVDM_LIBRARY
+
+// --stats: writes instruction and interrupt counts as JSON when the app ends. The emulator counts in its dispatch
+// loops, so -x and -j run the same way with and without it.
+
+#ifndef NTVDM_LIBRARY
+static const char * g_statsPath = 0;                 // --stats: JSON file to write on exit
+
+static void PrintJsonString( FILE * fp, const char * pc )
+{
+    fputc( '"', fp );
+    for ( ; *pc; pc++ )
+    {
+        if ( '"' == *pc || '\\' == *pc )
+            fprintf( fp, "\\%c", *pc );
+        else if ( (uint8_t) *pc < ' ' )
+            fprintf( fp, "\\u%04x", (uint8_t) *pc );
+        else
+            fputc( *pc, fp );
+    }
+    fputc( '"', fp );
+} //PrintJsonString
+
+static void WriteStats( long long elapsedMs, uint64_t totalCycles )
+{
+    CFile fp( fopen( g_statsPath, "w" ) );
+    if ( !fp.get() )
+    {
+        printf( "can't create stats file %s, error %d\n", g_statsPath, errno );
+        return;
+    }
+
+    const i8086_counters & counters = cpu.get_counters();
+    uint64_t instructions = 0;
+    for ( size_t i = 0; i < 256; i++ )
+        instructions += counters.opcodes[ i ];
+
+    fprintf( fp.get(), "{\n  \"app\": " );
+    PrintJsonString( fp.get(), g_acApp );
+    fprintf( fp.get(), ",\n  \"exit_code\": %d,\n  \"elapsed_ms\": %lld,\n  \"cycles\": %llu,\n  \"instructions\": %llu,\n",
+             g_appTerminationReturnCode, elapsedMs, (unsigned long long) totalCycles, (unsigned long long) instructions );
+
+    fprintf( fp.get(), "  \"opcodes\": {" );
+    const char * separator = "";
+    for ( size_t i = 0; i < 256; i++ )
+    {
+        if ( counters.opcodes[ i ] )
+        {
+            fprintf( fp.get(), "%s\n    \"%02zx\": %llu", separator, i, (unsigned long long) counters.opcodes[ i ] );
+            separator = ",";
+        }
+    }
+
+    static const struct { uint8_t opcode; const char * name; } prefixes[] =
+        { { 0x26, "es" }, { 0x2e, "cs" }, { 0x36, "ss" }, { 0x3e, "ds" }, { 0xf0, "lock" }, { 0xf2, "repne" }, { 0xf3, "rep" } };
+
+    fprintf( fp.get(), "\n  },\n  \"prefixes\": {" );
+    for ( size_t i = 0; i < _countof( prefixes ); i++ )
+        fprintf( fp.get(), "%s\n    \"%s\": %llu", i ? "," : "", prefixes[ i ].name, (unsigned long long) counters.opcodes[ prefixes[ i ].opcode ] );
+
+    // mod r/m forms are the addressing modes, so the reg field is ignored
+
+    static const char * rm_names[ 8 ] = { "bx+si", "bx+di", "bp+si", "bp+di", "si", "di", "bp", "bx" };
+    uint64_t forms[ 4 ][ 8 ] = {};
+    for ( size_t i = 0; i < 256; i++ )
+        forms[ i >> 6 ][ i & 7 ] += counters.modrm[ i ];
+
+    fprintf( fp.get(), "\n  },\n  \"modrm_forms\": {" );
+    separator = "";
+    for ( size_t mod = 0; mod < 4; mod++ )
+    {
+        for ( size_t rm = 0; rm < 8; rm++ )
+        {
+            char acForm[ 20 ];
+            if ( 3 == mod )
+                snprintf( acForm, sizeof( acForm ), "reg %zu", rm );
+            else if ( 0 == mod && 6 == rm )
+                strcpy( acForm, "[d16]" );
+            else
+                snprintf( acForm, sizeof( acForm ), "[%s%s]", rm_names[ rm ], ( 0 == mod ) ? "" : ( 1 == mod ) ? "+d8" : "+d16" );
+
+            fprintf( fp.get(), "%s\n    \"%s\": %llu", separator, acForm, (unsigned long long) forms[ mod ][ rm ] );
+            separator = ",";
+        }
+    }
+
+    vector<InterruptUsage> usage;
+    GetInterruptUsage( usage );
+    fprintf( fp.get(), "\n  },\n  \"interrupts\": [" );
+    for ( size_t i = 0; i < usage.size(); i++ )
+    {
+        InterruptUsage & u = usage[ i ];
+        fprintf( fp.get(), "%s\n    { \"int\": \"%02x\", ", i ? "," : "", u.i );
+        if ( u.ah_used )
+            fprintf( fp.get(), "\"ah\": \"%02x\", ", u.c );
+        else
+            fprintf( fp.get(), "\"ah\": null, " );
+        fprintf( fp.get(), "\"calls\": %u, \"name\": ", u.calls );
+        PrintJsonString( fp.get(), u.name );
+        fprintf( fp.get(), " }" );
+    }
+
+    fprintf( fp.get(), "\n  ]\n}\n" );
+} //WriteStats
+#endif //NTVDM_LIBRARY
+
+// --trace: writes a binary record of each instruction. --tracedump and --tracediff decode those files.
+
+#ifndef NTVDM_LIBRARY
+static const char * g_binaryTracePath = 0;           // --trace: binary instruction trace file
+
+static int RunTraceTool( int argc, char * argv[] )
+{
+    bool ok;
+    const char * parg = argv[ 1 ];
+
+    if ( starts_with( parg, "--tracedump:" ) )
+    {
+        string path = parg + strlen( "--tracedump:" );
+        int onlyCS = -1;
+        size_t comma = path.find( ',' );
+        if ( string::npos != comma )
+        {
+            onlyCS = (int) strtoul( path.c_str() + comma + 1, 0, 16 );
+            path.resize( comma );
+        }
+
+        ok = i8086_print_trace( path.c_str(), stdout, onlyCS );
+        if ( !ok )
+            printf( "can't read trace file %s\n", path.c_str() );
+    }
+    else
+    {
+        string pathA = parg + strlen( "--tracediff:" );
+        size_t comma = pathA.find( ',' );
+        if ( string::npos == comma )
+        {
+            printf( "--tracediff requires two trace files: --tracediff:A,B\n" );
+            return 1;
         }
+
+        string pathB = pathA.substr( comma + 1 );
+        pathA.resize( comma );
+        ok = i8086_diff_traces( pathA.c_str(), pathB.c_str(), stdout );
+        if ( !ok )
+            printf( "can't read trace files %s and %s\n", pathA.c_str(), pathB.c_str() );
+    }
+
+    return ok ? 0 : 1;
+} //RunTraceTool
+#endif //NTVDM_LIBRARY
+
+// Snapshots. --snapshot: writes the machine to a file the first time the app reads the keyboard or stdin, then
+// keeps running. --restore: starts from that file instead of loading the app, so the app's startup is skipped.
+// Registers are saved while the fake interrupt opcode is executing, so the read is repeated after a restore.
+// Open files are reopened by host path and repositioned; they must still exist. Find first/next state isn't saved.
+
+const char SnapshotSignature[ 8 ] = { 'N', 'T', 'V', 'D', 'M', 'S', 'N', 'P' };
+const uint32_t SnapshotVersion = 1;
+
+struct SnapshotHeader
+{
+    char signature[ 8 ];
+    uint32_t version;
+    uint32_t headerBytes;           // sizeof( SnapshotHeader ), which differs across hosts
+    uint32_t memoryBytes;
+    uint32_t allocEntries;
+    uint32_t fileEntries;
+    uint32_t fileEntriesFCB;
+    i8086_registers registers;
+    uint16_t segHardware;
+    uint16_t diskTransferSegment;
+    uint16_t diskTransferOffset;
+    uint16_t currentPSP;
+    uint8_t use80xRowsMode;
+    uint8_t packedFileCorruptWorkaround;
+    char acRoot[ MAX_PATH ];
+    char acApp[ MAX_PATH ];
+    char lastLoadedApp[ MAX_PATH ];
+};
+
+struct SnapshotFile
+{
+    uint32_t position;
+    uint16_t handle;
+    uint16_t seg_process;
+    uint16_t pathBytes;             // the path follows this struct
+    uint8_t mode;
+    uint8_t reserved;
+};
+
+static bool WriteSnapshotFile( FILE * fp, const FileEntry & entry )
+{
+    SnapshotFile sf = {0};
+    sf.position = (uint32_t) ftell( entry.fp );
+    sf.handle = entry.handle;
+    sf.seg_process = entry.seg_process;
+    sf.pathBytes = (uint16_t) strlen( entry.path );
+    sf.mode = entry.mode;
+
+    return ( 1 == fwrite( & sf, sizeof( sf ), 1, fp ) ) && ( sf.pathBytes == fwrite( entry.path, 1, sf.pathBytes, fp ) );
+} //WriteSnapshotFile
+
+#ifndef NTVDM_LIBRARY
+static bool ReadSnapshotFile( FILE * fp, FileEntry & entry, bool fcb )
+{
+    SnapshotFile sf;
+    char path[ MAX_PATH ];
+    if ( 1 != fread( & sf, sizeof( sf ), 1, fp ) || sf.pathBytes >= sizeof( path ) || sf.pathBytes != fread( path, 1, sf.pathBytes, fp ) )
+        return false;
+
+    path[ sf.pathBytes ] = 0;
+    entry.fp = OpenHostFile( path, ( fcb || 0 != sf.mode ) ? "r+b" : "rb" );
+    if ( !entry.fp )
+    {
+        tracer.Trace( "  can't reopen snapshot file '%s', error %d\n", path, errno );
+        return false;
     }
 
-    if ( !found )
+    SeekHostFile( entry.fp, sf.position );
+    entry.path = InternPath( path );
+    entry.handle = sf.handle;
+    entry.mode = sf.mode;
+    entry.seg_process = sf.seg_process;
+    return true;
+} //ReadSnapshotFile
+#endif //NTVDM_LIBRARY
+
+static bool SaveSnapshot( const char * path )
+{
+    FILE * fp = fopen( path, "wb" );
+    if ( !fp )
+        return false;
+
+    fflush( 0 ); // so the saved file positions match what's on disk
+
+    SnapshotHeader h;
+    memset( & h, 0, sizeof( h ) );
+    memcpy( h.signature, SnapshotSignature, sizeof( h.signature ) );
+    h.version = SnapshotVersion;
+    h.headerBytes = sizeof( h );
+    h.memoryBytes = sizeof( memory );
+    h.allocEntries = (uint32_t) g_allocEntries.size();
+    h.fileEntriesFCB = (uint32_t) g_fileEntriesFCB.size();
+    for ( size_t i = 0; i < g_fileEntries.size(); i++ )
+        if ( g_fileEntries[ i ].fp )
+            h.fileEntries++;
+    cpu.save_registers( h.registers );
+    h.segHardware = g_segHardware;
+    h.diskTransferSegment = g_diskTransferSegment;
+    h.diskTransferOffset = g_diskTransferOffset;
+    h.currentPSP = g_currentPSP;
+    h.use80xRowsMode = g_use80xRowsMode;
+    h.packedFileCorruptWorkaround = g_PackedFileCorruptWorkaround;
+    strcpy( h.acRoot, g_acRoot );
+    strcpy( h.acApp, g_acApp );
+    strcpy( h.lastLoadedApp, g_lastLoadedApp );
+
+    bool ok = ( 1 == fwrite( & h, sizeof( h ), 1, fp ) ) && ( 1 == fwrite( memory, sizeof( memory ), 1, fp ) );
+    if ( ok && h.allocEntries )
+        ok = ( h.allocEntries == fwrite( g_allocEntries.data(), sizeof( DosAllocation ), h.allocEntries, fp ) );
+
+    for ( size_t i = 0; ok && i < g_fileEntries.size(); i++ )
+        if ( g_fileEntries[ i ].fp )
+            ok = WriteSnapshotFile( fp, g_fileEntries[ i ] );
+
+    for ( auto it = g_fileEntriesFCB.begin(); ok && it != g_fileEntriesFCB.end(); it++ )
+        ok = WriteSnapshotFile( fp, it->second );
+
+    ok = ( 0 == fclose( fp ) ) && ok;
+    tracer.Trace( "  wrote snapshot '%s' at %04x:%04x, ok %d\n", path, h.registers.cs, h.registers.ip, ok );
+    return ok;
+} //SaveSnapshot
+
+#ifndef NTVDM_LIBRARY
+static bool RestoreSnapshot( const char * path )
+{
+    CFile file( fopen( path, "rb" ) );
+    if ( !file.get() )
+        return false;
+
+    SnapshotHeader h;
+    if ( ( 1 != fread( & h, sizeof( h ), 1, file.get() ) ) || memcmp( h.signature, SnapshotSignature, sizeof( h.signature ) ) ||
+         ( SnapshotVersion != h.version ) || ( sizeof( h ) != h.headerBytes ) || ( sizeof( memory ) != h.memoryBytes ) )
+        return false;
+
+    PrepareMemoryForRead( memory, sizeof( memory ) );
+    if ( 1 != fread( memory, sizeof( memory ), 1, file.get() ) )
+        return false;
+
+    g_allocEntries.resize( h.allocEntries );
+    if ( h.allocEntries && ( h.allocEntries != fread( g_allocEntries.data(), sizeof( DosAllocation ), h.allocEntries, file.get() ) ) )
+        return false;
+
+    for ( uint32_t i = 0; i < h.fileEntries; i++ )
+    {
+        FileEntry entry;
+        if ( !ReadSnapshotFile( file.get(), entry, false ) )
+            return false;
+        AddFileEntry( entry );
+    }
+
+    for ( uint32_t i = 0; i < h.fileEntriesFCB; i++ )
+    {
+        FileEntry entry;
+        if ( !ReadSnapshotFile( file.get(), entry, true ) )
+            return false;
+        AddFileEntryFCB( entry );
+    }
+
+    // keystrokes typed ahead when the snapshot was taken belong to that session, not this one
+
+    * cpu.flat_address16( 0x40, 0x1c ) = cpu.mword( 0x40, 0x1a );
+
+    cpu.restore_registers( h.registers );
+    cpu.note_video_write();
+    g_segHardware = h.segHardware;
+    g_diskTransferSegment = h.diskTransferSegment;
+    g_diskTransferOffset = h.diskTransferOffset;
+    g_currentPSP = h.currentPSP;
+    g_PackedFileCorruptWorkaround = ( 0 != h.packedFileCorruptWorkaround );
+    strcpy( g_acRoot, h.acRoot );
+    strcpy( g_acApp, h.acApp );
+    strcpy( g_lastLoadedApp, h.lastLoadedApp );
+
+    // the display already holds the app's screen, so don't clear it like the first flip to 80xRows does
+
+    if ( h.use80xRowsMode && !g_forceConsole )
     {
-        IntCalled ic;
-        ic.i = interrupt_num;
-        ic.c = ah_used ? ah : 0xffff;
-        ic.calls = 1;
-        g_InterruptsCalled.push_back( ic );
+        s_firstTimeFlip = false;
+        g_use80xRowsMode = true;
+        g_consoleConfig.EstablishConsoleOutput( ScreenColumns, GetScreenRows() );
+        ClearLastUpdateBuffer();
     }
-} //TrackInterruptsCalled
+
+    tracer.Trace( "  restored snapshot '%s' of '%s' at %04x:%04x\n", path, g_acApp, h.registers.cs, h.registers.ip );
+    return true;
+} //RestoreSnapshot
+#endif //NTVDM_LIBRARY
+
+static bool ReadsKeyboard( uint8_t interrupt_num, uint8_t c )
+{
+    // checks for a keystroke count since apps often poll until one is available and only then read it
+
+    if ( 0x16 == interrupt_num )
+        return ( 0 == c || 1 == c || 0x10 == c || 0x11 == c );
+
+    if ( 0x21 == interrupt_num )
+        return ( 1 == c || 7 == c || 8 == c || 0xa == c || 0xb == c || 0xc == c ||
+                 ( 6 == c && 0xff == cpu.dl() ) || ( 0x3f == c && 0 == cpu.get_bx() ) );
+
+    return false;
+} //ReadsKeyboard
 
 void i8086_invoke_interrupt( uint8_t interrupt_num )
 {
     unsigned char c = cpu.ah();
-    bool ah_used = false;
-    const char * pintstr = get_interrupt_string( interrupt_num, c, ah_used );
-    tracer.Trace( "int %02x ah %02x al %02x bx %04x cx %04x dx %04x di %04x si %04x ds %04x cs %04x ss %04x es %04x bp %04x sp %04x %s\n",
-                  interrupt_num, cpu.ah(), cpu.al(),
-                  cpu.get_bx(), cpu.get_cx(), cpu.get_dx(), cpu.get_di(), cpu.get_si(),
-                  cpu.get_ds(), cpu.get_cs(), cpu.get_ss(), cpu.get_es(), cpu.get_bp(), cpu.get_sp(), pintstr );
+    if ( tracer.IsEnabled() )
+    {
+        bool ah_used = false;
+        const char * pintstr = get_interrupt_string( interrupt_num, c, ah_used );
+        tracer.Trace( "int %02x ah %02x al %02x bx %04x cx %04x dx %04x di %04x si %04x ds %04x cs %04x ss %04x es %04x bp %04x sp %04x %s\n",
+                      interrupt_num, cpu.ah(), cpu.al(),
+                      cpu.get_bx(), cpu.get_cx(), cpu.get_dx(), cpu.get_di(), cpu.get_si(),
+                      cpu.get_ds(), cpu.get_cs(), cpu.get_ss(), cpu.get_es(), cpu.get_bp(), cpu.get_sp(), pintstr );
+    }
+
+    g_InterruptsCalled[ ( (size_t) interrupt_num << 8 ) | c ]++;
+
+    if ( !IsPollingInterrupt( interrupt_num, c ) )
+        g_idle.busy = true;
+
+    bool readsKeyboard = ReadsKeyboard( interrupt_num, c );
+    g_keyboardActivity |= readsKeyboard;
+
+#if !defined( _WIN32 ) && !defined( NTVDM_LIBRARY )
+    if ( g_forkServerPath && readsKeyboard )
+    {
+        const char * path = g_forkServerPath;
+        g_forkServerPath = 0;
+        RunForkServer( path ); // only returns in a child that finishes this read with its client's handles
+    }
+#endif
+
+    if ( readsKeyboard && g_pipedStdout && !g_pipedStdin )
+        fflush( stdout ); // a prompt must be visible before the app waits for a keystroke
 
-    TrackInterruptsCalled( interrupt_num, c, ah_used );
+    if ( g_snapshotPath && readsKeyboard )
+    {
+        if ( !SaveSnapshot( g_snapshotPath ) )
+            i8086_hard_exit( "unable to write the snapshot\n", 0 );
+        g_snapshotPath = 0;
+    }
 
     // restore interrupts since we won't exit with an iret because Carry in flags must be preserved as a return code
 
@@ -7645,6 +9534,7 @@ void i8086_invoke_interrupt( uint8_t interrupt_num )
     else if ( 0x10 == interrupt_num )
     {
         handle_int_10( c );
+        cpu.note_video_write(); // bios video writes bypass the emulated instructions that track video memory
         return;
     }
     else if ( 0x11 == interrupt_num )
@@ -7706,30 +9596,13 @@ void i8086_invoke_interrupt( uint8_t interrupt_num )
         if ( 0 == c )
         {
             // read real time clock. get ticks since system boot. 18.2 ticks per second.
+            // the same count as 0040:006c, so with -s it's derived from cycles too
 
-#ifdef _WIN32 // gettimeofday() doesn't exist on Windows
-            ULONGLONG milliseconds = GetTickCount64();
-#else
-            struct timeval tv = {0};
-            gettimeofday( &tv, NULL );
-            uint64_t milliseconds = ( (uint64_t) tv.tv_sec * 1000ULL ) + ( (uint64_t) tv.tv_usec / 1000ULL );
-#endif            
-
-            milliseconds -= g_msAtStart;
-            milliseconds *= 18206ULL;
-            milliseconds /= 1000000ULL;
+            uint32_t ticks = GetBiosDailyTimer();
             cpu.set_al( 0 );
-
-            #if false // useful for creating logs that can be compared to fix bugs
-                static ULONGLONG fakems = 0;
-                fakems += 10;
-                milliseconds = fakems;
-            #endif
-
-            cpu.set_ch( ( milliseconds >> 24 ) & 0xff );
-            cpu.set_cl( ( milliseconds >> 16 ) & 0xff );
-            cpu.set_dh( ( milliseconds >> 8 ) & 0xff );
-            cpu.set_dl( milliseconds & 0xff );
+            cpu.set_cx( (uint16_t) ( ticks >> 16 ) );
+            cpu.set_dx( (uint16_t) ticks );
+            ReplayClock();
             return;
         }
         else if ( 2 == c )
@@ -7750,6 +9623,7 @@ void i8086_invoke_interrupt( uint8_t interrupt_num )
             cpu.set_cl( toBCD( (uint8_t) plocal->tm_min ) );
             cpu.set_dh( toBCD( (uint8_t) plocal->tm_sec ) );
             cpu.set_dl( 0 );
+            ReplayClock();
             return;
         }
         else
@@ -7764,6 +9638,7 @@ void i8086_invoke_interrupt( uint8_t interrupt_num )
     else if ( 0x21 == interrupt_num )
     {
         handle_int_21( c );
+        cpu.note_video_write(); // console output and file reads can land in video memory
         return;
     }
     else if ( 0x22 == interrupt_num ) // terminate address
@@ -7912,6 +9787,174 @@ void InitializePSP( uint16_t segment, const char * acAppArgs, uint8_t lenAppArgs
     psp->Trace();
 } //InitializePSP
 
+// Sampling profiler (--profile). The emulator reports cs:ip every g_profileCycles cycles. Each sample is charged
+// to the program image loaded most recently at that address, with cs made relative to the image's first segment
+// so addresses match the linker's .map file. Samples outside any image (DOS and BIOS stubs) are charged to "(dos)".
+
+struct ProfileImage
+{
+    string name;           // file name of the .com, .exe, or overlay
+    uint16_t segStart;     // first segment of the loaded image. for .com files this is the psp
+    uint16_t segEnd;       // first segment past the image
+    uint16_t psp;          // the program's psp or 0 for overlays
+    size_t parent;         // index of the program that loaded this one or NoProfileImage
+};
+
+struct ProfileHit
+{
+    uint64_t samples;
+    string instruction;    // disassembled when first sampled since the memory may be reused later
+};
+
+const size_t NoProfileImage = (size_t) -1;
+static const char * g_profilePath = 0;               // --profile: report file. folded stacks go to this + ".folded"
+#ifndef NTVDM_LIBRARY
+static uint32_t g_profileCycles = 1000;              // --profilecycles: cycles between samples
+#endif
+static vector<ProfileImage> g_profileImages;
+static unordered_map<uint64_t, ProfileHit> g_profileHits; // key is image index + 1, relative cs, and ip
+static uint64_t g_profileSamples = 0;
+static CDisassemble8086 g_profileDisassembler;
+
+static size_t FindProfileImage( uint32_t flat )
+{
+    for ( size_t i = g_profileImages.size(); i > 0; i-- )
+    {
+        ProfileImage & image = g_profileImages[ i - 1 ];
+        if ( flat >= ( (uint32_t) image.segStart << 4 ) && flat < ( (uint32_t) image.segEnd << 4 ) )
+            return i - 1;
+    }
+
+    return NoProfileImage;
+} //FindProfileImage
+
+void ProfileNoteImage( const char * app, uint16_t segStart, uint32_t paragraphs, uint16_t psp )
+{
+    if ( !g_profilePath )
+        return;
+
+    ProfileImage image;
+    const char * slash = strrchr( app, '/' );
+    const char * backslash = strrchr( app, '\\' );
+    const char * name = get_max( slash, backslash );
+    image.name = name ? name + 1 : app;
+    image.segStart = segStart;
+    image.segEnd = (uint16_t) get_min( (uint32_t) segStart + paragraphs, (uint32_t) 0xffff );
+    image.psp = psp;
+    image.parent = NoProfileImage;
+
+    for ( size_t i = g_profileImages.size(); i > 0; i-- )
+    {
+        if ( 0 != g_currentPSP && g_profileImages[ i - 1 ].psp == g_currentPSP )
+        {
+            image.parent = i - 1;
+            break;
+        }
+    }
+
+    tracer.Trace( "  profiling image %s at segments %04x..%04x\n", image.name.c_str(), image.segStart, image.segEnd );
+    g_profileImages.push_back( image );
+} //ProfileNoteImage
+
+void i8086_invoke_profile_sample( uint16_t cs, uint16_t ip )
+{
+    size_t image = FindProfileImage( ( (uint32_t) cs << 4 ) + ip );
+    uint16_t seg = ( NoProfileImage == image ) ? cs : (uint16_t) ( cs - g_profileImages[ image ].segStart );
+    uint64_t key = ( (uint64_t) ( image + 1 ) << 32 ) | ( (uint32_t) seg << 16 ) | ip;
+
+    ProfileHit & hit = g_profileHits[ key ];
+    if ( 0 == hit.samples )
+        hit.instruction = g_profileDisassembler.Disassemble( cpu.flat_address8( cs, ip ) );
+
+    hit.samples++;
+    g_profileSamples++;
+} //i8086_invoke_profile_sample
+
+#ifndef NTVDM_LIBRARY
+static const char * ProfileImageName( size_t image )
+{
+    return ( NoProfileImage == image ) ? "(dos)" : g_profileImages[ image ].name.c_str();
+} //ProfileImageName
+
+static void WriteProfileReport()
+{
+    const size_t MaxAddresses = 100;
+
+    struct Entry { size_t image; uint16_t seg; uint16_t ip; const ProfileHit * hit; };
+    vector<Entry> entries;
+    for ( auto & h : g_profileHits )
+        entries.push_back( { (size_t) ( h.first >> 32 ) - 1, (uint16_t) ( h.first >> 16 ), (uint16_t) h.first, & h.second } );
+
+    sort( entries.begin(), entries.end(), []( const Entry & a, const Entry & b ) { return a.hit->samples > b.hit->samples; } );
+
+    CFile fp( fopen( g_profilePath, "w" ) );
+    if ( !fp.get() )
+    {
+        printf( "can't create profile report %s, error %d\n", g_profilePath, errno );
+        return;
+    }
+
+    uint64_t total = get_max( g_profileSamples, (uint64_t) 1 );
+    fprintf( fp.get(), "profile of %s: %llu samples, one every %u cycles\n", g_acApp, (unsigned long long) g_profileSamples, g_profileCycles );
+
+    // totals by image and by image segment
+
+    vector<pair<uint64_t, uint64_t>> bySegment;                     // ( image + 1 ) << 16 | seg, samples
+    unordered_map<uint64_t, size_t> segmentIndex;
+    for ( auto & e : entries )
+    {
+        uint64_t key = ( (uint64_t) ( e.image + 1 ) << 16 ) | e.seg;
+        auto it = segmentIndex.find( key );
+        if ( it == segmentIndex.end() )
+        {
+            segmentIndex[ key ] = bySegment.size();
+            bySegment.push_back( { key, e.hit->samples } );
+        }
+        else
+            bySegment[ it->second ].second += e.hit->samples;
+    }
+
+    sort( bySegment.begin(), bySegment.end(), []( const pair<uint64_t, uint64_t> & a, const pair<uint64_t, uint64_t> & b ) { return a.second > b.second; } );
+
+    fprintf( fp.get(), "\nsamples by segment\n  samples  percent  program       segment\n" );
+    for ( auto & s : bySegment )
+        fprintf( fp.get(), "%9llu  %6.2lf%%  %-12s  %04x\n", (unsigned long long) s.second, 100.0 * (double) s.second / (double) total,
+                 ProfileImageName( (size_t) ( s.first >> 16 ) - 1 ), (uint16_t) s.first );
+
+    fprintf( fp.get(), "\nhottest addresses\n  samples  percent  program       address    instruction\n" );
+    for ( size_t i = 0; i < entries.size() && i < MaxAddresses; i++ )
+    {
+        Entry & e = entries[ i ];
+        fprintf( fp.get(), "%9llu  %6.2lf%%  %-12s  %04x:%04x  %s\n", (unsigned long long) e.hit->samples, 100.0 * (double) e.hit->samples / (double) total,
+                 ProfileImageName( e.image ), e.seg, e.ip, e.hit->instruction.c_str() );
+    }
+
+    // one line per address for flamegraph.pl: the chain of programs that loaded each other, segment, address
+
+    string foldedPath = g_profilePath;
+    foldedPath += ".folded";
+    CFile folded( fopen( foldedPath.c_str(), "w" ) );
+    if ( !folded.get() )
+    {
+        printf( "can't create profile folded stacks %s, error %d\n", foldedPath.c_str(), errno );
+        return;
+    }
+
+    for ( auto & e : entries )
+    {
+        string stack;
+        for ( size_t image = e.image; NoProfileImage != image; image = g_profileImages[ image ].parent )
+            stack = g_profileImages[ image ].name + ( stack.empty() ? "" : ";" ) + stack;
+
+        if ( stack.empty() )
+            stack = ProfileImageName( NoProfileImage );
+
+        fprintf( folded.get(), "%s;seg %04x;%04x:%04x %s %llu\n", stack.c_str(), e.seg, e.seg, e.ip, e.hit->instruction.c_str(),
+                 (unsigned long long) e.hit->samples );
+    }
+} //WriteProfileReport
+#endif //NTVDM_LIBRARY
+
 bool IsBinaryCOM( const char * app, FILE * fp )
 {
     bool isCOM = ends_with( app, ".com" );
@@ -7959,12 +10002,15 @@ uint16_t LoadOverlay( const char * app, uint16_t CodeSegment, uint16_t segReloca
             return 1;
         }
     
+        PrepareMemoryForRead( cpu.flat_address( CodeSegment, 0 ), file_size );
         size_t blocks_read = fread( cpu.flat_address( CodeSegment, 0 ), file_size, 1, file.get() );
         if ( 1 != blocks_read )
         {
             tracer.Trace( "can't read .com file into RAM, error %d\n", errno );
             return 1;
         }
+
+        ProfileNoteImage( app, CodeSegment, round_up( (uint32_t) file_size, (uint32_t) 16 ) / 16, 0 );
     }
     else // EXE
     {
@@ -7999,6 +10045,7 @@ uint16_t LoadOverlay( const char * app, uint16_t CodeSegment, uint16_t segReloca
 
         uint8_t * pcode = cpu.flat_address8( CodeSegment, 0 );
         fseek( file.get(), codeStart, SEEK_SET );
+        PrepareMemoryForRead( pcode, imageSize );
         blocks_read = fread( pcode, imageSize, 1, file.get() );
         if ( 1 != blocks_read )
         {
@@ -8028,6 +10075,8 @@ uint16_t LoadOverlay( const char * app, uint16_t CodeSegment, uint16_t segReloca
                 *target += segRelocationFactor;
             }
         }
+
+        ProfileNoteImage( app, CodeSegment, round_up( imageSize, (uint32_t) 16 ) / 16, 0 );
     }
 
     return 0;
@@ -8063,6 +10112,7 @@ uint16_t LoadAsBootSector( const char * acApp, const char * acAppArgs, uint8_t l
         return 0;
     }
     
+    PrepareMemoryForRead( cpu.flat_address( 0x7c0, 0 ), 512 );
     size_t blocks_read = fread( cpu.flat_address( 0x7c0, 0 ), 512, 1, file.get() );
     if ( 1 != blocks_read )
     {
@@ -8126,6 +10176,7 @@ uint16_t LoadBinary( const char * acApp, const char * acAppArgs, uint8_t lenAppA
             return 0;
         }
     
+        PrepareMemoryForRead( cpu.flat_address( ComSegment, 0x100 ), file_size );
         size_t blocks_read = fread( cpu.flat_address( ComSegment, 0x100 ), file_size, 1, file.get() );
         if ( 1 != blocks_read )
         {
@@ -8138,6 +10189,7 @@ uint16_t LoadBinary( const char * acApp, const char * acAppArgs, uint8_t lenAppA
 
         uint16_t * pstacktop = cpu.flat_address16( ComSegment, 0xfffe );
         *pstacktop = 0;
+        ProfileNoteImage( acApp, ComSegment, 0x1000, ComSegment );
 
         // prepare to execute the COM file
 
@@ -8263,6 +10315,7 @@ uint16_t LoadBinary( const char * acApp, const char * acAppArgs, uint8_t lenAppA
         const uint16_t CodeSegment = DataSegment + 16; //  data segment + 256 bytes (16 paragraphs) for the psp
         uint8_t * pcode = cpu.flat_address8( CodeSegment, 0 );
         fseek( file.get(), codeStart, SEEK_SET );
+        PrepareMemoryForRead( pcode, imageSize );
         blocks_read = fread( pcode, imageSize, 1, file.get() );
         if ( 1 != blocks_read )
         {
@@ -8292,6 +10345,8 @@ uint16_t LoadBinary( const char * acApp, const char * acAppArgs, uint8_t lenAppA
             }
         }
 
+        ProfileNoteImage( acApp, CodeSegment, image_paragraphs, DataSegment );
+
         tracer.Trace( "  start of the code:\n" );
         tracer.TraceBinaryData( pcode, get_min( imageSize, (uint32_t) 0x100 ), 4 );
 
@@ -8330,10 +10385,15 @@ uint16_t LoadBinary( const char * acApp, const char * acAppArgs, uint8_t lenAppA
 
         do
         {
-            DWORD ret = WaitForMultipleObjects( 2, aHandles, FALSE, 20 );
+            // only wait on console input when the ring has room for it, or a full ring would spin this loop
+
+            DWORD ret = WaitForMultipleObjects( ( g_hostKeys.FreeSpots() >= 10 ) ? 2 : 1, aHandles, FALSE, 20 );
             if ( WAIT_OBJECT_0 == ret )
                 break;
 
+            if ( ( WAIT_OBJECT_0 + 1 ) == ret )
+                read_host_key_events();
+
             if ( !g_KbdPeekAvailable )
             {
                 uint8_t asciiChar, scancode;
@@ -8355,50 +10415,26 @@ uint16_t LoadBinary( const char * acApp, const char * acAppArgs, uint8_t lenAppA
     {
         tracer.Trace( "in peekkeyboardthreadproc for linux\n" );
         CSimpleThread & thread = * (CSimpleThread *) param;
+        HostKeyReader reader;
 
-        do
+        while ( !thread.StopRequested() )
         {
-            struct timespec to;
-            clock_gettime( CLOCK_REALTIME, &to );
-            to.tv_nsec += ( 20 * 1000000 ); // 20 milliseconds
-            if ( to.tv_nsec >= 1000000000 ) // overflow
-            {
-                to.tv_sec += 1;
-                to.tv_nsec -= 1000000000;
-            }
-
-            int err;
-            {
-                C_pthread_mutex_t_lock mtx_lock( thread.the_mutex );
-                err = pthread_cond_timedwait( & thread.the_condition, & thread.the_mutex, & to );
-            }
+            // wake at once for console input, or every 20 milliseconds to check whether the thread should end.
+            // leave input in the console while the ring can't take a full pass of keys.
 
-            if ( ETIMEDOUT == err )
-            {
-                // too chatty tracer.Trace( "peekkeyboardthreadproc timed out in the wait\n" );
-                // check for keyboard input below
-            }
-            else if ( 0 == err )
-            {
-                tracer.Trace( "peekkeyboardthreadproc condition was signaled\n" );
-                break;
-            }
-            else
-            {
-                tracer.Trace( "peekkeyboardthreadproc error on cond_timewait: %d\n", err );
-                break;
-            }
+            if ( reader.ended || ( g_hostKeys.FreeSpots() < HostKeyReader::BatchSize ) )
+                sleep_ms( 20 );
+            else if ( reader.Wait( 20 ) )
+                reader.Decode();
 
-            if ( !g_KbdPeekAvailable )
+            if ( !g_KbdPeekAvailable && !g_hostKeys.IsEmpty() )
             {
-                if ( g_consoleConfig.portable_kbhit() )
-                {
-                    tracer.Trace( "async thread noticed that a keystroke is available\n" );
-                    g_KbdPeekAvailable = true; // make sure an int9 gets scheduled
-                    cpu.exit_emulate_early();  // no time to lose processing the keystroke
-                }
+                tracer.Trace( "async thread decoded a keystroke\n" );
+                g_KbdPeekAvailable = true; // make sure an int9 gets scheduled
+                cpu.exit_emulate_early();  // no time to lose processing the keystroke
+                WakeParkedCPU();           // in case the main loop is parked in an idle loop
             }
-        } while( true );
+        }
 
         tracer.Trace( "falling out of peekkeyboardthreadproc for linux\n" );
         return 0;
@@ -8568,33 +10604,1234 @@ bool InterruptHookedByApp( uint8_t i )
     return ( InterruptRoutineSegment != seg );
 } //InterruptHookedByApp
 
-uint32_t GetBiosDailyTimer()
+// Cycle scheduler. The main loop's work between emulate() calls is a queue of events keyed on total emulated
+// cycles, and emulate() runs to the earliest one rather than in fixed 2000-cycle slices. With -s, cycles map to
+// time, so the bios tick is derived from cycles: apps that hook int 8 or 1c see each tick at the same instruction on
+// every run and host, and the wall clock is only read to throttle. Unbounded, the timer event reads the wall clock
+// and schedules its next check for when the tick should change at the measured cycle rate, but at least 8 times a
+// tick. While recording or replaying the check stays at every 2000 cycles so slices end at the same cycles each
+// run. Keystrokes aren't events; the keyboard thread ends the running slice early instead.
+// The display event doubles as the main loop's housekeeping beat, and its period adapts: it drops to the minimum
+// when the app reads or polls the keyboard so echo and single-threaded keystroke checks stay prompt, doubles up to
+// MaxSliceCycles while video memory is untouched, and stops doubling at DirtySliceCycles while the app draws since
+// redraws are throttled anyway. A timer or keyboard interrupt that's due while interrupts are off gets a short retry.
+
+const uint64_t BiosTickNs = 54925100;                // the bios tick is 18.206 times per second
+const uint64_t MinSliceCycles = 2000;
+const uint64_t DirtySliceCycles = 64 * 1024;
+const uint64_t MaxSliceCycles = 1024 * 1024;
+const uint64_t RetrySliceCycles = 200;
+
+enum ScheduledEventKind { eventTimer, eventThrottle, eventDisplay, eventRetry, eventKinds };
+
+struct ScheduledEvent
 {
-    // the daily timer bios value should increment 18.206 times per second -- every 54.9251 ms
+    uint64_t due;                 // total cycles at which the event runs
+    ScheduledEventKind kind;
 
-    high_resolution_clock::time_point tNow = high_resolution_clock::now();
-    uint64_t diff = duration_cast<std::chrono::nanoseconds>( tNow - g_tAppStart ).count();
-    return (uint32_t) ( diff / 54925100 );
-} //GetBiosDailyTimer
+    bool operator > ( const ScheduledEvent & e ) const { return due > e.due; }
+};
 
-int main( int argc, char * argv[] )
+struct CycleScheduler
 {
-    try
+    priority_queue<ScheduledEvent, vector<ScheduledEvent>, greater<ScheduledEvent>> queue;
+    uint64_t due[ eventKinds ];   // each kind's live deadline. queued entries that don't match were rescheduled
+    bool active;                  // false unless the main loop is running events. DosContext::Run doesn't
+    uint64_t clockRate;           // -s cycles per second or 0 if unbounded
+    uint64_t sliceStart;          // total cycles when the running emulate() call started
+    uint64_t checkCycles;         // unbounded: total cycles at the last wall clock check
+    uint64_t checkNs;             // unbounded: ns since the app started at the last wall clock check
+    uint64_t sleptCycles;         // -s cycles that passed while the app slept waiting for a keystroke
+    uint64_t displayPeriod;       // cycles between display events. adapts to keyboard and video activity
+    uint64_t slices;              // calls to emulate() for -p
+
+    void Schedule( ScheduledEventKind kind, uint64_t at )
     {
-        char * posval = getenv( "OS" );
-        g_InRVOS = ( ( 0 != posval ) && !strcmp( posval, "RVOS" ) );
-        g_UseOneThread = g_InRVOS;
-    
-        g_consoleConfig.EstablishConsoleInput( (void *) ControlHandlerProc );
+        due[ kind ] = at;
+        queue.push( { at, kind } );
+    } //Schedule
 
+    uint64_t NextDue()
+    {
+        while ( queue.top().due != due[ queue.top().kind ] )
+            queue.pop();
+        return queue.top().due;
+    } //NextDue
+
+    bool PopDue( uint64_t now, ScheduledEventKind & kind )
+    {
+        while ( !queue.empty() && queue.top().due <= now )
+        {
+            ScheduledEvent e = queue.top();
+            queue.pop();
+            if ( e.due == due[ e.kind ] )
+            {
+                kind = e.kind;
+                return true;
+            }
+        }
+        return false;
+    } //PopDue
+
+    uint32_t TickAt( uint64_t cycles ) { return (uint32_t) ( (double) cycles * 1e9 / ( (double) BiosTickNs * clockRate ) ); }
+    uint64_t TickDue( uint32_t tick ) { return (uint64_t) ceil( (double) tick * BiosTickNs * clockRate / 1e9 ); }
+};
+
+static CycleScheduler g_scheduler = {};
+
+void CreditSleepCycles( high_resolution_clock::time_point tStart )
+{
+    // time passes for a real cpu spinning in int 16 too. without this the tick stops while waiting for a keystroke
+
+    if ( g_scheduler.active && g_scheduler.clockRate )
+    {
+        uint64_t ns = duration_cast<std::chrono::nanoseconds>( high_resolution_clock::now() - tStart ).count();
+        g_scheduler.sleptCycles += (uint64_t) ( (double) ns * g_scheduler.clockRate / 1e9 );
+    }
+} //CreditSleepCycles
+
+uint32_t GetBiosDailyTimer()
+{
+    // the daily timer bios value should increment 18.206 times per second -- every 54.9251 ms
+
+    static uint32_t last = 0;
+    uint32_t dt = last;
+    if ( !Replaying() )
+    {
+        if ( g_scheduler.active && g_scheduler.clockRate )
+            dt = g_scheduler.TickAt( g_scheduler.sliceStart + cpu.get_cycles() );
+        else
+        {
+            high_resolution_clock::time_point tNow = high_resolution_clock::now();
+            uint64_t diff = duration_cast<std::chrono::nanoseconds>( tNow - g_tAppStart ).count();
+            dt = (uint32_t) ( diff / BiosTickNs );
+        }
+    }
+
+    uint32_t bytes = sizeof( dt );
+    ReplayInput( replayTimer, & dt, bytes, sizeof( dt ), dt != last );
+    last = dt;
+    return dt;
+} //GetBiosDailyTimer
+
+// sets g_acRoot to the full path of the host folder that maps to DOS C:\. returns 0 or an error message
+
+static const char * SetRootFolder( const char * pcRoot )
+{
+#ifdef _WIN32
+    GetFullPathNameA( pcRoot, _countof( g_acRoot ), g_acRoot, 0 );
+    DWORD attr = GetFileAttributesA( g_acRoot );
+    if ( ( INVALID_FILE_ATTRIBUTES == attr ) || ( 0 == ( attr & FILE_ATTRIBUTE_DIRECTORY ) ) )
+        return "/r root argument isn't a folder";
+    size_t len = strlen( g_acRoot );
+    if ( 0 == len )
+        return "error parsing /r argument. does the folder exist?";
+    if ( '\\' != g_acRoot[ len - 1 ] )
+        strcat( g_acRoot, "\\" );
+#else
+    char * fpath = realpath( pcRoot, 0 );
+    if ( !fpath )
+        return "error parsing /r argument";
+    strcpy( g_acRoot, fpath );
+    free( fpath );
+    size_t len = strlen( g_acRoot );
+    if ( 0 == len )
+        return "error parsing /r argument. does the folder exist?";
+    if ( '/' != g_acRoot[ len - 1 ] )
+        strcat( g_acRoot, "/" );
+    struct stat statbuf;
+    if ( ( 0 != stat( g_acRoot, & statbuf ) ) || !S_ISDIR( statbuf.st_mode ) )
+        return "/r root argument isn't a folder";
+#endif
+
+    return 0;
+} //SetRootFolder
+
+// finds the .com or .exe to run, trying both extensions if none is given, and puts its path in g_acApp.
+// returns 0 or an error message
+
+static const char * FindAppFile( const char * pcAPP )
+{
+    strcpy( g_acApp, pcAPP );
+#ifdef _WIN32
+    _strupr( g_acApp );
+#else
+    const char * pLinuxPath = DOSToHostPath( g_acApp );
+    strcpy( g_acApp, pLinuxPath );
+#endif    
+
+    if ( !file_exists( g_acApp ) )
+    {
+        if ( ends_with( g_acApp, ".com" ) || ends_with( g_acApp, ".exe" ) )
+            return "can't find command file .com or .exe";
+        else
+        {
+            strcat( g_acApp, ".COM" );
+            if ( !file_exists( g_acApp ) )
+            {
+                char * dot = strstr( g_acApp, ".COM" );
+                strcpy( dot, ".EXE" );
+                if ( !file_exists( g_acApp ) )
+                {
+#ifdef _WIN32                    
+                    return "can't find command file";
+#else                    
+                    tracer.Trace( "couldn't find input file '%s'\n", g_acApp );
+                    char * pdot = strrchr( g_acApp, '.' );
+                    strcpy( pdot, ".com" );
+                    if ( !file_exists( g_acApp ) )
+                    {
+                        strcpy( pdot, ".exe" );
+                        if ( !file_exists( g_acApp ) )
+                        {
+                            tracer.Trace( "looked last for '%s'\n", g_acApp );
+                            return "can't find command file";
+                        }
+                    }
+#endif               
+                }     
+            }
+        }
+    }
+
+    return 0;
+} //FindAppFile
+
+// sets up the bios data area, the interrupt vectors and the routines they point to, and the
+// machine code used for keyboard input
+
+static void InitializeBiosAndVectors()
+{
+    // global bios memory
+
+    uint8_t * pbiosdata = cpu.flat_address8( 0x40, 0 );
+    * (uint16_t *) ( pbiosdata + 0x10 ) = 0x21;           // equipment list. diskette installed and initial video mode 0x20
+    * (uint16_t *) ( pbiosdata + 0x13 ) = 640;            // contiguous 1k blocks (640 * 1024)
+    * (uint16_t *) ( pbiosdata + 0x1a ) = 0x1e;           // keyboard buffer head
+    * (uint16_t *) ( pbiosdata + 0x1c ) = 0x1e;           // keyboard buffer tail
+    * (uint8_t *)  ( pbiosdata + 0x49 ) = DefaultVideoMode; // video mode is 3 == 80x25, 16 colors
+    * (uint16_t *) ( pbiosdata + 0x4a ) = ScreenColumns;  // 80
+    * (uint16_t *) ( pbiosdata + 0x4c ) = 0x1000;         // video regen buffer size
+    * (uint8_t *)  ( pbiosdata + 0x60 ) = 7;              // cursor ending/bottom scan line
+    * (uint8_t *)  ( pbiosdata + 0x61 ) = 6;              // cursor starting/top scan line
+    * (uint8_t *)  ( pbiosdata + 0x62 ) = 0;              // current display page
+    * (uint16_t *) ( pbiosdata + 0x63 ) = 0x3d4;          // base port for 6845 CRT controller. color
+    * (uint16_t *) ( pbiosdata + 0x65 ) = 41;             // 6845 crt mode control register value
+    * (uint16_t *) ( pbiosdata + 0x66 ) = 48;             // cga palette mask
+    * (uint16_t *) ( pbiosdata + 0x72 ) = 0x1234;         // soft reset flag (bypass memteest and crt init)
+    * (uint16_t *) ( pbiosdata + 0x80 ) = 0x1e;           // keyboard buffer start
+    * (uint16_t *) ( pbiosdata + 0x82 ) = 0x3e;           // one byte past keyboard buffer start
+    * (uint8_t *)  ( pbiosdata + 0x84 ) = DefaultScreenRows - 1; // 25 - 1
+    * (uint8_t *)  ( pbiosdata + 0x87 ) = 0x60;           // video mode options for ega+
+    * (uint8_t *)  ( pbiosdata + 0x88 ) = 9;              // ega feature bits
+    * (uint8_t *)  ( pbiosdata + 0x89 ) = 0x51;           // video display area (400 line mode, vga active)
+    * (uint8_t *)  ( pbiosdata + 0x8a ) = 0x8;            // 2 == CGA color, 8 == VGA color
+    * (uint8_t *)  ( pbiosdata + 0xd0 ) = 0;              // for int 21 fun 7/8: 1 if consumed ascii and scancode is next.
+    * (uint8_t *)  ( pbiosdata + 0x10f ) = 0;             // where GWBASIC checks if it's in a shelled command.com.
+    * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfff0 ) ) = 0xea;   // power on entry point (used by mulisp to detect if it's a standard PC) ea = jmp far
+    * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfff1 ) ) = 0xc0;   // "
+    * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfff2 ) ) = 0x12;   // "
+    * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfff3 ) ) = 0x00;   // "
+    * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfff4 ) ) = 0xf0;   // "
+    * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfff5 ) ) = '0';
+    * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfff6 ) ) = '8';
+    * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfff7 ) ) = '/';
+    * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfff8 ) ) = '1';
+    * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfff9 ) ) = '2';
+    * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfffa ) ) = '/';
+    * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfffb ) ) = '8';
+    * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfffc ) ) = '1';
+    * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfffe ) ) = 0xff; // original pc
+    * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xffff ) ) = 0x55; // original pc
+
+#if 0
+    // wordperfect 6.0 looks at +4 in lists of lists for a far pointer to the system file table.
+    // make that pointer point to an empty system file table.
+
+    * ( cpu.flat_address16( SegmentListOfLists, OffsetListOfLists + 4 ) ) = OffsetSystemFileTable;
+    * ( cpu.flat_address16( SegmentListOfLists, OffsetListOfLists + 6 ) ) = SegmentListOfLists;
+    * ( cpu.flat_address16( SegmentListOfLists, OffsetSystemFileTable ) ) = 0xffff;
+    * ( cpu.flat_address16( SegmentListOfLists, OffsetSystemFileTable + 2 ) ) = 0xffff;
+    * ( cpu.flat_address16( SegmentListOfLists, OffsetSystemFileTable + 4 ) ) = 0x30; // lots of files available
+#endif
+
+    // put dummy values in the list of lists
+    uint16_t * pListOfLists = cpu.flat_address16( SegmentListOfLists, OffsetListOfLists );
+    pListOfLists[ 2 ] = OffsetDeviceControlBlock; // low dword of first drive parameter block (ffff is end of list)
+    pListOfLists[ 3 ] = SegmentListOfLists;       // high "
+    uint16_t * pDeviceControlBlock = cpu.flat_address16( SegmentListOfLists, OffsetDeviceControlBlock );
+    *pDeviceControlBlock = 0xffff; // end of list
+
+    // 256 interrupt vectors at address 0 - 3ff. The first 0x40 are reserved for bios/dos and point to
+    // routines starting at InterruptRoutineSegment.
+    // Each interrupt vector element has 4 bytes for segment and offset.
+    // The routines are almost all the same -- fake opcode, interrupt #, retf 2
+    // One exception is tick tock interrupt 0x1c, which just does an iret for performance.
+    // Another exception is keyboard interrupt 9.
+    // Interrupts 9 and 1c require an iret so flags are restored since these are externally, asynchronously triggered.
+    // Other interrupts use far ret 2 (not iret) so as to not trash the flags (Z and C) used as return codes.
+    // Functions are all allocated 5 bytes each though in some cases fewer are used.
+
+    uint32_t * pVectors = (uint32_t *) cpu.flat_address( 0, 0 );
+    uint8_t * pRoutines = cpu.flat_address8( InterruptRoutineSegment, 0 );
+    for ( uint32_t intx = 0; intx < 0x40; intx++ )
+    {
+        uint32_t offset = intx * 5;
+        pVectors[ intx ] = ( InterruptRoutineSegment << 16 ) | ( offset ); // rotate 16 to store the segment in the high 2 bytes
+        uint8_t * routine = pRoutines + offset;
+
+        if ( 8 == intx )
+        {
+            routine[ 0 ] = 0xcd; // int
+            routine[ 1 ] = 0x1c; // int 1c
+            routine[ 2 ] = 0xcf; // iret
+        }
+        else if ( ( 9 == intx ) || ( intx <= 4 ) ) 
+        {
+            routine[ 0 ] = i8086_opcode_interrupt;
+            routine[ 1 ] = (uint8_t) intx;
+            routine[ 2 ] = 0xcf; // iret
+        }
+        else if ( 0x1c == intx )
+            routine[ 0 ] = 0xcf; // iret
+        else
+        {
+            routine[ 0 ] = i8086_opcode_interrupt;
+            routine[ 1 ] = (uint8_t) intx;
+            routine[ 2 ] = 0xca; // retf 2 instead of iret so C and Z flags aren't restored.
+            routine[ 3 ] = 2;    // 2 is for the 2 bytes of flags pushed during interrupt invocation then ignored.
+            routine[ 4 ] = 0;    // high byte of # of bytes to add to sp.
+        }
+    }
+
+    // write assembler routines into 0x0600 - 0x0bff. make each function segment-aligned so
+    // execution can start at ip 0.
+
+#if USE_ASSEMBLY_FOR_KBD
+    uint16_t curseg = MachineCodeSegment;
+
+    memcpy( cpu.flat_address( curseg, 0 ), int21_3f_code, sizeof( int21_3f_code ) );
+    g_int21_3f_seg = curseg;
+    curseg += ( round_up( (uint16_t) sizeof( int21_3f_code ), (uint16_t) 16 ) / 16 );
+
+    memcpy( cpu.flat_address( curseg, 0 ), int21_a_code, sizeof( int21_a_code ) );
+    g_int21_a_seg = curseg;
+    curseg += ( round_up( (uint16_t) sizeof( int21_a_code ), (uint16_t) 16 ) / 16 );
+
+    memcpy( cpu.flat_address( curseg, 0 ), int21_1_code, sizeof( int21_1_code ) );
+    g_int21_1_seg = curseg;
+    curseg += ( round_up( (uint16_t) sizeof( int21_1_code ), (uint16_t) 16 ) / 16 );
+
+    memcpy( cpu.flat_address( curseg, 0 ), int21_8_code, sizeof( int21_8_code ) );
+    g_int21_8_seg = curseg;
+    curseg += ( round_up( (uint16_t) sizeof( int21_8_code ), (uint16_t) 16 ) / 16 );
+
+    memcpy( cpu.flat_address( curseg, 0 ), int16_0_code, sizeof( int16_0_code ) );
+    g_int16_0_seg = curseg;
+    curseg += ( round_up( (uint16_t) sizeof( int16_0_code ), (uint16_t) 16 ) / 16 );
+
+    tracer.Trace( "machine code: 21_3f %04x, 21_a %04x, 21_1 %04x, 21_8 %04x, 16_0 %04x\n",
+                  g_int21_3f_seg, g_int21_a_seg, g_int21_1_seg, g_int21_8_seg, g_int16_0_seg );
+
+    assert( curseg <= InterruptRoutineSegment );
+#endif
+} //InitializeBiosAndVectors
+
+static void UpdateBiosTimer()
+{
+    uint32_t * pDailyTimer = (uint32_t *) ( cpu.flat_address8( 0x40, 0 ) + 0x6c );
+    uint32_t dt = GetBiosDailyTimer();
+    if ( dt != *pDailyTimer )
+    {
+        *pDailyTimer = dt;      // apps look here even if no timer interrupts happen because they aren't hooked
+        g_int8_pending = true;
+    }
+} //UpdateBiosTimer
+
+#ifndef NTVDM_LIBRARY
+static void RunTimerEvent( uint64_t total_cycles )
+{
+    UpdateBiosTimer();
+
+    uint64_t next = MinSliceCycles;
+    if ( g_scheduler.clockRate )
+        next = g_scheduler.TickDue( g_scheduler.TickAt( total_cycles ) + 1 ) - total_cycles;
+    else if ( !g_replay.fp )
+    {
+        uint64_t ns = duration_cast<std::chrono::nanoseconds>( high_resolution_clock::now() - g_tAppStart ).count();
+        if ( ns > g_scheduler.checkNs )
+        {
+            double cyclesPerNs = (double) ( total_cycles - g_scheduler.checkCycles ) / ( ns - g_scheduler.checkNs );
+            double untilTick = cyclesPerNs * ( BiosTickNs - ( ns % BiosTickNs ) );
+            next = (uint64_t) get_max( (double) MinSliceCycles, get_min( untilTick, cyclesPerNs * BiosTickNs / 8 ) );
+        }
+
+        g_scheduler.checkCycles = total_cycles;
+        g_scheduler.checkNs = ns;
+    }
+
+    g_scheduler.Schedule( eventTimer, total_cycles + get_max( next, (uint64_t) 1 ) );
+} //RunTimerEvent
+#endif //NTVDM_LIBRARY
+
+// called between calls to emulate() to raise control c, keyboard, and timer interrupts
+
+static void ScheduleExternalInterrupts( uint64_t total_cycles )
+{
+    if ( !g_scheduler.active )
+        UpdateBiosTimer(); // no timer event, so check each slice
+
+    // check interrupt enable and trap flags externally to avoid side effects in the emulator
+
+    if ( cpu.get_interrupt() && !cpu.get_trap() )
+    {
+        // if the keyboard peek thread has detected a keystroke, process it with an int 9.
+        // don't plumb through port 60 since apps work without that.
+
+        if ( g_UseOneThread && KeystrokeWaiting() )
+            g_KbdPeekAvailable = true; // make sure an int9 gets scheduled
+
+        if ( ReplayFlag( replayControlC, g_SendControlCInt ) )
+        {
+            tracer.Trace( "scheduling an int x23 -- control C\n" );
+            g_SendControlCInt = false;
+            ReplayInterrupt( 0x23, total_cycles );
+            cpu.external_interrupt( 0x23 );
+            return;
+        }
+
+        if ( g_KbdPeekAvailable && !g_int9_pending )
+        {
+            tracer.Trace( "%llu main loop: scheduling an int 9 -- keyboard\n", time_since_last() );
+            ReplayInterrupt( 9, total_cycles );
+            cpu.external_interrupt( 9 );
+            g_int9_pending = true;
+            g_KbdPeekAvailable = false;
+            return;
+        }
+
+        // if interrupt 8 (timer) or 0x1c (tick tock) are hooked by an app and the bios tick changed,
+        // invoke int 8, which by default then invokes int 1c. like the pic, a tick waits while interrupts are off.
+
+        if ( g_int8_pending )
+        {
+            g_int8_pending = false;
+            if ( InterruptHookedByApp( 0x1c ) || InterruptHookedByApp( 8 ) )
+            {
+                tracer.Trace( "scheduling an int 8 -- timer, total_cycles %llu\n", total_cycles );
+                ReplayInterrupt( 8, total_cycles );
+                cpu.external_interrupt( 8 );
+                return;
+            }
+        }
+    }
+    else
+    {
+        if ( g_KbdPeekAvailable )
+            tracer.Trace( "can't schedule a keyboard int 9 because interrupts are disabled!\n" );
+    }
+} //ScheduleExternalInterrupts
+
+// DosContext. DOS emulation and the 8086 emulator keep their state in globals, so each context holds its own
+// copy of that state and exchanges it with the globals while it's loading or running. Contexts are switched on
+// one thread; moving the state into the objects so they could run on separate threads is left undone.
+// memory[] is left holding the image of the last active machine, so running the same machine again copies nothing
+// in, and deactivating a machine copies back only the pages written while it was active.
+
+struct DosContextState
+{
+    vector<uint8_t> ram;
+    i8086_registers registers;
+    uint16_t segHardware;
+    bool haltExecution;
+    uint16_t diskTransferSegment;
+    uint16_t diskTransferOffset;
+    vector<FileEntry> fileEntries;
+    uint16_t firstFreeFileHandle;
+    unordered_multimap<string, uint16_t> fileHandlesByPath;
+    unordered_map<string, FileEntry> fileEntriesFCB;
+    vector<DosAllocation> allocEntries;
+    uint16_t currentPSP;
+    bool use80xRowsMode;
+    bool forceConsole;
+    bool firstTimeFlip;
+    bool int16_1_loop;
+    bool kbdPeekAvailable;
+    bool int9_pending;
+    bool int8_pending;
+    long injectedControlC;
+    int appTerminationReturnCode;
+    char acRoot[ MAX_PATH ];
+    char acApp[ MAX_PATH ];
+    char lastLoadedApp[ MAX_PATH ];
+    vector<uint32_t> interruptsCalled;
+    high_resolution_clock::time_point tAppStart;
+    bool sendControlCInt;
 #ifdef _WIN32
-        g_msAtStart = GetTickCount64(); // struct timeval not availabe on Win32
+    unordered_map<uint32_t, HANDLE> hFindFirst;
 #else
-        struct timeval tv = {0};
-        gettimeofday( &tv, NULL );
-        g_msAtStart = tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+    unordered_map<uint32_t, LinuxFindSearch *> findFirst;
+#endif
+    string * consoleSink;
+
+    string output;         // the app's console output. consoleSink points here while the machine is active
+    string environment;    // from DosContextOptions
+    const char * error;    // set if the root folder is invalid
+    string fatalError;     // the message from a fatal emulation error that stopped the app
+    uint64_t cycles;
+    bool loaded;
+    bool trackDirtyPages;  // from DosContextOptions
+
+    DosContextState() : ram( sizeof( memory ) ), registers(), segHardware( ScreenBufferSegment ), haltExecution( false ),
+                        diskTransferSegment( 0 ), diskTransferOffset( 0 ), firstFreeFileHandle( 5 ), currentPSP( 0 ),
+                        use80xRowsMode( false ), forceConsole( true ), firstTimeFlip( true ), int16_1_loop( false ),
+                        kbdPeekAvailable( false ), int9_pending( false ), int8_pending( false ), injectedControlC( 0 ),
+                        appTerminationReturnCode( 0 ),
+                        interruptsCalled( 256 * 256 ), sendControlCInt( false ),
+                        consoleSink( & output ), error( 0 ), cycles( 0 ), loaded( false ), trackDirtyPages( false )
+    {
+        acRoot[ 0 ] = 0;
+        acApp[ 0 ] = 0;
+        lastLoadedApp[ 0 ] = 0;
+    }
+};
+
+static DosContextState * g_memoryOwner = 0;         // the machine whose ram memory[] currently matches
+
+static void SwapMachineState( DosContextState & s, bool activate )
+{
+    if ( activate )
+    {
+        if ( g_memoryOwner != & s )
+        {
+            memcpy( memory, s.ram.data(), sizeof( memory ) );
+            g_memoryOwner = & s;
+        }
+
+        if ( s.trackDirtyPages )
+            StartDirtyTracking();
+    }
+    else if ( s.trackDirtyPages )
+    {
+        StopDirtyTracking();
+        CopyDirtyPages( s.ram.data() );
+    }
+    else
+        memcpy( s.ram.data(), memory, sizeof( memory ) );
+
+    i8086_registers live;
+    cpu.save_registers( live );
+    cpu.restore_registers( s.registers );
+    s.registers = live;
+    cpu.note_video_write();
+
+    swap( g_segHardware, s.segHardware );
+    swap( g_haltExecution, s.haltExecution );
+    swap( g_diskTransferSegment, s.diskTransferSegment );
+    swap( g_diskTransferOffset, s.diskTransferOffset );
+    swap( g_fileEntries, s.fileEntries );
+    swap( g_firstFreeFileHandle, s.firstFreeFileHandle );
+    swap( g_fileHandlesByPath, s.fileHandlesByPath );
+    swap( g_fileEntriesFCB, s.fileEntriesFCB );
+    swap( g_allocEntries, s.allocEntries );
+    swap( g_currentPSP, s.currentPSP );
+    swap( g_use80xRowsMode, s.use80xRowsMode );
+    swap( g_forceConsole, s.forceConsole );
+    swap( s_firstTimeFlip, s.firstTimeFlip );
+    swap( g_int16_1_loop, s.int16_1_loop );
+    swap( g_KbdPeekAvailable, s.kbdPeekAvailable );
+    swap( g_int9_pending, s.int9_pending );
+    swap( g_int8_pending, s.int8_pending );
+    swap( g_injectedControlC, s.injectedControlC );
+    swap( g_appTerminationReturnCode, s.appTerminationReturnCode );
+    swap( g_acRoot, s.acRoot );
+    swap( g_acApp, s.acApp );
+    swap( g_lastLoadedApp, s.lastLoadedApp );
+    swap( g_InterruptsCalled, s.interruptsCalled );
+    swap( g_tAppStart, s.tAppStart );
+    s.sendControlCInt = g_SendControlCInt.exchange( s.sendControlCInt );
+#ifdef _WIN32
+    swap( g_hFindFirst, s.hFindFirst );
+#else
+    swap( g_FindFirst, s.findFirst );
+#endif
+    swap( g_consoleSink, s.consoleSink );
+} //SwapMachineState
+
+class ActiveMachine
+{
+    // makes a machine's state live for the lifetime of the object
+
+    public:
+        ActiveMachine( DosContextState & s ) : state( s ) { SwapMachineState( state, true ); }
+        ~ActiveMachine() { SwapMachineState( state, false ); }
+
+    private:
+        DosContextState & state;
+};
+
+DosContext::DosContext( const DosContextOptions & options ) : state( new DosContextState() )
+{
+    init_blankline( DefaultVideoAttribute );
+
+    if ( options.environment )
+        state->environment = options.environment;
+    state->trackDirtyPages = options.trackDirtyPages;
+
+    ActiveMachine active( *state );
+    state->error = SetRootFolder( options.root ? options.root : "." );
+    InitializeBiosAndVectors();
+} //DosContext
+
+DosContext::~DosContext()
+{
+    {
+        ActiveMachine active( *state );
+
+        for ( size_t i = 0; i < g_fileEntries.size(); i++ )
+        {
+            if ( g_fileEntries[ i ].fp )
+            {
+                CloseHostFile( g_fileEntries[ i ].fp );
+                ReleasePath( g_fileEntries[ i ].path ); // g_filePaths is shared by all machines
+            }
+        }
+
+        for ( auto & e : g_fileEntriesFCB )
+        {
+            CloseHostFile( e.second.fp );
+            ReleasePath( e.second.path );
+        }
+
+        CloseAllFindFirst();
+    }
+
+    if ( g_memoryOwner == state.get() )
+        g_memoryOwner = 0;
+} //~DosContext
+
+bool DosContext::Load( const char * app, const char * args )
+{
+    if ( state->loaded || state->error )
+        return false;
+
+    ActiveMachine active( *state );
+
+    if ( FindAppFile( app ) )
+        return false;
+
+    // DOS puts a space before the first argument
+
+    char acAppArgs[ 127 ] = {0};
+    if ( args && *args )
+    {
+        acAppArgs[ 0 ] = ' ';
+        strncpy( acAppArgs + 1, args, _countof( acAppArgs ) - 2 );
+    }
+
+    if ( ends_with( g_acApp, "pas2.exe" ) )
+        g_segHardware = 0xa000;
+
+    uint16_t segEnvironment = AllocateEnvironment( 0, g_acApp, state->environment.empty() ? 0 : state->environment.c_str() );
+    if ( 0 == segEnvironment )
+        return false;
+
+    g_currentPSP = LoadBinary( g_acApp, acAppArgs, (uint8_t) strlen( acAppArgs ), segEnvironment, true, 0, 0, 0, 0, false );
+    if ( 0 == g_currentPSP )
+        return false;
+
+    g_diskTransferSegment = cpu.get_ds();
+    g_diskTransferOffset = 0x80;
+    cpu.set_interrupt( true );
+    g_tAppStart = high_resolution_clock::now();
+    state->loaded = true;
+    return true;
+} //Load
+
+bool DosContext::Run( uint64_t cycles )
+{
+    if ( !state->loaded || state->haltExecution )
+        return state->haltExecution;
+
+    ActiveMachine active( *state );
+    uint64_t start = state->cycles;
+
+    try
+    {
+        while ( ( state->cycles - start ) < cycles )
+        {
+            state->cycles += cpu.emulate( get_min( cycles - ( state->cycles - start ), (uint64_t) 2000 ) );
+
+            if ( g_haltExecution )
+                break;
+
+            ScheduleExternalInterrupts( state->cycles );
+        }
+    }
+    catch ( HardExit & e )
+    {
+        // the app can't continue. stop it rather than the host process
+
+        state->fatalError = e.what();
+        while ( !state->fatalError.empty() && '\n' == state->fatalError.back() )
+            state->fatalError.pop_back();
+        g_appTerminationReturnCode = -1;
+        g_haltExecution = true;
+    }
+
+    return g_haltExecution;
+} //Run
+
+bool DosContext::Exited() { return state->haltExecution; }
+int DosContext::ExitCode() { return state->appTerminationReturnCode; }
+const char * DosContext::Error() { return state->fatalError.empty() ? state->error : state->fatalError.c_str(); }
+uint64_t DosContext::Cycles() { return state->cycles; }
+const string & DosContext::Output() { return state->output; }
+void DosContext::ClearOutput() { state->output.clear(); }
+
+#ifndef NTVDM_LIBRARY
+
+// --batch runs each line of a job file as a separate DOS app. A line is [-r:root] [-e:env,...] [-u] [-l] PROGRAM [ARGUMENT]...
+// This is not a pool of worker threads. The emulator keeps its state in globals and a DosContext only swaps it
+// on one thread, so jobs can only run in parallel in separate processes. On Linux and MacOS the parent takes jobs
+// from one queue in file order and forks a child with its own copy of the emulator for each, up to the worker
+// count at once, starting the next job as soon as a child exits. There's no work stealing because children don't
+// share a queue. Output is printed in job file order. Windows has no fork, so there jobs run one at a time.
+// A child reports its job's exit code on a second pipe, since the 8-bit exit status can't tell a DOS app that
+// returned 255 from a job that never ran.
+
+const int BatchJobNotRun = -1;     // invalid job line or the program couldn't be loaded
+const int BatchJobCrashed = -2;    // the worker process died before reporting an exit code
+
+struct BatchJob
+{
+    string line;     // the job as written in the job file
+    string output;   // what the app wrote to the console
+    int exitCode;    // the app's exit code, BatchJobNotRun, or BatchJobCrashed
+    bool done;
+};
+
+static int RunBatchJob( const char * line, string & output )
+{
+    vector<string> tokens;
+    const char * p = line;
+    while ( *p )
+    {
+        while ( isspace( (uint8_t) *p ) )
+            p++;
+        const char * start = p;
+        while ( *p && !isspace( (uint8_t) *p ) )
+            p++;
+        if ( p != start )
+            tokens.push_back( string( start, p - start ) );
+    }
+
+    DosContextOptions options;
+#ifdef _WIN32
+    options.root = "\\";
+#else
+    options.root = "/";
+    g_forcePathsUpper = false; // a job gets only its own options, even if an earlier job ran in this process
+    g_forcePathsLower = false;
+#endif
+
+    size_t t = 0;
+    for ( ; t < tokens.size() && '-' == tokens[ t ][ 0 ]; t++ )
+    {
+        const char * parg = tokens[ t ].c_str();
+        char ca = (char) tolower( parg[ 1 ] );
+
+        if ( 'c' == ca )
+            continue; // jobs always run in teletype mode
+        else if ( 'r' == ca && ':' == parg[ 2 ] )
+            options.root = parg + 3;
+        else if ( 'e' == ca && ':' == parg[ 2 ] )
+            options.environment = parg + 3;
+#ifndef _WIN32
+        else if ( 'u' == ca )
+            g_forcePathsUpper = true;
+        else if ( 'l' == ca )
+            g_forcePathsLower = true;
+#endif
+        else
+        {
+            output += "invalid job argument " + tokens[ t ] + "\n";
+            return BatchJobNotRun;
+        }
+    }
+
+    if ( t == tokens.size() )
+    {
+        output += "no command specified\n";
+        return BatchJobNotRun;
+    }
+
+    string args;
+    for ( size_t a = t + 1; a < tokens.size(); a++ )
+    {
+        if ( a > t + 1 )
+            args += " ";
+        args += tokens[ a ];
+    }
+
+    int exitCode = BatchJobNotRun;
+    {
+        DosContext machine( options );
+        if ( machine.Load( tokens[ t ].c_str(), args.c_str() ) )
+        {
+            while ( !machine.Run( 1000000 ) )
+                continue;
+            exitCode = machine.ExitCode();
+        }
+        else
+            output += "unable to load " + tokens[ t ] + "\n";
+
+        output += machine.Output();
+    }
+
+    return exitCode;
+} //RunBatchJob
+
+static int RunBatch( int argc, char * argv[] )
+{
+    const char * jobFile = argv[ 1 ] + strlen( "--batch:" );
+    unsigned workers = std::thread::hardware_concurrency();
+
+    for ( int i = 2; i < argc; i++ )
+    {
+        if ( starts_with( argv[ i ], "--workers:" ) )
+            workers = (unsigned) strtoul( argv[ i ] + strlen( "--workers:" ), 0, 10 );
+        else
+            usage( "invalid argument after --batch" );
+    }
+
+    if ( 0 == workers )
+        workers = 1;
+
+    FILE * fp = fopen( jobFile, "r" );
+    if ( !fp )
+        usage( "can't open the --batch job file" );
+
+    vector<BatchJob> jobs;
+    char acLine[ 1024 ];
+    while ( fgets( acLine, sizeof( acLine ), fp ) )
+    {
+        acLine[ strcspn( acLine, "\r\n" ) ] = 0;
+        const char * p = acLine;
+        while ( isspace( (uint8_t) *p ) )
+            p++;
+        if ( 0 == *p || '#' == *p )
+            continue;
+
+        BatchJob job;
+        job.line = p;
+        job.exitCode = BatchJobNotRun;
+        job.done = false;
+        jobs.push_back( job );
+    }
+    fclose( fp );
+
+#ifdef _WIN32
+    for ( size_t j = 0; j < jobs.size(); j++ )
+    {
+        jobs[ j ].exitCode = RunBatchJob( jobs[ j ].line.c_str(), jobs[ j ].output );
+        jobs[ j ].done = true;
+        fwrite( jobs[ j ].output.c_str(), 1, jobs[ j ].output.length(), stdout );
+        fflush( stdout );
+    }
+#else
+    struct BatchWorker
+    {
+        pid_t pid;
+        int fd;       // read end of the pipe carrying the job's output
+        int statusFd; // read end of the pipe carrying the job's exit code
+        size_t job;
+    };
+
+    vector<BatchWorker> active;
+    size_t next = 0;
+    size_t printed = 0;
+
+    while ( printed < jobs.size() )
+    {
+        while ( ( next < jobs.size() ) && ( active.size() < workers ) )
+        {
+            int fds[ 2 ], statusFds[ 2 ];
+            if ( 0 != pipe( fds ) )
+                i8086_hard_exit( "can't create a pipe for a batch job\n", 0 );
+            if ( 0 != pipe( statusFds ) )
+                i8086_hard_exit( "can't create a pipe for a batch job\n", 0 );
+
+            fflush( stdout );
+            pid_t pid = fork();
+            if ( -1 == pid )
+                i8086_hard_exit( "can't fork a batch worker\n", 0 );
+
+            if ( 0 == pid )
+            {
+                close( fds[ 0 ] );
+                close( statusFds[ 0 ] );
+                dup2( fds[ 1 ], 1 ); // hard exits print to stdout; make those part of the job's output too
+                close( fds[ 1 ] );
+
+                string output;
+                int exitCode = RunBatchJob( jobs[ next ].line.c_str(), output );
+                const char * po = output.c_str();
+                size_t left = output.length();
+                while ( left > 0 )
+                {
+                    ssize_t written = write( 1, po, left );
+                    if ( written <= 0 )
+                    {
+                        if ( ( -1 == written ) && ( EINTR == errno ) )
+                            continue;
+                        break;
+                    }
+                    po += written;
+                    left -= written;
+                }
+
+                while ( ( -1 == write( statusFds[ 1 ], & exitCode, sizeof( exitCode ) ) ) && ( EINTR == errno ) )
+                    continue;
+                _exit( 0 );
+            }
+
+            close( fds[ 1 ] );
+            close( statusFds[ 1 ] );
+            BatchWorker worker = { pid, fds[ 0 ], statusFds[ 0 ], next };
+            active.push_back( worker );
+            next++;
+        }
+
+        vector<pollfd> pfds( active.size() );
+        for ( size_t w = 0; w < active.size(); w++ )
+        {
+            pfds[ w ].fd = active[ w ].fd;
+            pfds[ w ].events = POLLIN;
+            pfds[ w ].revents = 0;
+        }
+
+        if ( poll( pfds.data(), pfds.size(), -1 ) < 0 )
+        {
+            if ( EINTR == errno )
+                continue;
+            i8086_hard_exit( "poll failed running batch jobs\n", 0 );
+        }
+
+        for ( size_t w = active.size(); w > 0; w-- )
+        {
+            BatchWorker & worker = active[ w - 1 ];
+            if ( 0 == pfds[ w - 1 ].revents )
+                continue;
+
+            char buf[ 4096 ];
+            ssize_t len = read( worker.fd, buf, sizeof( buf ) );
+            if ( len > 0 )
+            {
+                jobs[ worker.job ].output.append( buf, len );
+                continue;
+            }
+
+            if ( ( -1 == len ) && ( EINTR == errno ) )
+                continue;
+
+            close( worker.fd );
+            int status = 0;
+            while ( ( -1 == waitpid( worker.pid, & status, 0 ) ) && ( EINTR == errno ) )
+                continue;
+
+            // the child wrote its exit code just before exiting, so it's already in the pipe if it got that far
+
+            int exitCode = 0;
+            ssize_t got = 0;
+            while ( ( -1 == ( got = read( worker.statusFd, & exitCode, sizeof( exitCode ) ) ) ) && ( EINTR == errno ) )
+                continue;
+            close( worker.statusFd );
+            jobs[ worker.job ].exitCode = ( sizeof( exitCode ) == got ) ? exitCode : BatchJobCrashed;
+            jobs[ worker.job ].done = true;
+            active.erase( active.begin() + ( w - 1 ) );
+        }
+
+        while ( ( printed < jobs.size() ) && jobs[ printed ].done )
+        {
+            fwrite( jobs[ printed ].output.c_str(), 1, jobs[ printed ].output.length(), stdout );
+            fflush( stdout );
+            printed++;
+        }
+    }
 #endif
 
+    // exit codes go to stderr so stdout has only what the apps wrote
+
+    int failures = 0;
+    for ( size_t j = 0; j < jobs.size(); j++ )
+    {
+        if ( 0 != jobs[ j ].exitCode )
+        {
+            if ( BatchJobNotRun == jobs[ j ].exitCode )
+                fprintf( stderr, "job %zu didn't run: %s\n", j + 1, jobs[ j ].line.c_str() );
+            else if ( BatchJobCrashed == jobs[ j ].exitCode )
+                fprintf( stderr, "job %zu ended without an exit code: %s\n", j + 1, jobs[ j ].line.c_str() );
+            else
+                fprintf( stderr, "exit code %d from job %zu: %s\n", jobs[ j ].exitCode, j + 1, jobs[ j ].line.c_str() );
+            failures++;
+        }
+    }
+
+    return ( 0 == failures ) ? 0 : 1;
+} //RunBatch
+
+#ifndef _WIN32
+
+// Fork server. --server:SOCKET loads the app once and then listens on a Unix socket. Each request from
+// --client:SOCKET is run in a forked child that shares the loaded image copy-on-write. The child gets the
+// client's stdin, stdout, and stderr, its current directory, and a new command tail. The child writes the
+// app's output straight to the client's stdout and sends back the exit code when the app ends.
+// The server runs the app's startup once and forks at its first keyboard or stdin read, the same point
+// --snapshot uses. Output written before then is kept and replayed to each client. The new command tail
+// is patched into the PSP at the fork, so apps that parsed it during startup still see the server's
+// arguments; those apps should take per-request input from stdin.
+
+struct ForkServerRequest
+{
+    char cwd[ MAX_PATH ];  // client's current directory
+    char args[ 127 ];      // command tail with a leading space, 0-terminated
+};
+
+static int g_serverConnection = -1;                  // in a fork server child, the connection to the client
+
+static bool SendAll( int fd, const void * p, size_t len )
+{
+    const char * pc = (const char *) p;
+    while ( len > 0 )
+    {
+        ssize_t sent = send( fd, pc, len, 0 );
+        if ( sent <= 0 )
+        {
+            if ( ( -1 == sent ) && ( EINTR == errno ) )
+                continue;
+            return false;
+        }
+        pc += sent;
+        len -= sent;
+    }
+    return true;
+} //SendAll
+
+static bool RecvAll( int fd, void * p, size_t len )
+{
+    char * pc = (char *) p;
+    while ( len > 0 )
+    {
+        ssize_t got = recv( fd, pc, len, 0 );
+        if ( got <= 0 )
+        {
+            if ( ( -1 == got ) && ( EINTR == errno ) )
+                continue;
+            return false;
+        }
+        pc += got;
+        len -= got;
+    }
+    return true;
+} //RecvAll
+
+static bool InitUnixAddress( sockaddr_un & addr, const char * path )
+{
+    memset( & addr, 0, sizeof( addr ) );
+    addr.sun_family = AF_UNIX;
+    if ( strlen( path ) >= sizeof( addr.sun_path ) )
+        return false;
+    strcpy( addr.sun_path, path );
+    return true;
+} //InitUnixAddress
+
+// called at the app's first keyboard or stdin read. returns only in a child that's ready to finish that
+// read and the rest of one request
+
+static void RunForkServer( const char * path )
+{
+    sockaddr_un addr;
+    if ( !InitUnixAddress( addr, path ) )
+        i8086_hard_exit( "the --server socket path is too long\n", 0 );
+
+    int listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+    unlink( path );
+    if ( ( -1 == listener ) || ( 0 != bind( listener, (sockaddr *) & addr, sizeof( addr ) ) ) || ( 0 != listen( listener, 64 ) ) )
+        i8086_hard_exit( "unable to listen on the --server socket\n", 0 );
+
+    g_consoleConfig.RestoreConsoleInput(); // the server never reads the keyboard. each child sets up its client's terminal
+    signal( SIGCHLD, SIG_IGN );            // children report to their clients, so let the OS reap them
+    tracer.Trace( "fork server listening on '%s' with '%s' initialized\n", path, g_acApp );
+
+    do
+    {
+        int connection = accept( listener, 0, 0 );
+        if ( -1 == connection )
+        {
+            if ( EINTR == errno )
+                continue;
+            i8086_hard_exit( "accept failed on the --server socket\n", 0 );
+        }
+
+        // the request arrives with the client's stdin, stdout, and stderr attached
+
+        ForkServerRequest request;
+        int fds[ 3 ] = { -1, -1, -1 };
+        char control[ CMSG_SPACE( sizeof( fds ) ) ];
+        iovec iov = { & request, sizeof( request ) };
+        msghdr msg;
+        memset( & msg, 0, sizeof( msg ) );
+        msg.msg_iov = & iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof( control );
+
+        ssize_t got = recvmsg( connection, & msg, 0 );
+        cmsghdr * pcmsg = ( got > 0 ) ? CMSG_FIRSTHDR( & msg ) : 0;
+        if ( pcmsg && ( SOL_SOCKET == pcmsg->cmsg_level ) && ( SCM_RIGHTS == pcmsg->cmsg_type ) &&
+             ( CMSG_LEN( sizeof( fds ) ) == pcmsg->cmsg_len ) )
+            memcpy( fds, CMSG_DATA( pcmsg ), sizeof( fds ) );
+
+        bool ok = ( -1 != fds[ 2 ] ) && ( ( got == sizeof( request ) ) ||
+                  ( ( got > 0 ) && RecvAll( connection, got + (char *) & request, sizeof( request ) - got ) ) );
+
+        if ( ok )
+        {
+            fflush( 0 );
+            pid_t pid = fork();
+            if ( 0 == pid )
+            {
+                close( listener );
+                signal( SIGCHLD, SIG_DFL );
+                for ( int i = 0; i < 3; i++ )
+                {
+                    dup2( fds[ i ], i );
+                    close( fds[ i ] );
+                }
+
+                g_serverConnection = connection;
+                request.cwd[ sizeof( request.cwd ) - 1 ] = 0;
+                request.args[ sizeof( request.args ) - 1 ] = 0;
+                if ( 0 != chdir( request.cwd ) )
+                    tracer.Trace( "  fork server child can't chdir to '%s', error %d\n", request.cwd, errno );
+
+                // patch the command tail for apps that read it after startup. the DTA may share its space
+
+                DOSPSP * psp = (DOSPSP *) cpu.flat_address( g_currentPSP, 0 );
+                size_t len = strlen( request.args );
+                psp->countCommandTail = (uint8_t) len;
+                memcpy( psp->commandTail, request.args, len );
+                psp->commandTail[ len ] = 0x0d;
+
+                g_consoleConfig.EstablishConsoleInput( (void *) ControlHandlerProc );
+                ConfigurePipedHandles();
+                g_consoleSink = 0;
+                fwrite( g_forkServerOutput.c_str(), 1, g_forkServerOutput.size(), stdout );
+                tracer.Trace( "fork server child %d running '%s' with args '%s'\n", getpid(), g_acApp, request.args );
+                return;
+            }
+
+            if ( -1 == pid )
+                tracer.Trace( "fork server can't fork, error %d\n", errno );
+        }
+        else
+            tracer.Trace( "fork server dropping a malformed request\n" );
+
+        for ( int i = 0; i < 3; i++ )
+            if ( -1 != fds[ i ] )
+                close( fds[ i ] );
+        close( connection );
+    } while ( true );
+} //RunForkServer
+
+static void ReportForkServerExit()
+{
+    if ( -1 != g_serverConnection )
+    {
+        fflush( 0 );
+        int32_t code = g_appTerminationReturnCode;
+        SendAll( g_serverConnection, & code, sizeof( code ) );
+        close( g_serverConnection );
+        g_serverConnection = -1;
+    }
+} //ReportForkServerExit
+
+static int RunForkClient( int argc, char * argv[] )
+{
+    const char * path = argv[ 1 ] + strlen( "--client:" );
+    sockaddr_un addr;
+    if ( !InitUnixAddress( addr, path ) )
+        usage( "the --client socket path is too long" );
+
+    ForkServerRequest request;
+    memset( & request, 0, sizeof( request ) );
+    if ( !getcwd( request.cwd, sizeof( request.cwd ) ) )
+        usage( "can't get the current directory" );
+
+    // DOS puts a space before the first argument and between arguments
+
+    for ( int i = 2; i < argc; i++ )
+    {
+        if ( strlen( request.args ) + 3 + strlen( argv[ i ] ) >= _countof( request.args ) )
+        {
+            fprintf( stderr, "the arguments don't fit in a DOS command tail of %d characters\n", (int) _countof( request.args ) - 3 );
+            return 1;
+        }
+
+        strcat( request.args, " " );
+        strcat( request.args, argv[ i ] );
+    }
+
+    int s = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( ( -1 == s ) || ( 0 != connect( s, (sockaddr *) & addr, sizeof( addr ) ) ) )
+    {
+        fprintf( stderr, "can't connect to the ntvdm server at '%s', error %d\n", path, errno );
+        return 1;
+    }
+
+    int fds[ 3 ] = { 0, 1, 2 };
+    char control[ CMSG_SPACE( sizeof( fds ) ) ];
+    memset( control, 0, sizeof( control ) );
+    iovec iov = { & request, sizeof( request ) };
+    msghdr msg;
+    memset( & msg, 0, sizeof( msg ) );
+    msg.msg_iov = & iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof( control );
+    cmsghdr * pcmsg = CMSG_FIRSTHDR( & msg );
+    pcmsg->cmsg_level = SOL_SOCKET;
+    pcmsg->cmsg_type = SCM_RIGHTS;
+    pcmsg->cmsg_len = CMSG_LEN( sizeof( fds ) );
+    memcpy( CMSG_DATA( pcmsg ), fds, sizeof( fds ) );
+
+    ssize_t sent = sendmsg( s, & msg, 0 );
+    if ( ( sent <= 0 ) || ( ( sent < (ssize_t) sizeof( request ) ) && !SendAll( s, sent + (char *) & request, sizeof( request ) - sent ) ) )
+    {
+        fprintf( stderr, "can't send the request to the ntvdm server, error %d\n", errno );
+        return 1;
+    }
+
+    // the server closes the connection without an exit code if the emulator hit a fatal error
+
+    int32_t code = 1;
+    if ( !RecvAll( s, & code, sizeof( code ) ) )
+        code = 1;
+    close( s );
+    return code;
+} //RunForkClient
+
+#endif // _WIN32
+
+int main( int argc, char * argv[] )
+{
+    try
+    {
+        char * posval = getenv( "OS" );
+        g_InRVOS = ( ( 0 != posval ) && !strcmp( posval, "RVOS" ) );
+        g_UseOneThread = g_InRVOS;
+    
 #ifndef _WIN32
         tzset(); // or localtime_r won't work correctly
 #endif        
@@ -8614,6 +11851,19 @@ int main( int argc, char * argv[] )
         char * pdot = strchr( g_thisApp, '.' );
         if ( pdot )
             *pdot = 0;
+
+        if ( ( argc > 1 ) && starts_with( argv[ 1 ], "--batch:" ) )
+            return RunBatch( argc, argv );
+
+        if ( ( argc > 1 ) && ( starts_with( argv[ 1 ], "--tracedump:" ) || starts_with( argv[ 1 ], "--tracediff:" ) ) )
+            return RunTraceTool( argc, argv );
+
+#ifndef _WIN32
+        if ( ( argc > 1 ) && starts_with( argv[ 1 ], "--client:" ) )
+            return RunForkClient( argc, argv );
+#endif
+
+        g_consoleConfig.EstablishConsoleInput( (void *) ControlHandlerProc );
     
         memset( memory, 0, sizeof( memory ) );
 
@@ -8639,7 +11889,13 @@ int main( int argc, char * argv[] )
         bool clearDisplayOnExit = true;
         bool bootSectorLoad = false;
         bool printVideoMemory = false;
+        bool useBlockCache = false;
+        bool useJit = false;
         char * penvVars = 0;
+        const char * pcRestore = 0;
+        const char * pcServer = 0;
+        const char * pcRecord = 0;
+        const char * pcReplay = 0;
         static char acRootArg[ MAX_PATH ];
 #ifdef _WIN32
         strcpy( acRootArg, "\\" );
@@ -8663,7 +11919,31 @@ int main( int argc, char * argv[] )
             {
                 char ca = (char) tolower( parg[1] );
     
-                if ( 'b' == ca )
+                if ( starts_with( parg, "--snapshot:" ) )
+                    g_snapshotPath = parg + strlen( "--snapshot:" );
+                else if ( starts_with( parg, "--stats:" ) )
+                    g_statsPath = parg + strlen( "--stats:" );
+                else if ( starts_with( parg, "--trace:" ) )
+                    g_binaryTracePath = parg + strlen( "--trace:" );
+                else if ( starts_with( parg, "--profile:" ) )
+                    g_profilePath = parg + strlen( "--profile:" );
+                else if ( starts_with( parg, "--profilecycles:" ) )
+                    g_profileCycles = get_max( (uint32_t) strtoul( parg + strlen( "--profilecycles:" ), 0, 10 ), (uint32_t) 1 );
+                else if ( starts_with( parg, "--restore:" ) )
+                    pcRestore = parg + strlen( "--restore:" );
+                else if ( starts_with( parg, "--record:" ) )
+                    pcRecord = parg + strlen( "--record:" );
+                else if ( starts_with( parg, "--replay:" ) )
+                    pcReplay = parg + strlen( "--replay:" );
+#ifndef _WIN32
+                else if ( starts_with( parg, "--server:" ) )
+                {
+                    pcServer = parg + strlen( "--server:" );
+                    g_forceConsole = true; // requests share one loaded image and run with their clients' terminals
+                    g_UseOneThread = true; // the fork happens mid-run, and children don't inherit a keyboard thread
+                }
+#endif
+                else if ( 'b' == ca )
                     bootSectorLoad = true;
                 else if ( 's' == ca )
                 {
@@ -8741,6 +12021,10 @@ int main( int argc, char * argv[] )
 #endif            
                 else if ( 'v' == ca )
                     version();
+                else if ( 'x' == ca )
+                    useBlockCache = true;
+                else if ( 'j' == ca )
+                    useJit = true;
                 else if ( '?' == ca )
                     usage( 0 );
                 else
@@ -8765,83 +12049,37 @@ int main( int argc, char * argv[] )
         tracer.Enable( trace, logFile, true );
         tracer.SetQuiet( true );
         cpu.trace_instructions( traceInstructions );
+        useBlockCache |= useJit; // compiled code runs out of the block cache
+        cpu.enable_block_cache( useBlockCache );
+        if ( useJit && !cpu.enable_jit( true ) )
+        {
+            printf( "the JIT isn't available on this host; running the interpreter\n" );
+            useJit = false;
+        }
     
         tracer.Trace( "Use one thread: %d\n", g_UseOneThread );
     
-#ifdef _WIN32    
-        GetFullPathNameA( acRootArg, _countof( g_acRoot ), g_acRoot, 0 );
-        DWORD attr = GetFileAttributesA( g_acRoot );
-        if ( ( INVALID_FILE_ATTRIBUTES == attr ) || ( 0 == ( attr & FILE_ATTRIBUTE_DIRECTORY ) ) )
-            usage( "/r root argument isn't a folder" );
-        size_t len = strlen( g_acRoot );
-        if ( 0 == len )
-            usage( "error parsing /r argument. does the folder exist?" );
-        if ( '\\' != g_acRoot[ len - 1 ] )
-            strcat( g_acRoot, "\\" );
-#else
-        char * fpath = realpath( acRootArg, 0 );
-        if ( !fpath )
-            usage( "error parsing /r argument" );
-        strcpy( g_acRoot, fpath );
-        free( fpath );
-        size_t len = strlen( g_acRoot );
-        if ( 0 == len )
-            usage( "error parsing /r argument. does the folder exist?" );
-        if ( '/' != g_acRoot[ len - 1 ] )
-            strcat( g_acRoot, "/" );
-        struct stat statbuf;
-        int ret = stat( g_acRoot, & statbuf );
-        if ( !S_ISDIR( statbuf.st_mode ) )
-            usage( "/r root argument isn't a folder" );
-#endif
+        const char * rootError = SetRootFolder( acRootArg );
+        if ( rootError )
+            usage( rootError );
         tracer.Trace( "root full path: '%s'\n", g_acRoot );
 
-        if ( 0 == pcAPP )
+        if ( pcRestore )
         {
-            usage( "no command specified" );
-            assume_false; // prevent false prefast warning from the msft compiler
+            if ( pcAPP )
+                usage( "a command can't be specified with --restore" );
         }
-    
-        strcpy( g_acApp, pcAPP );
-#ifdef _WIN32    
-        _strupr( g_acApp );
-#else
-        const char * pLinuxPath = DOSToHostPath( g_acApp );
-        strcpy( g_acApp, pLinuxPath );
-#endif    
-
-        if ( !file_exists( g_acApp ) )
+        else
         {
-            if ( ends_with( g_acApp, ".com" ) || ends_with( g_acApp, ".exe" ) )
-                usage( "can't find command file .com or .exe" );
-            else
+            if ( 0 == pcAPP )
             {
-                strcat( g_acApp, ".COM" );
-                if ( !file_exists( g_acApp ) )
-                {
-                    char * dot = strstr( g_acApp, ".COM" );
-                    strcpy( dot, ".EXE" );
-                    if ( !file_exists( g_acApp ) )
-                    {
-#ifdef _WIN32                    
-                        usage( "can't find command file" );
-#else                    
-                        tracer.Trace( "couldn't find input file '%s'\n", g_acApp );
-                        char * pdot = strrchr( g_acApp, '.' );
-                        strcpy( pdot, ".com" );
-                        if ( !file_exists( g_acApp ) )
-                        {
-                            strcpy( pdot, ".exe" );
-                            if ( !file_exists( g_acApp ) )
-                            {
-                                tracer.Trace( "looked last for '%s'\n", g_acApp );
-                                usage( "can't find command file" );
-                            }
-                        }
-#endif               
-                    }     
-                }
+                usage( "no command specified" );
+                assume_false; // prevent false prefast warning from the msft compiler
             }
+        
+            const char * appError = FindAppFile( pcAPP );
+            if ( appError )
+                usage( appError );
         }
 
         // Microsoft Pascal v1.0's second pass PAS2.EXE requires end of 64k block, not the middle of a block.
@@ -8859,257 +12097,201 @@ int main( int argc, char * argv[] )
 #endif    
 
         g_keyStrokes.SetMode( keystroke_mode );
-    
-        // global bios memory
-    
-        uint8_t * pbiosdata = cpu.flat_address8( 0x40, 0 );
-        * (uint16_t *) ( pbiosdata + 0x10 ) = 0x21;           // equipment list. diskette installed and initial video mode 0x20
-        * (uint16_t *) ( pbiosdata + 0x13 ) = 640;            // contiguous 1k blocks (640 * 1024)
-        * (uint16_t *) ( pbiosdata + 0x1a ) = 0x1e;           // keyboard buffer head
-        * (uint16_t *) ( pbiosdata + 0x1c ) = 0x1e;           // keyboard buffer tail
-        * (uint8_t *)  ( pbiosdata + 0x49 ) = DefaultVideoMode; // video mode is 3 == 80x25, 16 colors
-        * (uint16_t *) ( pbiosdata + 0x4a ) = ScreenColumns;  // 80
-        * (uint16_t *) ( pbiosdata + 0x4c ) = 0x1000;         // video regen buffer size
-        * (uint8_t *)  ( pbiosdata + 0x60 ) = 7;              // cursor ending/bottom scan line
-        * (uint8_t *)  ( pbiosdata + 0x61 ) = 6;              // cursor starting/top scan line
-        * (uint8_t *)  ( pbiosdata + 0x62 ) = 0;              // current display page
-        * (uint16_t *) ( pbiosdata + 0x63 ) = 0x3d4;          // base port for 6845 CRT controller. color
-        * (uint16_t *) ( pbiosdata + 0x65 ) = 41;             // 6845 crt mode control register value
-        * (uint16_t *) ( pbiosdata + 0x66 ) = 48;             // cga palette mask
-        * (uint16_t *) ( pbiosdata + 0x72 ) = 0x1234;         // soft reset flag (bypass memteest and crt init)
-        * (uint16_t *) ( pbiosdata + 0x80 ) = 0x1e;           // keyboard buffer start
-        * (uint16_t *) ( pbiosdata + 0x82 ) = 0x3e;           // one byte past keyboard buffer start
-        * (uint8_t *)  ( pbiosdata + 0x84 ) = DefaultScreenRows - 1; // 25 - 1
-        * (uint8_t *)  ( pbiosdata + 0x87 ) = 0x60;           // video mode options for ega+
-        * (uint8_t *)  ( pbiosdata + 0x88 ) = 9;              // ega feature bits
-        * (uint8_t *)  ( pbiosdata + 0x89 ) = 0x51;           // video display area (400 line mode, vga active)
-        * (uint8_t *)  ( pbiosdata + 0x8a ) = 0x8;            // 2 == CGA color, 8 == VGA color
-        * (uint8_t *)  ( pbiosdata + 0xd0 ) = 0;              // for int 21 fun 7/8: 1 if consumed ascii and scancode is next.
-        * (uint8_t *)  ( pbiosdata + 0x10f ) = 0;             // where GWBASIC checks if it's in a shelled command.com.
-        * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfff0 ) ) = 0xea;   // power on entry point (used by mulisp to detect if it's a standard PC) ea = jmp far
-        * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfff1 ) ) = 0xc0;   // "
-        * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfff2 ) ) = 0x12;   // "
-        * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfff3 ) ) = 0x00;   // "
-        * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfff4 ) ) = 0xf0;   // "
-        * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfff5 ) ) = '0';
-        * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfff6 ) ) = '8';
-        * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfff7 ) ) = '/';
-        * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfff8 ) ) = '1';
-        * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfff9 ) ) = '2';
-        * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfffa ) ) = '/';
-        * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfffb ) ) = '8';
-        * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfffc ) ) = '1';
-        * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xfffe ) ) = 0xff; // original pc
-        * (uint8_t *)  ( cpu.flat_address8( 0xf000, 0xffff ) ) = 0x55; // original pc
-    
-#if 0
-        // wordperfect 6.0 looks at +4 in lists of lists for a far pointer to the system file table.
-        // make that pointer point to an empty system file table.
-    
-        * ( cpu.flat_address16( SegmentListOfLists, OffsetListOfLists + 4 ) ) = OffsetSystemFileTable;
-        * ( cpu.flat_address16( SegmentListOfLists, OffsetListOfLists + 6 ) ) = SegmentListOfLists;
-        * ( cpu.flat_address16( SegmentListOfLists, OffsetSystemFileTable ) ) = 0xffff;
-        * ( cpu.flat_address16( SegmentListOfLists, OffsetSystemFileTable + 2 ) ) = 0xffff;
-        * ( cpu.flat_address16( SegmentListOfLists, OffsetSystemFileTable + 4 ) ) = 0x30; // lots of files available
-#endif
-    
-        // put dummy values in the list of lists
-        uint16_t * pListOfLists = cpu.flat_address16( SegmentListOfLists, OffsetListOfLists );
-        pListOfLists[ 2 ] = OffsetDeviceControlBlock; // low dword of first drive parameter block (ffff is end of list)
-        pListOfLists[ 3 ] = SegmentListOfLists;       // high "
-        uint16_t * pDeviceControlBlock = cpu.flat_address16( SegmentListOfLists, OffsetDeviceControlBlock );
-        *pDeviceControlBlock = 0xffff; // end of list
-    
-        // 256 interrupt vectors at address 0 - 3ff. The first 0x40 are reserved for bios/dos and point to
-        // routines starting at InterruptRoutineSegment.
-        // Each interrupt vector element has 4 bytes for segment and offset.
-        // The routines are almost all the same -- fake opcode, interrupt #, retf 2
-        // One exception is tick tock interrupt 0x1c, which just does an iret for performance.
-        // Another exception is keyboard interrupt 9.
-        // Interrupts 9 and 1c require an iret so flags are restored since these are externally, asynchronously triggered.
-        // Other interrupts use far ret 2 (not iret) so as to not trash the flags (Z and C) used as return codes.
-        // Functions are all allocated 5 bytes each though in some cases fewer are used.
-    
-        uint32_t * pVectors = (uint32_t *) cpu.flat_address( 0, 0 );
-        uint8_t * pRoutines = cpu.flat_address8( InterruptRoutineSegment, 0 );
-        for ( uint32_t intx = 0; intx < 0x40; intx++ )
-        {
-            uint32_t offset = intx * 5;
-            pVectors[ intx ] = ( InterruptRoutineSegment << 16 ) | ( offset ); // rotate 16 to store the segment in the high 2 bytes
-            uint8_t * routine = pRoutines + offset;
-
-            if ( 8 == intx )
-            {
-                routine[ 0 ] = 0xcd; // int
-                routine[ 1 ] = 0x1c; // int 1c
-                routine[ 2 ] = 0xcf; // iret
-            }
-            else if ( ( 9 == intx ) || ( intx <= 4 ) ) 
-            {
-                routine[ 0 ] = i8086_opcode_interrupt;
-                routine[ 1 ] = (uint8_t) intx;
-                routine[ 2 ] = 0xcf; // iret
-            }
-            else if ( 0x1c == intx )
-                routine[ 0 ] = 0xcf; // iret
-            else
+
+        ConfigurePipedHandles();
+        if ( g_pipedStdout && !force80xRows )
+            g_forceConsole = true; // cursor positioning and colors would end up in the pipe
+
+        if ( pcRecord && pcReplay )
+            usage( "--record and --replay can't be used together" );
+
+        if ( pcRecord || pcReplay )
+        {
+            const char * pcLog = pcRecord ? pcRecord : pcReplay;
+            if ( !OpenReplayLog( pcLog, 0 != pcReplay ) )
             {
-                routine[ 0 ] = i8086_opcode_interrupt;
-                routine[ 1 ] = (uint8_t) intx;
-                routine[ 2 ] = 0xca; // retf 2 instead of iret so C and Z flags aren't restored.
-                routine[ 3 ] = 2;    // 2 is for the 2 bytes of flags pushed during interrupt invocation then ignored.
-                routine[ 4 ] = 0;    // high byte of # of bytes to add to sp.
+                printf( "can't %s log file %s\n", pcRecord ? "create" : "read", pcLog );
+                return 1;
             }
+
+            g_UseOneThread = true; // a keyboard thread would end emulate() slices at different cycles each run
         }
     
-        // write assembler routines into 0x0600 - 0x0bff. make each function segment-aligned so
-        // execution can start at ip 0.
-    
-#if USE_ASSEMBLY_FOR_KBD
-        uint16_t curseg = MachineCodeSegment;
-    
-        memcpy( cpu.flat_address( curseg, 0 ), int21_3f_code, sizeof( int21_3f_code ) );
-        g_int21_3f_seg = curseg;
-        curseg += ( round_up( (uint16_t) sizeof( int21_3f_code ), (uint16_t) 16 ) / 16 );
-    
-        memcpy( cpu.flat_address( curseg, 0 ), int21_a_code, sizeof( int21_a_code ) );
-        g_int21_a_seg = curseg;
-        curseg += ( round_up( (uint16_t) sizeof( int21_a_code ), (uint16_t) 16 ) / 16 );
-    
-        memcpy( cpu.flat_address( curseg, 0 ), int21_1_code, sizeof( int21_1_code ) );
-        g_int21_1_seg = curseg;
-        curseg += ( round_up( (uint16_t) sizeof( int21_1_code ), (uint16_t) 16 ) / 16 );
+        InitializeBiosAndVectors();
+
+        if ( pcRestore )
+        {
+            // the display mode, DTA, and interrupt flag come from the snapshot
+
+            if ( !RestoreSnapshot( pcRestore ) )
+                i8086_hard_exit( "unable to restore the snapshot\n", 0 );
+        }
+        else
+        {
+            // allocate the environment space and load the binary
     
-        memcpy( cpu.flat_address( curseg, 0 ), int21_8_code, sizeof( int21_8_code ) );
-        g_int21_8_seg = curseg;
-        curseg += ( round_up( (uint16_t) sizeof( int21_8_code ), (uint16_t) 16 ) / 16 );
+            uint16_t segEnvironment = AllocateEnvironment( 0, g_acApp, penvVars );
+            if ( 0 == segEnvironment )
+                i8086_hard_exit( "unable to create environment for the app\n", 0 );
     
-        memcpy( cpu.flat_address( curseg, 0 ), int16_0_code, sizeof( int16_0_code ) );
-        g_int16_0_seg = curseg;
-        curseg += ( round_up( (uint16_t) sizeof( int16_0_code ), (uint16_t) 16 ) / 16 );
+            g_currentPSP = LoadBinary( g_acApp, acAppArgs, (uint8_t) strlen( acAppArgs ), segEnvironment, true, 0, 0, 0, 0, bootSectorLoad );
+            if ( 0 == g_currentPSP )
+                i8086_hard_exit( "unable to load executable\n", 0 );
     
-        tracer.Trace( "machine code: 21_3f %04x, 21_a %04x, 21_1 %04x, 21_8 %04x, 16_0 %04x\n",
-                      g_int21_3f_seg, g_int21_a_seg, g_int21_1_seg, g_int21_8_seg, g_int16_0_seg );
+            // gwbasic calls ioctrl on stdin and stdout before doing anything that would indicate what mode it wants.
+            // turbo pascal v3 doesn't give a good indication that it wants 80x25.
+            // word for DOS 6.0 is the same -- hard code it
     
-        assert( curseg <= InterruptRoutineSegment );
-#endif
+            if ( ends_with( g_acApp, "gwbasic.exe" ) || ends_with( g_acApp, "mips.com" ) ||
+                 ends_with( g_acApp, "turbo.com" ) || ends_with( g_acApp, "word.exe" ) ||
+                 ends_with( g_acApp, "bc.exe" )  || ends_with( g_acApp, "mulisp.com" ) )
+            {
+                if ( !g_forceConsole )
+                    force80xRows = true;
+            }
 
-        // allocate the environment space and load the binary
-    
-        uint16_t segEnvironment = AllocateEnvironment( 0, g_acApp, penvVars );
-        if ( 0 == segEnvironment )
-            i8086_hard_exit( "unable to create environment for the app\n", 0 );
-    
-        g_currentPSP = LoadBinary( g_acApp, acAppArgs, (uint8_t) strlen( acAppArgs ), segEnvironment, true, 0, 0, 0, 0, bootSectorLoad );
-        if ( 0 == g_currentPSP )
-            i8086_hard_exit( "unable to load executable\n", 0 );
-    
-        // gwbasic calls ioctrl on stdin and stdout before doing anything that would indicate what mode it wants.
-        // turbo pascal v3 doesn't give a good indication that it wants 80x25.
-        // word for DOS 6.0 is the same -- hard code it
+            if ( force80xRows )
+            {
+                SetScreenRows( rowCount );
+                PerhapsFlipTo80xRows();
+            }
     
-        if ( ends_with( g_acApp, "gwbasic.exe" ) || ends_with( g_acApp, "mips.com" ) ||
-             ends_with( g_acApp, "turbo.com" ) || ends_with( g_acApp, "word.exe" ) ||
-             ends_with( g_acApp, "bc.exe" )  || ends_with( g_acApp, "mulisp.com" ) )
-        {
-            if ( !g_forceConsole )
-                force80xRows = true;
+            g_diskTransferSegment = cpu.get_ds();
+            g_diskTransferOffset = 0x80; // same address as the second half of PSP -- the command tail
+            g_haltExecution = false;
+            cpu.set_interrupt( true ); // DOS starts apps with interrupts enabled
         }
 
-        if ( force80xRows )
+#ifndef _WIN32
+        if ( pcServer )
         {
-            SetScreenRows( rowCount );
-            PerhapsFlipTo80xRows();
+            // startup runs here once. i8086_invoke_interrupt starts the server at the first keyboard or stdin read
+
+            g_forkServerPath = pcServer;
+            g_consoleSink = & g_forkServerOutput;
         }
-    
-        g_diskTransferSegment = cpu.get_ds();
-        g_diskTransferOffset = 0x80; // same address as the second half of PSP -- the command tail
-        g_haltExecution = false;
-        cpu.set_interrupt( true ); // DOS starts apps with interrupts enabled
-        uint32_t * pDailyTimer = (uint32_t *) ( pbiosdata + 0x6c );
+#endif
     
         // Peek for keystrokes in a separate thread. Without this, some DOS apps would require polling in the loop below,
         // but keyboard peeks are very slow -- it makes cross-process calls. With the thread, the loop below is faster.
         // Note that kbhit() makes the same call interally to the same cross-process API. It's no faster.
     
-        unique_ptr<CSimpleThread> peekKbdThread( g_UseOneThread ? 0 : new CSimpleThread( PeekKeyboardThreadProc ) );
+        // When stdin is piped, int 21 reads it and the keyboard sees nothing, so there's no thread.
+
+        bool readHostKeys = !g_UseOneThread && !g_pipedStdin;
+        g_keyboardThreadActive = readHostKeys; // from here on only the thread reads host keystrokes
+        unique_ptr<CSimpleThread> peekKbdThread( readHostKeys ? new CSimpleThread( PeekKeyboardThreadProc ) : 0 );
     
         uint64_t total_cycles = 0; // this will be inaccurate if I8086_TRACK_CYCLES isn't defined
         CPUCycleDelay delay( clockrate );
         g_tAppStart = high_resolution_clock::now();    
+
+        if ( g_profilePath )
+            cpu.enable_profiler( g_profileCycles );
+
+        if ( g_statsPath )
+            cpu.enable_counters( true );
+
+        if ( g_binaryTracePath && !cpu.trace_binary( g_binaryTracePath ) )
+            printf( "can't create trace file %s, error %d\n", g_binaryTracePath, errno );
     
+        const uint64_t throttlePeriod = get_max( clockrate / 1000, (uint64_t) 1 ); // wake the throttle once a millisecond
+        g_scheduler.active = true;
+        g_scheduler.clockRate = clockrate;
+        g_scheduler.displayPeriod = MinSliceCycles;
+        g_scheduler.Schedule( eventTimer, 0 );
+        g_scheduler.Schedule( eventDisplay, MinSliceCycles );
+        if ( clockrate )
+            g_scheduler.Schedule( eventThrottle, throttlePeriod );
+
         do
         {
-            total_cycles += cpu.emulate( 2000 );
+            uint64_t due = g_scheduler.NextDue();
+            g_scheduler.sliceStart = total_cycles;
+            total_cycles += cpu.emulate( ( due > total_cycles ) ? ( due - total_cycles ) : 1 ) + g_scheduler.sleptCycles;
+            g_scheduler.sleptCycles = 0;
+            g_scheduler.slices++;
     
             if ( g_haltExecution )
                 break;
-    
-            delay.Delay( total_cycles );
-    
-            // apps like mips.com write to video ram and never provide an opportunity to redraw the display
-    
-            if ( g_use80xRowsMode )
-                throttled_UpdateDisplay( 200 );
-    
-            uint32_t dt = GetBiosDailyTimer();
-            bool timer_changed = ( dt != *pDailyTimer );
-            if ( timer_changed )
-                *pDailyTimer = dt;      // apps look here even if no timer interrupts happen because they aren't hooked
-    
-            // check interrupt enable and trap flags externally to avoid side effects in the emulator
-    
-            if ( cpu.get_interrupt() && !cpu.get_trap() )
+
+            ScheduledEventKind kind;
+            while ( g_scheduler.PopDue( total_cycles, kind ) )
             {
-                // if the keyboard peek thread has detected a keystroke, process it with an int 9.
-                // don't plumb through port 60 since apps work without that.
-    
-                if ( g_UseOneThread && g_consoleConfig.throttled_kbhit() )
-                    g_KbdPeekAvailable = true; // make sure an int9 gets scheduled
-    
-                if ( g_SendControlCInt )
+                if ( eventTimer == kind )
+                    RunTimerEvent( total_cycles );
+                else if ( eventThrottle == kind )
                 {
-                    tracer.Trace( "scheduling an int x23 -- control C\n" );
-                    g_SendControlCInt = false;
-                    cpu.external_interrupt( 0x23 );
-                    continue;
+                    delay.Delay( total_cycles );
+                    g_scheduler.Schedule( eventThrottle, total_cycles + throttlePeriod );
                 }
-    
-                if ( g_KbdPeekAvailable && !g_int9_pending )
+                else if ( eventDisplay == kind )
                 {
-                    tracer.Trace( "%llu main loop: scheduling an int 9 -- keyboard\n", time_since_last() );
-                    cpu.external_interrupt( 9 );
-                    g_int9_pending = true;
-                    g_KbdPeekAvailable = false;
-                    continue;
+                    // apps like mips.com write to video ram and never provide an opportunity to redraw the display.
+                    // only bother with the throttle clock when a store has landed in video memory since the last redraw.
+
+                    bool dirty = ( g_use80xRowsMode && VideoMemoryMayHaveChanged() );
+                    if ( dirty )
+                        throttled_UpdateDisplay( 200 );
+
+                    // record and replay keep the period fixed so slices end at the same cycles
+
+                    uint64_t & period = g_scheduler.displayPeriod;
+                    if ( g_replay.fp || g_keyboardActivity )
+                        period = MinSliceCycles;
+                    else
+                        period = get_min( 2 * period, dirty ? DirtySliceCycles : MaxSliceCycles );
+
+                    g_keyboardActivity = false;
+                    g_scheduler.Schedule( eventDisplay, total_cycles + period );
                 }
+
+                // eventRetry has no work. it just ends the slice so a blocked interrupt is tried again soon
+            }
     
-                // if interrupt 8 (timer) or 0x1c (tick tock) are hooked by an app and 55 milliseconds have elapsed,
-                // invoke int 8, which by default then invokes int 1c.
-        
-                if ( timer_changed && ( InterruptHookedByApp( 0x1c ) || InterruptHookedByApp( 8 ) ) )
-                {
-                    // on my machine this is invoked about every 72 million total_cycles if no throttle sleeping happened (tens of thousands if so)
-        
-                    tracer.Trace( "scheduling an int 8 -- timer, dt: %#x, total_cycles %llu\n", dt, total_cycles );
-                    cpu.external_interrupt( 8 );
-                    continue;
-                }
+            ScheduleExternalInterrupts( total_cycles );
+
+            if ( !g_replay.fp )
+            {
+                if ( g_keyboardActivity && ( g_scheduler.due[ eventDisplay ] > total_cycles + MinSliceCycles ) )
+                    g_scheduler.Schedule( eventDisplay, total_cycles + MinSliceCycles );
+
+                bool blocked = !cpu.get_interrupt() && ( g_SendControlCInt || ( g_KbdPeekAvailable && !g_int9_pending ) ||
+                               ( g_int8_pending && ( InterruptHookedByApp( 0x1c ) || InterruptHookedByApp( 8 ) ) ) );
+                if ( blocked )
+                    g_scheduler.Schedule( eventRetry, total_cycles + RetrySliceCycles );
             }
-            else
+
+#ifndef _WIN32
+            // with -s the tick comes from cycles, so parking can't bring it closer. the throttle sleeps instead
+
+            if ( !clockrate && IdleAfterSlice() )
             {
-                if ( g_KbdPeekAvailable )
-                    tracer.Trace( "can't schedule a keyboard int 9 because interrupts are disabled!\n" );
+                ParkUntilTickOrKeystroke();
+                RunTimerEvent( total_cycles ); // see the new tick before running more code
             }
+#endif
         } while ( true );
+
+#ifndef _WIN32
+        if ( g_forkServerPath )
+        {
+            g_consoleSink = 0;
+            fwrite( g_forkServerOutput.c_str(), 1, g_forkServerOutput.size(), stdout );
+            i8086_hard_exit( "the app ended before reading the keyboard or stdin, so --server had no point to fork at\n", 0 );
+        }
+#endif
+
+        g_scheduler.active = false;
     
         if ( g_use80xRowsMode )  // get any last-second screen updates displayed
             UpdateDisplay();
     
         high_resolution_clock::time_point tDone = high_resolution_clock::now();
     
-        if ( !g_UseOneThread )
+        if ( peekKbdThread )
             peekKbdThread->EndThread();
+        g_keyboardThreadActive = false;
     
         g_consoleConfig.RestoreConsole( clearDisplayOnExit );
 #ifdef _WIN32
@@ -9145,27 +12327,58 @@ int main( int argc, char * argv[] )
                     printf( "      %20s Hz\n", CDJLTrace::RenderNumberWithCommas( clockrate, ac ) );
             #endif
     
+            if ( useBlockCache )
+            {
+                uint64_t builds, invalidations;
+                cpu.block_cache_stats( builds, invalidations );
+                printf( "blocks decoded:   %20s\n", CDJLTrace::RenderNumberWithCommas( builds, ac ) );
+                printf( "blocks rewritten: %20s\n", CDJLTrace::RenderNumberWithCommas( invalidations, ac ) );
+            }
+
+            if ( useJit )
+            {
+                uint64_t compiled, runs;
+                cpu.jit_stats( compiled, runs );
+                printf( "blocks compiled:  %20s\n", CDJLTrace::RenderNumberWithCommas( compiled, ac ) );
+                printf( "compiled runs:    %20s\n", CDJLTrace::RenderNumberWithCommas( runs, ac ) );
+            }
+
             #ifndef NDEBUG
                 uint8_t unique_first_opcodes = cpu.trace_opcode_usage();
                 printf( "unique first opcodes: %16u\n", unique_first_opcodes );
             #endif
     
+            printf( "emulate() slices: %20s\n", CDJLTrace::RenderNumberWithCommas( g_scheduler.slices, ac ) );
+            if ( totalTime )
+                printf( "slices per second:%20s\n", CDJLTrace::RenderNumberWithCommas( g_scheduler.slices * 1000 / totalTime, ac ) );
+            if ( g_scheduler.slices )
+                printf( "avg slice cycles: %20s\n", CDJLTrace::RenderNumberWithCommas( total_cycles / g_scheduler.slices, ac ) );
+            printf( "idle loop parks:  %20s\n", CDJLTrace::RenderNumberWithCommas( g_idle.parks, ac ) );
             printf( "app exit code:    %20d\n", g_appTerminationReturnCode );
         }
+
+        if ( g_profilePath )
+            WriteProfileReport();
+
+        if ( g_binaryTracePath )
+            cpu.trace_binary( 0 );
+
+        CloseReplayLog();
+
+        if ( g_statsPath )
+            WriteStats( duration_cast<std::chrono::milliseconds>( tDone - g_tAppStart ).count(), total_cycles );
     
-        qsort( g_InterruptsCalled.data(), g_InterruptsCalled.size(), sizeof( IntCalled ), compare_int_entries );
-        bool ah_used = false;
-        size_t cEntries = g_InterruptsCalled.size();
+        vector<InterruptUsage> usage;
+        GetInterruptUsage( usage );
         tracer.Trace( "Interrupt usage by the app:\n" );
         tracer.Trace( "  int     ah       calls    name\n" );
-        for ( size_t i = 0; i < cEntries; i++ )
+        for ( size_t i = 0; i < usage.size(); i++ )
         {
-            IntCalled & ic = g_InterruptsCalled[ i ];
-            const char * pintstr = get_interrupt_string( ic.i, (uint8_t) ic.c, ah_used );
-            if ( ah_used )
-                tracer.Trace( "   %02x     %02x  %10d    %s\n", ic.i, ic.c, ic.calls, pintstr );
+            InterruptUsage & u = usage[ i ];
+            if ( u.ah_used )
+                tracer.Trace( "   %02x     %02x  %10d    %s\n", u.i, u.c, u.calls, u.name );
             else
-                tracer.Trace( "   %02x         %10d    %s\n", ic.i, ic.calls, pintstr );
+                tracer.Trace( "   %02x         %10d    %s\n", u.i, u.calls, u.name );
         }
     }
     catch ( bad_alloc & e )
@@ -9181,9 +12394,15 @@ int main( int argc, char * argv[] )
         printf( "caught a generic exception\n" );
     }
 
+#ifndef _WIN32
+    ReportForkServerExit();
+#endif
+
     tracer.Trace( "exit code of %s: %d\n", g_thisApp, g_appTerminationReturnCode );
     tracer.Shutdown();
 
     return g_appTerminationReturnCode; // return what the main app returned
 } //main
 
+#endif //NTVDM_LIBRARY
+
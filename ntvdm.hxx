@@ -0,0 +1,53 @@
+#pragma once
+
+// API for hosting DOS apps in another program. Build ntvdm.cxx with -D NTVDM_LIBRARY so it has no main() and
+// link it with i8086.cxx. There is one emulator per process: the 8086, DOS, and BIOS keep their state in globals.
+// A DosContext is a saved copy of that state (address space, registers, open files, memory allocations, and
+// console output) that Load() and Run() switch into the globals and back out again. So it's a single-threaded
+// context switcher, not an independent machine: use all contexts from one thread, and only one runs at a time.
+// To run apps in parallel, use separate processes (--batch forks one per job).
+// Output is captured as the app writes it in teletype mode; apps that read the keyboard read the host's console.
+// DOS paths starting with C:\ or \ map to the context's root; relative paths use the process's current directory.
+// A fatal emulation error (an unhandled instruction, a failed critical disk operation, ...) stops just that
+// context: Run() returns true, ExitCode() is -1, and Error() has the message.
+// By default switching contexts copies all of guest memory. With trackDirtyPages on non-Windows platforms, guest
+// memory is write-protected while the context runs and a SIGSEGV handler records the pages it writes, so only
+// those are copied. The handler is installed the first time a tracking context runs; faults outside guest
+// memory are passed to the handler that was installed before it. Leave it off if the host handles SIGSEGV itself.
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+
+struct DosContextOptions
+{
+    const char * root;        // host folder that maps to DOS C:\. 0 for the current folder
+    const char * environment; // environment variables in the form of the -e argument: "include=.\inc,lib=.\lib". may be 0
+    bool trackDirtyPages;     // track written pages with mprotect and SIGSEGV so switching contexts copies only those
+
+    DosContextOptions() : root( 0 ), environment( 0 ), trackDirtyPages( false ) {}
+};
+
+struct DosContextState;
+
+class DosContext
+{
+    public:
+        DosContext( const DosContextOptions & options );
+        ~DosContext();
+
+        bool Load( const char * app, const char * args ); // find and load the .com or .exe. false on failure
+        bool Run( uint64_t cycles );                       // run for about this many cycles. true once the app has exited
+        bool Exited();                                     // true once the app has exited
+        int ExitCode();                                    // the app's return code once it has exited
+        const char * Error();                              // why the context can't load or run the app, or 0
+        uint64_t Cycles();                                 // cycles run so far
+        const std::string & Output();                      // everything the app has written to the console
+        void ClearOutput();                                // discard the captured output
+
+    private:
+        std::unique_ptr<DosContextState> state;
+
+        DosContext( const DosContext & );                  // not copyable
+        DosContext & operator = ( const DosContext & );
+};
@@ -0,0 +1,140 @@
+; Tests that a handle duplicated with int 21 45 sees data written through the original handle.
+; The dup has its own host stream and read-ahead buffer, so this catches reads of stale buffered data.
+; Prints "dup ok" and exits 0, or prints "dup failed" and exits 1.
+;
+; build and run like this (mtestdup.bat). on Linux add -l and use lowercase names for tasm and tlink:
+;     ntvdm -c tasm\tasm testdup.asm
+;     ntvdm -c tasm\tlink /t testdup.obj
+;     ntvdm -c testdup.com
+
+.model tiny
+
+code segment
+assume cs:code, ds:code
+org 100h
+
+failc macro                           ; jump to failed if carry is set. 8086 conditional jumps are short only
+    local skip
+    jnc skip
+    jmp failed
+skip:
+endm
+
+failnz macro                          ; jump to failed if zero is clear
+    local skip
+    jz skip
+    jmp failed
+skip:
+endm
+
+begin:
+    mov ah, 3ch                       ; create file
+    xor cx, cx
+    mov dx, offset filename
+    int 21h
+    failc
+    mov h1, ax
+
+    mov ah, 40h                       ; write 16 bytes through the original handle
+    mov bx, h1
+    mov cx, 16
+    mov dx, offset initial
+    int 21h
+    failc
+
+    mov ah, 45h                       ; duplicate the handle
+    mov bx, h1
+    int 21h
+    failc
+    mov h2, ax
+
+    mov ax, 4200h                     ; seek the duplicate to 0 and read the first 8 bytes. that fills its buffer
+    mov bx, h2
+    xor cx, cx
+    xor dx, dx
+    int 21h
+    failc
+    mov ah, 3fh
+    mov bx, h2
+    mov cx, 8
+    mov dx, offset buffer
+    int 21h
+    failc
+    mov si, offset initial
+    call compare8
+    failnz
+
+    mov ax, 4200h                     ; overwrite bytes 8..15 through the original handle
+    mov bx, h1
+    xor cx, cx
+    mov dx, 8
+    int 21h
+    failc
+    mov ah, 40h
+    mov bx, h1
+    mov cx, 8
+    mov dx, offset update
+    int 21h
+    failc
+
+    mov ax, 4200h                     ; read bytes 8..15 through the duplicate. they must be the new ones
+    mov bx, h2
+    xor cx, cx
+    mov dx, 8
+    int 21h
+    failc
+    mov ah, 3fh
+    mov bx, h2
+    mov cx, 8
+    mov dx, offset buffer
+    int 21h
+    failc
+    mov si, offset update
+    call compare8
+    failnz
+
+    call cleanup
+    mov dx, offset okmsg
+    mov ah, 9
+    int 21h
+    mov ax, 4c00h
+    int 21h
+
+failed:
+    call cleanup
+    mov dx, offset failmsg
+    mov ah, 9
+    int 21h
+    mov ax, 4c01h
+    int 21h
+
+compare8:                             ; compare buffer with the 8 bytes at si. ZF set if they match
+    mov di, offset buffer
+    mov cx, 8
+    cld
+    repe cmpsb
+    ret
+
+cleanup:
+    mov ah, 3eh
+    mov bx, h2
+    int 21h
+    mov ah, 3eh
+    mov bx, h1
+    int 21h
+    mov ah, 41h
+    mov dx, offset filename
+    int 21h
+    ret
+
+filename db 'DUPTEST.TMP', 0
+initial  db 'AAAAAAAABBBBBBBB'
+update   db 'CCCCCCCC'
+okmsg    db 'dup ok', 0dh, 0ah, '$'
+failmsg  db 'dup failed', 0dh, 0ah, '$'
+h1       dw 0
+h2       dw 0
+buffer   db 8 dup (0)
+
+code ends
+end begin
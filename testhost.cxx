@@ -0,0 +1,117 @@
+// Tests the DosContext API in ntvdm.hxx. Two contexts take turns running short slices of the same small .com
+// with different arguments; each must end with its own console output and exit code. The second one uses
+// trackDirtyPages, so both ways of switching guest memory are covered. Prints "host ok" and returns 0, or
+// describes the first mismatch and returns 1.
+//
+// build and run like this (mtesthost.sh, or mtesthost.bat with cl):
+//     g++ -O2 -fno-builtin -D NTVDM_LIBRARY -I . ntvdm.cxx i8086.cxx testhost.cxx -o testhost
+//     ./testhost
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#include "ntvdm.hxx"
+
+using namespace std;
+
+const char * TestApp = "TESTHOST.COM";
+const int TestRepeats = 200;
+
+// writes its command tail and a CR/LF TestRepeats times with int 21 ah=2, then exits with the tail's length
+
+static const uint8_t echo_com[] =
+{
+    0xbd, 0xc8, 0x00,          //      mov bp, 200
+    0xbe, 0x81, 0x00,          // next: mov si, 81h
+    0x8a, 0x0e, 0x80, 0x00,    //      mov cl, [80h]
+    0x30, 0xed,                //      xor ch, ch
+    0xe3, 0x09,                // char: jcxz eol
+    0xac,                      //      lodsb
+    0x88, 0xc2,                //      mov dl, al
+    0xb4, 0x02,                //      mov ah, 2
+    0xcd, 0x21,                //      int 21h
+    0xe2, 0xf5,                //      loop char
+    0xb2, 0x0d,                // eol: mov dl, 0dh
+    0xb4, 0x02,                //      mov ah, 2
+    0xcd, 0x21,                //      int 21h
+    0xb2, 0x0a,                //      mov dl, 0ah
+    0xcd, 0x21,                //      int 21h
+    0x4d,                      //      dec bp
+    0x75, 0xdf,                //      jnz next
+    0xa0, 0x80, 0x00,          //      mov al, [80h]
+    0xb4, 0x4c,                //      mov ah, 4ch
+    0xcd, 0x21,                //      int 21h
+};
+
+static bool CheckContext( const char * name, DosContext & context, const char * args )
+{
+    string line = string( " " ) + args + "\n"; // DOS puts a space before the first argument. teletype output drops CRs
+    string expected;
+    for ( int i = 0; i < TestRepeats; i++ )
+        expected += line;
+
+    int expectedExitCode = (int) strlen( args ) + 1;
+
+    if ( context.Error() )
+    {
+        printf( "context %s failed: %s\n", name, context.Error() );
+        return false;
+    }
+
+    if ( context.ExitCode() != expectedExitCode )
+    {
+        printf( "context %s exit code %d, expected %d\n", name, context.ExitCode(), expectedExitCode );
+        return false;
+    }
+
+    if ( context.Output() != expected )
+    {
+        printf( "context %s wrote %zu bytes of output, expected %zu\n", name, context.Output().size(), expected.size() );
+        return false;
+    }
+
+    return true;
+} //CheckContext
+
+int main( int argc, char * argv[] )
+{
+    FILE * fp = fopen( TestApp, "wb" );
+    if ( !fp || 1 != fwrite( echo_com, sizeof( echo_com ), 1, fp ) )
+    {
+        printf( "can't write %s\n", TestApp );
+        return 1;
+    }
+    fclose( fp );
+
+    bool ok;
+    {
+        DosContextOptions options;
+        DosContext a( options );
+
+        options.trackDirtyPages = true;
+        DosContext b( options );
+
+        ok = a.Load( TestApp, "alpha" ) && b.Load( TestApp, "be" );
+        if ( !ok )
+            printf( "can't load %s\n", TestApp );
+
+        // slices small enough that each app is switched out and back in many times before it ends
+
+        bool aDone = false, bDone = false;
+        while ( ok && ( !aDone || !bDone ) )
+        {
+            if ( !aDone )
+                aDone = a.Run( 5000 );
+            if ( !bDone )
+                bDone = b.Run( 7000 );
+        }
+
+        ok = ok && CheckContext( "a", a, "alpha" ) && CheckContext( "b", b, "be" );
+    }
+
+    remove( TestApp );
+    if ( ok )
+        printf( "host ok\n" );
+    return ok ? 0 : 1;
+} //main